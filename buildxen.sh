@@ -15,7 +15,8 @@ MORELIBS="external/bsd/flex/lib
 	crypto/external/bsd/openssl/lib/libcrypto
 	crypto/external/bsd/openssl/lib/libdes
 	crypto/external/bsd/openssl/lib/libssl
-	external/bsd/libpcap/lib"
+	external/bsd/libpcap/lib
+	lib/libz"
 LIBS="$(echo nblibs/lib/lib* | sed 's/nblibs/rumpsrc/g')"
 for lib in ${MORELIBS}; do
 	LIBS="${LIBS} rumpsrc/${lib}"
@@ -29,8 +30,10 @@ docheckout rumpsrc nblibs
 ./buildrump.sh/buildrump.sh -${BUILDXEN_QUIET:-q} ${STDJ} -k \
     -V MKPIC=no -s rumpsrc -T rumptools -o rumpobj -N \
     -V RUMP_CURLWP=hypercall -V RUMP_KERNEL_IS_LIBC=1 tools
+# MAXPHYS must not exceed BLKFRONT_MAX_IO.  blkfront splits transfers
+# the backend cannot take in one request.
 # FIXME to be able to specify this as part of previous cmdline
-echo 'CPPFLAGS+=-DMAXPHYS=32768' >> rumptools/mk.conf
+echo 'CPPFLAGS+=-DMAXPHYS=1048576' >> rumptools/mk.conf
 
 # set some special variables currently required by libpthread.  Doing
 # it this way preserves the ability to compile libpthread during development
@@ -29,9 +29,11 @@
 
 #include <xen/xen.h>
 
+#include "rumphyper.h"
+
 extern int main(int argc, char **argv);
 
-static void parseargs(void *cmdline, int *nargs, char **outarray) {
+void rumpuser_parseargs(void *cmdline, int *nargs, char **outarray) {
 	char *p = cmdline;
 	char *out = 0;
 	int quote = -1; /* -1 means outside arg, 0 or '"' or '\'' inside */
@@ -82,13 +84,19 @@ int
 __default_app_main(start_info_t *si)
 {
 	char argv0[] = "rumpuser-xen";
-	int nargs;
+	int nargs, i, j;
 	char **argv;
 
-	parseargs(si->cmd_line, &nargs, 0);
+	rumpuser_parseargs(si->cmd_line, &nargs, 0);
 	argv = malloc(sizeof(*argv) * (nargs+3));
 	argv[0] = argv0;
-	parseargs(si->cmd_line, &nargs, argv+1);
+	rumpuser_parseargs(si->cmd_line, &nargs, argv+1);
+
+	/* NAME=value tunables were for rumpuser_getparam() */
+	for (i = j = 1; i <= nargs; i++)
+		if (!rumpuser_cmdline_param(argv[i]))
+			argv[j++] = argv[i];
+	nargs = j - 1;
 	argv[nargs+1] = 0;
 	argv[nargs+2] = 0;
 
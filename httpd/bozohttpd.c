@@ -144,6 +144,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pwd.h>
 #include <grp.h>
 #include <signal.h>
@@ -159,14 +160,15 @@
 #ifndef MAX_WAIT_TIME
 #define	MAX_WAIT_TIME	60	/* hang around for 60 seconds max */
 #endif
+#ifndef BOZO_IDLE_TIME
+#define	BOZO_IDLE_TIME	15	/* kept-alive connection idles this long */
+#endif
 
 /* variables and functions */
 #ifndef LOG_FTP
 #define LOG_FTP LOG_DAEMON
 #endif
 
-volatile sig_atomic_t	alarmhit;
-
 /*
  * check there's enough space in the prefs and names arrays.
  */
@@ -309,9 +311,9 @@ parse_request(bozohttpd_t *httpd, char *in, char **method, char **file,
 	}
 
 	/* allocate private copies */
-	*file = bozostrdup(httpd, *file);
+	*file = bozo_arena_strdup(httpd, *file);
 	if (*query)
-		*query = bozostrdup(httpd, *query);
+		*query = bozo_arena_strdup(httpd, *query);
 
 	debug((httpd, DEBUG_FAT,
 		"url: method: \"%s\" file: \"%s\" query: \"%s\" proto: \"%s\"",
@@ -324,47 +326,19 @@ parse_request(bozohttpd_t *httpd, char *in, char **method, char **file,
 void
 bozo_clean_request(bozo_httpreq_t *request)
 {
-	struct bozoheaders *hdr, *ohdr = NULL;
-
 	if (request == NULL)
 		return;
 
-	/* If SSL enabled cleanup SSL structure. */
-	bozo_ssl_destroy(request->hr_httpd);
-
-	/* clean up request */
-#define MF(x)	if (request->x) free(request->x)
-	MF(hr_remotehost);
-	MF(hr_remoteaddr);
-	MF(hr_serverport);
-	MF(hr_virthostname);
-	MF(hr_file);
-	MF(hr_oldfile);
-	MF(hr_query);
-#undef MF
-	bozo_auth_cleanup(request);
-	for (hdr = SIMPLEQ_FIRST(&request->hr_headers); hdr;
-	    hdr = SIMPLEQ_NEXT(hdr, h_next)) {
-		free(hdr->h_value);
-		free(hdr->h_header);
-		if (ohdr)
-			free(ohdr);
-		ohdr = hdr;
-	}
-	if (ohdr)
-		free(ohdr);
-
-	free(request);
-}
+	/* If SSL enabled cleanup SSL structure, with the connection. */
+	if (!request->hr_keepalive)
+		bozo_ssl_destroy(request->hr_httpd);
 
-/*
- * send a HTTP/1.1 408 response if we timeout.
- */
-/* ARGSUSED */
-static void
-alarmer(int sig)
-{
-	alarmhit = 1;
+	/*
+	 * clean up request.  the request, its headers and the names
+	 * it was known by are in the arena, and go all at once.
+	 */
+	bozo_auth_cleanup(request);
+	bozo_arena_reset(request->hr_httpd);
 }
 
 /*
@@ -386,23 +360,24 @@ addmerge_header(bozo_httpreq_t *request, char *val,
 	if (hdr) {
 		/* yup, merge it in */
 		char *nval;
-
-		if (asprintf(&nval, "%s, %s", hdr->h_value, str) == -1) {
-			(void)bozo_http_error(request->hr_httpd, 500, NULL,
-			     "memory allocation failure");
-			return NULL;
-		}
-		free(hdr->h_value);
+		size_t vlen = strlen(hdr->h_value);
+
+		/* the old value stays in the arena until the request ends */
+		nval = bozo_arena_alloc(request->hr_httpd,
+		    vlen + strlen(str) + 3);
+		memcpy(nval, hdr->h_value, vlen);
+		memcpy(nval + vlen, ", ", 2);
+		strcpy(nval + vlen + 2, str);
 		hdr->h_value = nval;
 	} else {
 		/* nope, create a new one */
 
-		hdr = bozomalloc(request->hr_httpd, sizeof *hdr);
-		hdr->h_header = bozostrdup(request->hr_httpd, val);
+		hdr = bozo_arena_alloc(request->hr_httpd, sizeof *hdr);
+		hdr->h_header = bozo_arena_strdup(request->hr_httpd, val);
 		if (str && *str)
-			hdr->h_value = bozostrdup(request->hr_httpd, str);
+			hdr->h_value = bozo_arena_strdup(request->hr_httpd, str);
 		else
-			hdr->h_value = bozostrdup(request->hr_httpd, " ");
+			hdr->h_value = bozo_arena_strdup(request->hr_httpd, " ");
 
 		SIMPLEQ_INSERT_TAIL(&request->hr_headers, hdr, h_next);
 		request->hr_nheaders++;
@@ -504,45 +479,17 @@ process_method(bozo_httpreq_t *request, const char *method)
 }
 
 /*
- * This function reads a http request from stdin, returning a pointer to a
- * bozo_httpreq_t structure, describing the request.
+ * look up who is on the other end of the connection on stdin, once
+ * for all the requests that come over it.
  */
-bozo_httpreq_t *
-bozo_read_request(bozohttpd_t *httpd)
+static void
+conn_peer(bozohttpd_t *httpd)
 {
-	struct	sigaction	sa;
-	char	*str, *val, *method, *file, *proto, *query;
-	char	*host, *addr, *port;
+	const char *host, *addr, *port;
 	char	bufport[10];
 	char	hbuf[NI_MAXHOST], abuf[NI_MAXHOST];
 	struct	sockaddr_storage ss;
-	ssize_t	len;
-	int	line = 0;
 	socklen_t slen;
-	bozo_httpreq_t *request;
-
-	/*
-	 * if we're in daemon mode, bozo_daemon_fork() will return here twice
-	 * for each call.  once in the child, returning 0, and once in the
-	 * parent, returning 1.  for each child, then we can setup SSL, and
-	 * the parent can signal the caller there was no request to process
-	 * and it will wait for another.
-	 */
-	if (bozo_daemon_fork(httpd))
-		return NULL;
-	bozo_ssl_accept(httpd);
-
-	request = bozomalloc(httpd, sizeof(*request));
-	memset(request, 0, sizeof(*request));
-	request->hr_httpd = httpd;
-	request->hr_allow = request->hr_host = NULL;
-	request->hr_content_type = request->hr_content_length = NULL;
-	request->hr_range = NULL;
-	request->hr_last_byte_pos = -1;
-	request->hr_if_modified_since = NULL;
-	request->hr_virthostname = NULL;
-	request->hr_file = NULL;
-	request->hr_oldfile = NULL;
 
 	slen = sizeof(ss);
 	if (getpeername(0, (struct sockaddr *)(void *)&ss, &slen) < 0)
@@ -560,10 +507,6 @@ bozo_read_request(bozohttpd_t *httpd)
 		else
 			host = NULL;
 	}
-	if (host != NULL)
-		request->hr_remotehost = bozostrdup(request->hr_httpd, host);
-	if (addr != NULL)
-		request->hr_remoteaddr = bozostrdup(request->hr_httpd, addr);
 	slen = sizeof(ss);
 
 	/*
@@ -586,22 +529,96 @@ bozo_read_request(bozohttpd_t *httpd)
 				port = NULL;
 		}
 	}
-	if (port != NULL)
-		request->hr_serverport = bozostrdup(request->hr_httpd, port);
+
+#define SETCONN(x, v) do {						\
+	if (httpd->x)							\
+		free(httpd->x);						\
+	httpd->x = (v) ? bozostrdup(httpd, (v)) : NULL;			\
+} while (/*CONSTCOND*/0)
+	SETCONN(conn_remotehost, host);
+	SETCONN(conn_remoteaddr, addr);
+	SETCONN(conn_serverport, port);
+#undef SETCONN
+}
+
+/* does the client want to send another request over this connection? */
+static int
+want_keepalive(bozo_httpreq_t *request)
+{
+	bozohttpd_t *httpd = request->hr_httpd;
+	const char *c = request->hr_connection;
+
+	if (!httpd->keepalive)
+		return 0;
+	/* a body we won't read would be taken for the next request */
+	if (request->hr_method != HTTP_GET && request->hr_method != HTTP_HEAD)
+		return 0;
+	if (request->hr_content_length &&
+	    strtoll(request->hr_content_length, NULL, 10) != 0)
+		return 0;
+	if (request->hr_proto == httpd->consts.http_11)
+		return c == NULL || !bozo_has_token(c, "close");
+	if (request->hr_proto == httpd->consts.http_10)
+		return c != NULL && bozo_has_token(c, "keep-alive");
+	return 0;
+}
+
+/*
+ * This function reads a http request from stdin, returning a pointer to a
+ * bozo_httpreq_t structure, describing the request.
+ */
+bozo_httpreq_t *
+bozo_read_request(bozohttpd_t *httpd)
+{
+	char	*str, *val, *method, *file, *proto, *query;
+	const char *host, *addr, *port;
+	ssize_t	len;
+	int	line = 0;
+	bozo_httpreq_t *request;
 
 	/*
-	 * setup a timer to make sure the request is not hung
+	 * if we're in daemon mode, bozo_daemon_fork() will return here twice
+	 * for each call.  once in the child, returning 0, and once in the
+	 * parent, returning 1.  for each child, then we can setup SSL, and
+	 * the parent can signal the caller there was no request to process
+	 * and it will wait for another.
 	 */
-	sa.sa_handler = alarmer;
-	sigemptyset(&sa.sa_mask);
-	sigaddset(&sa.sa_mask, SIGALRM);
-	sa.sa_flags = 0;
-	sigaction(SIGALRM, &sa, NULL);	/* XXX */
+	if (httpd->conn_nreq == 0) {
+		if (bozo_daemon_fork(httpd))
+			return NULL;
+		bozo_ssl_accept(httpd);
+		conn_peer(httpd);
+	}
 
-	alarm(MAX_WAIT_TIME);
+	request = bozo_arena_alloc(httpd, sizeof(*request));
+	memset(request, 0, sizeof(*request));
+	request->hr_httpd = httpd;
+	request->hr_allow = request->hr_host = NULL;
+	request->hr_content_type = request->hr_content_length = NULL;
+	request->hr_range = NULL;
+	request->hr_last_byte_pos = -1;
+	request->hr_if_modified_since = NULL;
+	request->hr_virthostname = NULL;
+	request->hr_file = NULL;
+	request->hr_oldfile = NULL;
+
+	/* the peer is looked up once per connection, in conn_peer() */
+	host = request->hr_remotehost = httpd->conn_remotehost;
+	addr = request->hr_remoteaddr = httpd->conn_remoteaddr;
+	port = request->hr_serverport = httpd->conn_serverport;
+
+	/*
+	 * no request line for this long ends the connection, as does
+	 * a kept-alive one with no next request.  then each header
+	 * line gets as long again.
+	 */
+	httpd->getln_timeout = 1000 *
+	    (httpd->conn_nreq ? BOZO_IDLE_TIME : MAX_WAIT_TIME);
+	httpd->getln_timedout = 0;
 	while ((str = bozodgetln(httpd, STDIN_FILENO, &len, bozo_read)) != NULL) {
-		alarm(0);
-		if (alarmhit) {
+		if (httpd->getln_timedout) {
+			if (line == 0 && httpd->conn_nreq)
+				goto cleanup;
 			(void)bozo_http_error(httpd, 408, NULL,
 					"request timed out");
 			goto cleanup;
@@ -610,6 +627,9 @@ bozo_read_request(bozohttpd_t *httpd)
 
 		if (line == 1) {
 
+			/* the client is done with a kept-alive connection */
+			if (len < 1 && httpd->conn_nreq)
+				goto cleanup;
 			if (len < 1) {
 				(void)bozo_http_error(httpd, 404, NULL,
 						"null method");
@@ -701,17 +721,18 @@ bozo_read_request(bozohttpd_t *httpd)
 			else if (strcasecmp(hdr->h_header,
 					"accept-encoding") == 0)
 				request->hr_accept_encoding = hdr->h_value;
+			else if (strcasecmp(hdr->h_header, "connection") == 0)
+				request->hr_connection = hdr->h_value;
 
 			debug((httpd, DEBUG_FAT, "adding header %s: %s",
 			    hdr->h_header, hdr->h_value));
 		}
 next_header:
-		alarm(MAX_WAIT_TIME);
+		httpd->getln_timeout = 1000 * MAX_WAIT_TIME;
 	}
 
 	/* now, clear it all out */
-	alarm(0);
-	signal(SIGALRM, SIG_DFL);
+	httpd->getln_timeout = 0;
 
 	/* RFC1945, 8.3 */
 	if (request->hr_method == HTTP_POST &&
@@ -757,6 +778,8 @@ next_header:
 		}
 	}
 
+	request->hr_want_keepalive = want_keepalive(request);
+
 	debug((httpd, DEBUG_FAT, "bozo_read_request returns url %s in request",
 	       request->hr_file));
 	return request;
@@ -767,6 +790,7 @@ cleanup:
 	return NULL;
 }
 
+#ifndef BOZO_NO_MMAP
 static int
 mmap_and_write_part(bozohttpd_t *httpd, int fd, off_t first_byte_pos, size_t sz)
 {
@@ -829,9 +853,47 @@ mmap_and_write_part(bozohttpd_t *httpd, int fd, off_t first_byte_pos, size_t sz)
 
 	return 0;
 }
-
+#else /* BOZO_NO_MMAP */
+/*
+ * like mmap_and_write_part(), but read the file through one buffer
+ * which is kept for the next time.  for where mmap() of a file is
+ * itself just a read into fresh memory: the data is then copied the
+ * same number of times, minus allocating and faulting in the window.
+ */
 static int
-parse_http_date(const char *val, time_t *timestamp)
+read_and_write_part(bozohttpd_t *httpd, int fd, off_t first_byte_pos, size_t sz)
+{
+	ssize_t	rlen;
+	size_t	len;
+
+	if (httpd->sendbuf == NULL)
+		httpd->sendbuf = bozomalloc(httpd, BOZO_WRSZ);
+
+	while (sz) {
+		len = sz < BOZO_WRSZ ? sz : BOZO_WRSZ;
+		rlen = pread(fd, httpd->sendbuf, len, first_byte_pos);
+		if (rlen <= 0) {
+			bozo_warn(httpd, "read failed: %s",
+			    rlen == 0 ? "unexpected EOF" : strerror(errno));
+			return -1;
+		}
+		if (bozo_write(httpd, STDOUT_FILENO, httpd->sendbuf,
+				(size_t)rlen) != rlen) {
+			bozo_warn(httpd, "write failed: %s", strerror(errno));
+			return -1;
+		}
+		debug((httpd, DEBUG_OBESE, "wrote %d bytes", (int)rlen));
+		first_byte_pos += rlen;
+		sz -= (size_t)rlen;
+	}
+
+	return 0;
+}
+#define mmap_and_write_part read_and_write_part
+#endif /* BOZO_NO_MMAP */
+
+int
+bozo_parse_http_date(const char *val, time_t *timestamp)
 {
 	char *remainder;
 	struct tm tm;
@@ -1015,7 +1077,7 @@ handle_redirect(bozo_httpreq_t *request,
 	bozo_printf(httpd, "\">here</a>\n");
 	bozo_printf(httpd, "</body></html>\n");
 head:
-	bozo_flush(httpd, stdout);
+	bozo_flush(httpd, httpd->outfp);
 	if (urlbuf)
 		free(urlbuf);
 }
@@ -1048,7 +1110,7 @@ check_virtual(bozo_httpreq_t *request)
 		s = strchr(file, '/');
 		/* HTTP/1.1 draft rev-06, 5.2: URI takes precedence over Host: */
 		request->hr_host = file;
-		request->hr_file = bozostrdup(request->hr_httpd, s ? s : "/");
+		request->hr_file = bozo_arena_strdup(httpd, s ? s : "/");
 		debug((httpd, DEBUG_OBESE, "got host ``%s'' file is now ``%s''",
 		    request->hr_host, request->hr_file));
 	} else if (!request->hr_host)
@@ -1083,7 +1145,7 @@ check_virtual(bozo_httpreq_t *request)
 					/* found it, punch it */
 					debug((httpd, DEBUG_OBESE, "found it punch it"));
 					request->hr_virthostname =
-					    bozostrdup(httpd, d->d_name);
+					    bozo_arena_strdup(httpd, d->d_name);
 					if (asprintf(&s, "%s/%s", httpd->virtbase,
 					    request->hr_virthostname) < 0)
 						bozo_err(httpd, 1, "asprintf");
@@ -1275,7 +1337,7 @@ copy_rest:
  *	- disallow anything ending up with a file starting
  *	  at "/" or having ".." in it.
  *	- anything else is a really weird internal error
- *	- returns malloced file to serve, if unhandled
+ *	- returns file to serve from the arena, if unhandled
  */
 static int
 transform_request(bozo_httpreq_t *request, int *isindex)
@@ -1377,15 +1439,15 @@ transform_request(bozo_httpreq_t *request, int *isindex)
 		if (file[len-1] == '/') {	/* append index.html */
 			*isindex = 1;
 			debug((httpd, DEBUG_FAT, "appending index.html"));
-			newfile = bozomalloc(httpd,
+			newfile = bozo_arena_alloc(httpd,
 					len + strlen(httpd->index_html) + 1);
 			strcpy(newfile, file + 1);
 			strcat(newfile, httpd->index_html);
 		} else
-			newfile = bozostrdup(request->hr_httpd, file + 1);
+			newfile = bozo_arena_strdup(httpd, file + 1);
 	} else if (len == 1) {
 		debug((httpd, DEBUG_EXPLODING, "tf_req: len == 1"));
-		newfile = bozostrdup(request->hr_httpd, httpd->index_html);
+		newfile = bozo_arena_strdup(httpd, httpd->index_html);
 		*isindex = 1;
 	} else {	/* len == 0 ? */
 		(void)bozo_http_error(httpd, 500, request,
@@ -1429,8 +1491,6 @@ transform_request(bozo_httpreq_t *request, int *isindex)
 	return 1;
 bad_done:
 	debug((httpd, DEBUG_FAT, "transform_request returning: 0"));
-	if (newfile)
-		free(newfile);
 	return 0;
 }
 
@@ -1442,25 +1502,11 @@ bad_done:
  */
 
 static int
-can_gzip(bozo_httpreq_t *request)
+accepts_gzip(bozo_httpreq_t *request)
 {
 	const char	*pos;
-	const char	*tmp;
 	size_t		 len;
 
-	/* First we decide if the request can be gzipped at all. */
-
-	/* not if we already are encoded... */
-	tmp = bozo_content_encoding(request, request->hr_file);
-	if (tmp && *tmp)
-		return 0;
-
-	/* not if we are not asking for the whole file... */
-	if (request->hr_last_byte_pos != -1 || request->hr_have_range)
-		return 0;
-
-	/* Then we determine if gzip is on the cards. */
-
 	for (pos = request->hr_accept_encoding; pos && *pos; pos += len) {
 		while (*pos == ' ')
 			pos++;
@@ -1481,6 +1527,26 @@ can_gzip(bozo_httpreq_t *request)
 	return 0;
 }
 
+static int
+can_gzip(bozo_httpreq_t *request)
+{
+	const char	*tmp;
+
+	/* First we decide if the request can be gzipped at all. */
+
+	/* not if we already are encoded... */
+	tmp = bozo_content_encoding(request, request->hr_file);
+	if (tmp && *tmp)
+		return 0;
+
+	/* not if we are not asking for the whole file... */
+	if (request->hr_last_byte_pos != -1 || request->hr_have_range)
+		return 0;
+
+	/* Then we determine if gzip is on the cards. */
+	return accepts_gzip(request);
+}
+
 /*
  * bozo_process_request does the following:
  *	- check the request is valid
@@ -1496,7 +1562,15 @@ bozo_process_request(bozo_httpreq_t *request)
 	time_t timestamp;
 	char	*file;
 	const char *type, *encoding;
-	int	fd, isindex;
+	char	*gzfile;
+	int	fd, isindex, gzip;
+
+	/*
+	 * hot static files are answered from memory, before anything
+	 * touches the file system.
+	 */
+	if (bozo_cache_serve(request, accepts_gzip(request)))
+		goto cleanup_nofd;
 
 	/*
 	 * note that transform_request chdir()'s if required.  also note
@@ -1508,12 +1582,16 @@ bozo_process_request(bozo_httpreq_t *request)
 
 	fd = -1;
 	encoding = NULL;
-	if (can_gzip(request)) {
-		asprintf(&file, "%s.gz", request->hr_file);
-		fd = open(file, O_RDONLY);
+	gzfile = NULL;
+	if ((gzip = can_gzip(request)) != 0) {
+		asprintf(&gzfile, "%s.gz", request->hr_file);
+		fd = open(gzfile, O_RDONLY);
 		if (fd >= 0)
 			encoding = "gzip";
-		free(file);
+		else {
+			free(gzfile);
+			gzfile = NULL;
+		}
 	}
 
 	file = request->hr_file;
@@ -1544,13 +1622,14 @@ bozo_process_request(bozo_httpreq_t *request)
 	}
 
 	if (request->hr_if_modified_since &&
-	    parse_http_date(request->hr_if_modified_since, &timestamp) &&
+	    bozo_parse_http_date(request->hr_if_modified_since, &timestamp) &&
 	    timestamp >= sb.st_mtime) {
 		/* XXX ignore subsecond of timestamp */
 		bozo_printf(httpd, "%s 304 Not Modified\r\n",
 				request->hr_proto);
+		bozo_print_connection(request, 1);
 		bozo_printf(httpd, "\r\n");
-		bozo_flush(httpd, stdout);
+		bozo_flush(httpd, httpd->outfp);
 		goto cleanup;
 	}
 
@@ -1568,6 +1647,16 @@ bozo_process_request(bozo_httpreq_t *request)
 	    request->hr_have_range,
 	    (long long)request->hr_first_byte_pos,
 	    (long long)request->hr_last_byte_pos));
+	type = bozo_content_type(request, file);
+	if (!encoding)
+		encoding = bozo_content_encoding(request, file);
+
+	if (!request->hr_have_range &&
+	    bozo_cache_fill(request, fd, gzfile ? gzfile : file, &sb,
+			    type, encoding, gzip && gzfile == NULL &&
+			    bozo_content_compressible(request, file)))
+		goto cleanup;
+
 	if (request->hr_have_range)
 		bozo_printf(httpd, "%s 206 Partial Content\r\n",
 				request->hr_proto);
@@ -1575,14 +1664,10 @@ bozo_process_request(bozo_httpreq_t *request)
 		bozo_printf(httpd, "%s 200 OK\r\n", request->hr_proto);
 
 	if (request->hr_proto != httpd->consts.http_09) {
-		type = bozo_content_type(request, file);
-		if (!encoding)
-			encoding = bozo_content_encoding(request, file);
-
 		bozo_print_header(request, &sb, type, encoding);
 		bozo_printf(httpd, "\r\n");
 	}
-	bozo_flush(httpd, stdout);
+	bozo_flush(httpd, httpd->outfp);
 
 	if (request->hr_method != HTTP_HEAD) {
 		off_t szleft, cur_byte_pos;
@@ -1608,6 +1693,8 @@ bozo_process_request(bozo_httpreq_t *request)
 					if (httpd->mmapsz >= httpd->page_size)
 						goto retry;
 				}
+				/* short of what Content-Length promised */
+				request->hr_keepalive = 0;
 				goto cleanup;
 			}
 			cur_byte_pos += sz;
@@ -1616,10 +1703,14 @@ bozo_process_request(bozo_httpreq_t *request)
 	}
  cleanup:
 	close(fd);
+	if (gzfile)
+		free(gzfile);
  cleanup_nofd:
-	close(STDIN_FILENO);
-	close(STDOUT_FILENO);
-	/*close(STDERR_FILENO);*/
+	if (!request->hr_keepalive) {
+		close(STDIN_FILENO);
+		close(STDOUT_FILENO);
+		/*close(STDERR_FILENO);*/
+	}
 }
 
 /* make sure we're not trying to access special files */
@@ -1679,9 +1770,67 @@ bozo_print_header(bozo_httpreq_t *request,
 			len = sbp->st_size;
 		bozo_printf(httpd, "Content-Length: %qd\r\n", (long long)len);
 	}
-	if (request && request->hr_proto == httpd->consts.http_11)
+	if (request)
+		bozo_print_connection(request, sbp != NULL);
+	bozo_flush(httpd, httpd->outfp);
+}
+
+/*
+ * decide whether the connection outlives this request, and tell the
+ * client.  only a response whose end the client can tell without the
+ * connection closing (delimited) can have another one after it.
+ */
+void
+bozo_print_connection(bozo_httpreq_t *request, int delimited)
+{
+	bozohttpd_t *httpd = request->hr_httpd;
+
+	request->hr_keepalive = delimited && request->hr_want_keepalive;
+	if (request->hr_keepalive) {
+		if (request->hr_proto == httpd->consts.http_10)
+			bozo_printf(httpd, "Connection: keep-alive\r\n");
+	} else if (request->hr_proto == httpd->consts.http_11)
 		bozo_printf(httpd, "Connection: close\r\n");
-	bozo_flush(httpd, stdout);
+}
+
+/* is tok one of the comma separated tokens in list? */
+int
+bozo_has_token(const char *list, const char *tok)
+{
+	size_t	len, toklen = strlen(tok);
+
+	for (; *list; list += len) {
+		while (*list == ' ' || *list == ',')
+			list++;
+		len = strcspn(list, ",");
+		if (len >= toklen && strncasecmp(list, tok, toklen) == 0 &&
+		    strspn(list + toklen, " ") == len - toklen)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * serve the connection on stdin/stdout: its first request, and while
+ * the client keeps it alive, the ones after, which may well already
+ * be read ahead.  the caller closes it.
+ */
+void
+bozo_serve_connection(bozohttpd_t *httpd)
+{
+	bozo_httpreq_t	*request;
+	int		 keep;
+
+	httpd->conn_nreq = 0;
+	bozo_getln_reset(httpd);
+	do {
+		if ((request = bozo_read_request(httpd)) == NULL)
+			break;
+		bozo_process_request(request);
+		keep = request->hr_keepalive;
+		bozo_clean_request(request);
+		httpd->conn_nreq++;
+	} while (keep);
 }
 
 #ifndef NO_DEBUG
@@ -1904,10 +2053,15 @@ bozo_http_error(bozohttpd_t *httpd, int code, bozo_httpreq_t *request,
 	bozo_printf(httpd, "Server: %s\r\n", httpd->server_software);
 	if (request && request->hr_allow)
 		bozo_printf(httpd, "Allow: %s\r\n", request->hr_allow);
+	/* after an error the connection isn't worth trusting */
+	if (request)
+		bozo_print_connection(request, 0);
+	else if (proto == httpd->consts.http_11)
+		bozo_printf(httpd, "Connection: close\r\n");
 	bozo_printf(httpd, "\r\n");
 	if (size)
 		bozo_printf(httpd, "%s", httpd->errorbuf);
-	bozo_flush(httpd, stdout);
+	bozo_flush(httpd, httpd->outfp);
 
 	return code;
 }
@@ -1948,6 +2102,29 @@ bozostrnsep(char **strp, const char *delim, ssize_t	*lenp)
 	/* NOTREACHED */
 }
 
+/*
+ * wait up to getln_timeout ms for something to read on fd.  this is
+ * the connection's timer: there is one connection per httpd at a time,
+ * so a poll() timeout does it, with no signals.
+ */
+static int
+wait_readable(bozohttpd_t *httpd, int fd)
+{
+	struct pollfd pfd;
+	int rv;
+
+	/* TLS may hold a decrypted record that poll() can't see */
+	if (bozo_ssl_pending(httpd))
+		return 1;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	do
+		rv = poll(&pfd, 1, httpd->getln_timeout);
+	while (rv == -1 && errno == EINTR);
+	/* errors and hangups are for read() to report */
+	return rv != 0;
+}
+
 /*
  * inspired by fgetln(3), but works for fd's.  should work identically
  * except it, however, does *not* return the newline, and it does nul
@@ -1957,9 +2134,9 @@ char *
 bozodgetln(bozohttpd_t *httpd, int fd, ssize_t *lenp,
 	ssize_t (*readfn)(bozohttpd_t *, int, void *, size_t))
 {
-	ssize_t	len;
-	int	got_cr = 0;
-	char	c, *nbuffer;
+	ssize_t	len, rlen;
+	size_t	avail, chunk;
+	char	*p, *nl, *nbuffer;
 
 	/* initialise */
 	if (httpd->getln_buflen == 0) {
@@ -1971,21 +2148,42 @@ bozodgetln(bozohttpd_t *httpd, int fd, ssize_t *lenp,
 			return NULL;
 		}
 	}
+	if (httpd->getln_rabuf == NULL) {
+		httpd->getln_rabuf = malloc(BOZO_GETLN_RASZ);
+		if (httpd->getln_rabuf == NULL)
+			return NULL;
+	}
+	/* what is buffered is from another stream, and of no use here */
+	if (fd != httpd->getln_rafd) {
+		bozo_getln_reset(httpd);
+		httpd->getln_rafd = fd;
+	}
 	len = 0;
 
 	/*
-	 * we *have* to read one byte at a time, to not break cgi
-	 * programs (for we pass stdin off to them).  could fix this
-	 * by becoming a fd-passing program instead of just exec'ing
-	 * the program
-	 *
-	 * the above is no longer true, we are the fd-passing
-	 * program already.
+	 * read ahead in large reads and hand out one line at a time.
+	 * whatever is read past the line stays buffered for the next
+	 * call, or for bozo_read_buffered() if what follows is a body.
 	 */
-	for (; readfn(httpd, fd, &c, 1) == 1; ) {
-		debug((httpd, DEBUG_EXPLODING, "bozodgetln read %c", c));
+	for (;;) {
+		if (httpd->getln_raoff == httpd->getln_ralen) {
+			if (httpd->getln_timeout && !wait_readable(httpd, fd)) {
+				httpd->getln_timedout = 1;
+				break;
+			}
+			rlen = readfn(httpd, fd, httpd->getln_rabuf,
+			    BOZO_GETLN_RASZ);
+			if (rlen <= 0)
+				break;
+			httpd->getln_raoff = 0;
+			httpd->getln_ralen = (size_t)rlen;
+		}
+		p = httpd->getln_rabuf + httpd->getln_raoff;
+		avail = httpd->getln_ralen - httpd->getln_raoff;
+		nl = memchr(p, '\n', avail);
+		chunk = nl ? (size_t)(nl - p) + 1 : avail;
 
-		if (len >= httpd->getln_buflen - 1) {
+		while ((size_t)(httpd->getln_buflen - len) < chunk + 1) {
 			httpd->getln_buflen *= 2;
 			debug((httpd, DEBUG_EXPLODING, "bozodgetln: "
 				"reallocating buffer to buflen %zu",
@@ -1994,12 +2192,11 @@ bozodgetln(bozohttpd_t *httpd, int fd, ssize_t *lenp,
 				(size_t)httpd->getln_buflen);
 			httpd->getln_buffer = nbuffer;
 		}
+		memcpy(httpd->getln_buffer + len, p, chunk);
+		len += (ssize_t)chunk;
+		httpd->getln_raoff += chunk;
 
-		httpd->getln_buffer[len++] = c;
-		if (c == '\r') {
-			got_cr = 1;
-			continue;
-		} else if (c == '\n') {
+		if (nl) {
 			/*
 			 * HTTP/1.1 spec says to ignore CR and treat
 			 * LF as the real line terminator.  even though
@@ -2007,13 +2204,11 @@ bozodgetln(bozohttpd_t *httpd, int fd, ssize_t *lenp,
 			 * terminator, it is recommended in section 19.3
 			 * to do the LF trick for tolerance.
 			 */
-			if (got_cr)
-				len -= 2;
-			else
-				len -= 1;
+			len--;
+			if (len > 0 && httpd->getln_buffer[len - 1] == '\r')
+				len--;
 			break;
 		}
-
 	}
 	httpd->getln_buffer[len] = '\0';
 	debug((httpd, DEBUG_OBESE, "bozodgetln returns: ``%s'' with len %zd",
@@ -2022,6 +2217,33 @@ bozodgetln(bozohttpd_t *httpd, int fd, ssize_t *lenp,
 	return httpd->getln_buffer;
 }
 
+/*
+ * read from fd, starting with what bozodgetln() already read ahead
+ * from it.  for bodies that follow the header lines.
+ */
+ssize_t
+bozo_read_buffered(bozohttpd_t *httpd, int fd, void *buf, size_t len)
+{
+	size_t	avail;
+
+	avail = httpd->getln_ralen - httpd->getln_raoff;
+	if (fd == httpd->getln_rafd && avail) {
+		if (len > avail)
+			len = avail;
+		memcpy(buf, httpd->getln_rabuf + httpd->getln_raoff, len);
+		httpd->getln_raoff += len;
+		return (ssize_t)len;
+	}
+	return bozo_read(httpd, fd, buf, len);
+}
+
+/* forget anything read ahead, for when the stream on the fd changes */
+void
+bozo_getln_reset(bozohttpd_t *httpd)
+{
+	httpd->getln_raoff = httpd->getln_ralen = 0;
+}
+
 void *
 bozorealloc(bozohttpd_t *httpd, void *ptr, size_t size)
 {
@@ -2050,6 +2272,71 @@ bozomalloc(bozohttpd_t *httpd, size_t size)
 	return (p);
 }
 
+/*
+ * the per-request arena.  what lives exactly as long as one request
+ * -- the request itself, its headers, the file name as it is being
+ * rewritten -- is carved from a few blocks here, and all of it is
+ * given back at once by bozo_arena_reset() when the request is
+ * cleaned up.  the first block is kept for the next request, so a
+ * typical request makes no malloc() calls for these at all.
+ */
+#define BOZO_ARENA_BLKSZ	4096
+#define BOZO_ARENA_ALIGN(n)	(((n) + 15) & ~(size_t)15)
+
+typedef struct bozo_arena_blk_t {
+	struct bozo_arena_blk_t	*ab_next;
+	size_t			 ab_size;	/* usable bytes */
+	size_t			 ab_used;
+} bozo_arena_blk_t;
+
+#define ARENA_HDRSZ		BOZO_ARENA_ALIGN(sizeof(bozo_arena_blk_t))
+
+void *
+bozo_arena_alloc(bozohttpd_t *httpd, size_t size)
+{
+	bozo_arena_blk_t *ab = httpd->arena;
+	size_t blksz;
+	void *p;
+
+	size = BOZO_ARENA_ALIGN(size);
+	if (ab == NULL || ab->ab_size - ab->ab_used < size) {
+		blksz = size > BOZO_ARENA_BLKSZ - ARENA_HDRSZ ?
+		    size : BOZO_ARENA_BLKSZ - ARENA_HDRSZ;
+		ab = bozomalloc(httpd, ARENA_HDRSZ + blksz);
+		ab->ab_next = httpd->arena;
+		ab->ab_size = blksz;
+		ab->ab_used = 0;
+		httpd->arena = ab;
+	}
+	p = (char *)ab + ARENA_HDRSZ + ab->ab_used;
+	ab->ab_used += size;
+	return p;
+}
+
+char *
+bozo_arena_strdup(bozohttpd_t *httpd, const char *str)
+{
+	size_t	len = strlen(str) + 1;
+
+	return memcpy(bozo_arena_alloc(httpd, len), str, len);
+}
+
+void
+bozo_arena_reset(bozohttpd_t *httpd)
+{
+	bozo_arena_blk_t *ab, *next;
+
+	if ((ab = httpd->arena) == NULL)
+		return;
+	/* keep the oldest, first block; it is the regular size */
+	while ((next = ab->ab_next) != NULL) {
+		free(ab);
+		ab = next;
+	}
+	ab->ab_used = 0;
+	httpd->arena = ab;
+}
+
 char *
 bozostrdup(bozohttpd_t *httpd, const char *str)
 {
@@ -2080,6 +2367,9 @@ bozo_init_httpd(bozohttpd_t *httpd)
 	/* mmap region size */
 	httpd->mmapsz = BOZO_MMAPSZ;
 
+	/* serve_accepted() gives each connection a stream of its own */
+	httpd->outfp = stdout;
+
 	/* error buffer for bozo_http_error() */
 	if ((httpd->errorbuf = malloc(BUFSIZ)) == NULL) {
 		(void) fprintf(stderr,
@@ -2194,6 +2484,14 @@ bozo_setup(bozohttpd_t *httpd, bozoprefs_t *prefs, const char *vhost,
 	if ((cp = bozo_get_pref(prefs, "public_html")) != NULL) {
 		httpd->public_html = strdup(cp);
 	}
+	if ((cp = bozo_get_pref(prefs, "keep-alive")) == NULL ||
+	    strcmp(cp, "false") != 0) {
+		httpd->keepalive = 1;
+	}
+	if ((cp = bozo_get_pref(prefs, "cache size")) != NULL)
+		bozo_cache_init(httpd, (size_t)strtoul(cp, NULL, 10) * 1024);
+	else
+		bozo_cache_init(httpd, BOZO_CACHESZ);
 	httpd->server_software =
 			strdup(bozo_get_pref(prefs, "server software"));
 	httpd->index_html = strdup(bozo_get_pref(prefs, "index.html"));
@@ -95,11 +95,27 @@ typedef struct bozohttpd_t {
 	int		 process_cgi;	/* use the cgi handler */
 	char		*cgibin;	/* cgi-bin directory */
 	void		*sslinfo;	/* pointer to ssl struct */
+	FILE		*outfp;		/* stdio stream to the client */
 	int		dynamic_content_map_size;/* size of dyn cont map */
 	bozo_content_map_t	*dynamic_content_map;/* dynamic content map */
+	bozo_content_map_t	**static_content_hash;/* static map by suffix */
 	size_t		 mmapsz;	/* size of region to mmap */
+	char		*sendbuf;	/* file read buffer, BOZO_NO_MMAP */
+	void		*cache;		/* response cache, if any */
+	void		*arena;		/* per-request allocations */
 	char		*getln_buffer;	/* space for getln buffer */
 	ssize_t		 getln_buflen;	/* length of allocated space */
+	char		*getln_rabuf;	/* read-ahead for getln */
+	size_t		 getln_raoff;	/* next unread byte in it */
+	size_t		 getln_ralen;	/* bytes in it */
+	int		 getln_rafd;	/* fd they were read from */
+	int		 getln_timeout;	/* ms to wait for more, 0 forever */
+	int		 getln_timedout; /* and that ran out */
+	int		 keepalive;	/* allow persistent connections */
+	unsigned	 conn_nreq;	/* requests done on this connection */
+	char		*conn_remotehost; /* its peer, for all of them */
+	char		*conn_remoteaddr;
+	char		*conn_serverport;
 	char		*errorbuf;	/* no dynamic allocation allowed */
 	bozo_consts_t	 consts;	/* various constants */
 } bozohttpd_t;
@@ -131,6 +147,9 @@ typedef struct bozo_httpreq_t {
 	const char *hr_range;
 	const char *hr_if_modified_since;
 	const char *hr_accept_encoding;
+	const char *hr_connection;
+	int         hr_want_keepalive;	/* client asked to keep it open */
+	int         hr_keepalive;	/* and it will be */
 	int         hr_have_range;
 	off_t       hr_first_byte_pos;
 	off_t       hr_last_byte_pos;
@@ -144,6 +163,7 @@ typedef struct bozo_httpreq_t {
 #endif
 	SIMPLEQ_HEAD(, bozoheaders)	hr_headers;
 	int	hr_nheaders;
+	char	*hr_cachekey;	/* response cache key, if cacheable */
 } bozo_httpreq_t;
 
 /* helper to access the "active" host name from a httpd/request pair */
@@ -167,6 +187,19 @@ typedef struct bozoprefs_t {
 #define BOZO_MMAPSZ	(BOZO_WRSZ * 1024)
 #endif
 
+/* response cache of 4MiB by default, holding files of upto 64KiB */
+#ifndef BOZO_CACHESZ
+#define BOZO_CACHESZ	(4 * 1024 * 1024)
+#endif
+#ifndef BOZO_CACHEOBJ
+#define BOZO_CACHEOBJ	(64 * 1024)
+#endif
+
+/* bozodgetln() reads ahead in chunks of this much */
+#ifndef BOZO_GETLN_RASZ
+#define BOZO_GETLN_RASZ	4096
+#endif
+
 /* debug flags */
 #define DEBUG_NORMAL	1
 #define DEBUG_FAT	2
@@ -196,16 +229,25 @@ int	bozo_http_error(bozohttpd_t *, int, bozo_httpreq_t *, const char *);
 
 int	bozo_check_special_files(bozo_httpreq_t *, const char *);
 char	*bozo_http_date(char *, size_t);
+int	bozo_parse_http_date(const char *, time_t *);
 void	bozo_print_header(bozo_httpreq_t *, struct stat *, const char *, const char *);
+void	bozo_print_connection(bozo_httpreq_t *, int);
+int	bozo_has_token(const char *, const char *);
+void	bozo_serve_connection(bozohttpd_t *);
 char	*bozo_escape_rfc3986(bozohttpd_t *httpd, const char *url);
 char	*bozo_escape_html(bozohttpd_t *httpd, const char *url);
 
 char	*bozodgetln(bozohttpd_t *, int, ssize_t *, ssize_t (*)(bozohttpd_t *, int, void *, size_t));
+ssize_t	bozo_read_buffered(bozohttpd_t *, int, void *, size_t);
+void	bozo_getln_reset(bozohttpd_t *);
 char	*bozostrnsep(char **, const char *, ssize_t *);
 
 void	*bozomalloc(bozohttpd_t *, size_t);
 void	*bozorealloc(bozohttpd_t *, void *, size_t);
 char	*bozostrdup(bozohttpd_t *, const char *);
+void	*bozo_arena_alloc(bozohttpd_t *, size_t);
+char	*bozo_arena_strdup(bozohttpd_t *, const char *);
+void	bozo_arena_reset(bozohttpd_t *);
 
 /* ssl-bozo.c */
 #ifdef NO_SSL_SUPPORT
@@ -213,11 +255,13 @@ char	*bozostrdup(bozohttpd_t *, const char *);
 #define bozo_ssl_init(x)		do { /* nothing */ } while (0)
 #define bozo_ssl_accept(x)		do { /* nothing */ } while (0)
 #define bozo_ssl_destroy(x)		do { /* nothing */ } while (0)
+#define bozo_ssl_pending(x)		0
 #else
 void	bozo_ssl_set_opts(bozohttpd_t *, const char *, const char *);
 void	bozo_ssl_init(bozohttpd_t *);
 void	bozo_ssl_accept(bozohttpd_t *);
 void	bozo_ssl_destroy(bozohttpd_t *);
+int	bozo_ssl_pending(bozohttpd_t *);
 #endif
 
 
@@ -283,12 +327,25 @@ int	bozo_dir_index(bozo_httpreq_t *, const char *, int);
 /* content-bozo.c */
 const char *bozo_content_type(bozo_httpreq_t *, const char *);
 const char *bozo_content_encoding(bozo_httpreq_t *, const char *);
+int	bozo_content_compressible(bozo_httpreq_t *, const char *);
 bozo_content_map_t *bozo_match_content_map(bozohttpd_t *, const char *, int);
 bozo_content_map_t *bozo_get_content_map(bozohttpd_t *, const char *);
 #ifndef NO_DYNAMIC_CONTENT
 void	bozo_add_content_map_mime(bozohttpd_t *, const char *, const char *, const char *, const char *);
 #endif
 
+/* cache-bozo.c */
+#ifdef NO_RESPONSE_CACHE
+#define bozo_cache_init(x, y)				do { /* nothing */ } while (0)
+#define bozo_cache_serve(x, y)				0
+#define bozo_cache_fill(a, b, c, d, e, f, g)		0
+#else
+void	bozo_cache_init(bozohttpd_t *, size_t);
+int	bozo_cache_serve(bozo_httpreq_t *, int);
+int	bozo_cache_fill(bozo_httpreq_t *, int, const char *, struct stat *, const char *, const char *, int);
+#endif /* NO_RESPONSE_CACHE */
+
+
 /* I/O */
 int bozo_printf(bozohttpd_t *, const char *, ...) BOZO_PRINTFLIKE(2, 3);;
 ssize_t bozo_read(bozohttpd_t *, int, void *, size_t);
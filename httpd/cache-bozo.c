@@ -0,0 +1,444 @@
+/*	$eterna: cache-bozo.c,v 1.1 2026/10/14 12:00:00 mrg Exp $	*/
+
+/*
+ * Copyright (c) 1997-2013 Matthew R. Green
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer and
+ *    dedication in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/* this code implements an in-memory response cache for bozohttpd */
+
+#ifndef NO_RESPONSE_CACHE
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef NO_GZIP
+#include <zlib.h>
+#endif
+
+#include "bozohttpd.h"
+
+/*
+ * small static files are kept whole: the response header block that
+ * does not change between requests, and the body.  entries are keyed
+ * by the request as it arrived (Host: header, URL and whether the
+ * client takes gzip), so that a hit is answered before the request
+ * is transformed, without any chdir(), stat() or open().  an entry
+ * is only made after the full path has served the file, so anything
+ * transform_request() would have refused is never in the cache.
+ *
+ * the file behind an entry is stat()ed at most once every
+ * BOZO_CACHE_TTL seconds; if it changed the entry is dropped.
+ *
+ * compressible files the client could take gzip'ed, but which have
+ * no .gz next to them, are compressed once when the entry is made.
+ *
+ * each bozohttpd_t has its own cache and serves one request at a
+ * time, so there is no locking.
+ */
+
+#ifndef BOZO_CACHE_TTL
+#define BOZO_CACHE_TTL		1
+#endif
+#define BOZO_CACHE_HASHSZ	256
+
+typedef struct bozo_cache_entry {
+	struct bozo_cache_entry	*ce_hnext;	/* hash chain */
+	struct bozo_cache_entry	*ce_prev;	/* LRU, head is newest */
+	struct bozo_cache_entry	*ce_next;
+	unsigned	 ce_hash;
+	char		*ce_key;
+	char		*ce_path;	/* absolute path of the file served */
+	dev_t		 ce_dev;
+	ino_t		 ce_ino;
+	time_t		 ce_mtime;
+	off_t		 ce_size;
+	time_t		 ce_checked;	/* when ce_path was last stat()ed */
+	char		*ce_hdr;	/* header lines after Date: */
+	size_t		 ce_hdrlen;
+	char		*ce_body;
+	size_t		 ce_bodylen;	/* differs from ce_size if gzip'ed */
+	size_t		 ce_cost;	/* bytes charged to the budget */
+} bozo_cache_entry_t;
+
+typedef struct bozo_cache_t {
+	bozo_cache_entry_t	*bc_hash[BOZO_CACHE_HASHSZ];
+	bozo_cache_entry_t	*bc_head;
+	bozo_cache_entry_t	*bc_tail;
+	size_t			 bc_used;
+	size_t			 bc_budget;
+	size_t			 bc_maxobj;
+} bozo_cache_t;
+
+static unsigned
+cache_hash(const char *s)
+{
+	unsigned h = 5381;
+
+	while (*s)
+		h = h * 33 + (unsigned char)*s++;
+	return h;
+}
+
+static void
+lru_unlink(bozo_cache_t *bc, bozo_cache_entry_t *ce)
+{
+	if (ce->ce_prev)
+		ce->ce_prev->ce_next = ce->ce_next;
+	else
+		bc->bc_head = ce->ce_next;
+	if (ce->ce_next)
+		ce->ce_next->ce_prev = ce->ce_prev;
+	else
+		bc->bc_tail = ce->ce_prev;
+}
+
+static void
+lru_insert_head(bozo_cache_t *bc, bozo_cache_entry_t *ce)
+{
+	ce->ce_prev = NULL;
+	ce->ce_next = bc->bc_head;
+	if (bc->bc_head)
+		bc->bc_head->ce_prev = ce;
+	else
+		bc->bc_tail = ce;
+	bc->bc_head = ce;
+}
+
+static void
+cache_free_entry(bozo_cache_entry_t *ce)
+{
+	free(ce->ce_key);
+	free(ce->ce_path);
+	free(ce->ce_hdr);
+	free(ce->ce_body);
+	free(ce);
+}
+
+static void
+cache_evict(bozo_cache_t *bc, bozo_cache_entry_t *ce)
+{
+	bozo_cache_entry_t **cep;
+
+	for (cep = &bc->bc_hash[ce->ce_hash % BOZO_CACHE_HASHSZ]; *cep;
+	    cep = &(*cep)->ce_hnext)
+		if (*cep == ce) {
+			*cep = ce->ce_hnext;
+			break;
+		}
+	lru_unlink(bc, ce);
+	bc->bc_used -= ce->ce_cost;
+	cache_free_entry(ce);
+}
+
+static bozo_cache_entry_t *
+cache_find(bozo_cache_t *bc, const char *key, unsigned hash)
+{
+	bozo_cache_entry_t *ce;
+
+	for (ce = bc->bc_hash[hash % BOZO_CACHE_HASHSZ]; ce; ce = ce->ce_hnext)
+		if (ce->ce_hash == hash && strcmp(ce->ce_key, key) == 0)
+			return ce;
+	return NULL;
+}
+
+/* can this request be answered from, or go into, the cache at all? */
+static int
+cache_request_ok(bozo_httpreq_t *request)
+{
+	bozohttpd_t *httpd = request->hr_httpd;
+
+	if (httpd->cache == NULL)
+		return 0;
+	if (request->hr_method != HTTP_GET && request->hr_method != HTTP_HEAD)
+		return 0;
+	if (request->hr_proto == httpd->consts.http_09)
+		return 0;
+	if (request->hr_have_range || request->hr_last_byte_pos != -1)
+		return 0;
+	/* the referrer check and auth depend on more than the key */
+	if (httpd->untrustedref)
+		return 0;
+#ifdef DO_HTPASSWD
+	return 0;
+#else
+	return 1;
+#endif
+}
+
+/* answer the request from the entry */
+static int
+cache_send(bozo_httpreq_t *request, bozo_cache_entry_t *ce)
+{
+	bozohttpd_t *httpd = request->hr_httpd;
+	time_t timestamp;
+	char date[40];
+
+	if (request->hr_if_modified_since &&
+	    bozo_parse_http_date(request->hr_if_modified_since, &timestamp) &&
+	    timestamp >= ce->ce_mtime) {
+		bozo_printf(httpd, "%s 304 Not Modified\r\n",
+				request->hr_proto);
+		bozo_print_connection(request, 1);
+		bozo_printf(httpd, "\r\n");
+		bozo_flush(httpd, httpd->outfp);
+		return 1;
+	}
+
+	bozo_printf(httpd, "%s 200 OK\r\n", request->hr_proto);
+	bozo_printf(httpd, "Date: %s\r\n", bozo_http_date(date, sizeof(date)));
+	bozo_printf(httpd, "%.*s", (int)ce->ce_hdrlen, ce->ce_hdr);
+	bozo_print_connection(request, 1);
+	bozo_printf(httpd, "\r\n");
+	bozo_flush(httpd, httpd->outfp);
+
+	if (request->hr_method != HTTP_HEAD && ce->ce_bodylen &&
+	    (size_t)bozo_write(httpd, STDOUT_FILENO, ce->ce_body,
+	    ce->ce_bodylen) != ce->ce_bodylen) {
+		bozo_warn(httpd, "write failed: %s", strerror(errno));
+		request->hr_keepalive = 0;
+	}
+	return 1;
+}
+
+void
+bozo_cache_init(bozohttpd_t *httpd, size_t budget)
+{
+	bozo_cache_t *bc;
+
+	if (budget == 0)
+		return;
+	bc = bozomalloc(httpd, sizeof(*bc));
+	memset(bc, 0, sizeof(*bc));
+	bc->bc_budget = budget;
+	bc->bc_maxobj = budget / 8 < BOZO_CACHEOBJ ? budget / 8 : BOZO_CACHEOBJ;
+	httpd->cache = bc;
+}
+
+/*
+ * try to answer the request from the cache.  returns 1 if it was.
+ * otherwise, if the answer may be cached, the key is left in
+ * request->hr_cachekey for bozo_cache_fill() to use.
+ */
+int
+bozo_cache_serve(bozo_httpreq_t *request, int gzip_ok)
+{
+	bozohttpd_t *httpd = request->hr_httpd;
+	bozo_cache_t *bc = httpd->cache;
+	bozo_cache_entry_t *ce;
+	struct stat sb;
+	const char *host;
+	size_t keylen;
+	time_t now;
+	unsigned hash;
+
+	if (!cache_request_ok(request))
+		return 0;
+
+	host = request->hr_host ? request->hr_host : "";
+	keylen = strlen(host) + strlen(request->hr_file) + 5;
+	request->hr_cachekey = bozo_arena_alloc(httpd, keylen);
+	snprintf(request->hr_cachekey, keylen, "%s %s %d",
+	    host, request->hr_file, gzip_ok != 0);
+	hash = cache_hash(request->hr_cachekey);
+	if ((ce = cache_find(bc, request->hr_cachekey, hash)) == NULL)
+		return 0;
+
+	now = time(NULL);
+	if (now - ce->ce_checked >= BOZO_CACHE_TTL) {
+		if (stat(ce->ce_path, &sb) < 0 ||
+		    sb.st_mtime != ce->ce_mtime || sb.st_size != ce->ce_size ||
+		    sb.st_ino != ce->ce_ino || sb.st_dev != ce->ce_dev) {
+			debug((httpd, DEBUG_FAT, "cache: %s is stale",
+			    ce->ce_path));
+			cache_evict(bc, ce);
+			return 0;
+		}
+		ce->ce_checked = now;
+	}
+
+	if (ce != bc->bc_head) {
+		lru_unlink(bc, ce);
+		lru_insert_head(bc, ce);
+	}
+	debug((httpd, DEBUG_FAT, "cache: hit %s", ce->ce_path));
+	return cache_send(request, ce);
+}
+
+#ifndef NO_GZIP
+/*
+ * gzip the body in place, if that makes it smaller.  returns 1 if
+ * the body was replaced.
+ */
+static int
+cache_gzip(bozohttpd_t *httpd, bozo_cache_entry_t *ce)
+{
+	z_stream zs;
+	char *out;
+	uLong bound;
+	int rv;
+
+	memset(&zs, 0, sizeof(zs));
+	/* 16 + MAX_WBITS asks for a gzip header and trailer */
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+	    16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return 0;
+	bound = deflateBound(&zs, (uLong)ce->ce_bodylen);
+	if ((out = malloc(bound)) == NULL) {
+		deflateEnd(&zs);
+		return 0;
+	}
+	zs.next_in = (Bytef *)ce->ce_body;
+	zs.avail_in = (uInt)ce->ce_bodylen;
+	zs.next_out = (Bytef *)out;
+	zs.avail_out = (uInt)bound;
+	rv = deflate(&zs, Z_FINISH);
+	deflateEnd(&zs);
+	if (rv != Z_STREAM_END || zs.total_out >= ce->ce_bodylen) {
+		free(out);
+		return 0;
+	}
+
+	debug((httpd, DEBUG_FAT, "cache: gzip'ed %s, %zu -> %lu bytes",
+	    ce->ce_path, ce->ce_bodylen, zs.total_out));
+	free(ce->ce_body);
+	ce->ce_body = out;
+	ce->ce_bodylen = zs.total_out;
+	return 1;
+}
+#else
+#define cache_gzip(h, c)	0
+#endif /* NO_GZIP */
+
+/*
+ * make an entry for the file just opened on fd for this request, and
+ * answer the request from it.  returns 1 if that was done, 0 if the
+ * file is not cacheable and the caller has to send it, with nothing
+ * written yet.  if compress is set, the body is gzip'ed if that
+ * helps, and sent with that encoding.
+ */
+int
+bozo_cache_fill(bozo_httpreq_t *request, int fd, const char *path,
+		struct stat *sbp, const char *type, const char *encoding,
+		int compress)
+{
+	bozohttpd_t *httpd = request->hr_httpd;
+	bozo_cache_t *bc = httpd->cache;
+	bozo_cache_entry_t *ce;
+	char filedate[40], cwd[MAXPATHLEN];
+	struct tm *tm;
+	size_t done;
+	ssize_t rlen;
+	int len;
+
+	if (request->hr_cachekey == NULL || !S_ISREG(sbp->st_mode) ||
+	    sbp->st_size > (off_t)bc->bc_maxobj)
+		return 0;
+	if (*path != '/' && getcwd(cwd, sizeof(cwd)) == NULL)
+		return 0;
+
+	if ((ce = calloc(1, sizeof(*ce))) == NULL)
+		return 0;
+	ce->ce_key = strdup(request->hr_cachekey);
+	if (*path == '/')
+		ce->ce_path = strdup(path);
+	else if (asprintf(&ce->ce_path, "%s/%s", cwd, path) < 0)
+		ce->ce_path = NULL;
+	ce->ce_body = malloc(sbp->st_size ? (size_t)sbp->st_size : 1);
+	if (ce->ce_key == NULL || ce->ce_path == NULL || ce->ce_body == NULL)
+		goto bad;
+
+	for (done = 0; done < (size_t)sbp->st_size; done += (size_t)rlen) {
+		rlen = pread(fd, ce->ce_body + done,
+		    (size_t)sbp->st_size - done, (off_t)done);
+		if (rlen <= 0)
+			goto bad;
+	}
+	ce->ce_bodylen = (size_t)sbp->st_size;
+	if (compress && cache_gzip(httpd, ce))
+		encoding = "gzip";
+
+	/* the same lines, in the same order, as bozo_print_header() */
+	tm = gmtime(&sbp->st_mtime);
+	strftime(filedate, sizeof filedate, "%a, %d %b %Y %H:%M:%S GMT", tm);
+	len = asprintf(&ce->ce_hdr,
+	    "Server: %s\r\n"
+	    "Accept-Ranges: bytes\r\n"
+	    "Last-Modified: %s\r\n"
+	    "%s%s%s"
+	    "%s%s%s"
+	    "%s"
+	    "Content-Length: %zu\r\n",
+	    httpd->server_software, filedate,
+	    type && *type ? "Content-Type: " : "", type && *type ? type : "",
+	    type && *type ? "\r\n" : "",
+	    encoding && *encoding ? "Content-Encoding: " : "",
+	    encoding && *encoding ? encoding : "",
+	    encoding && *encoding ? "\r\n" : "",
+	    compress ? "Vary: Accept-Encoding\r\n" : "",
+	    ce->ce_bodylen);
+	if (len < 0) {
+		ce->ce_hdr = NULL;
+		goto bad;
+	}
+	ce->ce_hdrlen = (size_t)len;
+
+	ce->ce_hash = cache_hash(ce->ce_key);
+	ce->ce_dev = sbp->st_dev;
+	ce->ce_ino = sbp->st_ino;
+	ce->ce_mtime = sbp->st_mtime;
+	ce->ce_size = sbp->st_size;
+	ce->ce_checked = time(NULL);
+	ce->ce_cost = sizeof(*ce) + strlen(ce->ce_key) + strlen(ce->ce_path) +
+	    ce->ce_hdrlen + ce->ce_bodylen;
+
+	if (ce->ce_cost > bc->bc_budget)
+		goto bad;
+	while (bc->bc_tail && bc->bc_used + ce->ce_cost > bc->bc_budget)
+		cache_evict(bc, bc->bc_tail);
+
+	ce->ce_hnext = bc->bc_hash[ce->ce_hash % BOZO_CACHE_HASHSZ];
+	bc->bc_hash[ce->ce_hash % BOZO_CACHE_HASHSZ] = ce;
+	lru_insert_head(bc, ce);
+	bc->bc_used += ce->ce_cost;
+	debug((httpd, DEBUG_FAT, "cache: added %s, %zu/%zu bytes used",
+	    ce->ce_path, bc->bc_used, bc->bc_budget));
+
+	return cache_send(request, ce);
+
+ bad:
+	cache_free_entry(ce);
+	return 0;
+}
+
+#endif /* NO_RESPONSE_CACHE */
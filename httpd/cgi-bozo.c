@@ -147,7 +147,7 @@ finish_cgi_output(bozohttpd_t *httpd, bozo_httpreq_t *request, int in, int nph)
 				"from status %s ..", hdr_value));
 			bozo_printf(httpd, "%s %s\r\n", request->hr_proto,
 					hdr_value);
-			bozo_flush(httpd, stdout);
+			bozo_flush(httpd, httpd->outfp);
 			write_header = 0;
 			free(hdr_name);
 			break;
@@ -165,7 +165,7 @@ finish_cgi_output(bozohttpd_t *httpd, bozo_httpreq_t *request, int in, int nph)
 			"bozo_process_cgi:  writing HTTP header .."));
 		bozo_printf(httpd,
 			"%s 200 OK\r\n", request->hr_proto);
-		bozo_flush(httpd, stdout);
+		bozo_flush(httpd, httpd->outfp);
 	}
 
 	if (nheaders) {
@@ -178,7 +178,7 @@ finish_cgi_output(bozohttpd_t *httpd, bozo_httpreq_t *request, int in, int nph)
 			free(hdr);
 		}
 		bozo_printf(httpd, "\r\n");
-		bozo_flush(httpd, stdout);
+		bozo_flush(httpd, httpd->outfp);
 	}
 
 	/* XXX we should have some goo that times us out
@@ -454,7 +454,7 @@ bozo_process_cgi(bozo_httpreq_t *request)
 
 	close(sv[1]);
 
-	/* parent: read from stdin (bozo_read()) write to sv[0] */
+	/* parent: read from stdin (bozo_read_buffered()) write to sv[0] */
 	/* child: read from sv[0] (bozo_write()) write to stdout */
 	pid = fork();
 	if (pid == -1)
@@ -472,7 +472,8 @@ bozo_process_cgi(bozo_httpreq_t *request)
 
 	/* XXX we should have some goo that times us out
 	 */
-	while ((rbytes = bozo_read(httpd, STDIN_FILENO, buf, sizeof buf)) > 0) {
+	while ((rbytes = bozo_read_buffered(httpd, STDIN_FILENO, buf,
+	    sizeof buf)) > 0) {
 		ssize_t wbytes;
 		char *bp = buf;
 
@@ -34,6 +34,7 @@
 
 #include <sys/param.h>
 
+#include <ctype.h>
 #include <errno.h>
 #include <string.h>
 
@@ -56,6 +57,8 @@ static bozo_content_map_t static_content_map[] = {
 	{ ".png",	4, "image/png",			"",		"", NULL },
 	{ ".mp3",	4, "audio/mpeg",		"",		"", NULL },
 	{ ".css",	4, "text/css",			"",		"", NULL },
+	{ ".js",	3, "application/javascript",	"",		"", NULL },
+	{ ".svg",	4, "image/svg+xml",		"",		"", NULL },
 	{ ".txt",	4, "text/plain",		"",		"", NULL },
 	{ ".swf",	4, "application/x-shockwave-flash","",		"", NULL },
 	{ ".dcr",	4, "application/x-director",	"",		"", NULL },
@@ -186,6 +189,71 @@ search_map(bozo_content_map_t *map, const char *name, size_t len)
 	return NULL;
 }
 
+/*
+ * the static map is also kept in a hash table by suffix, so that a
+ * lookup costs one probe per '.' in the file name instead of a walk
+ * over the whole map.  every static suffix starts with a '.', so the
+ * candidates are the name from each '.' on, longest first.  for the
+ * static map that gives the same answer as search_map(): where one
+ * suffix ends another (.tar.gz and .gz), the longer comes first.
+ * duplicate suffixes keep the first entry, also as search_map() did.
+ *
+ * the dynamic map stays a list: it is usually empty, it may hold
+ * suffixes without a '.', and it moves when it grows.
+ */
+#define CONTENT_HASHSZ	512	/* power of 2, over twice the static map */
+
+static unsigned
+suffix_hash(const char *s)
+{
+	unsigned h = 2166136261u;
+
+	for (; *s; s++)
+		h = (h ^ (unsigned char)tolower((unsigned char)*s)) * 16777619u;
+	return h;
+}
+
+static void
+build_content_hash(bozohttpd_t *httpd)
+{
+	bozo_content_map_t	**tab, *map;
+	unsigned		 h;
+
+	tab = bozomalloc(httpd, CONTENT_HASHSZ * sizeof(*tab));
+	memset(tab, 0, CONTENT_HASHSZ * sizeof(*tab));
+	for (map = static_content_map; map->name; map++) {
+		for (h = suffix_hash(map->name) & (CONTENT_HASHSZ - 1);
+		    tab[h] && strcasecmp(tab[h]->name, map->name) != 0;
+		    h = (h + 1) & (CONTENT_HASHSZ - 1))
+			continue;
+		if (tab[h] == NULL)
+			tab[h] = map;
+	}
+	httpd->static_content_hash = tab;
+}
+
+static bozo_content_map_t *
+search_static_map(bozohttpd_t *httpd, const char *name)
+{
+	bozo_content_map_t	**tab, *map;
+	const char		*p;
+	unsigned		 h;
+
+	if (httpd->static_content_hash == NULL)
+		build_content_hash(httpd);
+	tab = httpd->static_content_hash;
+
+	/* never the whole name: a suffix must be shorter than it */
+	for (p = strchr(name + 1, '.'); p; p = strchr(p + 1, '.')) {
+		for (h = suffix_hash(p) & (CONTENT_HASHSZ - 1);
+		    (map = tab[h]) != NULL;
+		    h = (h + 1) & (CONTENT_HASHSZ - 1))
+			if (strcasecmp(map->name, p) == 0)
+				return map;
+	}
+	return NULL;
+}
+
 /* match a suffix on a file - dynamiconly means no static content search */
 bozo_content_map_t *
 bozo_match_content_map(bozohttpd_t *httpd, const char *name,
@@ -194,12 +262,14 @@ bozo_match_content_map(bozohttpd_t *httpd, const char *name,
 	bozo_content_map_t	*map;
 	size_t			 len;
 
-	len = strlen(name);
-	if ((map = search_map(httpd->dynamic_content_map, name, len)) != NULL) {
-		return map;
+	if (httpd->dynamic_content_map) {
+		len = strlen(name);
+		map = search_map(httpd->dynamic_content_map, name, len);
+		if (map != NULL)
+			return map;
 	}
-	if (!dynamiconly) {
-		if ((map = search_map(static_content_map, name, len)) != NULL) {
+	if (!dynamiconly && *name) {
+		if ((map = search_static_map(httpd, name)) != NULL) {
 			return map;
 		}
 	}
@@ -238,6 +308,47 @@ bozo_content_encoding(bozo_httpreq_t *request, const char *file)
 	return NULL;
 }
 
+/*
+ * content types that are worth compressing on the fly.  anything
+ * that is not already encoded and starts with one of these.
+ */
+static const char *compressible_types[] = {
+	"text/",
+	"application/javascript",
+	"application/postscript",
+	"application/rtf",
+	"application/x-csh",
+	"application/x-latex",
+	"application/x-patch",
+	"application/x-sh",
+	"application/x-tcl",
+	"application/x-tex",
+	"application/x-troff",
+	"image/svg+xml",
+	"image/x-xbitmap",
+	"image/x-xpixmap",
+	NULL
+};
+
+/*
+ * given the file name, return if its content compresses well enough
+ * to be worth sending gzip'ed.
+ */
+int
+bozo_content_compressible(bozo_httpreq_t *request, const char *file)
+{
+	const char *type, *encoding, **ct;
+
+	encoding = bozo_content_encoding(request, file);
+	if (encoding && *encoding)
+		return 0;
+	type = bozo_content_type(request, file);
+	for (ct = compressible_types; *ct; ct++)
+		if (strncasecmp(type, *ct, strlen(*ct)) == 0)
+			return 1;
+	return 0;
+}
+
 #ifndef NO_DYNAMIC_CONTENT
 
 bozo_content_map_t *
@@ -101,7 +101,7 @@ bozo_dir_index(bozo_httpreq_t *request, const char *dirname, int isindex)
 		bozo_print_header(request, NULL, "text/html", "");
 		bozo_printf(httpd, "\r\n");
 	}
-	bozo_flush(httpd, stdout);
+	bozo_flush(httpd, httpd->outfp);
 
 	if (request->hr_method == HTTP_HEAD) {
 		closedir(dp);
@@ -202,7 +202,7 @@ bozo_dir_index(bozo_httpreq_t *request, const char *dirname, int isindex)
 	bozo_printf(httpd, "</pre>");
 	directory_hr(httpd);
 	bozo_printf(httpd, "</body></html>\r\n\r\n");
-	bozo_flush(httpd, stdout);
+	bozo_flush(httpd, httpd->outfp);
 
 done:
 	if (file)
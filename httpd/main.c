@@ -39,8 +39,11 @@
 
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/socket.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
@@ -80,6 +83,12 @@ usage(bozohttpd_t *httpd, char *progname)
 		"   -c cgibin\t\tenable cgi-bin support in this directory");
 #endif
 	bozo_warn(httpd, "   -I port\t\tbind or use on this port");
+	bozo_warn(httpd,
+		"   -k\t\t\tclose each connection after one request");
+#ifndef NO_RESPONSE_CACHE
+	bozo_warn(httpd,
+		"   -K kbytes\t\tmemory for cached responses, 0 to disable");
+#endif
 #ifndef NO_DAEMON_MODE
 	bozo_warn(httpd, "   -b\t\t\tbackground and go into daemon mode");
 	bozo_warn(httpd, "   -f\t\t\tkeep daemon mode in the foreground");
@@ -87,6 +96,8 @@ usage(bozohttpd_t *httpd, char *progname)
 		"   -i address\t\tbind on this address (daemon mode only)");
 	bozo_warn(httpd, "   -P pidfile\t\tpath to the pid file to create");
 #endif
+	bozo_warn(httpd,
+		"   -W fd\t\tserve connections accepted on fd, no fork");
 	bozo_warn(httpd, "   -S version\t\tset server version string");
 	bozo_warn(httpd, "   -t dir\t\tchroot to `dir'");
 	bozo_warn(httpd, "   -U username\t\tchange user to `user'");
@@ -116,14 +127,71 @@ usage(bozohttpd_t *httpd, char *progname)
 	bozo_err(httpd, 1, "%s failed to start", progname);
 }
 
+/*
+ * serve connections from an inherited listening socket, one after the
+ * other, in this process.  meant for embedding bozohttpd where fork()
+ * isn't available: several processes each running this can share one
+ * listening socket.  a connection becomes stdin/stdout while served,
+ * and is written through a stdio stream of its own: the one libc
+ * stdout is shared by all the workers in the domain, and output one
+ * of them left buffered could go out on another's connection.
+ */
+static void
+serve_accepted(bozohttpd_t *httpd, int listenfd)
+{
+	int		 fd;
+
+	/* keep stdin/stdout free for the connections */
+	if (listenfd < 3) {
+		if ((fd = fcntl(listenfd, F_DUPFD, 3)) == -1)
+			bozo_err(httpd, 1, "F_DUPFD: %s", strerror(errno));
+		close(listenfd);
+		listenfd = fd;
+	}
+
+	for (;;) {
+		if ((fd = accept(listenfd, NULL, NULL)) == -1) {
+			if (errno == EFAULT || errno == EINVAL ||
+			    errno == EBADF || errno == ENOTSOCK)
+				bozo_err(httpd, 1, "accept: %s",
+					strerror(errno));
+			if (errno == ENOMEM || errno == ENFILE ||
+			    errno == EMFILE)
+				sleep(1);
+			continue;
+		}
+		/* 0 and 1 are closed, so accept() may well hand one out */
+		if (fd != 0)
+			dup2(fd, 0);
+		if (fd != 1)
+			dup2(fd, 1);
+		if (fd > 1)
+			close(fd);
+		if ((httpd->outfp = fdopen(1, "w")) == NULL) {
+			bozo_warn(httpd, "fdopen: %s", strerror(errno));
+			httpd->outfp = stdout;
+			close(0);
+			close(1);
+			continue;
+		}
+
+		httpd->request_times++;
+		bozo_serve_connection(httpd);
+		/* flushes what is left, and closes 1 */
+		fclose(httpd->outfp);
+		httpd->outfp = stdout;
+		close(0);
+		bozo_getln_reset(httpd);
+	}
+}
+
 int
 main(int argc, char **argv)
 {
-	bozo_httpreq_t	*request;
 	bozohttpd_t	 httpd;
 	bozoprefs_t	 prefs;
 	char		*progname;
-	int		 c;
+	int		 c, listenfd = -1;
 
 	(void) memset(&httpd, 0x0, sizeof(httpd));
 	(void) memset(&prefs, 0x0, sizeof(prefs));
@@ -138,9 +206,26 @@ main(int argc, char **argv)
 	bozo_set_defaults(&httpd, &prefs);
 
 	while ((c = getopt(argc, argv,
-			   "C:HI:M:P:S:U:VXZ:bc:defhi:np:rst:uv:x:z:")) != -1) {
+			   "C:HI:K:M:P:S:U:VW:XZ:bc:defhi:knp:rst:uv:x:z:")) != -1) {
 		switch(c) {
 
+		case 'W':
+			listenfd = atoi(optarg);
+			break;
+
+		case 'K':
+#ifdef NO_RESPONSE_CACHE
+			bozo_err(&httpd, 1, "response cache is not enabled");
+			/* NOTREACHED */
+#else
+			bozo_set_pref(&prefs, "cache size", optarg);
+			break;
+#endif /* NO_RESPONSE_CACHE */
+
+		case 'k':
+			bozo_set_pref(&prefs, "keep-alive", "false");
+			break;
+
 		case 'M':
 #ifdef NO_DYNAMIC_CONTENT
 			bozo_err(&httpd, 1,
@@ -327,14 +412,16 @@ main(int argc, char **argv)
 	/* virtual host, and root of tree to serve */
 	bozo_setup(&httpd, &prefs, argv[1], argv[0]);
 
+	if (listenfd != -1) {
+		serve_accepted(&httpd, listenfd);
+		/* NOTREACHED */
+	}
+
 	/*
 	 * read and process the HTTP request.
 	 */
 	do {
-		if ((request = bozo_read_request(&httpd)) != NULL) {
-			bozo_process_request(request);
-			bozo_clean_request(request);
-		}
+		bozo_serve_connection(&httpd);
 	} while (httpd.background);
 
 	return (0);
@@ -43,11 +43,23 @@
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
 
 #ifndef USE_ARG
 #define USE_ARG(x)	/*LINTED*/(void)&(x)
 #endif
 
+/* sessions kept for resumption, and for how long (seconds) */
+#ifndef BOZO_SSL_SESSIONS
+#define BOZO_SSL_SESSIONS	1024
+#endif
+#ifndef BOZO_SSL_SESSTIMEOUT
+#define BOZO_SSL_SESSTIMEOUT	300
+#endif
+
+/* AES-GCM first: with AES-NI and PCLMULQDQ it is the cheapest there is */
+#define BOZO_SSL_CIPHERS	"ECDHE+AESGCM:DHE+AESGCM:AESGCM:HIGH:!aNULL:!MD5:!RC4"
+
 /* this structure encapsulates the ssl info */
 typedef struct sslinfo_t {
 	SSL_CTX			*ssl_context;
@@ -64,6 +76,20 @@ typedef struct sslinfo_t {
  * the error provided by the caller at the point of error it pops and
  * prints all errors from the SSL error queue.
  */
+/*
+ * every context in this address space encrypts session tickets with the
+ * same keys.  several httpds serving one listening socket in one image
+ * each have their own context, and a client coming back through
+ * another of them can still resume.
+ */
+static unsigned char	ticket_keys[48];
+static int		ticket_keys_ok;
+
+#if defined(__i386__) || defined(__x86_64__)
+/* only there if libcrypto was built with its x86 assembly */
+extern unsigned int OPENSSL_ia32cap_P[] __attribute__((__weak__));
+#endif
+
 BOZO_PRINTFLIKE(3, 4) BOZO_DEAD static void
 bozo_ssl_err(bozohttpd_t *httpd, int code, const char *fmt, ...)
 {
@@ -192,6 +218,46 @@ bozo_ssl_init(bozohttpd_t *httpd)
 	if (!SSL_CTX_check_private_key(sslinfo->ssl_context))
 		bozo_ssl_err(httpd, EXIT_FAILURE,
 		    "Check private key failed");
+
+	/*
+	 * let clients resume, by session id or by ticket, instead of
+	 * doing the full handshake every time.
+	 */
+	SSL_CTX_set_session_id_context(sslinfo->ssl_context,
+	    (const unsigned char *)"bozohttpd", 9);
+	SSL_CTX_set_session_cache_mode(sslinfo->ssl_context,
+	    SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(sslinfo->ssl_context, BOZO_SSL_SESSIONS);
+	SSL_CTX_set_timeout(sslinfo->ssl_context, BOZO_SSL_SESSTIMEOUT);
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEYS
+	if (!ticket_keys_ok &&
+	    RAND_bytes(ticket_keys, (int)sizeof(ticket_keys)) == 1)
+		ticket_keys_ok = 1;
+	if (ticket_keys_ok)
+		SSL_CTX_set_tlsext_ticket_keys(sslinfo->ssl_context,
+		    ticket_keys, sizeof(ticket_keys));
+#endif
+
+	SSL_CTX_set_options(sslinfo->ssl_context,
+	    SSL_OP_CIPHER_SERVER_PREFERENCE);
+	if (1 != SSL_CTX_set_cipher_list(sslinfo->ssl_context,
+	    BOZO_SSL_CIPHERS))
+		bozo_ssl_err(httpd, EXIT_FAILURE,
+		    "Unable to set cipher list '%s'", BOZO_SSL_CIPHERS);
+
+	debug((httpd, DEBUG_NORMAL, "%s, session cache %d, tickets %s",
+	    SSLeay_version(SSLEAY_VERSION), BOZO_SSL_SESSIONS,
+	    ticket_keys_ok ? "shared" : "per context"));
+#if defined(__i386__) || defined(__x86_64__)
+	/* word 1 is cpuid(1).ecx; AES-NI is bit 25 of it */
+	if (OPENSSL_ia32cap_P == NULL)
+		bozo_warn(httpd, "libcrypto has no x86 assembly, "
+		    "AES is done in C");
+	else
+		debug((httpd, DEBUG_NORMAL, "libcrypto assembly, AES-NI %s",
+		    (OPENSSL_ia32cap_P[1] & (1U << 25)) ? "in use" :
+		    "not offered by the CPU"));
+#endif
 }
 
 void
@@ -218,6 +284,18 @@ bozo_ssl_destroy(bozohttpd_t *httpd)
 		SSL_free(sslinfo->bozossl);
 }
 
+/* bytes already decrypted, which a poll() on the socket won't see */
+int
+bozo_ssl_pending(bozohttpd_t *httpd)
+{
+	sslinfo_t	*sslinfo;
+
+	sslinfo = httpd->sslinfo;
+	if (sslinfo && sslinfo->bozossl)
+		return SSL_pending(sslinfo->bozossl);
+	return 0;
+}
+
 void
 bozo_ssl_set_opts(bozohttpd_t *httpd, const char *cert, const char *priv)
 {
@@ -256,7 +334,7 @@ bozo_printf(bozohttpd_t *httpd, const char *fmt, ...)
 		return cc;
 	}
 #endif
-	cc = vprintf(fmt, args);
+	cc = vfprintf(httpd->outfp, fmt, args);
 	va_end(args);
 	return cc;
 }
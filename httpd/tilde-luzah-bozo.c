@@ -48,7 +48,7 @@
  * bozo_user_transform does this:
  *	- chdir's /~user/public_html
  *	- returns the rest of the file, index.html appended if required
- *	- returned malloced file to serve in request->hr_file,
+ *	- returned file to serve in request->hr_file, from the arena,
  *        ala transform_request().
  *
  * transform_request() is supposed to check that we have user support
@@ -99,9 +99,9 @@ bozo_user_transform(bozo_httpreq_t *request, int *isindex)
 		return 0;
 	}
 	if (s == NULL || *s == '\0') {
-		file = bozostrdup(httpd, httpd->index_html);
+		file = bozo_arena_strdup(httpd, httpd->index_html);
 	} else {
-		file = bozomalloc(httpd, strlen(s) +
+		file = bozo_arena_alloc(httpd, strlen(s) +
 		    (*isindex ? strlen(httpd->index_html) + 1 : 1));
 		strcpy(file, s);
 		if (*isindex)
@@ -112,16 +112,12 @@ bozo_user_transform(bozo_httpreq_t *request, int *isindex)
 	if (*file == '/' || strcmp(file, "..") == 0 ||
 	    strstr(file, "/..") || strstr(file, "../")) {
 		(void)bozo_http_error(httpd, 403, request, "illegal request");
-		free(file);
 		return 0;
 	}
 
-	if (bozo_auth_check(request, file)) {
-		free(file);
+	if (bozo_auth_check(request, file))
 		return 0;
-	}
 
-	free(request->hr_file);
 	request->hr_file = file;
 
 	debug((httpd, DEBUG_FAT, "transform_user returning %s under %s", file,
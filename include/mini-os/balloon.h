@@ -0,0 +1,10 @@
+#ifndef __MINIOS_BALLOON_H__
+#define __MINIOS_BALLOON_H__
+
+void init_balloon(void);
+void balloon_set_target(unsigned long npages);
+unsigned long balloon_current_pages(void);
+/* pages to leave free beyond the balloon's own reserve when inflating */
+void balloon_set_reserve(unsigned long (*reserve)(void));
+
+#endif /* __MINIOS_BALLOON_H__ */
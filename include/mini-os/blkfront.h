@@ -4,7 +4,28 @@
 #include <mini-os/wait.h>
 #include <xen/io/blkif.h>
 #include <mini-os/types.h>
+#include <mini-os/queue.h>
+
+/*
+ * Largest transfer a single aiocb may carry.  Transfers which need more
+ * segments than the backend accepts per request (directly or through
+ * indirect descriptors) are split over several ring slots.
+ */
+#define BLKFRONT_MAX_IO (1024*1024)
+#define BLKFRONT_MAX_SEGMENTS (BLKFRONT_MAX_IO / PAGE_SIZE + 1)
+#define BLKFRONT_MAX_REQS \
+    (BLKFRONT_MAX_SEGMENTS / BLKIF_MAX_SEGMENTS_PER_REQUEST + 1)
+
+/*
+ * Requests in flight per device, at most.  The ring is one page
+ * unless the backend offers max-ring-page-order, then up to
+ * 1 << BLKFRONT_MAX_RING_ORDER pages; blkfront_info.ring_size tells.
+ */
+#define BLKFRONT_MAX_RING_ORDER 4
+#define BLKFRONT_RING_SIZE __RING_SIZE((struct blkif_sring *)0, PAGE_SIZE)
+
 struct blkfront_dev;
+struct blk_buffer;
 struct blkfront_aiocb
 {
     struct blkfront_dev *aio_dev;
@@ -15,9 +36,22 @@ struct blkfront_aiocb
     uint8_t is_write;
     void *data;
 
-    grant_ref_t gref[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    grant_ref_t gref[BLKFRONT_MAX_SEGMENTS];
+    /* persistently granted bounce pages, NULL if granted directly */
+    struct blk_buffer *pbuf[BLKFRONT_MAX_SEGMENTS];
     int n;
 
+    /* ring requests still in flight and their indirect pages */
+    int nreq;
+    int aio_ret;
+    struct blk_buffer *ibuf[BLKFRONT_MAX_REQS];
+    int nibuf;
+    /* next aiocb sharing our single ring request */
+    struct blkfront_aiocb *merge_next;
+    /* what went on the ring, and the others in flight, for a restore */
+    uint8_t op;
+    MINIOS_TAILQ_ENTRY(blkfront_aiocb) inflight;
+
     void (*aio_cb)(struct blkfront_aiocb *aiocb, int ret);
 };
 struct blkfront_info
@@ -28,6 +62,11 @@ struct blkfront_info
     int info;
     int barrier;
     int flush;
+    int persistent;
+    int max_indirect;
+    int discard;
+    unsigned discard_granularity;
+    int ring_size;
 };
 struct blkfront_dev *init_blkfront(char *nodename, struct blkfront_info *info);
 void blkfront_aio(struct blkfront_aiocb *aiocbp, int write);
@@ -37,10 +76,23 @@ void blkfront_io(struct blkfront_aiocb *aiocbp, int write);
 #define blkfront_read(aiocbp) blkfront_io(aiocbp, 0)
 #define blkfront_write(aiocbp) blkfront_io(aiocbp, 1)
 void blkfront_aio_push_operation(struct blkfront_aiocb *aiocbp, uint8_t op);
+void blkfront_aio_flush(struct blkfront_aiocb *aiocbp);
+void blkfront_plug(struct blkfront_dev *dev);
+void blkfront_unplug(struct blkfront_dev *dev);
 int blkfront_aio_poll(struct blkfront_dev *dev);
 void blkfront_sync(struct blkfront_dev *dev);
 void shutdown_blkfront(struct blkfront_dev *dev);
 
-extern struct wait_queue_head blkfront_queue;
+/*
+ * Around kernel_suspend(), for every device.  Nothing is drained:
+ * after a restore the rings are set up with the new backends and
+ * whatever was in flight is issued again.  Submitters wait meanwhile.
+ * A device whose backend does not come back fails all I/O with -EIO.
+ */
+void suspend_blkfront(void);
+void resume_blkfront(int cancelled);
+
+/* Woken whenever the device's event channel fires */
+struct wait_queue_head *blkfront_waitq(struct blkfront_dev *dev);
 
 #endif /* _MINIOS_BLKFRONT_H_ */
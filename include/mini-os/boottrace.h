@@ -0,0 +1,18 @@
+#ifndef __MINIOS_BOOTTRACE_H__
+#define __MINIOS_BOOTTRACE_H__
+
+/*
+ * Boot phase timestamps.  boot_mark() records NOW() under a name,
+ * from start_kernel() (once arch_init() has mapped the shared info
+ * page) until the table is full.  boot_trace_done() prints the
+ * phases and publishes them under data/boot-trace in xenstore; marks
+ * after that are still kept, for the "boot" stats dump.
+ */
+#define BOOT_TRACE_MAX 48
+#define BOOT_TRACE_NAMESZ 24
+void boot_mark(const char *fmt, ...)
+                   __attribute__((__format__(printf, 1, 2)));
+void boot_trace_done(void);
+void init_boot_trace(void);
+
+#endif /* __MINIOS_BOOTTRACE_H__ */
@@ -31,6 +31,7 @@ evtchn_port_t bind_evtchn(evtchn_port_t port, evtchn_handler_t handler,
 						  void *data);
 void unbind_evtchn(evtchn_port_t port);
 void init_events(void);
+void init_evtchn_stats(void);
 int evtchn_alloc_unbound(domid_t pal, evtchn_handler_t handler,
 						 void *data, evtchn_port_t *port);
 int evtchn_bind_interdomain(domid_t pal, evtchn_port_t remote_port,
@@ -45,6 +46,7 @@ static inline int notify_remote_via_evtchn(evtchn_port_t port)
     return HYPERVISOR_event_channel_op(EVTCHNOP_send, &op);
 }
 
+void resume_events(void);
 void fini_events(void);
 
 #endif /* _MINIOS_EVENTS_H_ */
@@ -10,6 +10,9 @@
 struct gntmap {
     int nentries;
     struct gntmap_entry *entries;
+    int freelist;
+    int nbuckets;
+    int *buckets;
 };
 
 int
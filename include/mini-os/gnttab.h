@@ -7,10 +7,19 @@ void init_gnttab(void);
 grant_ref_t gnttab_alloc_and_grant(void **map);
 grant_ref_t gnttab_grant_access(domid_t domid, unsigned long frame,
 				int readonly);
+void gnttab_grant_access_batch(domid_t domid, const unsigned long *frames,
+			       int n, int readonly, grant_ref_t *refs);
+void gnttab_regrant(grant_ref_t ref, domid_t domid, unsigned long frame,
+		    int readonly);
 grant_ref_t gnttab_grant_transfer(domid_t domid, unsigned long pfn);
 unsigned long gnttab_end_transfer(grant_ref_t gref);
 int gnttab_end_access(grant_ref_t ref);
+int gnttab_end_access_batch(const grant_ref_t *refs, int n);
 const char *gnttabop_error(int16_t status);
+void gnttab_stats(unsigned int *nframes, unsigned int *maxframes,
+		  unsigned long *exhausted);
+void suspend_gnttab(void);
+void resume_gnttab(void);
 void fini_gnttab(void);
 
 #endif /* !__MINIOS_GNTTAB_H__ */
@@ -0,0 +1,61 @@
+#ifndef __MINIOS_HYPERCALL_STATS_H__
+#define __MINIOS_HYPERCALL_STATS_H__
+
+#include <mini-os/types.h>
+
+/*
+ * With CONFIG_HYPERCALL_STATS, every _hypercallN() counts the call and
+ * the TSC cycles it took, by hypercall number.  Calls issued through
+ * HYPERVISOR_multicall count once as multicall, and their entries as
+ * "batched" under their own number.  A block in sched_op counts the
+ * time the domain was away, so its cycles say little.
+ *
+ * "hypercall" in control/stats dumps the totals; with a period set,
+ * the rates since the last dump are printed every that many seconds.
+ */
+#ifdef CONFIG_HYPERCALL_STATS
+
+#define HYPERCALL_STATS_MAX 64
+
+struct hypercall_stat {
+    uint64_t calls;
+    uint64_t cycles;
+    uint64_t batched;
+};
+extern struct hypercall_stat hypercall_stats[HYPERCALL_STATS_MAX];
+
+static inline uint64_t hypercall_stats_tsc(void)
+{
+    uint32_t lo, hi;
+
+    __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void hypercall_stats_add(unsigned int op, uint64_t start)
+{
+    struct hypercall_stat *hs = &hypercall_stats[op % HYPERCALL_STATS_MAX];
+
+    hs->calls++;
+    hs->cycles += hypercall_stats_tsc() - start;
+}
+
+#define HYPERCALL_STATS_BEGIN \
+    uint64_t __hcstart = hypercall_stats_tsc()
+#define HYPERCALL_STATS_END(name) \
+    hypercall_stats_add(__HYPERVISOR_##name, __hcstart)
+#define HYPERCALL_STATS_BATCHED(op) \
+    (hypercall_stats[(op) % HYPERCALL_STATS_MAX].batched++)
+
+void init_hypercall_stats(void);
+void hypercall_stats_set_period(int secs);
+
+#else
+
+#define HYPERCALL_STATS_BEGIN do { } while (0)
+#define HYPERCALL_STATS_END(name) do { } while (0)
+#define HYPERCALL_STATS_BATCHED(op) do { } while (0)
+
+#endif /* CONFIG_HYPERCALL_STATS */
+
+#endif /* __MINIOS_HYPERCALL_STATS_H__ */
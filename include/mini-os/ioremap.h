@@ -26,6 +26,7 @@
 
 void *ioremap(unsigned long phys_addr, unsigned long size);
 void *ioremap_nocache(unsigned long phys_addr, unsigned long size);
+void *ioremap_wc(unsigned long phys_addr, unsigned long size);
 void iounmap(void *virt_addr, unsigned long size);
 
 #endif /* _MINIOS_IOREMAP_H_ */
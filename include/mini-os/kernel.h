@@ -5,5 +5,9 @@ extern int app_main(start_info_t *);
 
 extern void do_exit(void) __attribute__((noreturn));
 extern void stop_kernel(void);
+extern int kernel_suspend(void);
+extern void kernel_suspend_hold(void);
+extern void kernel_suspend_release(void);
+extern int kernel_suspend_held(void);
 
 #endif /* _MINIOS_KERNEL_H_ */
@@ -49,6 +49,10 @@ unsigned long alloc_pages(int order);
 #define alloc_page()    alloc_pages(0)
 void free_pages(void *pointer, int order);
 #define free_page(p)    free_pages(p, 0)
+unsigned long alloc_pages_exact(unsigned long npages, unsigned long align);
+int alloc_pages_bulk(unsigned long *pages, int n);
+void free_pages_bulk(unsigned long *pages, int n);
+void free_pages_exact(void *pointer, unsigned long npages);
 
 static __inline__ int get_order(unsigned long size)
 {
@@ -62,6 +66,7 @@ static __inline__ int get_order(unsigned long size)
 void arch_init_demand_mapping_area(unsigned long max_pfn);
 void arch_init_mm(unsigned long* start_pfn_p, unsigned long* max_pfn_p);
 void arch_init_p2m(unsigned long max_pfn_p);
+void arch_rebuild_p2m(void);
 
 unsigned long allocate_ondemand(unsigned long n, unsigned long alignment);
 /* map f[i*stride]+i*increment for i in 0..n-1, aligned on alignment pages */
@@ -72,9 +77,15 @@ void do_map_frames(unsigned long addr,
         const unsigned long *f, unsigned long n, unsigned long stride,
 	unsigned long increment, domid_t id, int *err, unsigned long prot);
 int unmap_frames(unsigned long va, unsigned long num_frames);
+/* thread stacks, npages mapped above an unmapped guard page */
+void *map_stack(unsigned long npages);
+void unmap_stack(void *stack, unsigned long npages);
+/* 1:1 area pages in or out of the page tables, for PROT_NONE */
+int protect_pages(unsigned long va, unsigned long npages, int noaccess);
 unsigned long alloc_contig_pages(int order, unsigned int addr_bits);
 
 int free_physical_pages(xen_pfn_t *mfns, int n);
+extern unsigned long nr_free_pages;
 void fini_mm(void);
 
 #endif /* _MINIOS_MM_H_ */
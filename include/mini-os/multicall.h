@@ -0,0 +1,46 @@
+#ifndef __MINIOS_MULTICALL_H__
+#define __MINIOS_MULTICALL_H__
+
+#include <mini-os/os.h>
+#include <mini-os/events.h>
+#include <mini-os/time.h>
+
+/*
+ * Hypercalls queued up and issued with a single HYPERVISOR_multicall.
+ * A batch lives on the caller's stack: queue the calls, then flush.
+ * A full batch is flushed on the way.  mmu_updates for one domain
+ * queued back to back share a single entry.  Calls run in the order
+ * queued; errors are not reported per call, multicall_flush() returns
+ * the first one since the previous flush.
+ */
+#define MULTICALL_MAX       16
+#define MULTICALL_MMU_MAX   64
+
+struct multicall {
+    multicall_entry_t mc_calls[MULTICALL_MAX];
+    union {                     /* what mc_calls[i] points to */
+        struct mmuext_op ext;
+        evtchn_send_t send;
+    } mc_args[MULTICALL_MAX];
+    mmu_update_t mc_mmu[MULTICALL_MMU_MAX];
+    int mc_ncalls;
+    int mc_nmmu;
+    int mc_mmucall;     /* entry mmu_updates are added to, or -1 */
+    int mc_err;
+};
+
+void multicall_init(struct multicall *mc);
+int multicall_flush(struct multicall *mc);
+
+/* the next entry, for the caller to fill in the arguments of */
+multicall_entry_t *multicall_next(struct multicall *mc, unsigned long op);
+
+void multicall_mmu_update(struct multicall *mc, uint64_t ptr, uint64_t val,
+                          domid_t dom);
+void multicall_mmuext(struct multicall *mc, unsigned int cmd,
+                      unsigned long arg);
+void multicall_set_timer(struct multicall *mc, s_time_t deadline);
+void multicall_sched_op(struct multicall *mc, int cmd, void *arg);
+void multicall_evtchn_send(struct multicall *mc, evtchn_port_t port);
+
+#endif /* __MINIOS_MULTICALL_H__ */
@@ -2,11 +2,61 @@
 #define _MINIOS_NETFRONT_H_
 
 #include <mini-os/wait.h>
+#include <sys/uio.h>
+
+/* upper limit for feature-multi-queue, each queue costs an rx ring of pages */
+#define NETFRONT_MAX_QUEUES 4
+
+/* netfront_features() */
+#define NETFRONT_F_CSUM		0x01	/* backend fills in tx checksums */
+#define NETFRONT_F_GSO_TCPV4	0x02	/* backend segments TCPv4 */
+
+/* netfront_xmit_iov() flags */
+#define NETFRONT_TXF_CSUM_BLANK	0x01
+#define NETFRONT_TXF_GSO_TCPV4	0x02
+#define NETFRONT_TXF_MORE	0x04	/* part of a batch, don't push yet */
+
+/* default rx responses per polling round */
+#define NETFRONT_POLL_BUDGET	64
+
+/* netif_rx callback flags */
+#define NETFRONT_RXF_CSUM_BLANK	0x01	/* checksum not filled in */
+#define NETFRONT_RXF_CSUM_VALID	0x02	/* checksum verified by the sender */
+#define NETFRONT_RXF_COPY	0x04	/* copy out, the page stays with netfront */
+
+/* netfront_get_stats(), totals since the device was set up */
+struct netfront_stats {
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t rx_errors;	/* error responses and unexpected extras */
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t tx_errors;	/* backend reported an error */
+    uint64_t tx_dropped;	/* refused here, or dropped by the backend */
+    uint64_t tx_stalls;	/* had to wait for ring slots */
+};
+
 struct netfront_dev;
-struct netfront_dev *init_netfront(char *nodename, void (*netif_rx)(struct netfront_dev *, unsigned char *data, int len), unsigned char rawmac[6], char **ip, void *priv);
+struct netfront_dev *init_netfront(char *nodename, int (*netif_rx)(struct netfront_dev *, void *page, unsigned char *data, int len, int flags), unsigned char rawmac[6], char **ip, void *priv);
+void netfront_rxpage_put(struct netfront_dev *dev, void *page);
+void netfront_rx_resume(struct netfront_dev *dev);
+void netfront_set_rx_budget(struct netfront_dev *dev, int npages);
+void netfront_set_rx_cache(struct netfront_dev *dev, int npages);
+void netfront_set_rx_copybreak(struct netfront_dev *dev, int nbytes);
+void netfront_set_rx_poll(struct netfront_dev *dev, int budget, int delay_us);
 void netfront_xmit(struct netfront_dev *dev, unsigned char* data,int len);
+void netfront_xmit_queue(struct netfront_dev *dev, int queue, unsigned char* data,int len);
+int netfront_xmit_iov(struct netfront_dev *dev, int queue, const struct iovec *iov, int iovcnt, int flags, int gso_size);
+void netfront_xmit_flush(struct netfront_dev *dev, int queue);
+int netfront_num_queues(struct netfront_dev *dev);
+int netfront_features(struct netfront_dev *dev);
+void netfront_get_stats(struct netfront_dev *dev, struct netfront_stats *st);
 void shutdown_netfront(struct netfront_dev *dev);
 
+/* Around kernel_suspend(), for every device, see blkfront.h */
+void suspend_netfront(void);
+void resume_netfront(int cancelled);
+
 void *netfront_get_private(struct netfront_dev *);
 
 extern struct wait_queue_head netfront_queue;
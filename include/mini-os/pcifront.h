@@ -31,4 +31,8 @@ int pcifront_disable_msix(struct pcifront_dev *dev,
                           unsigned int bus, unsigned int slot, unsigned long fun);
 void shutdown_pcifront(struct pcifront_dev *dev);
 
+/* Around kernel_suspend(), for every device, see blkfront.h */
+void suspend_pcifront(void);
+void resume_pcifront(int cancelled);
+
 #endif /* _MINIOS_PCIFRONT_H_ */
@@ -12,8 +12,13 @@ struct thread {
     size_t stack_size;
     struct thread_md md;
     TAILQ_ENTRY(thread) thread_list;
+    TAILQ_ENTRY(thread) runq;
+    int sleepq_idx;
+    int prio;
+    int cpu;
     uint32_t flags;
     s_time_t wakeup_time;
+    s_time_t slack;		/* -1 for the scheduler default */
     int threrrno;
     void *lwp;
     void *cookie;
@@ -27,6 +32,18 @@ void idle_thread_fn(void *unused);
 #define THREAD_JOINED	0x00000004
 #define THREAD_EXTSTACK	0x00000008
 #define THREAD_TIMEDOUT	0x00000010
+#define THREAD_ONRUNQ	0x00000020
+
+/*
+ * Scheduling classes, highest first.  A runnable thread always runs
+ * ahead of threads in lower classes, threads within a class are
+ * scheduled round robin.
+ */
+#define THREAD_PRIO_SOFTIRQ	0	/* deferred event handler work */
+#define THREAD_PRIO_DRIVER	1	/* driver bottom halves */
+#define THREAD_PRIO_NORMAL	2	/* everything else */
+#define THREAD_PRIO_IDLE	3
+#define THREAD_NPRIO		4
 
 #define is_runnable(_thread)    (_thread->flags & RUNNABLE_FLAG)
 #define set_runnable(_thread)   (_thread->flags |= RUNNABLE_FLAG)
@@ -36,15 +53,30 @@ void switch_threads(struct thread *prev, struct thread *next);
  
     /* Architecture specific setup of thread creation. */
 struct thread* arch_create_thread(const char *name, void (*function)(void *),
-                                  void *data, void *stack);
+                                  void *data, void *stack, size_t stack_size);
+
+/* Exited threads kept for reuse, with their stacks. */
+#define THREAD_CACHE_MAX 16
+struct thread *thread_cache_get(size_t stack_size);
 
 void init_sched(void);
 void run_idle_thread(void);
 struct thread* create_thread(const char *name, void *cookie,
 			     void (*f)(void *), void *data, void *stack);
+struct thread* create_thread_prio(const char *name, void *cookie, int prio,
+			     void (*f)(void *), void *data, void *stack);
+/*
+ * With stack NULL, the stack is allocated with an unmapped guard
+ * page below it.  stack_size 0 means STACK_SIZE.
+ */
+struct thread* create_thread_stack(const char *name, void *cookie, int prio,
+			     void (*f)(void *), void *data,
+			     void *stack, size_t stack_size);
 void exit_thread(void) __attribute__((noreturn));
 void join_thread(struct thread *);
 void set_sched_hook(void (*hook)(void *, void *));
+void sched_set_timer_slack(s_time_t slack);
+void sched_set_thread_slack(struct thread *thread, s_time_t slack);
 struct thread *init_mainlwp(void *cookie);
 void schedule(void);
 
@@ -54,5 +86,7 @@ void wake(struct thread *thread);
 void block(struct thread *thread);
 int msleep(uint32_t millisecs);
 int absmsleep(uint32_t millisecs);
+int nsleep(s_time_t nsecs);
+int absnsleep(s_time_t deadline);
 
 #endif /* __MINIOS_SCHED_H__ */
@@ -0,0 +1,35 @@
+#ifndef __MINIOS_SOFTIRQ_H__
+#define __MINIOS_SOFTIRQ_H__
+
+#include <mini-os/time.h>
+#include <sys/queue.h>
+
+/*
+ * Deferred work for event handlers.  A handler queues the work item,
+ * the softirq thread runs it in thread context ahead of every other
+ * thread.  Work items must not block: the next one waits until they
+ * return.  Queueing an item which is already pending is a no-op,
+ * queueing a delayed one makes it run right away.
+ */
+struct softirq_work {
+    void (*func)(void *);
+    void *arg;
+    int pending;
+    s_time_t deadline;
+    TAILQ_ENTRY(softirq_work) entries;
+};
+
+static inline void softirq_init_work(struct softirq_work *w,
+                                     void (*func)(void *), void *arg)
+{
+    w->func = func;
+    w->arg = arg;
+    w->pending = 0;
+}
+
+void softirq_schedule(struct softirq_work *w);
+void softirq_schedule_delayed(struct softirq_work *w, s_time_t delay);
+void softirq_cancel(struct softirq_work *w);
+void init_softirq(void);
+
+#endif /* __MINIOS_SOFTIRQ_H__ */
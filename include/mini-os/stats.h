@@ -0,0 +1,14 @@
+#ifndef __MINIOS_STATS_H__
+#define __MINIOS_STATS_H__
+
+/*
+ * Runtime statistics.  Subsystems register a dump routine under a
+ * name; writing that name (or "all") to control/stats in xenstore
+ * prints it on the console.
+ */
+#define STATS_MAX 16
+int stats_register(const char *name, void (*dump)(void));
+void stats_dump(const char *name);
+void init_stats(void);
+
+#endif /* __MINIOS_STATS_H__ */
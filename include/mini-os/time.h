@@ -48,9 +48,14 @@ typedef int64_t s_time_t;
 /* prototypes */
 void     init_time(void);
 void     fini_time(void);
+void     suspend_time(void);
+void     resume_time(int cancelled);
 s_time_t get_s_time(void);
 s_time_t get_v_time(void);
 uint64_t monotonic_clock(void);
+s_time_t wallclock(void);
 void     block_domain(s_time_t until);
+void     block_domain_range(s_time_t earliest, s_time_t latest);
+void     block_domain_set_poll(s_time_t max);
 
 #endif /* _MINIOS_TIME_H_ */
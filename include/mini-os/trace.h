@@ -0,0 +1,59 @@
+#ifndef __MINIOS_TRACE_H__
+#define __MINIOS_TRACE_H__
+
+#include <mini-os/types.h>
+#include <mini-os/os.h>
+
+/*
+ * Binary tracepoints.  Compiled in everywhere, a tracepoint() costs a
+ * load and a branch until tracing is switched on by writing "on" to
+ * control/trace ("off" stops it again).  Events then go into a ring
+ * of TRACE_RING_PAGES pages granted read-only to dom0, which a tool
+ * finds through data/trace/ring-ref-<n> and maps.
+ *
+ * The first page is a struct trace_ring_hdr, the rest an array of
+ * nr_events struct trace_event.  Event n (counting from 0 since
+ * tracing started) is in slot n % nr_events; prod is bumped after
+ * the event is written.  A reader copies out [prod - nr_events,
+ * prod) and then drops what prod has since overtaken.  Mini-OS runs
+ * on one vCPU, so "per-CPU" means one ring.
+ */
+#define TRACE_RING_ORDER 5
+#define TRACE_RING_PAGES (1 << TRACE_RING_ORDER)
+#define TRACE_MAGIC 0x54524345 /* "TRCE" */
+
+#define TRACE_BLK_SUBMIT    1   /* arg write, a bytes, b aiocb, c sector */
+#define TRACE_BLK_DONE      2   /* arg error, b aiocb */
+#define TRACE_NET_RX        3   /* arg queue, a bytes */
+#define TRACE_NET_TX        4   /* arg queue, a bytes, b slots */
+#define TRACE_SCHED_SWITCH  5   /* b from thread, c to thread */
+#define TRACE_LOCK_WAIT     6   /* b lock, c ns waited */
+#define TRACE_GNT_ALLOC     7   /* a refs, b first ref */
+
+struct trace_event {
+    uint64_t ts;                /* NOW() */
+    uint16_t type;
+    uint16_t arg;
+    uint32_t a;
+    uint64_t b;
+    uint64_t c;
+};
+
+struct trace_ring_hdr {
+    uint32_t magic;
+    uint32_t event_size;
+    uint32_t nr_events;
+    uint32_t pad;
+    volatile uint64_t prod;
+};
+
+extern int trace_enabled;
+void __trace(uint16_t type, uint16_t arg, uint32_t a, uint64_t b, uint64_t c);
+#define tracepoint(type, arg, a, b, c) do {                              \
+    if (unlikely(trace_enabled))                                    \
+        __trace((type), (arg), (a), (uint64_t)(b), (uint64_t)(c));  \
+} while (0)
+
+void init_trace(void);
+
+#endif /* __MINIOS_TRACE_H__ */
@@ -0,0 +1,31 @@
+#ifndef __MINIOS_VCHAN_H__
+#define __MINIOS_VCHAN_H__
+
+#include <mini-os/types.h>
+#include <mini-os/waittypes.h>
+
+/*
+ * Byte streams between two domains over shared rings, laid out like
+ * libxenvchan's so that either end may be a libxenvchan program.
+ * The server grants the rings and publishes them under path, the
+ * client maps them.  Reads and writes don't block; wait on
+ * vchan_waitq() for vchan_data_ready() or vchan_buffer_space(),
+ * which also ask the peer for the notification that ends the wait.
+ */
+struct vchan;
+
+struct vchan *vchan_server_init(domid_t peer, const char *path,
+                                size_t read_min, size_t write_min);
+struct vchan *vchan_client_init(domid_t peer, const char *path);
+void vchan_close(struct vchan *vc);
+
+int vchan_read(struct vchan *vc, void *buf, size_t len);
+int vchan_write(struct vchan *vc, const void *buf, size_t len);
+int vchan_data_ready(struct vchan *vc);
+int vchan_buffer_space(struct vchan *vc);
+
+/* 1 if connected, 0 if the peer closed, 2 while a server waits */
+int vchan_is_open(struct vchan *vc);
+struct wait_queue_head *vchan_waitq(struct vchan *vc);
+
+#endif /* !__MINIOS_VCHAN_H__ */
@@ -138,6 +138,8 @@ typedef unsigned long pgentry_t;
 /* flags for ioremap */
 #define IO_PROT (L1_PROT)
 #define IO_PROT_NOCACHE (L1_PROT | _PAGE_PCD)
+/* Xen sets up PAT entry 4 (PAT, !PCD, !PWT) as write-combining for PV */
+#define IO_PROT_WC (L1_PROT | _PAGE_PAT)
 
 /* for P2M */
 #define INVALID_P2M_ENTRY (~0UL)
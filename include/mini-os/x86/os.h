@@ -45,7 +45,11 @@ void trap_fini(void);
 
 void arch_init(start_info_t *si);
 void arch_print_info(void);
+void init_string(void);
 void arch_fini(void);
+void arch_pre_suspend(void);
+int arch_suspend(void);
+void arch_post_suspend(int cancelled);
 
 
 
@@ -120,6 +124,9 @@ do {									\
 /* This is a barrier for the compiler only, NOT the processor! */
 #define barrier() __asm__ __volatile__("": : :"memory")
 
+/* in spin loops, eases off the sibling hyperthread */
+#define cpu_relax() __asm__ __volatile__("rep;nop": : :"memory")
+
 #if defined(__i386__)
 #define mb()    __asm__ __volatile__ ("lock; addl $0,0(%%esp)": : :"memory")
 #define rmb()   __asm__ __volatile__ ("lock; addl $0,0(%%esp)": : :"memory")
@@ -543,6 +550,46 @@ static __inline__ int synch_var_test_bit(int nr, volatile void * addr)
  synch_var_test_bit((nr),(addr)))
 
 
+/* CPUID as Xen filters it for this domain, not the raw host view */
+static __inline__ void xen_cpuid(uint32_t leaf, uint32_t subleaf,
+    uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    __asm__ __volatile__ (XEN_CPUID
+        : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+        : "0" (leaf), "2" (subleaf));
+}
+
+#define CPUID1_ECX_RDRAND	(1U << 30)
+#define CPUID7_EBX_RDSEED	(1U << 18)
+
+/*
+ * rdrand and rdseed, by hand for old assemblers.  Both return 0 when
+ * the hardware had nothing to give, callers retry or fall back.
+ */
+static __inline__ int rdrand_long(unsigned long *v)
+{
+    unsigned char ok;
+#ifdef __x86_64__
+    __asm__ __volatile__ (".byte 0x48,0x0f,0xc7,0xf0; setc %1"
+#else
+    __asm__ __volatile__ (".byte 0x0f,0xc7,0xf0; setc %1"
+#endif
+        : "=a" (*v), "=qm" (ok));
+    return ok;
+}
+
+static __inline__ int rdseed_long(unsigned long *v)
+{
+    unsigned char ok;
+#ifdef __x86_64__
+    __asm__ __volatile__ (".byte 0x48,0x0f,0xc7,0xf8; setc %1"
+#else
+    __asm__ __volatile__ (".byte 0x0f,0xc7,0xf8; setc %1"
+#endif
+        : "=a" (*v), "=qm" (ok));
+    return ok;
+}
+
 #undef ADDR
 
 #endif /* not assembly */
@@ -4,27 +4,36 @@
 
 #include <mini-os/machine/limits.h>
 
+/*
+ * Stacks come in any size and alignment, so current can't be found
+ * from the stack pointer.  There is one VCPU: switch_threads() keeps
+ * this up to date.
+ */
+extern struct thread *current_thread;
+
 static inline struct thread* get_current(void)
 {
-    struct thread **current;
-#ifdef __i386__    
-    register unsigned long sp asm("esp");
-#else
-    register unsigned long sp asm("rsp");
-#endif 
-    current = (void *)(unsigned long)(sp & ~(__STACK_SIZE-1));
-    return *current;
+    return current_thread;
 };
 
 struct thread_md {
     unsigned long thrmd_sp;
     unsigned long thrmd_ip;
+    void *thrmd_fpu;		/* FPU/SSE save area, see fpu.c */
 };
 #define thr_sp md.thrmd_sp
 #define thr_ip md.thrmd_ip
+#define thr_fpu md.thrmd_fpu
+
+int fpu_thread_init(struct thread *thread);
+void fpu_thread_fini(struct thread *thread);
+void fpu_switch(struct thread *next);
 
 extern void __arch_switch_threads(unsigned long *prevctx, unsigned long *nextctx);
 
-#define arch_switch_threads(prev,next) __arch_switch_threads(&(prev)->thr_sp, &(next)->thr_sp)
+#define arch_switch_threads(prev,next) do {                            \
+    fpu_switch(next);                                                   \
+    __arch_switch_threads(&(prev)->thr_sp, &(next)->thr_sp);            \
+} while (0)
 
 #endif /* __ARCH_SCHED_H__ */
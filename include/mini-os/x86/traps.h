@@ -71,6 +71,9 @@ struct pt_regs {
 void dump_regs(struct pt_regs *regs);
 void stack_walk(void);
 
+void init_fpu(void);
+void fpu_exit_callback(void);
+
 #define TRAP_PF_PROT   0x1
 #define TRAP_PF_WRITE  0x2
 #define TRAP_PF_USER   0x4
@@ -37,6 +37,7 @@
 #include <xen/xen.h>
 #include <xen/sched.h>
 #include <mini-os/mm.h>
+#include <mini-os/hypercall_stats.h>
 
 #define __STR(x) #x
 #define STR(x) __STR(x)
@@ -46,39 +47,46 @@ extern char hypercall_page[PAGE_SIZE];
 #define _hypercall0(type, name)			\
 ({						\
 	long __res;				\
+	HYPERCALL_STATS_BEGIN;			\
 	asm volatile (				\
 		"call hypercall_page + ("STR(__HYPERVISOR_##name)" * 32)"\
 		: "=a" (__res)			\
 		:				\
 		: "memory" );			\
+	HYPERCALL_STATS_END(name);		\
 	(type)__res;				\
 })
 
 #define _hypercall1(type, name, a1)				\
 ({								\
 	long __res, __ign1;					\
+	HYPERCALL_STATS_BEGIN;					\
 	asm volatile (						\
 		"call hypercall_page + ("STR(__HYPERVISOR_##name)" * 32)"\
 		: "=a" (__res), "=D" (__ign1)			\
 		: "1" ((long)(a1))				\
 		: "memory" );					\
+	HYPERCALL_STATS_END(name);				\
 	(type)__res;						\
 })
 
 #define _hypercall2(type, name, a1, a2)				\
 ({								\
 	long __res, __ign1, __ign2;				\
+	HYPERCALL_STATS_BEGIN;					\
 	asm volatile (						\
 		"call hypercall_page + ("STR(__HYPERVISOR_##name)" * 32)"\
 		: "=a" (__res), "=D" (__ign1), "=S" (__ign2)	\
 		: "1" ((long)(a1)), "2" ((long)(a2))		\
 		: "memory" );					\
+	HYPERCALL_STATS_END(name);				\
 	(type)__res;						\
 })
 
 #define _hypercall3(type, name, a1, a2, a3)			\
 ({								\
 	long __res, __ign1, __ign2, __ign3;			\
+	HYPERCALL_STATS_BEGIN;					\
 	asm volatile (						\
 		"call hypercall_page + ("STR(__HYPERVISOR_##name)" * 32)"\
 		: "=a" (__res), "=D" (__ign1), "=S" (__ign2), 	\
@@ -86,12 +94,14 @@ extern char hypercall_page[PAGE_SIZE];
 		: "1" ((long)(a1)), "2" ((long)(a2)),		\
 		"3" ((long)(a3))				\
 		: "memory" );					\
+	HYPERCALL_STATS_END(name);				\
 	(type)__res;						\
 })
 
 #define _hypercall4(type, name, a1, a2, a3, a4)			\
 ({								\
 	long __res, __ign1, __ign2, __ign3;			\
+	HYPERCALL_STATS_BEGIN;					\
 	asm volatile (						\
 		"movq %7,%%r10; "				\
 		"call hypercall_page + ("STR(__HYPERVISOR_##name)" * 32)"\
@@ -100,12 +110,14 @@ extern char hypercall_page[PAGE_SIZE];
 		: "1" ((long)(a1)), "2" ((long)(a2)),		\
 		"3" ((long)(a3)), "g" ((long)(a4))		\
 		: "memory", "r10" );				\
+	HYPERCALL_STATS_END(name);				\
 	(type)__res;						\
 })
 
 #define _hypercall5(type, name, a1, a2, a3, a4, a5)		\
 ({								\
 	long __res, __ign1, __ign2, __ign3;			\
+	HYPERCALL_STATS_BEGIN;					\
 	asm volatile (						\
 		"movq %7,%%r10; movq %8,%%r8; "			\
 		"call hypercall_page + ("STR(__HYPERVISOR_##name)" * 32)"\
@@ -115,6 +127,7 @@ extern char hypercall_page[PAGE_SIZE];
 		"3" ((long)(a3)), "g" ((long)(a4)),		\
 		"g" ((long)(a5))				\
 		: "memory", "r10", "r8" );			\
+	HYPERCALL_STATS_END(name);				\
 	(type)__res;						\
 })
 
@@ -77,8 +77,8 @@ struct write_req {
 };
 
 /* Send a message to xenbus, in the same fashion as xb_write, and
-   block waiting for a reply.  The reply is malloced and should be
-   freed by the caller. */
+   block waiting for a reply.  The reply should be freed by the
+   caller, with xenbus_free(). */
 struct xsd_sockmsg *
 xenbus_msg_reply(int type,
                  xenbus_transaction_t trans,
@@ -126,6 +126,57 @@ char* xenbus_printf(xenbus_transaction_t xbt,
 /* Utility function to figure out our domain id */
 domid_t xenbus_get_self_id(void);
 
+/*
+ * ----- batched requests -----
+ *
+ * A batch puts its requests on the ring as they are submitted and
+ * only waits for the replies in xenbus_batch_end(), so that N reads
+ * or writes cost about one xenstored round trip rather than N.  With
+ * transaction set, they all go in one transaction, which the end
+ * commits, or aborts if any of them failed.
+ *
+ * Each reply is handed to its callback, in the order the replies
+ * arrive, with err and value malloc'd for the callback to free (value
+ * is the reply's payload, NULL on error); this may happen
+ * inside a later submit.  The first error of a request without a
+ * callback is returned by xenbus_batch_end(), which otherwise works
+ * like xenbus_transaction_end().  A batch is used by one thread.
+ */
+typedef void xenbus_batch_fn(void *arg, char *err, char *value);
+
+#define XENBUS_BATCH_DEPTH 16
+struct xenbus_batch_op {
+    struct xenbus_event event;  /* must be first */
+    int id;                     /* -1 if the slot is free */
+    xenbus_batch_fn *done;
+    void *arg;
+};
+struct xenbus_batch {
+    xenbus_transaction_t xbt;
+    int in_trans;
+    int nr_inflight;
+    char *err;
+    struct xenbus_event_queue replies;
+    struct xenbus_batch_op ops[XENBUS_BATCH_DEPTH];
+};
+
+/* Returns a malloc'd error string if the transaction can't start. */
+char *xenbus_batch_start(struct xenbus_batch *b, int transaction);
+void xenbus_batch_submit(struct xenbus_batch *b, int type,
+                         const struct write_req *io, int nr_reqs,
+                         xenbus_batch_fn *done, void *arg);
+void xenbus_batch_read(struct xenbus_batch *b, const char *path,
+                       xenbus_batch_fn *done, void *arg);
+/* *out is set to the value, or -1 on error, by xenbus_batch_end(). */
+void xenbus_batch_read_integer(struct xenbus_batch *b, const char *path,
+                               int *out);
+void xenbus_batch_write(struct xenbus_batch *b, const char *path,
+                        const char *value);
+void xenbus_batch_printf(struct xenbus_batch *b, const char *node,
+                         const char *path, const char *fmt, ...)
+                   __attribute__((__format__(printf, 4, 5)));
+char *xenbus_batch_end(struct xenbus_batch *b, int abort, int *retry);
+
 /*
  * ----- asynchronous low-level interface -----
  */
@@ -161,7 +212,7 @@ domid_t xenbus_get_self_id(void);
  * When the response arrives, the reply message will stored in
  * for_queue->reply and for_queue will be queued on reply_queue.  The
  * id must be then explicitly released (or, used again, if desired).
- * After ->reply is done with the caller must pass it to free().
+ * After ->reply is done with the caller must pass it to xenbus_free().
  * (Do not use the id for more than one request at a time.) */
 int xenbus_id_allocate(struct xenbus_event_queue *reply_queue,
                        struct xenbus_event *for_queue);
@@ -181,9 +232,10 @@ void xenbus_id_release(int id);
  * and queued on events.  The field xenbus_event->watch will have been
  * set to watch by the xenbus machinery, and xenbus_event->path will
  * be the watch path.  After the caller is done with the event,
- * its pointer should simply be passed to free(). */
+ * its pointer should simply be passed to xenbus_free(). */
 struct xenbus_watch {
     char *token;
+    char *path;     /* xenbus_watch_path_token() only, for resume */
     struct xenbus_event_queue *events;
     MINIOS_LIST_ENTRY(xenbus_watch) entry;
 };
@@ -200,11 +252,14 @@ void xenbus_xb_write(int type, int req_id, xenbus_transaction_t trans_id,
 		     const struct write_req *req, int nr_reqs);
 
 void xenbus_free(void*);
-/* If the caller is in a scope which uses a different malloc arena,
- * it must use this rather than free() when freeing data received
- * from xenbus. */
+/* Replies and events received from xenbus mostly live in a pool of
+ * preallocated buffers, so they must be freed with this rather than
+ * free(). */
 
 #ifdef CONFIG_XENBUS
+/* Around a suspend: no request may be in flight, watches come back. */
+void suspend_xenbus(void);
+void resume_xenbus(int cancelled);
 /* Reset the XenBus system. */
 void fini_xenbus(void);
 #else
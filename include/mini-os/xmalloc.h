@@ -5,12 +5,20 @@
 #include <limits.h>
 
 void *	memalloc(size_t, size_t);
+void *	memalloc_site(size_t, size_t, void *);
 void	memfree(void *);
 void	free(void *);
 int	posix_memalign(void **, size_t, size_t);
 void *	realloc(void *, size_t);
 void *	calloc(size_t, size_t);
 
+/* heap profiler, see lib/memalloc.c */
+void	memprof_start(size_t);
+void	memprof_stop(void);
+void	memprof_dump(void);
+void	memprof_pages_alloc(void *, size_t, void *);
+void	memprof_pages_free(void *);
+
 #define DEFAULT_ALIGN (sizeof(unsigned long))
 
 /* compat */
@@ -40,12 +40,22 @@ struct schedulable {
 	void *scd_arg;
 
 	void *scd_stack;
+	size_t scd_stacksize;
 
 	struct lwpctl scd_lwpctl;
 
-	TAILQ_ENTRY(schedulable) entries;
+	LIST_ENTRY(schedulable) entries;
 };
-static TAILQ_HEAD(, schedulable) scheds = TAILQ_HEAD_INITIALIZER(scheds);
+
+/*
+ * Schedulables hashed by lwpid.  lwpids are handed out sequentially,
+ * so the low bits spread them evenly.  park/unpark look up the target
+ * on every contended pthread mutex and condvar, so this must not grow
+ * with the number of threads.
+ */
+#define LWPID_HASHSIZE 128
+static LIST_HEAD(, schedulable) lwpid_hash[LWPID_HASHSIZE];
+#define LWPID_HASH(lid) (&lwpid_hash[(lid) & (LWPID_HASHSIZE-1)])
 
 #define FIRST_LWPID 1
 static int curlwpid = FIRST_LWPID;
@@ -78,15 +88,13 @@ _lwp_rumpxen_makecontext(ucontext_t *nbuctx, void (*start)(void *),
     void *arg, void *private, void *stack_base, size_t stack_size)
 {
 	struct schedulable *scd = private;
-	unsigned long thestack = (unsigned long)stack_base;
 
 	scd->scd_start = start;
 	scd->scd_arg = arg;
 
-	/* XXX: stack_base is not guaranteed to be aligned */
-	thestack = (thestack & ~(STACK_SIZE-1)) + STACK_SIZE;
-	scd->scd_stack = (void *)thestack;
-	assert(stack_size == 2*STACK_SIZE);
+	/* libpthread's own stack, guard page and all, any size */
+	scd->scd_stack = stack_base;
+	scd->scd_stacksize = stack_size;
 
 	/* thread uctx -> schedulable mapping this way */
 	*(struct schedulable **)nbuctx = scd;
@@ -97,7 +105,7 @@ lwpid2scd(lwpid_t lid)
 {
 	struct schedulable *scd;
 
-	TAILQ_FOREACH(scd, &scheds, entries) {
+	LIST_FOREACH(scd, LWPID_HASH(lid), entries) {
 		if (scd->scd_lwpid == lid)
 			return scd;
 	}
@@ -111,11 +119,11 @@ _lwp_create(const ucontext_t *ucp, unsigned long flags, lwpid_t *lid)
 	*lid = ++curlwpid;
 
 	scd->scd_lwpid = *lid;
-	scd->scd_thread = create_thread("lwp", scd,
-	    scd->scd_start, scd->scd_arg, scd->scd_stack);
+	scd->scd_thread = create_thread_stack("lwp", scd, THREAD_PRIO_NORMAL,
+	    scd->scd_start, scd->scd_arg, scd->scd_stack, scd->scd_stacksize);
 	if (scd->scd_thread == NULL)
 		return EBUSY; /* ??? */
-	TAILQ_INSERT_TAIL(&scheds, scd, entries);
+	LIST_INSERT_HEAD(LWPID_HASH(scd->scd_lwpid), scd, entries);
 
 	return 0;
 }
@@ -137,6 +145,8 @@ _lwp_unpark(lwpid_t lid, const void *hint)
 ssize_t
 _lwp_unpark_all(const lwpid_t *targets, size_t ntargets, const void *hint)
 {
+	struct schedulable *scd;
+	unsigned long flags;
 	ssize_t rv;
 
 	if (targets == NULL)
@@ -145,13 +155,20 @@ _lwp_unpark_all(const lwpid_t *targets, size_t ntargets, const void *hint)
 	/*
 	 * XXX: this it not 100% correct (unparking has memory), but good
 	 * enuf for now
+	 *
+	 * Wake the lot with interrupts off once instead of per target.
+	 * Nobody runs before we return, so the order doesn't matter.
 	 */
 	rv = ntargets;
+	local_irq_save(flags);
 	while (ntargets--) {
-		if (_lwp_unpark(*targets, NULL) != 0)
+		if ((scd = lwpid2scd(*targets)) != NULL)
+			wake(scd->scd_thread);
+		else
 			rv--;
 		targets++;
 	}
+	local_irq_restore(flags);
 	//assert(rv >= 0);
 	return rv;
 }
@@ -184,7 +201,7 @@ _lwp_rumpxen_scheduler_init(void)
 
 	set_sched_hook(schedhook);
 	mainthread.scd_thread = init_mainlwp(&mainthread.scd_tls);
-	TAILQ_INSERT_TAIL(&scheds, &mainthread, entries);
+	LIST_INSERT_HEAD(LWPID_HASH(mainthread.scd_lwpid), &mainthread, entries);
 }
 
 int
@@ -227,7 +244,7 @@ _lwp_exit(void)
 	struct schedulable *scd = (struct schedulable *)curtcb;
 
 	scd->scd_lwpctl.lc_curcpu = LWPCTL_CPU_EXITED;
-	TAILQ_REMOVE(&scheds, scd, entries);
+	LIST_REMOVE(scd, entries);
 	exit_thread();
 }
 
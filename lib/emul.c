@@ -4,6 +4,14 @@
  * Emulate a bit of mmap.  Currently just MAP_ANON
  * and MAP_FILE+PROT_READ are supported.  For files, it's not true
  * mmap, but should cover a good deal of the cases anyway.
+ *
+ * Mappings are backed by exact page runs straight from the page
+ * allocator, so a mapping costs what it covers and nothing more.
+ * File contents are read in when the mapping is made: faulting them
+ * in lazily is not an option, since the first touch typically comes
+ * from copyin() inside the rump kernel, and reading the file from the
+ * fault handler would mean re-entering rump with its CPU still held.
+ * Callers wanting to stream a large file should map it in windows.
  */
 
 /* for libc namespace */
@@ -15,15 +23,18 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <mini-os/os.h> /* for PAGE_SIZE */
 #include <mini-os/kernel.h>
+#include <mini-os/mm.h>
 
 void *
 mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off)
 {
-	void *v;
+	unsigned long npages;
+	char *v;
 	ssize_t nn;
 	int error;
 
@@ -31,21 +42,30 @@ mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off)
 		errno = ENOTSUP;
 		return MAP_FAILED;
 	}
+	if (len == 0 || (off & (PAGE_SIZE-1)) != 0) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
 
-	if ((error = posix_memalign(&v, len, PAGE_SIZE)) != 0) {
-		errno = error;
+	npages = (len + PAGE_SIZE-1) >> PAGE_SHIFT;
+	if ((v = (void *)alloc_pages_exact(npages, PAGE_SIZE)) == NULL) {
+		errno = ENOMEM;
 		return MAP_FAILED;
 	}
 
-	if (flags & MAP_ANON)
+	if (flags & MAP_ANON) {
+		memset(v, 0, npages << PAGE_SHIFT);
 		return v;
+	}
 
 	if ((nn = pread(fd, v, len, off)) == -1) {
 		error = errno;
-		free(v);
+		free_pages_exact(v, npages);
 		errno = error;
 		return MAP_FAILED;
 	}
+	/* past EOF reads as zero */
+	memset(v + nn, 0, (npages << PAGE_SHIFT) - nn);
 	return v;
 }
 #undef mmap
@@ -59,10 +79,29 @@ madvise(void *addr, size_t len, int adv)
 	return 0;
 }
 
+/*
+ * Only PROT_NONE is enforced, by unmapping the pages, which is what
+ * libpthread asks for on the guard page below each thread stack.
+ * Anything else makes the pages accessible again.
+ */
+static int anyprotected;
+
 int
 mprotect(void *addr, size_t len, int prot)
 {
-	/* no protection */
+	unsigned long va = (unsigned long)addr;
+
+	if ((va & (PAGE_SIZE-1)) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (protect_pages(va, (len + PAGE_SIZE-1) >> PAGE_SHIFT,
+	    prot == PROT_NONE) != 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (prot == PROT_NONE)
+		anyprotected = 1;
 	return 0;
 }
 
@@ -70,7 +109,15 @@ int
 munmap(void *addr, size_t len)
 {
 
-	free(addr);
+	/* only whole mappings can be unmapped */
+	if (((unsigned long)addr & (PAGE_SIZE-1)) != 0 || len == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (anyprotected)
+		protect_pages((unsigned long)addr,
+		    (len + PAGE_SIZE-1) >> PAGE_SHIFT, 0);
+	free_pages_exact(addr, (len + PAGE_SIZE-1) >> PAGE_SHIFT);
 	return 0;
 }
 
@@ -29,134 +29,141 @@
  */
 
 /*
- * malloc.c (Caltech) 2/21/82
- * Chris Kingsley, kingsley@cit-20.
+ * Slab allocator with per-CPU magazines.
  *
- * This is a very fast storage allocator.  It allocates blocks of a small 
- * number of different sizes, and keeps free lists of each size.  Blocks that
- * don't exactly fit are passed up to the next larger size.  In this 
- * implementation, the available sizes are 2^n-4 (or 2^n-10) bytes long.
- * This is designed for use in a virtual memory environment.
+ * Small requests are served from size classes spaced about 12.5%
+ * apart (16, 32, ..., 128, 144, 160, ..., 256, 288, ...).  Objects of
+ * a class are carved out of one-page slabs, with the slab header at
+ * the start of the page, so the owning slab of any pointer is found by
+ * masking it down to the page boundary.  There are no per-object
+ * headers.  Alignment above the natural 16 bytes is handled by
+ * allocating from a larger class and aligning within the object.
  *
- * Modified for Xen Mini-OS:
- *  + allocate backing storage with page_alloc() instead of sbrk()
- *  + support alignment
- *  + use ANSI C (hey, there's no rush!)
+ * Each class has a small per-CPU magazine of free objects in front of
+ * the slabs so that the common alloc/free pairs only push and pop an
+ * array.  Slabs which become entirely free are returned to the page
+ * allocator, except for one kept per class to avoid thrashing.
+ *
+ * Requests too big for a slab get their own run of pages, with a
+ * header at the start of the first page.  If the run was rounded up
+ * to a power of two, the unused tail pages are given back.  Page
+ * aligned requests from the big path have their header on the page
+ * preceding the object.  Slab objects and small-aligned big objects
+ * are never page aligned, so a page aligned pointer is unambiguous.
+ *
+ * Objects in use are counted per class, with the peak, at all times.
+ * memprof_start() additionally samples about one allocation per rate
+ * bytes requested, remembering the pointer, the requested size and
+ * the caller.  Each sample stands for rate bytes (or its own size if
+ * bigger), which gives estimates of the live and peak bytes per call
+ * site, and of what rounding up to the class size really wastes.
+ * Page runs rumpuser_malloc() takes from the page allocator itself
+ * are sampled the same way, through memprof_pages_alloc().  For the
+ * rump kernel, the site is the frame above its allocator backend, or
+ * the backend if the rump kernel has no frame pointers to go by.
  */
 
 #ifdef MEMALLOC_TESTING
 #define PAGE_SIZE getpagesize()
 #define MSTATS
+#define smp_processor_id() 0
 
 #include <sys/cdefs.h>
 
 #include <sys/types.h>
-#if defined(RCHECK)
-#include <sys/uio.h>
-#endif
-#if defined(RCHECK) || defined(MSTATS)
+#include <sys/queue.h>
+#include <stdint.h>
 #include <stdio.h>
-#endif
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#define UNMAGIC		0x12
+#define UNMAGIC2	0x24
+
+#define printk(...)	fprintf(stderr, __VA_ARGS__)
+#define unlikely(x)	__builtin_expect((x),0)
+
 #else
 
 #include <mini-os/os.h>
 #include <mini-os/mm.h>
+#include <mini-os/console.h>
+#include <mini-os/xmalloc.h>
 
+#include <sys/queue.h>
 #include <string.h>
 
 #endif
 
+#define SLAB_MAGIC	0x51ab51ab
+#define BIG_MAGIC	0xb16b16b1
 
-/*
- * The overhead on a block is at least 4 bytes.  When free, this space
- * contains a pointer to the next free block, and the bottom two bits must
- * be zero.  When in use, the first byte is set to MAGIC, and the second
- * byte is the size index.  The remaining bytes are for alignment.
- * If range checking is enabled then a second word holds the size of the
- * requested block, less 1, rounded up to a multiple of sizeof(RMAGIC).
- * The order of elements is critical: ov_magic must overlay the low order
- * bits of ov_next, and ov_magic can not be a valid ov_next bit pattern.
- */
-union	overhead {
-	union	overhead *ov_next;	/* when free */
-	struct {
-		u_long  ovu_alignpad;	/* padding for alignment */
-		u_char	ovu_magic;	/* magic number */
-		u_char	ovu_index;	/* bucket # */
-#ifdef RCHECK
-		u_short	ovu_rmagic;	/* range magic number */
-		u_long	ovu_size;	/* actual block size */
-#endif
-	} ovu;
-#define	ov_alignpad	ovu.ovu_alignpad
-#define	ov_magic	ovu.ovu_magic
-#define	ov_index	ovu.ovu_index
-#define	ov_rmagic	ovu.ovu_rmagic
-#define	ov_size		ovu.ovu_size
-};
+#define MINSHIFT	4
+#define MINALIGN	(1<<MINSHIFT)
 
-#define	MAGIC		0xef		/* magic # on accounting info */
-#define UNMAGIC		0x12		/* magic # != MAGIC */
-#define UNMAGIC2	0x24		/* magic # != MAGIC/UNMAGIC */
-#ifdef RCHECK
-#define RMAGIC		0x5555		/* magic # on range info */
-#endif
+/* 8 classes up to 128 bytes, then 8 per power of two up to 2048 */
+#define NCLASSES	40
 
-#ifdef RCHECK
-#define	RSLOP		sizeof (u_short)
-#else
-#define	RSLOP		0
-#endif
+/* objects kept in a per-CPU magazine, and moved per refill/flush */
+#define MAGSIZE		16
+#define MAGBATCH	(MAGSIZE/2)
 
-/*
- * nextf[i] is the pointer to the next free block of size 2^(i+MINSHIFT).  The
- * smallest allocatable block is 1<<MINSHIFT bytes.  The overhead information
- * precedes the data area returned to the user.
- */
-#define MINSHIFT 5
-#define	NBUCKETS 30
-static	union overhead *nextf[NBUCKETS];
+#define NCPU		1
 
-static	long pagesz;			/* page size */
-static	int pagebucket;			/* page size bucket */
+struct slab {
+	uint32_t sl_magic;
+	uint16_t sl_class;
+	uint16_t sl_nfree;
+	void *sl_free;
+	LIST_ENTRY(slab) sl_entries;
+};
+#define SLAB_HDRSIZE	((sizeof(struct slab) + 63) & ~63)
 
-#ifdef MSTATS
-/*
- * nmalloc[i] is the difference between the number of mallocs and frees
- * for a given block size.
- */
-static	u_int nmalloc[NBUCKETS];
-#endif
+struct bigblock {
+	uint32_t bb_magic;
+	uint32_t bb_npages;
+	void *bb_base;
+	int bb_order;
+};
 
-#if 0
-#ifdef _REENT
-static	mutex_t malloc_mutex = MUTEX_INITIALIZER;
-#endif
-#endif
+struct magazine {
+	int mg_n;
+	void *mg_objs[MAGSIZE];
+};
+
+struct slabcache {
+	size_t sc_size;
+	int sc_nobjs;
+	LIST_HEAD(, slab) sc_partial;
+	struct slab *sc_spare;
+	struct magazine sc_mag[NCPU];
+	long sc_nalloc;		/* objects in use */
+	long sc_peak;
+	int sc_nslabs;
+};
+
+static struct slabcache caches[NCLASSES];
+static int nclasses;
+static long pagesz;
 
-/* not currently reentrant on mini-os */
+static long nbigpages, nbigpeak;
+
+/* not currently reentrant on mini-os, per-CPU magazines need no lock */
 #define malloc_lock()
 #define malloc_unlock()
 
-static void morecore(int);
 #ifdef MSTATS
 void mstats(const char *);
 #endif
 
-#if defined(RCHECK) || defined(MEMALLOC_TESTING)
+#if defined(MEMALLOC_TESTING)
 #define	ASSERT(p)   if (!(p)) botch(__STRING(p))
 #include <sys/uio.h>
 
 static void botch(const char *);
 
-/*
- * NOTE: since this may be called while malloc_mutex is locked, stdio must not
- *       be used in this function.
- */
 static void
 botch(const char *s)
 {
@@ -169,133 +176,508 @@ botch(const char *s)
 	iov[2].iov_base	= "\n";
 	iov[2].iov_len	= 1;
 
-	/*
-	 * This place deserves a word of warning: a cancellation point will
-	 * occur when executing writev(), and we might be still owning
-	 * malloc_mutex.  At this point we need to disable cancellation
-	 * until `after' abort() because i) establishing a cancellation handler
-	 * might, depending on the implementation, result in another malloc()
-	 * to be executed, and ii) it is really not desirable to let execution
-	 * continue.  `Fix me.'
-	 * 
-	 * Note that holding mutex_lock during abort() is safe.
-	 */
-
 	(void)writev(STDERR_FILENO, iov, 3);
 	abort();
 }
 #endif
 
-void *
-memalloc(size_t nbytes, size_t align)
+static void *
+corealloc(int order)
 {
-  	union overhead *op;
-	void *rv;
-	size_t allocbytes;
-	int bucket;
-	unsigned amt;
-	u_long alignpad;
+	void *v;
 
-	malloc_lock();
+#ifdef MEMALLOC_TESTING
+	/* naturally aligned, like the buddy allocator */
+	if (posix_memalign(&v, (1<<order) * pagesz, (1<<order) * pagesz) != 0)
+		v = NULL;
+#else
+	v = (void *)alloc_pages(order);
+#endif
 
-	if (pagesz == 0) {
-		pagesz = PAGE_SIZE;
-		ASSERT(pagesz > 0);
-
-#if 0
-		op = (union overhead *)(void *)sbrk(0);
-  		n = n - sizeof (*op) - ((long)op & (n - 1));
-		if (n < 0)
-			n += pagesz;
-		if (n) {
-			if (sbrk((int)n) == (void *)-1) {
-				malloc_unlock();
-				return (NULL);
-			}
-		}
+	return v;
+}
+
+/*
+ * Free npages pages starting at the order-aligned address v, in
+ * naturally aligned power-of-two chunks.  from is the page index
+ * to start at.
+ */
+static void
+corefree(void *v, int from, int npages)
+{
+#ifdef MEMALLOC_TESTING
+	if (from == 0)
+		free(v);
+#else
+	int order;
+
+	while (from < npages) {
+		/* largest aligned chunk at from which still fits */
+		for (order = 0; (from & (1<<order)) == 0
+		    && from + (2<<order) <= npages; order++)
+			continue;
+		free_pages((char *)v + from * pagesz, order);
+		from += 1<<order;
+	}
 #endif
+}
+
+static size_t
+class_size(int idx)
+{
+	int j, k;
+
+	if (idx < 8)
+		return (idx+1) << MINSHIFT;
+	j = idx - 8;
+	k = 7 + j/8;
+	return (1UL<<k) + ((j%8)+1) * (1UL<<(k-3));
+}
+
+static int
+size_class(size_t size)
+{
+	int k;
+
+	if (size <= 128)
+		return size <= MINALIGN ? 0 : (size-1) >> MINSHIFT;
+	for (k = 7; (2UL<<k) < size; k++)
+		continue;
+	return 8 + (k-7)*8 + (int)(((size-1) - (1UL<<k)) >> (k-3));
+}
 
-		bucket = 0;
-		amt = 1<<MINSHIFT;
-		while (pagesz > amt) {
-			amt <<= 1;
-			bucket++;
+static void
+memalloc_init(void)
+{
+	struct slabcache *sc;
+	int i;
+
+	pagesz = PAGE_SIZE;
+	for (i = 0; i < NCLASSES; i++) {
+		sc = &caches[i];
+		sc->sc_size = class_size(i);
+		sc->sc_nobjs = (pagesz - SLAB_HDRSIZE) / sc->sc_size;
+		/* not worth a slab below two objects per page */
+		if (sc->sc_nobjs < 2)
+			break;
+		LIST_INIT(&sc->sc_partial);
+	}
+	nclasses = i;
+}
+
+static struct slab *
+slab_create(int idx)
+{
+	struct slabcache *sc = &caches[idx];
+	struct slab *sl;
+	char *obj;
+	int i;
+
+	if ((sl = sc->sc_spare) != NULL) {
+		sc->sc_spare = NULL;
+		return sl;
+	}
+	if ((sl = corealloc(0)) == NULL)
+		return NULL;
+
+	sl->sl_magic = SLAB_MAGIC;
+	sl->sl_class = idx;
+	sl->sl_nfree = sc->sc_nobjs;
+	sl->sl_free = NULL;
+	obj = (char *)sl + SLAB_HDRSIZE + (sc->sc_nobjs-1) * sc->sc_size;
+	for (i = 0; i < sc->sc_nobjs; i++, obj -= sc->sc_size) {
+		*(void **)obj = sl->sl_free;
+		sl->sl_free = obj;
+	}
+	sc->sc_nslabs++;
+	return sl;
+}
+
+/* Take up to n objects from the slabs of class idx. */
+static int
+slab_get(int idx, void **objs, int n)
+{
+	struct slabcache *sc = &caches[idx];
+	struct slab *sl;
+	int got;
+
+	for (got = 0; got < n; ) {
+		if ((sl = LIST_FIRST(&sc->sc_partial)) == NULL) {
+			if ((sl = slab_create(idx)) == NULL)
+				break;
+			LIST_INSERT_HEAD(&sc->sc_partial, sl, sl_entries);
+		}
+		while (got < n && sl->sl_nfree) {
+			objs[got++] = sl->sl_free;
+			sl->sl_free = *(void **)sl->sl_free;
+			sl->sl_nfree--;
 		}
-		pagebucket = bucket;
+		if (sl->sl_nfree == 0)
+			LIST_REMOVE(sl, sl_entries);
+	}
+	return got;
+}
+
+static void
+slab_put(void *obj)
+{
+	struct slab *sl = (void *)((uintptr_t)obj & ~(pagesz-1));
+	struct slabcache *sc = &caches[sl->sl_class];
+
+	ASSERT(sl->sl_magic == SLAB_MAGIC);
+	if (sl->sl_nfree++ == 0)
+		LIST_INSERT_HEAD(&sc->sc_partial, sl, sl_entries);
+	*(void **)obj = sl->sl_free;
+	sl->sl_free = obj;
+
+	if (sl->sl_nfree == sc->sc_nobjs) {
+		LIST_REMOVE(sl, sl_entries);
+		if (sc->sc_spare == NULL) {
+			sc->sc_spare = sl;
+		} else {
+			sc->sc_nslabs--;
+			corefree(sl, 0, 1);
+		}
+	}
+}
+
+static void *
+cache_alloc(int idx)
+{
+	struct slabcache *sc = &caches[idx];
+	struct magazine *mg = &sc->sc_mag[smp_processor_id()];
+
+	if (mg->mg_n == 0) {
+		mg->mg_n = slab_get(idx, mg->mg_objs, MAGBATCH);
+		if (mg->mg_n == 0)
+			return NULL;
+	}
+	if (++sc->sc_nalloc > sc->sc_peak)
+		sc->sc_peak = sc->sc_nalloc;
+	return mg->mg_objs[--mg->mg_n];
+}
+
+static void
+cache_free(int idx, void *obj)
+{
+	struct magazine *mg = &caches[idx].sc_mag[smp_processor_id()];
+	int i;
+
+	if (mg->mg_n == MAGSIZE) {
+		for (i = 0; i < MAGBATCH; i++)
+			slab_put(mg->mg_objs[--mg->mg_n]);
 	}
+	mg->mg_objs[mg->mg_n++] = obj;
+	caches[idx].sc_nalloc--;
+}
 
-	if (align & (align-1))
+static void *
+bigalloc(size_t nbytes, size_t align)
+{
+	struct bigblock *bb;
+	uintptr_t base, obj;
+	size_t npages;
+	int order;
+
+	if (align < pagesz) {
+		npages = (((sizeof(*bb) + align-1) & ~(align-1)) + nbytes
+		    + pagesz-1) / pagesz;
+	} else {
+		npages = (align + nbytes + pagesz-1) / pagesz;
+	}
+	for (order = 0; (1UL<<order) < npages; order++)
+		continue;
+	if ((base = (uintptr_t)corealloc(order)) == 0)
 		return NULL;
-	if (align < sizeof(void *))
-		align = sizeof(void *);
-	
-	/* need at least this many bytes plus header to satisfy alignment */
-	allocbytes = nbytes + ((sizeof(*op) + (align-1)) & ~(align-1));
 
-	/*
-	 * Convert amount of memory requested into closest block size
-	 * stored in hash buckets which satisfies request.
-	 * Account for space used per block for accounting.
-	 */
-	if (allocbytes <= pagesz - RSLOP) {
-#ifndef RCHECK
-		amt = 1<<MINSHIFT;	/* size of first bucket */
-		bucket = 0;
-#else
-		amt = 1<<(MINSHIFT+1);	/* size of first bucket */
-		bucket = 1;
-#endif
+	/* the chunk is naturally aligned, i.e. at least to align */
+	if (align < pagesz) {
+		obj = (base + sizeof(*bb) + align-1) & ~(align-1);
+		bb = (void *)base;
 	} else {
-		amt = (unsigned)pagesz;
-		bucket = pagebucket;
+		obj = base + align;
+		bb = (void *)(obj - pagesz);
 	}
-	while (allocbytes > amt) {
-		amt <<= 1;
-		if (amt == 0)
-			return (NULL);
-		bucket++;
+	npages = (obj + nbytes - base + pagesz-1) / pagesz;
+	bb->bb_magic = BIG_MAGIC;
+	bb->bb_base = (void *)base;
+	bb->bb_npages = npages;
+	bb->bb_order = order;
+
+	/* give back the tail we didn't need */
+	if (npages < (1UL<<order))
+		corefree((void *)base, npages, 1<<order);
+	if ((nbigpages += npages) > nbigpeak)
+		nbigpeak = nbigpages;
+	return (void *)obj;
+}
+
+static struct bigblock *
+bigblock(void *cp)
+{
+
+	if (((uintptr_t)cp & (pagesz-1)) == 0)
+		return (void *)((uintptr_t)cp - pagesz);
+	return (void *)((uintptr_t)cp & ~(pagesz-1));
+}
+
+/*
+ * Heap profiler.  Sampled allocations are kept in an open addressing
+ * table keyed by pointer, so that freeing one takes it back out of
+ * the totals of its site and class.  What doesn't fit in the tables
+ * is not sampled, or is counted under the NULL site.
+ */
+#define MEMPROF_NRECS	1024	/* power of two */
+#define MEMPROF_NSITES	128
+#define MEMPROF_NTOP	16	/* sites in a dump */
+
+struct mp_site {
+	void *ms_pc;
+	size_t ms_live;		/* estimated bytes, as allocated */
+	size_t ms_peak;
+	size_t ms_req;		/* estimated bytes, as requested */
+	unsigned long ms_nsamples;
+};
+
+struct mp_rec {
+	void *mr_ptr;		/* NULL if the slot is empty */
+	size_t mr_est;
+	size_t mr_req;
+	uint16_t mr_site;
+	int16_t mr_class;	/* MP_BIG or MP_PAGES if not a slab object */
+};
+#define MP_BIG		-1	/* a big block */
+#define MP_PAGES	-2	/* a page run from memprof_pages_alloc() */
+
+static size_t memprof_rate;
+static long mp_countdown;
+static int mp_nrecs;
+static unsigned long mp_nsamples, mp_nlost;
+static struct mp_rec mp_recs[MEMPROF_NRECS];
+static struct mp_site mp_sites[MEMPROF_NSITES];
+static int mp_nsites;
+/*
+ * estimated live bytes per class, index NCLASSES for big blocks and
+ * NCLASSES+1 for page runs
+ */
+static size_t mp_clslive[NCLASSES+2], mp_clsreq[NCLASSES+2];
+
+static int
+mp_class(int idx)
+{
+
+	if (idx == MP_BIG)
+		return NCLASSES;
+	if (idx == MP_PAGES)
+		return NCLASSES+1;
+	return idx;
+}
+
+static unsigned int
+mp_hash(void *ptr)
+{
+
+	return (((uintptr_t)ptr >> MINSHIFT) * 2654435761U)
+	    & (MEMPROF_NRECS-1);
+}
+
+static struct mp_site *
+mp_site(void *pc)
+{
+	int i;
+
+	for (i = 0; i < mp_nsites; i++)
+		if (mp_sites[i].ms_pc == pc)
+			return &mp_sites[i];
+	/* the last slot is kept for the NULL site */
+	if (mp_nsites >= MEMPROF_NSITES-1 && pc != NULL)
+		return mp_site(NULL);
+	mp_sites[mp_nsites].ms_pc = pc;
+	return &mp_sites[mp_nsites++];
+}
+
+static void
+memprof_alloc(void *ptr, size_t nbytes, int idx, void *pc)
+{
+	struct mp_site *ms;
+	struct mp_rec *mr;
+	size_t size, est;
+	unsigned int h;
+	int cls;
+
+	if ((mp_countdown -= nbytes) > 0)
+		return;
+	mp_countdown = memprof_rate;
+	if (mp_nrecs == MEMPROF_NRECS/2) {
+		mp_nlost++;
+		return;
+	}
+
+	if (idx >= 0)
+		size = caches[idx].sc_size;
+	else if (idx == MP_BIG)
+		size = bigblock(ptr)->bb_npages * pagesz;
+	else
+		size = nbytes;
+	cls = mp_class(idx);
+	/* the sample stands for at least rate bytes */
+	est = size < memprof_rate ? memprof_rate : size;
+
+	for (h = mp_hash(ptr); mp_recs[h].mr_ptr != NULL;
+	    h = (h+1) & (MEMPROF_NRECS-1))
+		continue;
+	ms = mp_site(pc);
+	mr = &mp_recs[h];
+	mr->mr_ptr = ptr;
+	mr->mr_est = est;
+	mr->mr_req = (uint64_t)est * nbytes / size;
+	mr->mr_site = ms - mp_sites;
+	mr->mr_class = idx;
+	mp_nrecs++;
+	mp_nsamples++;
+
+	ms->ms_nsamples++;
+	ms->ms_req += mr->mr_req;
+	if ((ms->ms_live += est) > ms->ms_peak)
+		ms->ms_peak = ms->ms_live;
+	mp_clslive[cls] += est;
+	mp_clsreq[cls] += mr->mr_req;
+}
+
+static void
+memprof_free(void *ptr)
+{
+	struct mp_site *ms;
+	struct mp_rec *mr;
+	unsigned int h, i, k;
+	int cls;
+
+	for (h = mp_hash(ptr); mp_recs[h].mr_ptr != ptr;
+	    h = (h+1) & (MEMPROF_NRECS-1))
+		if (mp_recs[h].mr_ptr == NULL)
+			return;
+
+	mr = &mp_recs[h];
+	ms = &mp_sites[mr->mr_site];
+	cls = mp_class(mr->mr_class);
+	ms->ms_live -= mr->mr_est;
+	ms->ms_req -= mr->mr_req;
+	mp_clslive[cls] -= mr->mr_est;
+	mp_clsreq[cls] -= mr->mr_req;
+	mp_nrecs--;
+
+	/* close the gap, so that lookups needn't skip deleted slots */
+	for (i = h;;) {
+		mp_recs[i].mr_ptr = NULL;
+		for (;;) {
+			h = (h+1) & (MEMPROF_NRECS-1);
+			if (mp_recs[h].mr_ptr == NULL)
+				return;
+			k = mp_hash(mp_recs[h].mr_ptr);
+			/* moves into the gap unless its home is in (i, h] */
+			if (i <= h ? (k <= i || k > h) : (k <= i && k > h))
+				break;
+		}
+		mp_recs[i] = mp_recs[h];
+		i = h;
+	}
+}
+
+/*
+ * Sample about one allocation per rate bytes from now on.  Samples
+ * taken earlier are kept, as are the sites, so a profile can be
+ * stopped and resumed.  A rate of 0 stops sampling; what is already
+ * sampled is still accounted for when it is freed.
+ */
+void
+memprof_start(size_t rate)
+{
+
+	malloc_lock();
+	memprof_rate = rate;
+	mp_countdown = rate;
+	malloc_unlock();
+}
+
+void
+memprof_stop(void)
+{
+
+	memprof_start(0);
+}
+
+void *
+memalloc_site(size_t nbytes, size_t align, void *site)
+{
+	void *rv, *obj;
+	int idx;
+
+	malloc_lock();
+
+	if (pagesz == 0)
+		memalloc_init();
+
+	if (align & (align-1)) {
+		malloc_unlock();
+		return NULL;
 	}
+	if (align < MINALIGN)
+		align = MINALIGN;
+
 	/*
-	 * If nothing in hash bucket right now,
-	 * request more memory from the system.
+	 * Slab objects are MINALIGN aligned.  For stricter alignment,
+	 * allocate enough slack to align within the object.
 	 */
-  	if ((op = nextf[bucket]) == NULL) {
-  		morecore(bucket);
-  		if ((op = nextf[bucket]) == NULL) {
+	idx = size_class(nbytes + (align - MINALIGN));
+	if (idx < nclasses) {
+		if ((obj = cache_alloc(idx)) == NULL) {
 			malloc_unlock();
-  			return (NULL);
+			return NULL;
 		}
+		rv = (void *)(((uintptr_t)obj + align-1) & ~(align-1));
+	} else {
+		rv = bigalloc(nbytes, align);
+		idx = MP_BIG;
 	}
-	/* remove from linked list */
-  	nextf[bucket] = op->ov_next;
+	if (unlikely(memprof_rate) && rv != NULL)
+		memprof_alloc(rv, nbytes, idx, site);
 
-	/* align op before returned memory */
-	rv = (void *)(((uintptr_t)(op+1) + align - 1) & ~(align - 1));
-	alignpad = (uintptr_t)rv - (uintptr_t)op;
+	malloc_unlock();
+	return rv;
+}
 
-#ifdef MEMALLOC_TESTING
-	memset(op, MAGIC, alignpad);
-#endif
+/*
+ * Sample a run of nbytes, a multiple of the page size, which the
+ * caller got from the page allocator without going through us.
+ * memprof_pages_free() must see it again when it is freed.
+ */
+void
+memprof_pages_alloc(void *ptr, size_t nbytes, void *site)
+{
 
-	op = ((union overhead *)rv)-1;
-	op->ov_magic = MAGIC;
-	op->ov_index = bucket;
-	op->ov_alignpad = alignpad;
-#ifdef MSTATS
-  	nmalloc[bucket]++;
-#endif
+	if (!unlikely(memprof_rate) || ptr == NULL)
+		return;
+	malloc_lock();
+	memprof_alloc(ptr, nbytes, MP_PAGES, site);
 	malloc_unlock();
-#ifdef RCHECK
-	/*
-	 * Record allocated size of block and
-	 * bound space with magic numbers.
-	 */
-	op->ov_size = (nbytes + RSLOP - 1) & ~(RSLOP - 1);
-	op->ov_rmagic = RMAGIC;
-  	*(u_short *)((char *)(op + 1) + op->ov_size) = RMAGIC;
-#endif
+}
 
-  	return rv;
+void
+memprof_pages_free(void *ptr)
+{
+
+	if (!unlikely(mp_nrecs))
+		return;
+	malloc_lock();
+	memprof_free(ptr);
+	malloc_unlock();
+}
+
+void *
+memalloc(size_t nbytes, size_t align)
+{
+
+	return memalloc_site(nbytes, align, __builtin_return_address(0));
 }
 
 #ifndef MEMALLOC_TESTING
@@ -305,7 +687,8 @@ posix_memalign(void **rv, size_t nbytes, size_t align)
 	void *v;
 	int error = 10; /* XXX */
 
-	if ((v = memalloc(nbytes, align)) != NULL) {
+	if ((v = memalloc_site(nbytes, align,
+	    __builtin_return_address(0))) != NULL) {
 		*rv = v;
 		error = 0;
 	}
@@ -317,7 +700,7 @@ void *
 malloc(size_t size)
 {
 
-	return memalloc(size, 8);
+	return memalloc_site(size, 8, __builtin_return_address(0));
 }
 
 void *
@@ -326,7 +709,7 @@ calloc(size_t n, size_t size)
 	void *v;
 	size_t tot = n * size;
 
-	if ((v = malloc(tot)) != NULL) {
+	if ((v = memalloc_site(tot, 8, __builtin_return_address(0))) != NULL) {
 		memset(v, 0, tot);
 	}
 
@@ -334,104 +717,59 @@ calloc(size_t n, size_t size)
 }
 #endif
 
-static void *
-corealloc(int shift)
-{
-	void *v;
-
-#ifdef MEMALLOC_TESTING
-	v = malloc((1<<shift) * pagesz);
-#else
-	v = (void *)alloc_pages(shift);
-#endif
-
-	return v;
-}
-
 /*
- * Allocate more memory to the indicated bucket.
+ * Find the start (object or big block run) and the usable end of
+ * the allocation cp points into.  Returns the slab class, or -1 for
+ * a big block.
  */
-static void
-morecore(int bucket)
+static int
+memlookup(void *cp, void **startp, void **endp)
 {
-  	union overhead *op;
-	long sz;		/* size of desired block */
-  	long amt;			/* amount to allocate */
-  	long nblks;			/* how many blocks we get */
-
-	if (bucket < pagebucket) {
-		amt = 0;
-  		nblks = pagesz / (1<<(bucket + MINSHIFT));
-		sz = pagesz / nblks;
-	} else {
-		amt = bucket - pagebucket;
-		nblks = 1;
-		sz = 0; /* dummy */
+	struct slab *sl;
+	struct bigblock *bb;
+	struct slabcache *sc;
+	uintptr_t first;
+	size_t i;
+
+	sl = (void *)((uintptr_t)cp & ~(pagesz-1));
+	if (((uintptr_t)cp & (pagesz-1)) != 0 && sl->sl_magic == SLAB_MAGIC) {
+		sc = &caches[sl->sl_class];
+		first = (uintptr_t)sl + SLAB_HDRSIZE;
+		i = ((uintptr_t)cp - first) / sc->sc_size;
+		*startp = (void *)(first + i * sc->sc_size);
+		*endp = (char *)*startp + sc->sc_size;
+		return sl->sl_class;
 	}
-	op = (void *)corealloc(amt);
-	/* no more room! */
-  	if (op == NULL)
-  		return;
-	/*
-	 * Add new memory allocated to that on
-	 * free list for this hash bucket.
-	 */
-  	nextf[bucket] = op;
-  	while (--nblks > 0) {
-		op->ov_next =
-		    (union overhead *)(void *)((char *)(void *)op+(size_t)sz);
-		op = op->ov_next;
-  	}
-	op->ov_next = NULL;
+
+	bb = bigblock(cp);
+	ASSERT(bb->bb_magic == BIG_MAGIC);
+	*startp = bb;
+	*endp = (char *)bb->bb_base + bb->bb_npages * pagesz;
+	return -1;
 }
 
 void
 memfree(void *cp)
-{   
-	long size;
-	union overhead *op;
-	u_long alignpad;
-	void *origp;
-
-  	if (cp == NULL)
-  		return;
-	op = ((union overhead *)cp)-1;
-	if (op->ov_magic != MAGIC) {
-#ifdef MEMALLOC_TESTING
-		ASSERT(0);
-#endif
-		return;				/* sanity */
-	}
+{
+	struct bigblock *bb;
+	void *start, *end;
+	int idx;
 
-#ifdef RCHECK
-  	ASSERT(op->ov_rmagic == RMAGIC);
-	ASSERT(*(u_short *)((char *)(op + 1) + op->ov_size) == RMAGIC);
-#endif
-  	size = op->ov_index;
-	alignpad = op->ov_alignpad;
-  	ASSERT(size < NBUCKETS);
+	if (cp == NULL)
+		return;
 
 	malloc_lock();
-	origp = (uint8_t *)cp - alignpad;
-
-#ifdef MEMALLOC_TESTING
-	{
-		u_long i;
-
-		for (i = 0; (uint8_t *)origp + i < (uint8_t *)op; i++) {
-			ASSERT(*((uint8_t *)origp + i) == MAGIC);
-				
-		}
+	if (unlikely(mp_nrecs))
+		memprof_free(cp);
+	idx = memlookup(cp, &start, &end);
+	if (idx >= 0) {
+		cache_free(idx, start);
+	} else {
+		bb = start;
+		bb->bb_magic = 0;
+		nbigpages -= bb->bb_npages;
+		corefree(bb->bb_base, 0, bb->bb_npages);
 	}
-#endif
-
-	op = (void *)origp;
-	op->ov_next = nextf[(unsigned int)size];/* also clobbers ov_magic */
-  	nextf[(unsigned int)size] = op;
-#ifdef MSTATS
-  	nmalloc[(size_t)size]--;
-#endif
-
 	malloc_unlock();
 }
 
@@ -450,79 +788,164 @@ free(void *cp)
  *   + nbytes == 0 ==> free
  *   + else ==> realloc
  */
-void *
-memrealloc(void *cp, size_t nbytes)
-{   
-	union overhead *op;
-  	size_t size;
-	size_t alignpad;
-	void *np;
+static void *
+memrealloc_site(void *cp, size_t nbytes, void *site)
+{
+	void *np, *start, *end;
+	size_t have;
 
 	if (cp == NULL)
-		return memalloc(nbytes, 8);
+		return memalloc_site(nbytes, 8, site);
 
 	if (nbytes == 0) {
 		memfree(cp);
 		return NULL;
 	}
 
-	op = ((union overhead *)cp)-1;
-  	size = op->ov_index;
-	alignpad = op->ov_alignpad;
+	(void)memlookup(cp, &start, &end);
+	have = (char *)end - (char *)cp;
 
 	/* don't bother "compacting".  don't like it?  don't use realloc! */
-	if (((1<<(size+MINSHIFT)) - (alignpad+sizeof(*op))) >= nbytes)
+	if (have >= nbytes)
 		return cp;
 
 	/* we're gonna need a bigger bucket */
-	np = memalloc(nbytes, 8);
+	np = memalloc_site(nbytes, 8, site);
 	if (np == NULL)
 		return NULL;
 
-	memcpy(np, cp, (1<<(size+MINSHIFT)) - (alignpad+sizeof(*op)));
+	memcpy(np, cp, have);
 	memfree(cp);
 	return np;
 }
 
+void *
+memrealloc(void *cp, size_t nbytes)
+{
+
+	return memrealloc_site(cp, nbytes, __builtin_return_address(0));
+}
+
 #ifndef MEMALLOC_TESTING
 void *
 realloc(void *cp, size_t nbytes)
 {
 
-	return memrealloc(cp, nbytes);
+	return memrealloc_site(cp, nbytes, __builtin_return_address(0));
 }
 #endif
 
+/*
+ * The classes in use, with the bytes their slabs hold and the waste
+ * from rounding up to the class size as far as the samples tell;
+ * then the big blocks and the sites with the most estimated bytes
+ * live.  Sites are return addresses, for addr2line.
+ */
+void
+memprof_dump(void)
+{
+	struct slabcache *sc;
+	struct mp_site *ms, *top[MEMPROF_NTOP];
+	size_t used, slabbytes, totused = 0, totslab = 0;
+	size_t live = 0, req = 0;
+	int i, j, n;
+
+	malloc_lock();
+	printk("heap: class  slabs    live    peak     bytes  slabbytes"
+	    "  roundwaste\n");
+	for (i = 0; i < nclasses; i++) {
+		sc = &caches[i];
+		if (sc->sc_nslabs == 0 && sc->sc_peak == 0)
+			continue;
+		used = sc->sc_nalloc * sc->sc_size;
+		slabbytes = sc->sc_nslabs * pagesz;
+		printk("heap: %5lu %6d %7ld %7ld %9lu %10lu", (unsigned long)
+		    sc->sc_size, sc->sc_nslabs, sc->sc_nalloc, sc->sc_peak,
+		    (unsigned long)used, (unsigned long)slabbytes);
+		if (mp_clslive[i])
+			printk("  %9lu%%\n", (unsigned long)(100 -
+			    mp_clsreq[i] * 100 / mp_clslive[i]));
+		else
+			printk("           -\n");
+		totused += used;
+		totslab += slabbytes;
+		live += mp_clslive[i];
+		req += mp_clsreq[i];
+	}
+	printk("heap: big blocks: %ld pages, peak %ld", nbigpages, nbigpeak);
+	if (mp_clslive[NCLASSES])
+		printk(", %lu%% lost to page rounding",
+		    (unsigned long)(100 - mp_clsreq[NCLASSES] * 100
+		    / mp_clslive[NCLASSES]));
+	printk("\n");
+	live += mp_clslive[NCLASSES];
+	req += mp_clsreq[NCLASSES];
+	if (mp_clslive[NCLASSES+1])
+		printk("heap: page runs: about %lu bytes live\n",
+		    (unsigned long)mp_clslive[NCLASSES+1]);
+	live += mp_clslive[NCLASSES+1];
+	req += mp_clsreq[NCLASSES+1];
+
+	printk("heap: slabs %lu bytes, %lu in objects (%lu%% free)\n",
+	    (unsigned long)totslab, (unsigned long)totused,
+	    (unsigned long)(totslab ? 100 - totused * 100 / totslab : 0));
+	if (mp_nsamples == 0) {
+		malloc_unlock();
+		return;
+	}
+	printk("heap: %lu samples at %lu bytes, %d live, %lu not taken, "
+	    "%lu%% of sampled bytes wasted by rounding\n", mp_nsamples,
+	    (unsigned long)memprof_rate, mp_nrecs, mp_nlost,
+	    (unsigned long)(live ? 100 - req * 100 / live : 0));
+
+	/* the biggest sites, by insertion into a short sorted list */
+	n = 0;
+	for (i = 0; i < mp_nsites; i++) {
+		ms = &mp_sites[i];
+		if (n < MEMPROF_NTOP)
+			n++;
+		else if (top[n-1]->ms_live >= ms->ms_live)
+			continue;
+		for (j = n-1; j > 0 && top[j-1]->ms_live < ms->ms_live; j--)
+			top[j] = top[j-1];
+		top[j] = ms;
+	}
+	printk("heap: site                    live       peak  requested"
+	    "  samples\n");
+	for (i = 0; i < n; i++)
+		printk("heap: %-18p %10lu %10lu %10lu %8lu\n", top[i]->ms_pc,
+		    (unsigned long)top[i]->ms_live,
+		    (unsigned long)top[i]->ms_peak,
+		    (unsigned long)top[i]->ms_req, top[i]->ms_nsamples);
+	malloc_unlock();
+}
+
 #ifdef MSTATS
 /*
  * mstats - print out statistics about malloc
- * 
- * Prints two lines of numbers, one showing the length of the free list
- * for each size category, the second showing the number of mallocs -
- * frees for each size category.
+ *
+ * Prints the number of slabs and of objects in use for each size
+ * class, and the pages used by big blocks.
  */
 void
 mstats(const char *s)
 {
-  	int i, j;
-  	union overhead *p;
-  	int totfree = 0,
-  	totused = 0;
-
-  	fprintf(stderr, "Memory allocation statistics %s\nfree:\t", s);
-  	for (i = 0; i < NBUCKETS; i++) {
-  		for (j = 0, p = nextf[i]; p; p = p->ov_next, j++)
-  			;
-  		fprintf(stderr, " %d", j);
-  		totfree += j * (1 << (i + 3));
-  	}
-  	fprintf(stderr, "\nused:\t");
-  	for (i = 0; i < NBUCKETS; i++) {
-  		fprintf(stderr, " %d", nmalloc[i]);
-  		totused += nmalloc[i] * (1 << (i + 3));
-  	}
-  	fprintf(stderr, "\n\tTotal in use: %d, total free: %d\n",
-	    totused, totfree);
+	struct slabcache *sc;
+	long totused = 0, totslab = 0;
+	int i;
+
+	fprintf(stderr, "Memory allocation statistics %s\n", s);
+	for (i = 0; i < nclasses; i++) {
+		sc = &caches[i];
+		if (sc->sc_nslabs == 0)
+			continue;
+		fprintf(stderr, "\t%5zu: %d slabs, %ld used\n",
+		    sc->sc_size, sc->sc_nslabs, sc->sc_nalloc);
+		totused += sc->sc_nalloc * sc->sc_size;
+		totslab += sc->sc_nslabs * pagesz;
+	}
+	fprintf(stderr, "\tslab bytes in use: %ld of %ld, big pages: %ld\n",
+	    totused, totslab, nbigpages);
 }
 #endif
 
@@ -571,14 +994,17 @@ main()
 	int i, n;
 
 	srandom(time(NULL));
+	memprof_start(16*1024);
 
 	rings = malloc(NALLOC * NRING * sizeof(void *));
 	/* so we can free() immediately without stress */
 	memset(rings, 0, NALLOC * NRING * sizeof(void *));
 
 	for (n = 0;; n = (n+1) % NRING) {
-		if (n == 0)
+		if (n == 0) {
 			mstats("");
+			memprof_dump();
+		}
 
 		ring_alloc = &rings[n * NALLOC];
 		ring_free = &rings[((n + NRING/2) % NRING) * NALLOC];
@@ -23,19 +23,29 @@ static struct ps_strings thestrings;
 static AuxInfo myaux[2];
 extern struct ps_strings *__ps_strings;
 extern size_t pthread__stacksize;
+void rumpuser_checkpoint(void);
 
 #include "netbsd_init.h"
 
+/*
+ * Default pthread stack, guard page not included.  Threads may ask
+ * for other sizes with pthread_attr_setstacksize().
+ */
+#ifndef PTHREAD_STACKSIZE
+#define PTHREAD_STACKSIZE (STACK_SIZE/2)
+#endif
+
 void
 _netbsd_init(void)
 {
 
 	thestrings.ps_argvstr = (void *)((char *)&myaux - 2);
 	__ps_strings = &thestrings;
-	pthread__stacksize = 2*STACK_SIZE;
+	pthread__stacksize = PTHREAD_STACKSIZE;
 
 	rump_boot_setsigmodel(RUMP_SIGMODEL_IGNORE);
 	rump_init();
+	rumpuser_checkpoint();
 
 	environ = the_env;
 	_lwp_rumpxen_scheduler_init();
@@ -7,11 +7,14 @@
 
 #include <err.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 static pthread_mutex_t mtx;
 static pthread_cond_t cv, cv2;
@@ -131,3 +134,240 @@ test_pthread(void)
 
 	printf("main thread done\n");
 }
+
+/*
+ * Scaling benchmarks, run in the demo's benchmark mode at growing
+ * thread counts.  Results are "bench: pthread ..." console lines with
+ * the rate and the median and 99th percentile latency in ns.
+ */
+#define BENCH_MAXTHR 32
+#define BENCH_ITER 1000
+
+static uint64_t
+nsnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+cmp64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+report(const char *what, int nthr, uint64_t nops, uint64_t t,
+	uint64_t *lat, size_t nlat)
+{
+
+	qsort(lat, nlat, sizeof(*lat), cmp64);
+	printf("bench: pthread %s threads=%d ops=%" PRIu64 " opsps=%" PRIu64
+	    " p50=%" PRIu64 " p99=%" PRIu64 "\n", what, nthr, nops,
+	    t ? nops * (uint64_t)1000000000 / t : 0,
+	    nlat ? lat[nlat / 2] : 0, nlat ? lat[nlat * 99 / 100] : 0);
+}
+
+/* ping-pong pairs: one round trip is two handoffs */
+struct pingpong {
+	pthread_mutex_t pp_mtx;
+	pthread_cond_t pp_cv;
+	int pp_turn;
+	uint64_t *pp_lat;
+};
+
+static void *
+pingthread(void *arg)
+{
+	struct pingpong *pp = arg;
+	uint64_t t0;
+	int i;
+
+	pthread_mutex_lock(&pp->pp_mtx);
+	for (i = 0; i < BENCH_ITER; i++) {
+		t0 = nsnow();
+		pp->pp_turn = 1;
+		pthread_cond_signal(&pp->pp_cv);
+		while (pp->pp_turn == 1)
+			pthread_cond_wait(&pp->pp_cv, &pp->pp_mtx);
+		pp->pp_lat[i] = nsnow() - t0;
+	}
+	pp->pp_turn = -1;
+	pthread_cond_signal(&pp->pp_cv);
+	pthread_mutex_unlock(&pp->pp_mtx);
+
+	return NULL;
+}
+
+static void *
+pongthread(void *arg)
+{
+	struct pingpong *pp = arg;
+
+	pthread_mutex_lock(&pp->pp_mtx);
+	for (;;) {
+		while (pp->pp_turn == 0)
+			pthread_cond_wait(&pp->pp_cv, &pp->pp_mtx);
+		if (pp->pp_turn == -1)
+			break;
+		pp->pp_turn = 0;
+		pthread_cond_signal(&pp->pp_cv);
+	}
+	pthread_mutex_unlock(&pp->pp_mtx);
+
+	return NULL;
+}
+
+static void
+bench_pingpong(int npairs, uint64_t *lat)
+{
+	struct pingpong pp[BENCH_MAXTHR/2];
+	pthread_t pt[BENCH_MAXTHR];
+	uint64_t t;
+	int i;
+
+	t = nsnow();
+	for (i = 0; i < npairs; i++) {
+		pthread_mutex_init(&pp[i].pp_mtx, NULL);
+		pthread_cond_init(&pp[i].pp_cv, NULL);
+		pp[i].pp_turn = 0;
+		pp[i].pp_lat = lat + i * BENCH_ITER;
+		pthread_create(&pt[2*i], NULL, pongthread, &pp[i]);
+		pthread_create(&pt[2*i+1], NULL, pingthread, &pp[i]);
+	}
+	for (i = 0; i < 2*npairs; i++)
+		pthread_join(pt[i], NULL);
+	t = nsnow() - t;
+
+	for (i = 0; i < npairs; i++) {
+		pthread_cond_destroy(&pp[i].pp_cv);
+		pthread_mutex_destroy(&pp[i].pp_mtx);
+	}
+	report("pingpong", 2*npairs, 2ULL * npairs * BENCH_ITER, t,
+	    lat, npairs * BENCH_ITER);
+}
+
+/* everyone after one mutex, yielding while holding it now and then */
+static pthread_mutex_t storm_mtx = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t storm_count;
+
+static void *
+stormthread(void *arg)
+{
+	uint64_t *lat = arg, t0;
+	int i;
+
+	for (i = 0; i < BENCH_ITER; i++) {
+		t0 = nsnow();
+		pthread_mutex_lock(&storm_mtx);
+		lat[i] = nsnow() - t0;
+		storm_count++;
+		if ((i & 3) == 0)
+			sched_yield();
+		pthread_mutex_unlock(&storm_mtx);
+	}
+
+	return NULL;
+}
+
+static void
+bench_storm(int nthr, uint64_t *lat)
+{
+	pthread_t pt[BENCH_MAXTHR];
+	uint64_t t;
+	int i;
+
+	storm_count = 0;
+	t = nsnow();
+	for (i = 0; i < nthr; i++)
+		pthread_create(&pt[i], NULL, stormthread, lat + i * BENCH_ITER);
+	for (i = 0; i < nthr; i++)
+		pthread_join(pt[i], NULL);
+	t = nsnow() - t;
+
+	report("mutexstorm", nthr, storm_count, t, lat, nthr * BENCH_ITER);
+}
+
+/* one broadcast, nthr waiters; latency is until the last one is up */
+static pthread_mutex_t fan_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fan_cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t fan_donecv = PTHREAD_COND_INITIALIZER;
+static int fan_gen, fan_waiting, fan_stop;
+
+static void *
+fanthread(void *arg)
+{
+	int gen;
+
+	pthread_mutex_lock(&fan_mtx);
+	for (;;) {
+		gen = fan_gen;
+		fan_waiting++;
+		pthread_cond_signal(&fan_donecv);
+		while (gen == fan_gen && !fan_stop)
+			pthread_cond_wait(&fan_cv, &fan_mtx);
+		if (fan_stop)
+			break;
+	}
+	pthread_mutex_unlock(&fan_mtx);
+
+	return NULL;
+}
+
+static void
+bench_fanout(int nthr, uint64_t *lat)
+{
+	pthread_t pt[BENCH_MAXTHR];
+	uint64_t t, t0;
+	int i, nrounds = BENCH_ITER / 10;
+
+	fan_gen = fan_waiting = fan_stop = 0;
+	for (i = 0; i < nthr; i++)
+		pthread_create(&pt[i], NULL, fanthread, NULL);
+
+	t = nsnow();
+	pthread_mutex_lock(&fan_mtx);
+	for (i = 0; i < nrounds; i++) {
+		while (fan_waiting < nthr)
+			pthread_cond_wait(&fan_donecv, &fan_mtx);
+		fan_waiting = 0;
+		t0 = nsnow();
+		fan_gen++;
+		pthread_cond_broadcast(&fan_cv);
+		while (fan_waiting < nthr)
+			pthread_cond_wait(&fan_donecv, &fan_mtx);
+		lat[i] = nsnow() - t0;
+	}
+	fan_stop = 1;
+	pthread_cond_broadcast(&fan_cv);
+	pthread_mutex_unlock(&fan_mtx);
+	t = nsnow() - t;
+
+	for (i = 0; i < nthr; i++)
+		pthread_join(pt[i], NULL);
+
+	report("fanout", nthr, (uint64_t)nrounds * nthr, t, lat, nrounds);
+}
+
+void
+bench_pthread(void)
+{
+	uint64_t *lat;
+	int n;
+
+	if ((lat = malloc(BENCH_MAXTHR * BENCH_ITER * sizeof(*lat))) == NULL)
+		errx(1, "bench_pthread: malloc");
+
+	for (n = 2; n <= BENCH_MAXTHR; n *= 2)
+		bench_pingpong(n / 2, lat);
+	for (n = 2; n <= BENCH_MAXTHR; n *= 2)
+		bench_storm(n, lat);
+	for (n = 2; n <= BENCH_MAXTHR; n *= 2)
+		bench_fanout(n, lat);
+
+	free(lat);
+}
@@ -33,6 +33,29 @@
 
 extern struct rumpuser_hyperup rumpuser__hyp;
 
+void rumpuser_vif_attach_all(void);
+int rumpuser_vif_ipconfig(int);
+void rumpuser_bench(void);
+void rumpuser_random_init(void);
+void rumpuser_checkpoint(void);
+
+/* tunables, see rumpuser_getparam() */
+void rumpuser_parseargs(void *, int *, char **);
+int rumpuser_cmdline_param(const char *);
+long rumpuser_getparam_num(const char *, long);
+
+/* xenif over a vchan, see rumphyper_vchan.c */
+struct vchanif;
+struct virtif_sc;
+struct vif_pkt;
+int vchanif_attach(int, struct virtif_sc *, uint8_t *, struct vchanif **);
+void vchanif_send(struct vchanif *, struct vif_pkt *, int);
+void vchanif_dying(struct vchanif *);
+
+#ifdef CONFIG_LOCKPROF
+void rumpuser_lockprof_dump(void);
+#endif
+
 static inline void
 rumpkern_unsched(int *nlocks, void *interlock)
 {
@@ -25,14 +25,24 @@
 
 #include <mini-os/types.h>
 #include <mini-os/console.h>
+#include <mini-os/hypervisor.h>
+#include <mini-os/mm.h>
+#include <mini-os/sched.h>
 
 #include <xen/io/console.h>
 #include <mini-os/xmalloc.h>
 #include <mini-os/blkfront.h>
+#include <mini-os/balloon.h>
+#include <mini-os/xenbus.h>
+#include <mini-os/boottrace.h>
+#include <mini-os/stats.h>
+#include <mini-os/kernel.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "rumphyper.h"
@@ -40,14 +50,179 @@
 struct rumpuser_hyperup rumpuser__hyp;
 
 static struct rumpuser_mtx *bio_mtx;
-static struct rumpuser_cv *bio_cv;
-static int bio_outstanding_total;
+static int bio_plug = 1;	/* RUMP_BIO_PLUG */
+static int bio_queue;		/* RUMP_BIO_QUEUE, 0 for the ring size */
+static unsigned long memlimit;	/* RUMP_MEMLIMIT as the rump kernel got it */
+static unsigned long rumpmem;	/* bytes out through rumpuser_malloc() */
+
+static void params_init(void);
+static void blkattach_all(void);
+static void biostats_dump(void);
+static unsigned long memlimit_reserve(void);
+
+/*
+ * Checkpoint.  If rump/checkpoint is in xenstore at boot, the guest
+ * stops once rump_init() is done and waits to be saved, and every
+ * restore of that image starts out with the rump kernel bootstrapped:
+ *
+ *	xl create -p domain_config
+ *	xenstore-write /local/domain/<domid>/rump/checkpoint 1
+ *	xl unpause <domid>
+ *	(rump/checkpoint reads "ready")
+ *	xl save <domid> rump.save
+ *	...
+ *	xl restore rump.save
+ *
+ * The frontends aren't attached ahead in rumpuser_init() then, a save
+ * can't take them along.  They come up after the checkpoint, and so
+ * does a fresh seed for rumpuser_getrandom(), or all copies would
+ * draw the same numbers.  Generators the rump kernel seeded from it
+ * before the checkpoint are shared until they reseed.
+ */
+#define CKPT_XSPATH "rump/checkpoint"
+static int ckpt_wanted;
+
+static int
+checkpoint_wanted(void)
+{
+	char *err, *val;
+
+	if ((err = xenbus_read(XBT_NIL, CKPT_XSPATH, &val)) != NULL) {
+		free(err);
+		return 0;
+	}
+	free(val);
+	return 1;
+}
+
+/* Wait for the toolstack to ask for a suspend, and acknowledge it. */
+static void
+checkpoint_wait(void)
+{
+	struct xenbus_event_queue events;
+	char *err, *val;
+	int go;
+
+	xenbus_event_queue_init(&events);
+	if ((err = xenbus_watch_path_token(XBT_NIL, "control/shutdown",
+	    "checkpoint", &events)) != NULL)
+		free(err);
+	if ((err = xenbus_write(XBT_NIL, CKPT_XSPATH, "ready")) != NULL)
+		free(err);
+	printk("checkpoint: rump kernel up, waiting to be saved\n");
+
+	for (;;) {
+		go = 0;
+		if ((err = xenbus_read(XBT_NIL, "control/shutdown",
+		    &val)) == NULL) {
+			go = strcmp(val, "suspend") == 0;
+			free(val);
+		} else {
+			free(err);
+		}
+		if (go)
+			break;
+		xenbus_wait_for_watch(&events);
+	}
+
+	if ((err = xenbus_unwatch_path_token(XBT_NIL, "control/shutdown",
+	    "checkpoint")) != NULL)
+		free(err);
+	if ((err = xenbus_write(XBT_NIL, "control/shutdown", "")) != NULL)
+		free(err);
+}
+
+/*
+ * Later suspends, for xl save or migrate, are all alike: acknowledge
+ * and go.  kernel_suspend() takes the frontends along, so from the
+ * rump kernel's point of view I/O just takes a while.  With PCI
+ * interrupts, vchans or /dev/xen/evtchn ports bound, which would not
+ * survive, the request is left unacknowledged and the toolstack
+ * gives up on it.
+ */
+static void
+suspend_thread(void *arg)
+{
+	struct xenbus_event_queue events;
+	char *err, *val;
+	int go;
+
+	xenbus_event_queue_init(&events);
+	if ((err = xenbus_watch_path_token(XBT_NIL, "control/shutdown",
+	    "suspend", &events)) != NULL)
+		free(err);
+
+	for (;;) {
+		xenbus_wait_for_watch(&events);
+		if ((err = xenbus_read(XBT_NIL, "control/shutdown",
+		    &val)) != NULL) {
+			free(err);
+			continue;
+		}
+		go = strcmp(val, "suspend") == 0;
+		free(val);
+		if (!go)
+			continue;
+		if (kernel_suspend_held()) {
+			printk("suspend: refused, %d event channels can't "
+			    "be restored\n", kernel_suspend_held());
+			continue;
+		}
+		if ((err = xenbus_write(XBT_NIL, "control/shutdown",
+		    "")) != NULL)
+			free(err);
+		kernel_suspend();
+	}
+}
+
+static void
+devices_attach(void)
+{
+
+	blkattach_all();
+	rumpuser_vif_attach_all();
+	/* not before the checkpoint, which has its own watch */
+	if (create_thread("suspend", NULL, suspend_thread, NULL, NULL) == NULL)
+		printk("suspend: cannot create thread, no save or migrate\n");
+}
+
+/* Called by _netbsd_init() right after rump_init(). */
+void
+rumpuser_checkpoint(void)
+{
+	char **dirs, *err;
+	int i;
+
+	if (!ckpt_wanted)
+		return;
+	ckpt_wanted = 0;
+
+	/* pcifront came up before the rump kernel and can't be saved */
+	if ((err = xenbus_ls(XBT_NIL, "device/pci", &dirs)) == NULL) {
+		for (i = 0; dirs[i]; i++)
+			free(dirs[i]);
+		free(dirs);
+		printk("checkpoint: not with PCI devices, skipped\n");
+	} else {
+		free(err);
+		checkpoint_wait();
+		if (kernel_suspend() == 0)
+			rumpuser_random_init();
+		if ((err = xenbus_rm(XBT_NIL, CKPT_XSPATH)) != NULL)
+			free(err);
+		boot_mark("checkpoint");
+	}
+
+	devices_attach();
+}
 
 #define RUMPHYPER_MYVERSION 17
 
 int
 rumpuser_init(int version, const struct rumpuser_hyperup *hyp)
 {
+	char buf[32];
+	long rate;
 
 	if (version != RUMPHYPER_MYVERSION) {
 		printk("Unsupported hypercall versions requested, %d vs %d\n",
@@ -56,37 +231,77 @@ rumpuser_init(int version, const struct rumpuser_hyperup *hyp)
 	}
 
 	rumpuser__hyp = *hyp;
+	boot_mark("rumpuser_init");
+
+	params_init();
+
+	rumpuser_random_init();
 
 	rumpuser_mutex_init(&bio_mtx, RUMPUSER_MTX_SPIN);
-	rumpuser_cv_init(&bio_cv);
+	stats_register("blk", biostats_dump);
+
+	if (rumpuser_getparam("RUMP_TIMERSLACK_US", buf, sizeof(buf)) == 0)
+		sched_set_timer_slack(MICROSECS(strtol(buf, NULL, 10)));
+	/* spin up to this long for an event before blocking the domain */
+	block_domain_set_poll(MICROSECS(rumpuser_getparam_num(
+	    "RUMP_HALTPOLL_US", 0)));
+	if (rumpuser_getparam("RUMP_BIO_PLUG", buf, sizeof(buf)) == 0)
+		bio_plug = strtol(buf, NULL, 10) != 0;
+	bio_queue = rumpuser_getparam_num("RUMP_BIO_QUEUE", 0);
+	memlimit = rumpuser_getparam_num("RUMP_MEMLIMIT", 0);
+	balloon_set_reserve(memlimit_reserve);
+
+#ifdef CONFIG_LOCKPROF
+	stats_register("lockprof", rumpuser_lockprof_dump);
+#endif
+	/* heap profile, one sample per that many bytes allocated */
+	if ((rate = rumpuser_getparam_num("RUMP_MEMPROF", 0)) > 0)
+		memprof_start(rate);
+#ifdef CONFIG_HYPERCALL_STATS
+	hypercall_stats_set_period(rumpuser_getparam_num(
+	    "RUMP_HYPERCALL_STATS_S", 0));
+#endif
+
+	/* with a checkpoint to take, the frontends wait until after it */
+	if ((ckpt_wanted = checkpoint_wanted()) == 0)
+		devices_attach();
 
 	return 0;
 }
 
+/*
+ * The rump kernel prints a character at a time, so collect a line
+ * and hand it to the console in one go.
+ */
+static char putbuf[128];
+static int putlen;
+
 void
 rumpuser_putchar(int ch)
 {
-	char c = (char)ch;
 
-	console_print(NULL, &c, 1);
+	putbuf[putlen++] = (char)ch;
+	if (ch == '\n' || putlen == sizeof(putbuf)) {
+		console_print(NULL, putbuf, putlen);
+		putlen = 0;
+	}
 }
 
 void
 rumpuser_dprintf(const char *fmt, ...)
 {
-	char *buf;
+	char buf[1024];
 	va_list va;
-
-	buf = (void *)alloc_pages(0);
-	if (!buf)
-		return;
+	int len;
 
 	va_start(va, fmt);
-	vsnprintf(buf, PAGE_SIZE, fmt, va);
+	len = vsnprintf(buf, sizeof(buf), fmt, va);
 	va_end(va);
-	console_print(NULL, buf, strlen(buf));
-
-	free_pages(buf, 0);
+	if (len < 0)
+		return;
+	if (len >= (int)sizeof(buf))
+		len = sizeof(buf) - 1;
+	console_print(NULL, buf, len);
 }
 
 static struct {
@@ -96,15 +311,177 @@ static struct {
 	{ RUMPUSER_PARAM_NCPU, "1" },
 	{ RUMPUSER_PARAM_HOSTNAME, "rump4xen" },
 	{ "RUMP_VERBOSE", "1" },
-	{ "RUMP_MEMLIMIT", "8m" },
+	{ "RUMP_XENIF_RXQUEUE", "64" },
+	{ "RUMP_XENIF_RXBUDGET", "1m" },
+	{ "RUMP_XENIF_RXCOPYBREAK", "0" },
+	{ "RUMP_TIMERSLACK_US", "500" },
 	{ NULL, NULL },
 };
 
+/*
+ * Tunables which override envtab: NAME=value words on the domain
+ * command line, and then rump/param/NAME in xenstore.  Both are read
+ * once, in rumpuser_init(), so a driver gets the same value however
+ * late it looks.  The command line words are taken out of main()'s
+ * argv by callmain.c.
+ */
+#define PARAM_XSPATH "rump/param"
+#define NPARAMS 32
+
+static char cmdparams[sizeof(start_info.cmd_line)];
+static struct {
+	char *name;
+	char *value;
+} params[NPARAMS];
+static int nparams;
+
+int
+rumpuser_cmdline_param(const char *arg)
+{
+	const char *p;
+
+	if (strncmp(arg, "RUMP_", 5) != 0
+	    && strncmp(arg, "_RUMPUSER_", 10) != 0)
+		return 0;
+	for (p = arg; *p == '_' || (*p >= 'A' && *p <= 'Z')
+	    || (*p >= '0' && *p <= '9'); p++)
+		continue;
+	return *p == '=';
+}
+
+static int
+param_lookup(const char *name)
+{
+	int i;
+
+	for (i = 0; i < nparams; i++)
+		if (strcmp(params[i].name, name) == 0)
+			return i;
+	return -1;
+}
+
+/* the first source to set a name wins */
+static int
+param_add(char *name, char *value, const char *from)
+{
+
+	if (param_lookup(name) != -1)
+		return 0;
+	if (nparams == NPARAMS) {
+		printk("%s: too many parameters, %s ignored\n", from, name);
+		return 0;
+	}
+	params[nparams].name = name;
+	params[nparams].value = value;
+	nparams++;
+	printk("%s: %s=%s\n", from, name, value);
+	return 1;
+}
+
+static void
+params_init(void)
+{
+	char path[64], **argv, **dirs, *err, *val, *eq;
+	int i, nargs;
+
+	strncpy(cmdparams, (char *)start_info.cmd_line, sizeof(cmdparams)-1);
+	rumpuser_parseargs(cmdparams, &nargs, NULL);
+	if (nargs > 0 && (argv = malloc(nargs * sizeof(*argv))) != NULL) {
+		rumpuser_parseargs(cmdparams, &nargs, argv);
+		for (i = 0; i < nargs; i++) {
+			if (!rumpuser_cmdline_param(argv[i]))
+				continue;
+			eq = strchr(argv[i], '=');
+			*eq = '\0';
+			param_add(argv[i], eq+1, "cmdline");
+		}
+		free(argv);
+	}
+
+	if ((err = xenbus_ls(XBT_NIL, PARAM_XSPATH, &dirs)) != NULL) {
+		free(err);
+		return;
+	}
+	for (i = 0; dirs[i]; i++) {
+		snprintf(path, sizeof(path), PARAM_XSPATH "/%s", dirs[i]);
+		if ((err = xenbus_read(XBT_NIL, path, &val)) != NULL) {
+			free(err);
+			free(dirs[i]);
+		} else if (!param_add(dirs[i], val, "xenstore")) {
+			free(dirs[i]);
+			free(val);
+		}
+	}
+	free(dirs);
+}
+
+/* numeric parameter with an optional k or m suffix */
+long
+rumpuser_getparam_num(const char *name, long def)
+{
+	char buf[32];
+	char *ep;
+	long v;
+
+	if (rumpuser_getparam(name, buf, sizeof(buf)) != 0)
+		return def;
+	v = strtol(buf, &ep, 10);
+	switch (*ep) {
+	case 'k':
+	case 'K':
+		v *= 1024;
+		break;
+	case 'm':
+	case 'M':
+		v *= 1024*1024;
+		break;
+	}
+	return v > 0 ? v : def;
+}
+
+/*
+ * The rump kernel may use half of the domain's memory, the rest is
+ * left for Mini-OS, the hypercall layer and the application.  It reads
+ * the limit once at bootstrap and derives the pagedaemon thresholds
+ * from it, so the limit stays what the domain had at boot.  Its
+ * pagedaemon only reclaims when nearing that limit: memory it may
+ * still take must stay free, or its allocations would wait for a
+ * reclaim that never comes.  So the balloon keeps back whatever of
+ * the limit the rump kernel hasn't got yet, and all of the domain if
+ * the limit is unknown.
+ */
+#define MEMLIMIT(npages) ((npages) * PAGE_SIZE / 2)
+
+static unsigned long
+memlimit_reserve(void)
+{
+
+	if (memlimit == 0)
+		return balloon_current_pages();
+	if (rumpmem >= memlimit)
+		return 0;
+	return (memlimit - rumpmem + PAGE_SIZE-1) / PAGE_SIZE;
+}
+
 int
 rumpuser_getparam(const char *name, void *buf, size_t blen)
 {
 	int i;
 
+	if ((i = param_lookup(name)) != -1) {
+		if (blen < strlen(params[i].value)+1)
+			return E2BIG;
+		strcpy(buf, params[i].value);
+		return 0;
+	}
+
+	if (strcmp(name, "RUMP_MEMLIMIT") == 0) {
+		if (snprintf(buf, blen, "%lu", memlimit ? memlimit :
+		    MEMLIMIT(balloon_current_pages())) >= (int)blen)
+			return E2BIG;
+		return 0;
+	}
+
 	for (i = 0; envtab[i].name; i++) {
 		if (strcmp(name, envtab[i].name) == 0) {
 			if (blen < strlen(envtab[i].value)+1) {
@@ -119,11 +496,17 @@ rumpuser_getparam(const char *name, void *buf, size_t blen)
         return ENOENT;
 }
 
-/* Use same values both for absolute and relative clock. */
+/* RELWALL is the time of day, ABSMONO the time since boot. */
 int
 rumpuser_clock_gettime(int which, int64_t *sec, long *nsec)
 {
-	s_time_t time = NOW();
+	enum rumpclock rclk = which;
+	s_time_t time;
+
+	if (rclk == RUMPUSER_CLOCK_RELWALL)
+		time = wallclock();
+	else
+		time = NOW();
 
 	*sec  = time / (1000*1000*1000ULL);
 	*nsec = time % (1000*1000*1000ULL);
@@ -135,21 +518,16 @@ int
 rumpuser_clock_sleep(int enum_rumpclock, int64_t sec, long nsec)
 {
 	enum rumpclock rclk = enum_rumpclock;
-	struct thread *thread;
-	uint32_t msec;
+	s_time_t t = SECONDS(sec) + nsec;
 	int nlocks;
 
 	rumpkern_unsched(&nlocks, NULL);
 	switch (rclk) {
 	case RUMPUSER_CLOCK_RELWALL:
-		msec = sec * 1000 + nsec / (1000*1000UL);
-		msleep(msec);
+		nsleep(t);
 		break;
 	case RUMPUSER_CLOCK_ABSMONO:
-		thread = get_current();
-		thread->wakeup_time = sec * (1000*1000*1000ULL) + nsec;
-		clear_runnable(thread);
-		schedule();
+		absnsleep(t);
 		break;
 	}
 	rumpkern_sched(nlocks, NULL);
@@ -157,20 +535,45 @@ rumpuser_clock_sleep(int enum_rumpclock, int64_t sec, long nsec)
 	return 0;
 }
 
+/*
+ * Name the allocation site for the heap profiler: the caller of the
+ * rump kernel's allocator backend, one frame above our own caller.
+ * Going there needs the backend to keep a frame pointer, so the saved
+ * one is only trusted if it points further up our own stack and the
+ * return address next to it is in the text segment.  Otherwise, e.g.
+ * with a rump kernel built with -fomit-frame-pointer, the site is the
+ * backend itself, and the profile shows only which pool the memory
+ * went to.  Either way it's one frame: callers going through a
+ * wrapper such as kmem_alloc() are all attributed to the wrapper.
+ */
+static void *
+malloc_site(void **fp)
+{
+	struct thread *thread = get_current();
+	void **up = fp[0];
+
+	if ((char *)up > (char *)fp
+	    && (char *)(up + 2) <= thread->stack + thread->stack_size
+	    && ((unsigned long)up & (sizeof(void *)-1)) == 0
+	    && (char *)up[1] >= &_text && (char *)up[1] < &_etext)
+		return up[1];
+	return fp[1];
+}
+
 int
 rumpuser_malloc(size_t len, int alignment, void **retval)
 {
+	void *site = malloc_site(__builtin_frame_address(0));
 
 	/*
-	 * If we are allocating precisely a page-sized chunk
-	 * (the common case), use the Mini-OS page allocator directly.
-	 * This avoids the malloc header overhead for this very
-	 * common allocation, leading to 50% better memory use.
-	 * We can't easily use the page allocator for larger chucks
-	 * of memory, since those allocations might have stricter
-	 * alignment restrictions, and therefore it's just
-	 * easier to use memalloc() in those rare cases; it's not
-	 * as wasteful for larger chunks anyway.
+	 * If we are allocating a multiple of the page size (pool pages,
+	 * the common case), use the Mini-OS page allocator directly.
+	 * This avoids the malloc header, which for page-aligned big
+	 * allocations costs a whole page.  rumpuser_free() gets the
+	 * same length back, so it can tell which allocator to return
+	 * the memory to without looking at the buffer.  Anything else
+	 * goes to memalloc(), which has no per-object overhead for
+	 * sub-page sizes.
 	 *
 	 * XXX: how to make sure that rump kernel's and our
 	 * page sizes are the same?  Could be problematic especially
@@ -178,97 +581,368 @@ rumpuser_malloc(size_t len, int alignment, void **retval)
 	 * Note that the code will continue to work, but the optimization
 	 * will not trigger for the common case.
 	 */
-	if (len == PAGE_SIZE) {
-		ASSERT(alignment <= PAGE_SIZE);
+	if (len == PAGE_SIZE && alignment <= PAGE_SIZE) {
 		*retval = (void *)alloc_page();
+		memprof_pages_alloc(*retval, len, site);
+	} else if (len != 0 && (len & (PAGE_SIZE-1)) == 0) {
+		*retval = (void *)alloc_pages_exact(len / PAGE_SIZE, alignment);
+		memprof_pages_alloc(*retval, len, site);
 	} else {
-		*retval = memalloc(len, alignment);
+		*retval = memalloc_site(len, alignment, site);
 	}
-	if (*retval)
-		return 0;
-	else
+	if (*retval == NULL)
 		return ENOMEM;
+	rumpmem += len;
+	return 0;
 }
 
 void
 rumpuser_free(void *buf, size_t buflen)
 {
 
-	if (buflen == PAGE_SIZE)
+	rumpmem -= buflen;
+	if (buflen == PAGE_SIZE) {
+		memprof_pages_free(buf);
 		free_page(buf);
-	else
+	} else if (buflen != 0 && (buflen & (PAGE_SIZE-1)) == 0) {
+		memprof_pages_free(buf);
+		free_pages_exact(buf, buflen / PAGE_SIZE);
+	} else
 		memfree(buf);
 }
 
-/* Not very random */
-int
-rumpuser_getrandom(void *buf, size_t buflen, int flags, size_t *retp)
+void
+rumpuser_exit(int value)
 {
-	uint8_t *rndbuf;
 
-	for (*retp = 0, rndbuf = buf; *retp < buflen; (*retp)++) {
-		*rndbuf++ = NOW() & 0xff;
-	}
+	do_exit();
+}
 
-	return 0;
+/*
+ * Block devices are the vbds under device/vbd.  blk<n> is the n'th
+ * of them, in the order of their vbd numbers as found by the first
+ * lookup, with vbds turning up later appended in the same way.
+ * xvd<x> names a vbd by its number, the way Linux does.
+ */
+#define BLKFDOFF 64
+
+/*
+ * ram0 is the module the domain builder loaded along with the kernel
+ * (the ramdisk= line of the domain config), already mapped at
+ * start_info.mod_start.  Mounting root from it needs no backend and
+ * no ring, I/O is a memcpy completed before rumpuser_bio() returns.
+ * Writes go to the copy in memory and are lost at shutdown.
+ */
+#define RAMDEV "ram0"
+#define RAMFD (BLKFDOFF - 1)
+
+static int ramopen;
+
+#define BIOLAT_BUCKETS 24
+
+struct biocb {
+	struct blkfront_aiocb bio_aiocb;
+	struct blkdev *bio_bd;
+	int bio_sync;		/* flush before calling bio_done */
+	int bio_write;
+	int bio_ret;
+	s_time_t bio_start;
+	rump_biodone_fn bio_done;
+	void *bio_arg;
+	TAILQ_ENTRY(biocb) bio_entries;
+};
+TAILQ_HEAD(biohead, biocb);
+
+struct blkdev {
+	int bd_vbd;
+	struct blkfront_dev *bd_dev;
+	struct blkfront_info bd_info;
+	int bd_open;
+	int bd_outstanding;
+
+	/*
+	 * Each open device has its own completion thread, woken only by
+	 * the device's event channel.  Completed bios are collected on
+	 * bd_done and handed to the rump kernel in one go.
+	 */
+	struct biohead bd_done;
+	struct thread *bd_thread;
+	int bd_dying;
+
+	/*
+	 * biocbs come from a per-device pool at most as deep as the ring,
+	 * whose size blkfront negotiated with the backend.  The pool only
+	 * grows as far as the queue depth actually reached, so a deep ring
+	 * costs no memory until it's used.  There is no point in having
+	 * more in flight, so when the pool is at its limit the submitter
+	 * waits for a completion instead of allocating.
+	 */
+	int bd_nbio;
+	int bd_maxbio;
+	struct biohead bd_free;
+	struct wait_queue_head bd_freewq;
+
+	/* set while blkattach() is bringing bd_dev up ahead of time */
+	int bd_attaching;
+	struct wait_queue_head bd_attachwq;
+
+	/*
+	 * Submission to completion latency, in log2 microsecond buckets,
+	 * [0] for reads and [1] for writes.  Bucket 0 is below 1us, the
+	 * last one catches everything from about 8s up.
+	 */
+	uint64_t bd_lat[2][BIOLAT_BUCKETS];
+	uint64_t bd_ops[2];
+	uint64_t bd_bytes[2];
+	int bd_maxoutstanding;
+};
+
+static struct blkdev **blkdevs;
+static int nblkdevs;
+
+static void
+biostats_dump(void)
+{
+	static const char *opname[2] = { "read", "write" };
+	struct blkdev *bd;
+	uint64_t n;
+	int i, op, b, last;
+
+	for (i = 0; i < nblkdevs; i++) {
+		bd = blkdevs[i];
+		printk("blk: vbd %d: %llu reads %llu bytes, %llu writes "
+		    "%llu bytes, inflight %d max %d\n", bd->bd_vbd,
+		    (unsigned long long)bd->bd_ops[0],
+		    (unsigned long long)bd->bd_bytes[0],
+		    (unsigned long long)bd->bd_ops[1],
+		    (unsigned long long)bd->bd_bytes[1],
+		    bd->bd_outstanding, bd->bd_maxoutstanding);
+		for (op = 0; op < 2; op++) {
+			if (bd->bd_ops[op] == 0)
+				continue;
+			for (last = BIOLAT_BUCKETS-1; last > 0; last--)
+				if (bd->bd_lat[op][last])
+					break;
+			for (b = 0; b <= last; b++) {
+				if ((n = bd->bd_lat[op][b]) == 0)
+					continue;
+				printk("blk:   %-5s <%8luus %llu\n", opname[op],
+				    1UL << b, (unsigned long long)n);
+			}
+		}
+	}
 }
 
-void
-rumpuser_exit(int value)
+static int
+biolat_bucket(s_time_t t)
 {
+	uint64_t us = t / 1000;
+	int b = 0;
 
-	do_exit();
+	while (us && b < BIOLAT_BUCKETS-1) {
+		us >>= 1;
+		b++;
+	}
+	return b;
 }
 
-#define NBLKDEV 10
-#define BLKFDOFF 64
-static struct blkfront_dev *blkdevs[NBLKDEV];
-static struct blkfront_info blkinfos[NBLKDEV];
-static int blkopen[NBLKDEV];
-static int blkdev_outstanding[NBLKDEV];
+static void biothread(void *);
 
 static int
-devopen(int num)
+vbdlookup(int vbd)
 {
-	int devnum = 768 + (num<<6);
-	char buf[32];
-	int nlocks;
+	int i;
 
-	if (blkopen[num]) {
-		blkopen[num]++;
-		return 1;
+	for (i = 0; i < nblkdevs; i++)
+		if (blkdevs[i]->bd_vbd == vbd)
+			return i;
+	return -1;
+}
+
+/* Append the vbds not seen before. */
+static void
+vbdscan(int unsched)
+{
+	struct blkdev *bd, **tab;
+	char **dirs, *msg;
+	int *vbds, i, j, n, v, nlocks;
+
+	if (unsched)
+		rumpkern_unsched(&nlocks, NULL);
+	msg = xenbus_ls(XBT_NIL, "device/vbd", &dirs);
+	if (unsched)
+		rumpkern_sched(nlocks, NULL);
+	if (msg) {
+		free(msg);
+		return;
+	}
+
+	for (n = 0; dirs[n]; n++)
+		continue;
+	if (n == 0)
+		goto out;
+	if ((vbds = malloc(n * sizeof(*vbds))) == NULL)
+		goto out;
+	for (i = 0; i < n; i++) {
+		v = atoi(dirs[i]);
+		for (j = i; j > 0 && vbds[j-1] > v; j--)
+			vbds[j] = vbds[j-1];
+		vbds[j] = v;
 	}
 
-	snprintf(buf, sizeof(buf), "device/vbd/%d", devnum);
+	for (i = 0; i < n; i++) {
+		if (vbdlookup(vbds[i]) != -1)
+			continue;
+		tab = realloc(blkdevs, (nblkdevs+1) * sizeof(*blkdevs));
+		if (tab == NULL)
+			break;
+		blkdevs = tab;
+		if ((bd = calloc(1, sizeof(*bd))) == NULL)
+			break;
+		bd->bd_vbd = vbds[i];
+		init_waitqueue_head(&bd->bd_attachwq);
+		blkdevs[nblkdevs++] = bd;
+	}
+	free(vbds);
 
-	rumpkern_unsched(&nlocks, NULL);
-	blkdevs[num] = init_blkfront(buf, &blkinfos[num]);
-	rumpkern_sched(nlocks, NULL);
+ out:
+	for (i = 0; i < n; i++)
+		free(dirs[i]);
+	free(dirs);
+}
 
-	if (blkdevs[num] != NULL) {
-		blkopen[num] = 1;
-		return 0;
-	} else {
-		return EIO; /* guess something */
+/* xvda is 202:0, xvdb 202:16 and so on, past xvdp the extended scheme */
+static int
+xvd2vbd(const char *p)
+{
+	int disk = 0;
+
+	if (*p == '\0')
+		return -1;
+	for (; *p; p++) {
+		if (*p < 'a' || *p > 'z' || disk > 0xfffff)
+			return -1;
+		disk = disk*26 + (*p - 'a' + 1);
 	}
+	disk--;
+
+	if (disk < 16)
+		return (202<<8) | (disk<<4);
+	return (1<<28) | (disk<<8);
 }
 
 static int
 devname2num(const char *name)
 {
-	const char *p;
-	int num;
+	char *ep;
+	long n;
+	int vbd, num;
+
+	if (strncmp(name, "blk", 3) == 0) {
+		n = strtol(name+3, &ep, 10);
+		if (name[3] == '\0' || *ep != '\0' || n < 0 || n > INT_MAX)
+			return -1;
+		if (n >= nblkdevs)
+			vbdscan(1);
+		return n < nblkdevs ? (int)n : -1;
+	}
+
+	if (strncmp(name, "xvd", 3) == 0) {
+		if ((vbd = xvd2vbd(name+3)) == -1)
+			return -1;
+		if ((num = vbdlookup(vbd)) == -1) {
+			vbdscan(1);
+			num = vbdlookup(vbd);
+		}
+		return num;
+	}
 
 	/* we support only block devices */
-	if (strncmp(name, "blk", 3) != 0 || strlen(name) != 4)
-		return -1;
+	return -1;
+}
 
-	p = name + strlen(name)-1;
-	num = *p - '0';
-	if (num < 0 || num >= NBLKDEV)
-		return -1;
+/*
+ * Attach ahead.  rumpuser_init() brings every vbd present at boot up
+ * in a thread of its own, so that the backend handshakes overlap
+ * each other and the rump kernel bootstrap, instead of being done one
+ * after the other on first open.
+ */
+static void
+blkattach(void *arg)
+{
+	struct blkdev *bd = arg;
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "device/vbd/%d", bd->bd_vbd);
+	bd->bd_dev = init_blkfront(buf, &bd->bd_info);
+	boot_mark("vbd %d %s", bd->bd_vbd, bd->bd_dev ? "attached" : "failed");
+	bd->bd_attaching = 0;
+	wake_up(&bd->bd_attachwq);
+}
+
+static void
+blkattach_all(void)
+{
+	struct blkdev *bd;
+	int i;
 
-	return num;
+	/* not a rump kernel thread yet, so vbdscan() needn't unschedule */
+	vbdscan(0);
+	for (i = 0; i < nblkdevs; i++) {
+		bd = blkdevs[i];
+		bd->bd_attaching = 1;
+		if (create_thread("blkattach", NULL, blkattach, bd, NULL) == NULL)
+			bd->bd_attaching = 0;
+	}
+}
+
+static int
+devopen(int num)
+{
+	struct blkdev *bd = blkdevs[num];
+	char buf[32];
+	int nlocks;
+
+	if (bd->bd_open) {
+		bd->bd_open++;
+		return 0;
+	}
+
+	snprintf(buf, sizeof(buf), "device/vbd/%d", bd->bd_vbd);
+
+	rumpkern_unsched(&nlocks, NULL);
+	wait_event(bd->bd_attachwq, !bd->bd_attaching);
+	/* attached ahead, or retry if that failed */
+	if (bd->bd_dev == NULL)
+		bd->bd_dev = init_blkfront(buf, &bd->bd_info);
+	rumpkern_sched(nlocks, NULL);
+
+	if (bd->bd_dev != NULL) {
+		/* bios in flight, at most one per ring slot */
+		bd->bd_maxbio = bd->bd_info.ring_size;
+		if (bio_queue > 0 && bio_queue < bd->bd_maxbio)
+			bd->bd_maxbio = bio_queue;
+		bd->bd_nbio = 0;
+		TAILQ_INIT(&bd->bd_free);
+		init_waitqueue_head(&bd->bd_freewq);
+
+		TAILQ_INIT(&bd->bd_done);
+		bd->bd_dying = 0;
+		bd->bd_thread = create_thread_prio("biopoll", NULL,
+		    THREAD_PRIO_DRIVER, biothread, bd, NULL);
+		if (bd->bd_thread == NULL) {
+			rumpkern_unsched(&nlocks, NULL);
+			shutdown_blkfront(bd->bd_dev);
+			rumpkern_sched(nlocks, NULL);
+			bd->bd_dev = NULL;
+			return ENOMEM;
+		}
+		bd->bd_thread->flags |= THREAD_MUSTJOIN;
+		bd->bd_open = 1;
+		return 0;
+	} else {
+		return EIO; /* guess something */
+	}
 }
 
 int
@@ -276,6 +950,14 @@ rumpuser_open(const char *name, int mode, int *fdp)
 {
 	int acc, rv, num;
 
+	if ((mode & RUMPUSER_OPEN_BIO) && strcmp(name, RAMDEV) == 0) {
+		if (start_info.mod_len == 0)
+			return ENXIO;
+		ramopen++;
+		*fdp = RAMFD;
+		return 0;
+	}
+
 	if ((mode & RUMPUSER_OPEN_BIO) == 0 || (num = devname2num(name)) == -1)
 		return ENXIO;
 
@@ -284,7 +966,7 @@ rumpuser_open(const char *name, int mode, int *fdp)
 
 	acc = mode & RUMPUSER_OPEN_ACCMODE;
 	if (acc == RUMPUSER_OPEN_WRONLY || acc == RUMPUSER_OPEN_RDWR) {
-		if (blkinfos[num].mode != O_RDWR) {
+		if (blkdevs[num]->bd_info.mode != O_RDWR) {
 			/* XXX: unopen */
 			return EROFS;
 		}
@@ -298,16 +980,41 @@ int
 rumpuser_close(int fd)
 {
 	int rfd = fd - BLKFDOFF;
+	struct blkdev *bd;
 
-	if (rfd < 0 || rfd+1 > NBLKDEV)
+	if (fd == RAMFD && ramopen) {
+		ramopen--;
+		return 0;
+	}
+
+	if (rfd < 0 || rfd >= nblkdevs || !blkdevs[rfd]->bd_open)
 		return EBADF;
+	bd = blkdevs[rfd];
+
+	if (--bd->bd_open == 0) {
+		struct blkfront_dev *toclose = bd->bd_dev;
+		struct biocb *bio;
+		int nlocks;
+
+		rumpkern_unsched(&nlocks, NULL);
+
+		/* reap everything, then let the completion thread drain */
+		blkfront_sync(toclose);
+		bd->bd_dying = 1;
+		wake_up(blkfront_waitq(toclose));
+		join_thread(bd->bd_thread);
+		bd->bd_thread = NULL;
+		while ((bio = TAILQ_FIRST(&bd->bd_free)) != NULL) {
+			TAILQ_REMOVE(&bd->bd_free, bio, bio_entries);
+			memfree(bio);
+		}
+		bd->bd_nbio = 0;
 
-	if (--blkopen[rfd] == 0) {
-		struct blkfront_dev *toclose = blkdevs[rfd];
-		
 		/* not sure if this appropriately prevents races either ... */
-		blkdevs[rfd] = NULL;
+		bd->bd_dev = NULL;
 		shutdown_blkfront(toclose);
+
+		rumpkern_sched(nlocks, NULL);
 	}
 
 	return 0;
@@ -316,14 +1023,24 @@ rumpuser_close(int fd)
 int
 rumpuser_getfileinfo(const char *name, uint64_t *size, int *type)
 {
+	struct blkdev *bd;
 	int rv, num;
 
+	if (strcmp(name, RAMDEV) == 0) {
+		if (start_info.mod_len == 0)
+			return ENXIO;
+		*size = start_info.mod_len;
+		*type = RUMPUSER_FT_BLK;
+		return 0;
+	}
+
 	if ((num = devname2num(name)) == -1)
 		return ENXIO;
 	if ((rv = devopen(num)) != 0)
 		return rv;
+	bd = blkdevs[num];
 
-	*size = blkinfos[num].sectors * blkinfos[num].sector_size;
+	*size = bd->bd_info.sectors * bd->bd_info.sector_size;
 	*type = RUMPUSER_FT_BLK;
 
 	rumpuser_close(num + BLKFDOFF);
@@ -331,39 +1048,77 @@ rumpuser_getfileinfo(const char *name, uint64_t *size, int *type)
 	return 0;
 }
 
-struct biocb {
-	struct blkfront_aiocb bio_aiocb;
-	int bio_num;
-	rump_biodone_fn bio_done;
-	void *bio_arg;
-};
+static struct biocb *
+bioget(struct blkdev *bd)
+{
+	DEFINE_WAIT(w);
+	struct biocb *bio;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	for (;;) {
+		if ((bio = TAILQ_FIRST(&bd->bd_free)) != NULL) {
+			TAILQ_REMOVE(&bd->bd_free, bio, bio_entries);
+			break;
+		}
+		if (bd->bd_nbio < bd->bd_maxbio) {
+			if ((bio = memalloc(sizeof(*bio), 0)) != NULL) {
+				bd->bd_nbio++;
+				break;
+			}
+			/* out of memory, and none in flight to wait for */
+			if (bd->bd_nbio == 0)
+				break;
+		}
+		add_waiter(w, bd->bd_freewq);
+		local_irq_restore(flags);
+		schedule();
+		local_irq_save(flags);
+	}
+	remove_waiter(w, bd->bd_freewq);
+	local_irq_restore(flags);
 
+	return bio;
+}
+
+/*
+ * Called from blkfront_aio_poll(), usually by the device's completion
+ * thread but possibly by a thread waiting for a ring slot.  Just queue
+ * the bio; the completion thread delivers it.
+ */
 static void
 biocomp(struct blkfront_aiocb *aiocb, int ret)
 {
 	struct biocb *bio = aiocb->data;
-	int dummy, num;
-
-	rumpkern_sched(0, NULL);
-	if (ret)
-		bio->bio_done(bio->bio_arg, 0, EIO);
-	else
-		bio->bio_done(bio->bio_arg, bio->bio_aiocb.aio_nbytes, 0);
-	rumpkern_unsched(&dummy, NULL);
-	num = bio->bio_num;
-	xfree(bio);
-
-	rumpuser_mutex_enter_nowrap(bio_mtx);
-	bio_outstanding_total--;
-	blkdev_outstanding[num]--;
-	rumpuser_mutex_exit(bio_mtx);
+	struct blkdev *bd = bio->bio_bd;
+	unsigned long flags;
+	int w = bio->bio_write;
+
+	bio->bio_ret = ret;
+	local_irq_save(flags);
+	/* a synchronous write isn't done until the flush after it is */
+	if (!bio->bio_sync || ret) {
+		bd->bd_lat[w][biolat_bucket(NOW() - bio->bio_start)]++;
+		bd->bd_ops[w]++;
+		if (!ret)
+			bd->bd_bytes[w] += aiocb->aio_nbytes;
+	}
+	TAILQ_INSERT_TAIL(&bio->bio_bd->bd_done, bio, bio_entries);
+	local_irq_restore(flags);
+	wake_up(blkfront_waitq(aiocb->aio_dev));
 }
 
 static void
 biothread(void *arg)
 {
 	DEFINE_WAIT(w);
-	int i, flags, did;
+	struct biohead done;
+	struct biocb *bio, *nbio;
+	struct blkdev *bd = arg;
+	struct blkfront_dev *dev;
+	int flags, dummy, ndone;
+
+	dev = bd->bd_dev;
 
 	/* for the bio callback */
 	rumpuser__hyp.hyp_schedule();
@@ -371,78 +1126,152 @@ biothread(void *arg)
 	rumpuser__hyp.hyp_unschedule();
 
 	for (;;) {
-		rumpuser_mutex_enter_nowrap(bio_mtx);
-		while (bio_outstanding_total == 0) {
-			rumpuser_cv_wait_nowrap(bio_cv, bio_mtx);
-		}
-		rumpuser_mutex_exit(bio_mtx);
-
-		/*
-		 * if we made any progress, recheck.  could be batched,
-		 * but since currently locks are free here ... meh
-		 */
 		local_irq_save(flags);
-		for (did = 0;;) {
-			for (i = 0; i < NBLKDEV; i++) {
-				if (blkdev_outstanding[i])
-					did += blkfront_aio_poll(blkdevs[i]);
-			}
-			if (did)
+		for (;;) {
+			/* submitters have yielded, send what they queued */
+			blkfront_unplug(dev);
+			blkfront_aio_poll(dev);
+			if (!TAILQ_EMPTY(&bd->bd_done))
+				break;
+			/*
+			 * Closing waits only for what was on the ring, so
+			 * stay for the flushes of sync writes issued since.
+			 */
+			if (bd->bd_dying && bd->bd_outstanding == 0)
 				break;
-			add_waiter(w, blkfront_queue);
+			add_waiter(w, *blkfront_waitq(dev));
 			local_irq_restore(flags);
 			schedule();
 			local_irq_save(flags);
 		}
+		remove_waiter(w, *blkfront_waitq(dev));
+		TAILQ_INIT(&done);
+		TAILQ_CONCAT(&done, &bd->bd_done, bio_entries);
 		local_irq_restore(flags);
+
+		if (TAILQ_EMPTY(&done))
+			break;
+
+		/*
+		 * A synchronous write is done when the flush issued after
+		 * it completes.  Meanwhile other bios keep going.
+		 */
+		for (bio = TAILQ_FIRST(&done); bio; bio = nbio) {
+			nbio = TAILQ_NEXT(bio, bio_entries);
+			if (!bio->bio_sync || bio->bio_ret)
+				continue;
+			TAILQ_REMOVE(&done, bio, bio_entries);
+			bio->bio_sync = 0;
+			blkfront_aio_flush(&bio->bio_aiocb);
+		}
+		if (TAILQ_EMPTY(&done))
+			continue;
+
+		/* one trip into the rump kernel for the whole batch */
+		ndone = 0;
+		rumpkern_sched(0, NULL);
+		while ((bio = TAILQ_FIRST(&done)) != NULL) {
+			TAILQ_REMOVE(&done, bio, bio_entries);
+			if (bio->bio_ret)
+				bio->bio_done(bio->bio_arg, 0, EIO);
+			else
+				bio->bio_done(bio->bio_arg,
+				    bio->bio_aiocb.aio_nbytes, 0);
+			ndone++;
+			TAILQ_INSERT_TAIL(&bd->bd_free, bio, bio_entries);
+		}
+		rumpkern_unsched(&dummy, NULL);
+		wake_up(&bd->bd_freewq);
+
+		rumpuser_mutex_enter_nowrap(bio_mtx);
+		bd->bd_outstanding -= ndone;
+		rumpuser_mutex_exit(bio_mtx);
 	}
+
+	ASSERT(bd->bd_outstanding == 0);
+
+	rumpuser__hyp.hyp_schedule();
+	rumpuser__hyp.hyp_lwproc_release();
+	rumpuser__hyp.hyp_unschedule();
+
+	exit_thread();
+}
+
+static void
+ramdisk_bio(int op, void *data, size_t dlen, int64_t off,
+	rump_biodone_fn biodone, void *donearg)
+{
+	char *ram = (char *)start_info.mod_start;
+
+	if (off < 0 || off > start_info.mod_len
+	    || dlen > start_info.mod_len - off) {
+		biodone(donearg, 0, EIO);
+		return;
+	}
+
+	if (op & RUMPUSER_BIO_READ)
+		memcpy(data, ram + off, dlen);
+	else
+		memcpy(ram + off, data, dlen);
+	biodone(donearg, dlen, 0);
 }
 
 void
 rumpuser_bio(int fd, int op, void *data, size_t dlen, int64_t off,
 	rump_biodone_fn biodone, void *donearg)
 {
-	static int bio_inited;
-	struct biocb *bio = memalloc(sizeof(*bio), 0);
-	struct blkfront_aiocb *aiocb = &bio->bio_aiocb;
+	struct blkdev *bd;
+	struct biocb *bio;
+	struct blkfront_aiocb *aiocb;
 	int nlocks;
-	int num = fd - BLKFDOFF;
+
+	if (fd == RAMFD) {
+		ramdisk_bio(op, data, dlen, off, biodone, donearg);
+		return;
+	}
+	bd = blkdevs[fd - BLKFDOFF];
 
 	rumpkern_unsched(&nlocks, NULL);
 
-	if (!bio_inited) {
-		rumpuser_mutex_enter_nowrap(bio_mtx);
-		if (!bio_inited) {
-			bio_inited = 1;
-			rumpuser_mutex_exit(bio_mtx);
-			create_thread("biopoll", NULL,
-			    biothread, NULL, NULL);
-		} else {
-			rumpuser_mutex_exit(bio_mtx);
-		}
+	if ((bio = bioget(bd)) == NULL) {
+		rumpkern_sched(nlocks, NULL);
+		biodone(donearg, 0, ENOMEM);
+		return;
 	}
+	aiocb = &bio->bio_aiocb;
 
 	bio->bio_done = biodone;
 	bio->bio_arg = donearg;
-	bio->bio_num = num;
+	bio->bio_bd = bd;
+	bio->bio_sync = (op & RUMPUSER_BIO_SYNC) && (op & RUMPUSER_BIO_WRITE);
+	bio->bio_write = (op & RUMPUSER_BIO_READ) == 0;
+	bio->bio_start = NOW();
 
-	aiocb->aio_dev = blkdevs[num];
+	aiocb->aio_dev = bd->bd_dev;
 	aiocb->aio_buf = data;
 	aiocb->aio_nbytes = dlen;
 	aiocb->aio_offset = off;
 	aiocb->aio_cb = biocomp;
 	aiocb->data  = bio;
 
+	rumpuser_mutex_enter_nowrap(bio_mtx);
+	if (++bd->bd_outstanding > bd->bd_maxoutstanding)
+		bd->bd_maxoutstanding = bd->bd_outstanding;
+	rumpuser_mutex_exit(bio_mtx);
+
+	/*
+	 * Plug until the completion thread gets to run, i.e. until the
+	 * submitter yields.  Back-to-back bios then share a notification
+	 * and adjacent ones share a ring request.  RUMP_BIO_PLUG=0 pushes
+	 * each one right away, for latency over throughput.
+	 */
+	if (bio_plug)
+		blkfront_plug(aiocb->aio_dev);
 	if (op & RUMPUSER_BIO_READ)
 		blkfront_aio_read(aiocb);
 	else
 		blkfront_aio_write(aiocb);
-
-	rumpuser_mutex_enter(bio_mtx);
-	bio_outstanding_total++;
-	blkdev_outstanding[num]++;
-	rumpuser_cv_signal(bio_cv);
-	rumpuser_mutex_exit(bio_mtx);
+	wake_up(blkfront_waitq(aiocb->aio_dev));
 
 	rumpkern_sched(nlocks, NULL);
 }
@@ -0,0 +1,331 @@
+/*
+ * Benchmarks for the hypercall layer, run by the demo when asked to
+ * on the command line.  Each result is one console line of the form
+ *
+ *	bench: <test> key=value ...
+ *
+ * so that a harness can grep for them and compare runs.  Block I/O
+ * is read only, it is safe to point at a disk holding a file system.
+ */
+
+#include <mini-os/types.h>
+#include <mini-os/console.h>
+#include <mini-os/sched.h>
+#include <mini-os/wait.h>
+#include <mini-os/xmalloc.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rumphyper.h"
+
+#define BENCH_TIME	SECONDS(2)
+#define BENCH_DEV	"blk0"
+
+static uint64_t
+xorshift(uint64_t *x)
+{
+
+	*x ^= *x << 13;
+	*x ^= *x >> 7;
+	*x ^= *x << 17;
+	return *x;
+}
+
+static uint64_t
+persec(uint64_t n, s_time_t t)
+{
+
+	return t > 0 ? n * SECONDS(1) / t : 0;
+}
+
+/*
+ * Block I/O: keep qd bios in flight for BENCH_TIME, sequentially
+ * or at random aligned offsets within the device.
+ */
+struct biobench {
+	int bb_inflight;
+	int bb_errors;
+	uint64_t bb_bytes;
+	struct wait_queue_head bb_wq;
+};
+
+static void
+bench_biodone(void *arg, size_t len, int error)
+{
+	struct biobench *bb = arg;
+
+	bb->bb_inflight--;
+	if (error)
+		bb->bb_errors++;
+	else
+		bb->bb_bytes += len;
+	wake_up(&bb->bb_wq);
+}
+
+static void
+bench_bio_run(int fd, void *buf, uint64_t span, size_t iosize, int qd,
+	int rnd)
+{
+	struct biobench bb;
+	s_time_t start, end, t;
+	uint64_t off = 0, x = 0x9e3779b97f4a7c15ULL, nios = 0;
+	int want, nlocks;
+
+	memset(&bb, 0, sizeof(bb));
+	init_waitqueue_head(&bb.bb_wq);
+
+	start = NOW();
+	end = start + BENCH_TIME;
+	for (;;) {
+		while (bb.bb_inflight < qd && NOW() < end) {
+			if (rnd)
+				off = (xorshift(&x) % (span / iosize)) * iosize;
+			else if (off + iosize > span)
+				off = 0;
+			bb.bb_inflight++;
+			nios++;
+			rumpuser_bio(fd, RUMPUSER_BIO_READ, buf, iosize, off,
+			    bench_biodone, &bb);
+			if (!rnd)
+				off += iosize;
+		}
+		if (bb.bb_inflight == 0)
+			break;
+		want = NOW() < end ? qd : 1;
+		rumpkern_unsched(&nlocks, NULL);
+		wait_event(bb.bb_wq, bb.bb_inflight < want);
+		rumpkern_sched(nlocks, NULL);
+	}
+	t = NOW() - start;
+
+	printk("bench: bio %s size=%lu qd=%d iops=%llu KiB/s=%llu errors=%d\n",
+	    rnd ? "rand" : "seq", (unsigned long)iosize, qd,
+	    (unsigned long long)persec(nios, t),
+	    (unsigned long long)persec(bb.bb_bytes, t) / 1024, bb.bb_errors);
+}
+
+static void
+bench_bio(void)
+{
+	static const int depths[] = { 1, 4, 16, 32 };
+	uint64_t size;
+	void *buf;
+	int fd, type, i, rv;
+
+	if ((rv = rumpuser_getfileinfo(BENCH_DEV, &size, &type)) != 0
+	    || (rv = rumpuser_open(BENCH_DEV,
+	      RUMPUSER_OPEN_RDONLY | RUMPUSER_OPEN_BIO, &fd)) != 0) {
+		printk("bench: bio skipped, %s: %d\n", BENCH_DEV, rv);
+		return;
+	}
+	if ((buf = memalloc(64*1024, PAGE_SIZE)) == NULL) {
+		rumpuser_close(fd);
+		return;
+	}
+	if (size >= 64*1024) {
+		for (i = 0; i < sizeof(depths)/sizeof(depths[0]); i++)
+			bench_bio_run(fd, buf, size, 64*1024, depths[i], 0);
+		for (i = 0; i < sizeof(depths)/sizeof(depths[0]); i++)
+			bench_bio_run(fd, buf, size, 4096, depths[i], 1);
+	}
+	memfree(buf);
+	rumpuser_close(fd);
+}
+
+/* schedule(): two threads handing the CPU back and forth */
+static struct thread *pp_main, *pp_peer;
+static int pp_done;
+
+static void
+bench_pp_peer(void *arg)
+{
+
+	for (;;) {
+		block(current);
+		schedule();
+		if (pp_done)
+			break;
+		wake(pp_main);
+	}
+}
+
+static void
+bench_sched(void)
+{
+	s_time_t start, t;
+	int i, n = 100000, nlocks;
+
+	rumpkern_unsched(&nlocks, NULL);
+	pp_main = current;
+	pp_done = 0;
+	pp_peer = create_thread("benchpp", NULL, bench_pp_peer, NULL, NULL);
+	pp_peer->flags |= THREAD_MUSTJOIN;
+	while (is_runnable(pp_peer))
+		schedule();
+
+	start = NOW();
+	for (i = 0; i < n; i++) {
+		wake(pp_peer);
+		block(current);
+		schedule();
+	}
+	t = NOW() - start;
+
+	pp_done = 1;
+	wake(pp_peer);
+	join_thread(pp_peer);
+	rumpkern_sched(nlocks, NULL);
+
+	printk("bench: sched switch ns=%llu\n",
+	    (unsigned long long)(t / (2*n)));
+}
+
+/* rumpuser mutexes and condvars, uncontended and handed over */
+static struct rumpuser_mtx *cv_mtx;
+static struct rumpuser_cv *cv_cv;
+static int cv_turn, cv_stop;
+
+static void
+bench_cv_peer(void *arg)
+{
+
+	rumpuser__hyp.hyp_schedule();
+	rumpuser__hyp.hyp_lwproc_newlwp(0);
+
+	rumpuser_mutex_enter(cv_mtx);
+	for (;;) {
+		while (cv_turn == 0 && !cv_stop)
+			rumpuser_cv_wait(cv_cv, cv_mtx);
+		if (cv_stop)
+			break;
+		cv_turn = 0;
+		rumpuser_cv_signal(cv_cv);
+	}
+	rumpuser_mutex_exit(cv_mtx);
+
+	rumpuser__hyp.hyp_lwproc_release();
+	rumpuser__hyp.hyp_unschedule();
+}
+
+static void
+bench_synch(void)
+{
+	struct thread *peer;
+	s_time_t start, t;
+	int i, n = 100000, nlocks;
+
+	rumpuser_mutex_init(&cv_mtx, 0);
+	rumpuser_cv_init(&cv_cv);
+
+	start = NOW();
+	for (i = 0; i < n; i++) {
+		rumpuser_mutex_enter(cv_mtx);
+		rumpuser_mutex_exit(cv_mtx);
+	}
+	t = NOW() - start;
+	printk("bench: mutex uncontended ns=%llu\n",
+	    (unsigned long long)(t / n));
+
+	cv_turn = cv_stop = 0;
+	peer = create_thread("benchcv", NULL, bench_cv_peer, NULL, NULL);
+	peer->flags |= THREAD_MUSTJOIN;
+
+	n /= 10;
+	start = NOW();
+	rumpuser_mutex_enter(cv_mtx);
+	for (i = 0; i < n; i++) {
+		cv_turn = 1;
+		rumpuser_cv_signal(cv_cv);
+		while (cv_turn == 1)
+			rumpuser_cv_wait(cv_cv, cv_mtx);
+	}
+	cv_stop = 1;
+	rumpuser_cv_signal(cv_cv);
+	rumpuser_mutex_exit(cv_mtx);
+	t = NOW() - start;
+
+	rumpkern_unsched(&nlocks, NULL);
+	join_thread(peer);
+	rumpkern_sched(nlocks, NULL);
+
+	printk("bench: cv handoff ns=%llu\n",
+	    (unsigned long long)(t / (2*n)));
+
+	rumpuser_cv_destroy(cv_cv);
+	rumpuser_mutex_destroy(cv_mtx);
+}
+
+/* allocators, in batches so that frees don't just undo the last alloc */
+#define ALLOC_BATCH 64
+static void
+bench_alloc(void)
+{
+	static const size_t sizes[] = { 32, 256, 4096, 65536 };
+	void *p[ALLOC_BATCH];
+	s_time_t start, t;
+	size_t sz;
+	int i, j, k, n = 1000;
+
+	for (k = 0; k < sizeof(sizes)/sizeof(sizes[0]); k++) {
+		sz = sizes[k];
+
+		start = NOW();
+		for (i = 0; i < n; i++) {
+			for (j = 0; j < ALLOC_BATCH; j++)
+				p[j] = memalloc(sz, 0);
+			for (j = 0; j < ALLOC_BATCH; j++)
+				memfree(p[j]);
+		}
+		t = NOW() - start;
+		printk("bench: memalloc size=%lu ns=%llu\n", (unsigned long)sz,
+		    (unsigned long long)(t / (n * ALLOC_BATCH)));
+
+		start = NOW();
+		for (i = 0; i < n; i++) {
+			for (j = 0; j < ALLOC_BATCH; j++)
+				if (rumpuser_malloc(sz, 0, &p[j]) != 0)
+					p[j] = NULL;
+			for (j = 0; j < ALLOC_BATCH; j++)
+				if (p[j])
+					rumpuser_free(p[j], sz);
+		}
+		t = NOW() - start;
+		printk("bench: rumpuser_malloc size=%lu ns=%llu\n",
+		    (unsigned long)sz,
+		    (unsigned long long)(t / (n * ALLOC_BATCH)));
+	}
+}
+
+static void
+benchthread(void *arg)
+{
+
+	/* a rump kernel context of our own, like the bio threads */
+	rumpuser__hyp.hyp_schedule();
+	rumpuser__hyp.hyp_lwproc_newlwp(0);
+
+	bench_sched();
+	bench_synch();
+	bench_alloc();
+	bench_bio();
+
+	rumpuser__hyp.hyp_lwproc_release();
+	rumpuser__hyp.hyp_unschedule();
+}
+
+/*
+ * Run the lot and return when done.  Called by the application,
+ * outside the rump kernel.
+ */
+void
+rumpuser_bench(void)
+{
+	struct thread *thr;
+
+	printk("bench: start\n");
+	thr = create_thread("bench", NULL, benchthread, NULL, NULL);
+	thr->flags |= THREAD_MUSTJOIN;
+	join_thread(thr);
+	printk("bench: done\n");
+}
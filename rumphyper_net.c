@@ -27,80 +27,172 @@
 
 #include <mini-os/os.h>
 #include <mini-os/netfront.h>
+#include <mini-os/xenbus.h>
+#include <mini-os/boottrace.h>
 
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "rumphyper.h"
+#include <rump/rump.h>
+#include <rump/netconfig.h>
 #include <rump/rumpuser.h>
 
 #include <rumpxenif/if_virt.h>
 #include <rumpxenif/if_virt_user.h>
 
 /*
- * For now, shovel the packets from the interrupt to a
- * thread context via an intermediate set of buffers.  Need
- * to fix this a bit down the road.
+ * Shovel the packets from the interrupt to a thread context.
+ * Only the page netfront received into is queued, it is loaned
+ * to the rump kernel as external mbuf storage and comes back
+ * via VIFHYPER_RXFREE() when the mbuf is freed.  Frames up to
+ * RUMP_XENIF_RXCOPYBREAK bytes are copied into the queue entry
+ * instead, so that netfront can reuse their page right away.
  */
-#define MAXPKT 2000
+#define RXCOPYBREAK_MAX 256
 struct onepkt {
-	unsigned char pkt_data[MAXPKT];
+	void *pkt_page;		/* NULL if copied to pkt_copy */
+	unsigned char *pkt_data;
 	int pkt_dlen;
+	int pkt_flags;
+	unsigned char pkt_copy[RXCOPYBREAK_MAX];
 };
 
-#define NBUF 64
+/*
+ * The queue starts out at RUMP_XENIF_RXQUEUE entries and doubles
+ * whenever it fills up, until the pages it pins would exceed
+ * RUMP_XENIF_RXBUDGET bytes.  When full, myrecv() refuses the frame
+ * and netfront holds back its ring until pusher() catches up.
+ */
+#define RXQUEUE_DEFAULT 64
+#define RXBUDGET_DEFAULT (1024*1024)
+#define RXCACHE_DEFAULT 256	/* returned pages netfront keeps, a ring's worth */
 struct virtif_user {
 	struct netfront_dev *viu_dev;
+	struct vchanif *viu_vchan;	/* instead of viu_dev */
 	struct thread *viu_rcvr;
 	struct virtif_sc *viu_vifsc;
 
 	int viu_read;
 	int viu_write;
-	struct onepkt viu_pkts[NBUF];
+	int viu_npkts;
+	int viu_maxpkts;
+	int viu_stalled;
+	uint64_t viu_nstalls;
+	struct onepkt *viu_pkts;
+	struct netfront_stats viu_stats;	/* as last given to ifnet */
+	uint8_t viu_enaddr[6];
 };
 
 /*
- * Ok, based on how (the unmodified) netfront works, we need to
- * consume the data here.  So store it locally (and revisit some day).
+ * Called from netfront's ring processing in the softirq thread, with
+ * interrupts off, with the page the frame was received into.  We own the page if we take it.
  */
-static void
-myrecv(struct netfront_dev *dev, unsigned char *data, int dlen)
+static int
+myrecv(struct netfront_dev *dev, void *page, unsigned char *data, int dlen,
+	int flags)
 {
 	struct virtif_user *viu = netfront_get_private(dev);
+	struct onepkt *pkt;
 	int nextw;
 
 	/* TODO: we should be at the correct spl already, assert how? */
 
-	nextw = (viu->viu_write+1) % NBUF;
-	/* queue full?  drop packet */
+	nextw = (viu->viu_write+1) % viu->viu_npkts;
+	/* queue full?  push back until pusher() has made room */
 	if (nextw == viu->viu_read) {
-		return;
+		if (!viu->viu_stalled) {
+			viu->viu_stalled = 1;
+			viu->viu_nstalls++;
+		}
+		return EAGAIN;
 	}
 
-	if (dlen > MAXPKT) {
-		printk("myrecv: pkt len %d too big\n", dlen);
-		return;
+	pkt = &viu->viu_pkts[viu->viu_write];
+	if (flags & NETFRONT_RXF_COPY) {
+		memcpy(pkt->pkt_copy, data, dlen);
+		pkt->pkt_page = NULL;
+	} else {
+		pkt->pkt_page = page;
+		pkt->pkt_data = data;
 	}
-
-	memcpy(viu->viu_pkts[viu->viu_write].pkt_data, data, dlen);
-	viu->viu_pkts[viu->viu_write].pkt_dlen = dlen;
+	pkt->pkt_dlen = dlen;
+	pkt->pkt_flags = 0;
+	if (flags & NETFRONT_RXF_CSUM_BLANK)
+		pkt->pkt_flags |= VIF_PKT_CSUM_BLANK;
+	if (flags & NETFRONT_RXF_CSUM_VALID)
+		pkt->pkt_flags |= VIF_PKT_CSUM_VALID;
 	viu->viu_write = nextw;
 
 	if (viu->viu_rcvr)
 		wake(viu->viu_rcvr);
+	return 0;
+}
+
+/* Double the rx queue, if the budget allows.  Thread context only. */
+static void
+viu_growqueue(struct virtif_user *viu)
+{
+	struct onepkt *npkts, *opkts;
+	int nsize, n, flags;
+
+	nsize = 2*viu->viu_npkts;
+	if (nsize > viu->viu_maxpkts)
+		nsize = viu->viu_maxpkts;
+	if (nsize <= viu->viu_npkts)
+		return;
+	if ((npkts = malloc(nsize * sizeof(*npkts))) == NULL)
+		return;
+
+	local_irq_save(flags);
+	opkts = viu->viu_pkts;
+	for (n = 0; viu->viu_read != viu->viu_write; n++) {
+		npkts[n] = opkts[viu->viu_read];
+		viu->viu_read = (viu->viu_read+1) % viu->viu_npkts;
+	}
+	viu->viu_pkts = npkts;
+	viu->viu_npkts = nsize;
+	viu->viu_read = 0;
+	viu->viu_write = n;
+	local_irq_restore(flags);
+
+	free(opkts);
 }
 
+/*
+ * Pass the netfront error counts accumulated since the last call on
+ * to the interface.  Call with the rump kernel scheduled.
+ */
+static void
+viu_syncstats(struct virtif_user *viu)
+{
+	struct netfront_stats st;
+	struct vif_stats vs;
+
+	netfront_get_stats(viu->viu_dev, &st);
+	vs.vs_ierrors = st.rx_errors - viu->viu_stats.rx_errors;
+	vs.vs_iqdrops = 0;
+	vs.vs_oerrors = (st.tx_errors - viu->viu_stats.tx_errors)
+	    + (st.tx_dropped - viu->viu_stats.tx_dropped);
+	viu->viu_stats = st;
+	if (vs.vs_ierrors || vs.vs_oerrors)
+		rump_virtif_stats(viu->viu_vifsc, &vs);
+}
+
+/*
+ * Deliver packets in bursts of up to PUSH_BURST under a single
+ * rump kernel schedule, like the DPDK receiver does.
+ */
+#define PUSH_BURST 16
 static void
 pusher(void *arg)
 {
 	struct virtif_user *viu = arg;
-	struct iovec iov;
-	struct onepkt *mypkt;
+	struct onepkt mypkts[PUSH_BURST];
 	struct thread *me;
-	int flags;
-
-	mypkt = malloc(sizeof(*mypkt));
+	int flags, i, n, stalled;
 
 	/* give us a rump kernel context */
 	rumpuser__hyp.hyp_schedule();
@@ -119,47 +211,435 @@ pusher(void *arg)
 			local_irq_save(flags);
 			viu->viu_rcvr = NULL;
 		}
-		*mypkt = viu->viu_pkts[viu->viu_read];
+		for (n = 0; n < PUSH_BURST && viu->viu_read != viu->viu_write;
+		    n++) {
+			mypkts[n] = viu->viu_pkts[viu->viu_read];
+			viu->viu_read = (viu->viu_read+1) % viu->viu_npkts;
+		}
+		stalled = viu->viu_stalled;
+		viu->viu_stalled = 0;
 		local_irq_restore(flags);
 
-		iov.iov_base = mypkt->pkt_data;
-		iov.iov_len =  mypkt->pkt_dlen;
+		if (stalled)
+			viu_growqueue(viu);
 
 		rumpuser__hyp.hyp_schedule();
-		rump_virtif_pktdeliver(viu->viu_vifsc, &iov, 1);
+		for (i = 0; i < n; i++) {
+			struct onepkt *pkt = &mypkts[i];
+			struct iovec iov;
+
+			if (pkt->pkt_page == NULL) {
+				iov.iov_base = pkt->pkt_copy;
+				iov.iov_len = pkt->pkt_dlen;
+				rump_virtif_pktdeliver(viu->viu_vifsc,
+				    &iov, 1, pkt->pkt_flags);
+				continue;
+			}
+			rump_virtif_pktdeliver_ext(viu->viu_vifsc,
+			    pkt->pkt_page, PAGE_SIZE,
+			    pkt->pkt_data - (unsigned char *)pkt->pkt_page,
+			    pkt->pkt_dlen, pkt->pkt_flags);
+		}
+		viu_syncstats(viu);
 		rumpuser__hyp.hyp_unschedule();
 
+		/*
+		 * take refused frames and top starved rings up.  queues
+		 * still being polled are left alone, so as not to undo
+		 * the poll delay.
+		 */
+		netfront_rx_resume(viu->viu_dev);
+
 		local_irq_save(flags);
-		viu->viu_read = (viu->viu_read+1) % NBUF;
 	}
 	local_irq_restore(flags);
 }
 
+/*
+ * Pick a transmit queue so that all packets of one flow stay in
+ * order on the same ring.  IPv4 TCP and UDP hash on addresses and
+ * ports, other IPv4 on addresses, everything else goes to queue 0.
+ */
+#define TXQ_HDRLEN (14 + 60 + 4)
+static int
+viu_txqueue(struct virtif_user *viu, const struct iovec *iov, size_t iovlen)
+{
+	uint8_t pkt[TXQ_HDRLEN];
+	const uint8_t *ip;
+	uint32_t hash;
+	size_t i, len, n;
+	int nqueues, hlen;
+
+	nqueues = netfront_num_queues(viu->viu_dev);
+	if (nqueues == 1)
+		return 0;
+
+	/* the headers may be spread over several mbufs */
+	for (i = 0, len = 0; i < iovlen && len < sizeof(pkt); i++) {
+		n = iov[i].iov_len;
+		if (n > sizeof(pkt) - len)
+			n = sizeof(pkt) - len;
+		memcpy(pkt + len, iov[i].iov_base, n);
+		len += n;
+	}
+
+	/* ethernet header, then IPv4 */
+	if (len < 14 + 20 || pkt[12] != 0x08 || pkt[13] != 0x00)
+		return 0;
+	ip = pkt + 14;
+	hlen = (ip[0] & 0x0f) << 2;
+
+	hash = (ip[12]<<24 | ip[13]<<16 | ip[14]<<8 | ip[15])
+	    ^ (ip[16]<<24 | ip[17]<<16 | ip[18]<<8 | ip[19]);
+	if ((ip[9] == 6 || ip[9] == 17) && len >= 14 + hlen + 4
+	    && (ip[6] & 0x3f) == 0 && ip[7] == 0) {
+		/* unfragmented only, so all fragments hash alike */
+		hash ^= ip[hlen]<<24 | ip[hlen+1]<<16
+		    | ip[hlen+2]<<8 | ip[hlen+3];
+	}
+	hash ^= hash >> 16;
+	hash ^= hash >> 8;
+
+	return hash % nqueues;
+}
+
+#define VIF_MAX 0x100	/* the cloner doesn't go any higher */
+
+/*
+ * Static addresses.  The toolstack puts a vif's address in the
+ * backend's ip node (ip= in the vif spec, possibly several separated
+ * by spaces, possibly with a /prefix), netfront reads it while
+ * connecting.  netmask and gateway nodes next to it are optional; the
+ * mask then comes from the prefix, or is a /24.
+ */
+static struct vif_ipconf {
+	char *vic_ip;
+	char *vic_mask;
+	char *vic_gw;
+} vif_ipconf[VIF_MAX];
+
+static void
+vif_ipconf_read(int devnum, const char *backend, char *ip)
+{
+	struct vif_ipconf *vic = &vif_ipconf[devnum];
+	char path[64], *msg;
+
+	free(vic->vic_ip);
+	free(vic->vic_mask);
+	free(vic->vic_gw);
+	vic->vic_ip = ip;
+	vic->vic_mask = vic->vic_gw = NULL;
+	if (ip == NULL)
+		return;
+
+	snprintf(path, sizeof(path), "%s/netmask", backend);
+	if ((msg = xenbus_read(XBT_NIL, path, &vic->vic_mask)) != NULL) {
+		free(msg);
+		vic->vic_mask = NULL;
+	}
+	snprintf(path, sizeof(path), "%s/gateway", backend);
+	if ((msg = xenbus_read(XBT_NIL, path, &vic->vic_gw)) != NULL) {
+		free(msg);
+		vic->vic_gw = NULL;
+	}
+}
+
+/*
+ * Configure xenif<devnum> from xenstore.  Returns ENOENT if there is
+ * no address to configure, for instance to go for DHCP instead.
+ * Called by the application once the interface exists, outside the
+ * rump kernel.
+ */
 int
-VIFHYPER_CREATE(int devnum, struct virtif_sc *vif_sc, uint8_t *enaddr,
-	struct virtif_user **viup)
+rumpuser_vif_ipconfig(int devnum)
 {
-	struct virtif_user *viu = NULL;
-	int rv, nlocks;
+	struct vif_ipconf *vic;
+	char ifname[16], addr[32], mask[16], *p;
+	unsigned long prefix = 24, m;
+	int rv;
+
+	if (devnum < 0 || devnum >= VIF_MAX
+	    || (vic = &vif_ipconf[devnum])->vic_ip == NULL)
+		return ENOENT;
+
+	/* the first address, if more than one */
+	snprintf(addr, sizeof(addr), "%s", vic->vic_ip);
+	addr[strcspn(addr, " \t")] = '\0';
+	if ((p = strchr(addr, '/')) != NULL) {
+		*p++ = '\0';
+		prefix = strtoul(p, NULL, 10);
+		if (prefix > 32)
+			prefix = 32;
+	}
+	if (addr[0] == '\0')
+		return ENOENT;
+	if (vic->vic_mask) {
+		snprintf(mask, sizeof(mask), "%s", vic->vic_mask);
+	} else {
+		m = prefix ? 0xffffffffUL << (32 - prefix) : 0;
+		snprintf(mask, sizeof(mask), "%lu.%lu.%lu.%lu",
+		    (m >> 24) & 0xff, (m >> 16) & 0xff, (m >> 8) & 0xff,
+		    m & 0xff);
+	}
 
-	rumpkern_unsched(&nlocks, NULL);
+	snprintf(ifname, sizeof(ifname), "xenif%d", devnum);
+	if ((rv = rump_pub_netconfig_ipv4_ifaddr(ifname, addr, mask)) != 0) {
+		printk("xenif: %s address %s/%s: %d\n", ifname, addr, mask, rv);
+		return rv;
+	}
+	printk("xenif: %s %s netmask %s\n", ifname, addr, mask);
+	if (vic->vic_gw && vic->vic_gw[0]) {
+		if ((rv = rump_pub_netconfig_ipv4_gw(vic->vic_gw)) != 0)
+			printk("xenif: gateway %s: %d\n", vic->vic_gw, rv);
+		else
+			printk("xenif: default route via %s\n", vic->vic_gw);
+	}
+	return rv;
+}
+
+/*
+ * Vif hotplug.  Once the first interface is created, device/vif is
+ * watched, and every vif showing up after that gets a xenif<n> in
+ * the rump kernel, with its address if xenstore has one.  Otherwise
+ * configuring it is up to the application, which learns about it
+ * like about any other new interface.  Vifs present when the watch
+ * starts are left for the application to create.
+ */
+static uint8_t vif_known[VIF_MAX/8];
+
+static void
+vif_scan(int announce)
+{
+	char **dirs, *msg, name[16];
+	int i, n, rv;
+
+	if ((msg = xenbus_ls(XBT_NIL, "device/vif", &dirs)) != NULL) {
+		free(msg);
+		return;
+	}
+	for (i = 0; dirs[i]; i++) {
+		n = atoi(dirs[i]);
+		free(dirs[i]);
+		if (n < 0 || n >= VIF_MAX || (vif_known[n/8] & (1<<(n%8))))
+			continue;
+		vif_known[n/8] |= 1<<(n%8);
+		if (!announce)
+			continue;
+
+		snprintf(name, sizeof(name), "xenif%d", n);
+		if ((rv = rump_pub_netconfig_ifcreate(name)) != 0) {
+			printk("xenif: hotplugging %s failed: %d\n", name, rv);
+		} else {
+			printk("xenif: hotplugged %s\n", name);
+			rumpuser_vif_ipconfig(n);
+		}
+	}
+	free(dirs);
+}
+
+static void
+vif_watcher(void *arg)
+{
+	struct xenbus_event_queue events;
+
+	xenbus_event_queue_init(&events);
+	xenbus_watch_path_token(XBT_NIL, "device/vif", "vif-hotplug", &events);
+	for (;;) {
+		xenbus_wait_for_watch(&events);
+		vif_scan(1);
+	}
+}
+
+static void
+vif_hotplug_init(int devnum)
+{
+	static int inited;
+
+	if (inited)
+		return;
+	inited = 1;
+
+	vif_scan(0);
+	/* the one being created counts as known even if it isn't there */
+	if (devnum < VIF_MAX)
+		vif_known[devnum/8] |= 1<<(devnum%8);
+	create_thread("xenifhp", NULL, vif_watcher, NULL, NULL);
+}
+
+/*
+ * Bring up device/vif/<devnum>, with the MAC address going to
+ * viu_enaddr.  Returns an errno.
+ */
+static int
+viu_attach(int devnum, struct virtif_user **viup)
+{
+	struct virtif_user *viu;
+	char nodename[32], path[64], *msg, *backend, *ip = NULL;
+	int copybreak;
+
+	/* xenif<n> is device/vif/<n> */
+	snprintf(nodename, sizeof(nodename), "device/vif/%d", devnum);
+	snprintf(path, sizeof(path), "%s/backend", nodename);
+	if ((msg = xenbus_read(XBT_NIL, path, &backend)) != NULL) {
+		free(msg);
+		return ENXIO;
+	}
 
 	viu = malloc(sizeof(*viu));
 	if (viu == NULL) {
-		rv = ENOMEM;
-		goto out;
+		free(backend);
+		return ENOMEM;
 	}
 	memset(viu, 0, sizeof(*viu));
-	viu->viu_vifsc = vif_sc;
 
-	viu->viu_dev = init_netfront(NULL, myrecv, enaddr, NULL, viu);
+	viu->viu_maxpkts = rumpuser_getparam_num("RUMP_XENIF_RXBUDGET",
+	    RXBUDGET_DEFAULT) / PAGE_SIZE;
+	viu->viu_npkts = rumpuser_getparam_num("RUMP_XENIF_RXQUEUE",
+	    RXQUEUE_DEFAULT);
+	if (viu->viu_npkts < 2)
+		viu->viu_npkts = 2;
+	if (viu->viu_maxpkts < viu->viu_npkts)
+		viu->viu_maxpkts = viu->viu_npkts;
+	viu->viu_pkts = malloc(viu->viu_npkts * sizeof(*viu->viu_pkts));
+	if (viu->viu_pkts == NULL) {
+		free(viu);
+		free(backend);
+		return ENOMEM;
+	}
+
+	viu->viu_dev = init_netfront(nodename, myrecv, viu->viu_enaddr,
+	    &ip, viu);
 	if (!viu->viu_dev) {
-		rv = EINVAL; /* ? */
+		free(viu->viu_pkts);
 		free(viu);
+		free(backend);
+		return EINVAL; /* ? */
+	}
+	vif_ipconf_read(devnum, backend, ip);
+	free(backend);
+	/* pages the queue may pin on top of the rings */
+	netfront_set_rx_budget(viu->viu_dev, viu->viu_maxpkts);
+	netfront_set_rx_cache(viu->viu_dev,
+	    rumpuser_getparam_num("RUMP_XENIF_RXCACHE", RXCACHE_DEFAULT));
+	copybreak = rumpuser_getparam_num("RUMP_XENIF_RXCOPYBREAK", 0);
+	if (copybreak > RXCOPYBREAK_MAX)
+		copybreak = RXCOPYBREAK_MAX;
+	netfront_set_rx_copybreak(viu->viu_dev, copybreak);
+	/* responses per polling round, microseconds between busy rounds */
+	netfront_set_rx_poll(viu->viu_dev,
+	    rumpuser_getparam_num("RUMP_XENIF_POLLBUDGET",
+	    NETFRONT_POLL_BUDGET),
+	    rumpuser_getparam_num("RUMP_XENIF_POLLDELAY", 0));
+
+	*viup = viu;
+	return 0;
+}
+
+/* no device/vif/<devnum>, but maybe a vchan to another domain */
+static int
+viu_attach_vchan(int devnum, struct virtif_sc *vif_sc,
+	struct virtif_user **viup)
+{
+	struct virtif_user *viu;
+	int rv;
+
+	viu = malloc(sizeof(*viu));
+	if (viu == NULL)
+		return ENOMEM;
+	memset(viu, 0, sizeof(*viu));
+	viu->viu_vifsc = vif_sc;
+	rv = vchanif_attach(devnum, vif_sc, viu->viu_enaddr, &viu->viu_vchan);
+	if (rv != 0) {
+		free(viu);
+		return rv;
+	}
+
+	*viup = viu;
+	return 0;
+}
+
+/*
+ * Attach ahead.  rumpuser_init() brings every vif present at boot up
+ * in a thread of its own, so that the backend handshakes overlap
+ * each other and the rump kernel bootstrap.  VIFHYPER_CREATE() then
+ * claims the device, waiting for the handshake if need be.  Frames
+ * arriving before that wait in viu_pkts; once it is full, netfront
+ * holds them back until pusher() starts.
+ */
+static struct vif_early {
+	struct virtif_user *ve_viu;
+	int ve_attaching;
+} vif_early[VIF_MAX];
+static DECLARE_WAIT_QUEUE_HEAD(vif_early_wq);
+
+static void
+vif_attach_early(void *arg)
+{
+	struct vif_early *ve = arg;
+
+	if (viu_attach(ve - vif_early, &ve->ve_viu) != 0)
+		ve->ve_viu = NULL;
+	boot_mark("vif %d %s", (int)(ve - vif_early),
+	    ve->ve_viu ? "attached" : "failed");
+	ve->ve_attaching = 0;
+	wake_up(&vif_early_wq);
+}
+
+void
+rumpuser_vif_attach_all(void)
+{
+	struct vif_early *ve;
+	char **dirs, *msg;
+	int i, n;
+
+	if ((msg = xenbus_ls(XBT_NIL, "device/vif", &dirs)) != NULL) {
+		free(msg);
+		return;
+	}
+	for (i = 0; dirs[i]; i++) {
+		n = atoi(dirs[i]);
+		free(dirs[i]);
+		if (n < 0 || n >= VIF_MAX)
+			continue;
+		ve = &vif_early[n];
+		ve->ve_attaching = 1;
+		if (create_thread("xenifat", NULL, vif_attach_early, ve,
+		    NULL) == NULL)
+			ve->ve_attaching = 0;
+	}
+	free(dirs);
+}
+
+int
+VIFHYPER_CREATE(int devnum, struct virtif_sc *vif_sc, uint8_t *enaddr,
+	struct virtif_user **viup)
+{
+	struct virtif_user *viu = NULL;
+	int rv, nlocks;
+
+	rumpkern_unsched(&nlocks, NULL);
+
+	vif_hotplug_init(devnum);
+
+	if (devnum < VIF_MAX) {
+		wait_event(vif_early_wq, !vif_early[devnum].ve_attaching);
+		viu = vif_early[devnum].ve_viu;
+		vif_early[devnum].ve_viu = NULL;
+	}
+	/* not attached ahead, or that failed */
+	if (viu == NULL && (rv = viu_attach(devnum, &viu)) != 0) {
+		viu = NULL;
+		if (rv != ENXIO
+		    || (rv = viu_attach_vchan(devnum, vif_sc, &viu)) != 0)
+			goto out;
+		memcpy(enaddr, viu->viu_enaddr, sizeof(viu->viu_enaddr));
 		goto out;
 	}
+	viu->viu_vifsc = vif_sc;
+	memcpy(enaddr, viu->viu_enaddr, sizeof(viu->viu_enaddr));
 
-	if (create_thread("xenifp", NULL, pusher, viu, NULL) == NULL) {
+	if (create_thread_prio("xenifp", NULL, THREAD_PRIO_DRIVER,
+	    pusher, viu, NULL) == NULL) {
 		printk("fatal thread creation failure\n"); /* XXX */
 		do_exit();
 	}
@@ -173,46 +653,87 @@ VIFHYPER_CREATE(int devnum, struct virtif_sc *vif_sc, uint8_t *enaddr,
 	return rv;
 }
 
+int
+VIFHYPER_OFFLOAD(struct virtif_user *viu)
+{
+	int features, rv = 0;
+
+	if (viu->viu_vchan)
+		return VIF_OFFLOAD_CSUM;
+	features = netfront_features(viu->viu_dev);
+	if (features & NETFRONT_F_CSUM)
+		rv |= VIF_OFFLOAD_CSUM;
+	if (features & NETFRONT_F_GSO_TCPV4)
+		rv |= VIF_OFFLOAD_TSO4;
+	return rv;
+}
+
+/*
+ * Queue the whole batch, then push each tx queue it touched once,
+ * so that the backend gets one notification per batch and queue.
+ */
 void
-VIFHYPER_SEND(struct virtif_user *viu,
-	struct iovec *iov, size_t iovlen)
+VIFHYPER_SEND(struct virtif_user *viu, struct vif_pkt *pkts, int npkts)
 {
-	size_t tlen, i;
-	int nlocks;
-	void *d;
-	char *d0;
+	struct vif_pkt *vp;
+	unsigned touched = 0;
+	int nlocks, i, q, txflags;
 
-	rumpkern_unsched(&nlocks, NULL);
-	/*
-	 * netfront doesn't do scatter-gather, so just simply
-	 * copy the data into one lump here.
-	 */
-	if (iovlen == 1) {
-		d = iov->iov_base;
-		tlen = iov->iov_len;
-	} else {
-		for (i = 0, tlen = 0; i < iovlen; i++) {
-			tlen += iov[i].iov_len;
-		}
-		d = d0 = malloc(tlen);
-		for (i = 0; i < iovlen; i++) {
-			memcpy(d0, iov[i].iov_base, iov[i].iov_len);
-			d0 += iov[i].iov_len;
-		}
+	if (viu->viu_vchan) {
+		vchanif_send(viu->viu_vchan, pkts, npkts);
+		return;
 	}
 
-	netfront_xmit(viu->viu_dev, d, tlen);
+	rumpkern_unsched(&nlocks, NULL);
+	for (i = 0; i < npkts; i++) {
+		vp = &pkts[i];
+		txflags = NETFRONT_TXF_MORE;
+		if (vp->vp_flags & VIF_PKT_CSUM_BLANK)
+			txflags |= NETFRONT_TXF_CSUM_BLANK;
+		if (vp->vp_flags & VIF_PKT_TSO4)
+			txflags |= NETFRONT_TXF_GSO_TCPV4;
+
+		/* netfront gathers the chain straight into the tx pages */
+		q = viu_txqueue(viu, vp->vp_iov, vp->vp_iovlen);
+		netfront_xmit_iov(viu->viu_dev, q,
+		    vp->vp_iov, vp->vp_iovlen, txflags, vp->vp_segsz);
+		touched |= 1U << q;
+	}
+	for (q = 0; touched; q++, touched >>= 1)
+		if (touched & 1)
+			netfront_xmit_flush(viu->viu_dev, q);
+	rumpkern_sched(nlocks, NULL);
+	viu_syncstats(viu);
+}
 
-	if (iovlen != 1)
-		free(d);
+/*
+ * Called by the rump kernel when an mbuf holding a page loaned
+ * by pusher() is freed.  Does not block, so no need to unschedule.
+ */
+void
+VIFHYPER_RXFREE(struct virtif_user *viu, void *buf)
+{
 
-	rumpkern_sched(nlocks, NULL);
+	netfront_rxpage_put(viu->viu_dev, buf);
 }
 
 void
 VIFHYPER_DYING(struct virtif_user *viu)
 {
 
+	struct netfront_stats st;
+
+	if (viu->viu_vchan) {
+		vchanif_dying(viu->viu_vchan);
+		return;
+	}
+	if (viu->viu_nstalls)
+		printk("xenif: rx queue of %d filled up %llu times\n",
+		    viu->viu_npkts, (unsigned long long)viu->viu_nstalls);
+	netfront_get_stats(viu->viu_dev, &st);
+	if (st.tx_stalls)
+		printk("xenif: waited for tx ring slots %llu times\n",
+		    (unsigned long long)st.tx_stalls);
 	/* the train is always leavin' */
 }
 
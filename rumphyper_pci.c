@@ -29,39 +29,188 @@
 #include <mini-os/events.h>
 #include <mini-os/mm.h>
 #include <mini-os/hypervisor.h>
+#include <mini-os/sched.h>
+#include <mini-os/kernel.h>
 
 #include "rumpsrc/sys/rump/dev/lib/libpci/pci_user.h" /* XXX */
 
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h> /* for malloc */
 
-void *
-rumpcomp_pci_map(unsigned long addr, unsigned long len)
+#include "rumphyper.h"
+
+
+/*
+ * Shadow of the config header registers which only change when we
+ * write them: IDs, class, BARs, subsystem, ROM, capability pointer
+ * and interrupt line/pin.  Command/status, BIST and everything past
+ * the header go to pciback every time.  A write invalidates the
+ * register it hits, so BAR sizing reads back what the device says.
+ *
+ * pciif carries one register per op, so there is nothing to batch
+ * reads into, it's the shadow that saves the round trips.
+ */
+#define PCICACHE_NDEV 16
+#define PCICACHE_NREG 16	/* dwords, i.e. the type 0 header */
+#define PCICACHE_STATIC \
+    ((1<<0) | (1<<2) | (0x3f<<4) | (1<<11) | (1<<12) | (1<<13) | (1<<15))
+static struct pcicache {
+	unsigned pc_bus, pc_dev, pc_fun;
+	int pc_used;
+	uint32_t pc_valid;
+	uint32_t pc_val[PCICACHE_NREG];
+} pcicache[PCICACHE_NDEV];
+
+static struct pcicache *
+pcicache_lookup(unsigned bus, unsigned dev, unsigned fun, int create)
 {
+	struct pcicache *pc, *freepc = NULL;
+	int i;
 
-	return ioremap_nocache(addr, len);
+	for (i = 0; i < PCICACHE_NDEV; i++) {
+		pc = &pcicache[i];
+		if (!pc->pc_used) {
+			if (freepc == NULL)
+				freepc = pc;
+			continue;
+		}
+		if (pc->pc_bus == bus && pc->pc_dev == dev && pc->pc_fun == fun)
+			return pc;
+	}
+	if (!create || (pc = freepc) == NULL)
+		return NULL;
+	pc->pc_bus = bus;
+	pc->pc_dev = dev;
+	pc->pc_fun = fun;
+	pc->pc_valid = 0;
+	pc->pc_used = 1;
+	return pc;
 }
 
 int
 rumpcomp_pci_confread(unsigned bus, unsigned dev, unsigned fun,
 	int reg, unsigned int *rv)
 {
+	struct pcicache *pc = NULL;
+	int idx = reg >> 2, rc;
+
+	if ((reg & 3) == 0 && idx < PCICACHE_NREG
+	    && (PCICACHE_STATIC & (1<<idx))) {
+		pc = pcicache_lookup(bus, dev, fun, 1);
+		if (pc && (pc->pc_valid & (1<<idx))) {
+			*rv = pc->pc_val[idx];
+			return 0;
+		}
+	}
 
-	return pcifront_conf_read(NULL, 0, bus, dev, fun, reg, 4, rv);
+	rc = pcifront_conf_read(NULL, 0, bus, dev, fun, reg, 4, rv);
+	if (rc == 0 && pc) {
+		pc->pc_val[idx] = *rv;
+		pc->pc_valid |= 1<<idx;
+	}
+	return rc;
 }
 
 int
 rumpcomp_pci_confwrite(unsigned bus, unsigned dev, unsigned fun,
 	int reg, unsigned int v)
 {
+	struct pcicache *pc;
+	int idx = reg >> 2;
+
+	if (idx < PCICACHE_NREG
+	    && (pc = pcicache_lookup(bus, dev, fun, 0)) != NULL)
+		pc->pc_valid &= ~(1<<idx);
 
 	return pcifront_conf_write(NULL, 0, bus, dev, fun, reg, 4, v);
 }
 
+/* Is addr the start of a prefetchable memory BAR seen in the shadow? */
+static int
+pci_bar_prefetchable(unsigned long addr)
+{
+	struct pcicache *pc;
+	uint64_t base;
+	uint32_t bar;
+	int i, idx;
+
+	for (i = 0; i < PCICACHE_NDEV; i++) {
+		pc = &pcicache[i];
+		if (!pc->pc_used)
+			continue;
+		for (idx = 4; idx <= 9; idx++) {
+			if ((pc->pc_valid & (1<<idx)) == 0)
+				continue;
+			bar = pc->pc_val[idx];
+			if (bar & 1)		/* I/O space */
+				continue;
+			base = bar & ~0xfU;
+			if ((bar & 6) == 4 && idx < 9) {	/* 64 bit */
+				idx++;
+				if (pc->pc_valid & (1<<idx))
+					base |= (uint64_t)pc->pc_val[idx] << 32;
+			}
+			if (base == addr)
+				return (bar & 8) != 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * BARs are mapped uncached.  With RUMP_PCI_WC=1, prefetchable memory
+ * BARs are mapped write-combining instead.  Bus code which knows
+ * better can pick per BAR with rumpcomp_pci_map_wc().
+ */
+static int pci_wc = -1;
+
+void *
+rumpcomp_pci_map(unsigned long addr, unsigned long len)
+{
+	char buf[8];
+
+	if (pci_wc == -1)
+		pci_wc = rumpuser_getparam("RUMP_PCI_WC", buf, sizeof(buf)) == 0
+		    && buf[0] == '1';
+	if (pci_wc && pci_bar_prefetchable(addr))
+		return ioremap_wc(addr, len);
+	return ioremap_nocache(addr, len);
+}
+
+/* Map write-combining.  For prefetchable memory BARs only. */
+void *rumpcomp_pci_map_wc(unsigned long, unsigned long);
+void *
+rumpcomp_pci_map_wc(unsigned long addr, unsigned long len)
+{
+
+	return ioremap_wc(addr, len);
+}
+
+/*
+ * Interrupt routes recorded by rumpcomp_pci_irq_map(), one per
+ * device function, found again by cookie when the driver establishes
+ * its handler.
+ */
+#define NINTRMAP 16
+static struct intrmap {
+	unsigned im_cookie;
+	unsigned im_bus, im_dev, im_fun;
+	int im_intrline;
+	int im_used;
+} intrmaps[NINTRMAP];
+
+/*
+ * The event handler only masks the port and wakes the handler's
+ * interrupt thread, which runs the driver's handler with a rump
+ * kernel context of its own and then unmasks.
+ */
 struct ihandler {
 	int (*i_handler)(void *);
 	void *i_data;
 	evtchn_port_t i_prt;
+	struct thread *i_thread;
+	int i_pending;
 };
 
 static void
@@ -69,22 +218,66 @@ hyperhandler(evtchn_port_t prt, struct pt_regs *regs, void *data)
 {
 	struct ihandler *ihan = data;
 
-	/* XXX: not correct, might not even have rump kernel context now */
-	ihan->i_handler(ihan->i_data);
+	mask_evtchn(prt);
+	ihan->i_pending = 1;
+	wake(ihan->i_thread);
 }
 
-/* XXXXX */
-static int myintr;
-static unsigned mycookie;
+static void
+intrthread(void *arg)
+{
+	struct ihandler *ihan = arg;
+	int flags, dummy;
+
+	rumpuser__hyp.hyp_schedule();
+	rumpuser__hyp.hyp_lwproc_newlwp(0);
+	rumpuser__hyp.hyp_unschedule();
+
+	local_irq_save(flags);
+	for (;;) {
+		while (!ihan->i_pending) {
+			block(ihan->i_thread);
+			local_irq_restore(flags);
+			schedule();
+			local_irq_save(flags);
+		}
+		ihan->i_pending = 0;
+		local_irq_restore(flags);
+
+		rumpkern_sched(0, NULL);
+		ihan->i_handler(ihan->i_data);
+		rumpkern_unsched(&dummy, NULL);
+		unmask_evtchn(ihan->i_prt);
+
+		local_irq_save(flags);
+	}
+}
 
 int
 rumpcomp_pci_irq_map(unsigned bus, unsigned device, unsigned fun,
 	int intrline, unsigned cookie)
 {
+	struct intrmap *im, *freeim = NULL;
+	int i;
 
-	/* XXX */
-	myintr = intrline;
-	mycookie = cookie;
+	for (i = 0; i < NINTRMAP; i++) {
+		im = &intrmaps[i];
+		if (im->im_used && im->im_cookie == cookie)
+			break;
+		if (!im->im_used && freeim == NULL)
+			freeim = im;
+	}
+	if (i == NINTRMAP) {
+		if ((im = freeim) == NULL)
+			return ENOSPC;
+	}
+
+	im->im_cookie = cookie;
+	im->im_bus = bus;
+	im->im_dev = device;
+	im->im_fun = fun;
+	im->im_intrline = intrline;
+	im->im_used = 1;
 
 	return 0;
 }
@@ -92,53 +285,151 @@ rumpcomp_pci_irq_map(unsigned bus, unsigned device, unsigned fun,
 void *
 rumpcomp_pci_irq_establish(unsigned cookie, int (*handler)(void *), void *data)
 {
+	struct intrmap *im;
 	struct ihandler *ihan;
 	evtchn_port_t prt;
-	int pirq;
+	int pirq, share, i, nlocks;
 
-	if (cookie != mycookie)
+	for (i = 0; i < NINTRMAP; i++) {
+		im = &intrmaps[i];
+		if (im->im_used && im->im_cookie == cookie)
+			break;
+	}
+	if (i == NINTRMAP)
 		return NULL;
-	pirq = myintr;
 
 	ihan = malloc(sizeof(*ihan));
 	if (!ihan)
 		return NULL;
 	ihan->i_handler = handler;
 	ihan->i_data = data;
+	ihan->i_pending = 0;
 
-	prt = bind_pirq(pirq, 1, hyperhandler, ihan);
-	unmask_evtchn(prt);
+	rumpkern_unsched(&nlocks, NULL);
+
+	/*
+	 * Prefer MSI, which gives the function a vector of its own.
+	 * Legacy drivers don't notice, their handler runs the same.
+	 * Otherwise use the shared INTx line.
+	 */
+	pirq = pcifront_enable_msi(NULL, 0,
+	    im->im_bus, im->im_dev, im->im_fun);
+	share = 0;
+	if (pirq <= 0) {
+		pirq = im->im_intrline;
+		share = 1;
+	}
+
+	/* the port comes up masked, so no event before the thread exists */
+	prt = bind_pirq(pirq, share, hyperhandler, ihan);
+	if (prt == (evtchn_port_t)-1) {
+		rumpkern_sched(nlocks, NULL);
+		free(ihan);
+		return NULL;
+	}
 	ihan->i_prt = prt;
+	/* pirqs aren't bound again after a restore, and never unbound */
+	kernel_suspend_hold();
+	ihan->i_thread = create_thread_prio("pciintr", NULL,
+	    THREAD_PRIO_DRIVER, intrthread, ihan, NULL);
+	unmask_evtchn(prt);
+
+	rumpkern_sched(nlocks, NULL);
 
 	return ihan;
 }
 
+/*
+ * Buffers smaller than a page are carved out of single pages, which
+ * are machine contiguous as they are.  Descriptors and small rx
+ * buffers thus don't cost a page, or an exchange hypercall, each.
+ * The interface has no free, so carving only goes one way.
+ */
+static unsigned long dmapool_va;
+static size_t dmapool_left;
+
+static unsigned long
+dmapool_alloc(size_t size, size_t align)
+{
+	unsigned long va;
+	size_t pad;
+
+	if (align == 0)
+		align = sizeof(long);
+	pad = dmapool_left ? (align - (dmapool_va & (align-1))) & (align-1) : 0;
+	if (dmapool_left < pad + size) {
+		if ((dmapool_va = alloc_page()) == 0)
+			return 0;
+		dmapool_left = PAGE_SIZE;
+		pad = 0;
+	}
+	va = dmapool_va + pad;
+	dmapool_va = va + size;
+	dmapool_left -= pad + size;
+	return va;
+}
+
 int
 rumpcomp_pci_dmalloc(size_t size, size_t align,
 	unsigned long *pap, unsigned long *vap)
 {
 	unsigned long va;
-	int i;
+	int order;
 
-	for (i = 0; size >> (i + PAGE_SHIFT); i++)
-		continue;
-
-	va = alloc_contig_pages(i, 0); /* XXX: MD interface */
+	/* alignment is a power of two, at most a page for the pool */
+	if (size < PAGE_SIZE && align <= PAGE_SIZE/2) {
+		va = dmapool_alloc(size, align);
+	} else {
+		/* Xen hands out extents aligned to their order */
+		order = get_order(size > align ? size : align);
+		if (order == 0)
+			va = alloc_page();
+		else
+			va = alloc_contig_pages(order, 0); /* XXX: MD interface */
+	}
+	if (va == 0)
+		return ENOMEM;
 	*vap = (uintptr_t)va;
 	*pap = virt_to_mach(va);
 
 	return 0;
 }
 
+/*
+ * Multi-segment maps put the segments back to back in the demand
+ * mapping area.  All but the last must be whole pages.
+ */
 int
 rumpcomp_pci_dmamem_map(struct rumpcomp_pci_dmaseg *dss, size_t nseg,
 	size_t totlen, void **vap)
 {
+	unsigned long *mfns, npages, n, j;
+	void *va;
+	size_t i;
+
+	if (nseg == 1) {
+		*vap = (void *)dss[0].ds_vacookie;
+		return 0;
+	}
 
-	if (nseg > 1) {
-		return ENOTSUP;
+	npages = 0;
+	for (i = 0; i < nseg; i++) {
+		if ((dss[i].ds_pa & (PAGE_SIZE-1)) != 0
+		    || (i < nseg-1 && (dss[i].ds_len & (PAGE_SIZE-1)) != 0))
+			return ENOTSUP;
+		npages += (dss[i].ds_len + PAGE_SIZE-1) >> PAGE_SHIFT;
 	}
-	*vap = (void *)dss[0].ds_vacookie;
+	if ((mfns = malloc(npages * sizeof(*mfns))) == NULL)
+		return ENOMEM;
+	for (i = 0, n = 0; i < nseg; i++)
+		for (j = 0; j < (dss[i].ds_len + PAGE_SIZE-1) >> PAGE_SHIFT; j++)
+			mfns[n++] = (dss[i].ds_pa >> PAGE_SHIFT) + j;
+
+	va = map_frames_ex(mfns, npages, 1, 0, 1, DOMID_SELF, NULL, L1_PROT);
+	free(mfns);
+	if (va == NULL)
+		return ENOMEM;
+	*vap = va;
 
 	return 0;
 }
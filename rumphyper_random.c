@@ -0,0 +1,216 @@
+/*
+ * rumpuser_getrandom(): a ChaCha20 keystream.  After every request
+ * the key is replaced with keystream nobody has seen, so that output
+ * already handed out can't be worked back from a later copy of the
+ * state.
+ *
+ * The key is seeded in rumpuser_init() from rdseed or rdrand when the
+ * CPU has them, from entropy the toolstack may leave in xenstore as
+ * hex under rump/entropy, and from the clocks.  rdrand is stirred in
+ * again every RANDOM_RESEED bytes.
+ */
+
+#include <mini-os/os.h>
+#include <mini-os/types.h>
+#include <mini-os/console.h>
+#include <mini-os/time.h>
+#include <mini-os/xenbus.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rumphyper.h"
+
+#define RANDOM_RESEED	(1024*1024)
+#define RANDOM_XSPATH	"rump/entropy"
+
+static uint32_t rnd_key[8];
+static size_t rnd_sincereseed;
+static int rnd_hwrand, rnd_hwseed;
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QR(a, b, c, d) do {						\
+	a += b; d ^= a; d = ROTL32(d, 16);				\
+	c += d; b ^= c; b = ROTL32(b, 12);				\
+	a += b; d ^= a; d = ROTL32(d, 8);				\
+	c += d; b ^= c; b = ROTL32(b, 7);				\
+} while (/*CONSTCOND*/0)
+
+/* one 64 byte block, original layout: 64bit counter, 64bit nonce */
+static void
+chacha20_block(const uint32_t key[8], uint64_t ctr, uint64_t nonce,
+	uint32_t out[16])
+{
+	uint32_t x[16];
+	int i;
+
+	out[0] = 0x61707865;
+	out[1] = 0x3320646e;
+	out[2] = 0x79622d32;
+	out[3] = 0x6b206574;
+	for (i = 0; i < 8; i++)
+		out[4+i] = key[i];
+	out[12] = (uint32_t)ctr;
+	out[13] = (uint32_t)(ctr >> 32);
+	out[14] = (uint32_t)nonce;
+	out[15] = (uint32_t)(nonce >> 32);
+
+	memcpy(x, out, sizeof(x));
+	for (i = 0; i < 20; i += 2) {
+		QR(x[0], x[4], x[ 8], x[12]);
+		QR(x[1], x[5], x[ 9], x[13]);
+		QR(x[2], x[6], x[10], x[14]);
+		QR(x[3], x[7], x[11], x[15]);
+		QR(x[0], x[5], x[10], x[15]);
+		QR(x[1], x[6], x[11], x[12]);
+		QR(x[2], x[7], x[ 8], x[13]);
+		QR(x[3], x[4], x[ 9], x[14]);
+	}
+	for (i = 0; i < 16; i++)
+		out[i] += x[i];
+}
+
+/*
+ * Mix seed material into the key, 32 bytes at a time: xor it in and
+ * replace the key with a block of its own keystream.  The nonce keeps
+ * these blocks apart from those handed out.
+ */
+static void
+random_stir(const void *seed, size_t len)
+{
+	const uint8_t *p = seed;
+	uint8_t *k = (uint8_t *)rnd_key;
+	uint32_t blk[16];
+	size_t i, n;
+
+	while (len) {
+		n = len < sizeof(rnd_key) ? len : sizeof(rnd_key);
+		for (i = 0; i < n; i++)
+			k[i] ^= p[i];
+		chacha20_block(rnd_key, 0, ~0ULL, blk);
+		memcpy(rnd_key, blk, sizeof(rnd_key));
+		p += n;
+		len -= n;
+	}
+	memset(blk, 0, sizeof(blk));
+}
+
+/* rdseed may run dry under load, rdrand hardly ever does */
+static int
+random_hw(unsigned long *v)
+{
+	int i;
+
+	for (i = 0; i < 10; i++) {
+		if (rnd_hwseed && rdseed_long(v))
+			return 1;
+		if (rnd_hwrand && rdrand_long(v))
+			return 1;
+	}
+	return 0;
+}
+
+static int
+random_xenstore(void)
+{
+	uint8_t seed[64];
+	char *val, *err, hex[3];
+	size_t i, n;
+
+	if ((err = xenbus_read(XBT_NIL, RANDOM_XSPATH, &val)) != NULL) {
+		free(err);
+		return 0;
+	}
+	n = strlen(val) / 2;
+	if (n > sizeof(seed))
+		n = sizeof(seed);
+	hex[2] = '\0';
+	for (i = 0; i < n; i++) {
+		hex[0] = val[2*i];
+		hex[1] = val[2*i+1];
+		seed[i] = strtoul(hex, NULL, 16);
+	}
+	random_stir(seed, n);
+	memset(seed, 0, sizeof(seed));
+	memset(val, 0, strlen(val));
+	free(val);
+
+	/* one use only, ignore failure if the toolstack wants it kept */
+	if ((err = xenbus_rm(XBT_NIL, RANDOM_XSPATH)) != NULL)
+		free(err);
+	return n > 0;
+}
+
+void
+rumpuser_random_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	unsigned long v;
+	uint64_t tsc;
+	s_time_t t;
+	int i, nhw, xs;
+
+	xen_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	rnd_hwrand = !!(ecx & CPUID1_ECX_RDRAND);
+	xen_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+	if (eax >= 7) {
+		xen_cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+		rnd_hwseed = !!(ebx & CPUID7_EBX_RDSEED);
+	}
+
+	for (i = nhw = 0; i < 2*sizeof(rnd_key)/sizeof(v); i++) {
+		if (random_hw(&v)) {
+			random_stir(&v, sizeof(v));
+			nhw++;
+		}
+	}
+	xs = random_xenstore();
+
+	/* not secret, but different every boot */
+	rdtscll(tsc);
+	random_stir(&tsc, sizeof(tsc));
+	t = wallclock();
+	random_stir(&t, sizeof(t));
+	v = 0;
+
+	printk("random: seeded from %s%s%s\n",
+	    nhw ? (rnd_hwseed ? "rdseed " : "rdrand ") : "",
+	    xs ? "xenstore " : "", "clock");
+	if (!nhw && !xs)
+		printk("random: WARNING: no entropy source but the clock\n");
+}
+
+int
+rumpuser_getrandom(void *buf, size_t buflen, int flags, size_t *retp)
+{
+	uint8_t *p = buf;
+	uint32_t blk[16];
+	uint64_t ctr = 0;
+	unsigned long v;
+	size_t n;
+
+	if (rnd_sincereseed >= RANDOM_RESEED) {
+		if (random_hw(&v))
+			random_stir(&v, sizeof(v));
+		rnd_sincereseed = 0;
+	}
+	rnd_sincereseed += buflen;
+
+	for (n = buflen; n >= sizeof(blk); n -= sizeof(blk)) {
+		chacha20_block(rnd_key, ctr++, 0, blk);
+		memcpy(p, blk, sizeof(blk));
+		p += sizeof(blk);
+	}
+	if (n) {
+		chacha20_block(rnd_key, ctr++, 0, blk);
+		memcpy(p, blk, n);
+	}
+
+	/* new key from a block never handed out */
+	chacha20_block(rnd_key, ctr, 0, blk);
+	memcpy(rnd_key, blk, sizeof(rnd_key));
+	memset(blk, 0, sizeof(blk));
+
+	*retp = buflen;
+	return 0;
+}
@@ -35,6 +35,9 @@
 #include <mini-os/types.h>
 #include <mini-os/console.h>
 #include <mini-os/sched.h>
+#ifdef CONFIG_LOCKPROF
+#include <mini-os/trace.h>
+#endif
 
 #include <errno.h>
 #include <stdlib.h>
@@ -71,6 +74,24 @@ wait(struct waithead *wh, uint64_t nsec)
 	return w.onlist ? ETIMEDOUT : 0;
 }
 
+/*
+ * Wait until a handoff takes us off wh.  Unlike with wait(), a stray
+ * wakeup, e.g. from _lwp_unpark(), leaves us queued where we were.
+ */
+static void
+wait_handoff(struct waithead *wh)
+{
+	struct waiter w;
+
+	w.who = get_current();
+	TAILQ_INSERT_TAIL(wh, &w, entries);
+	w.onlist = 1;
+	while (w.onlist) {
+		block(w.who);
+		schedule();
+	}
+}
+
 static void
 wakeup_one(struct waithead *wh)
 {
@@ -132,11 +153,85 @@ rumpuser_thread_join(void *p)
 	return 0;
 }
 
+#ifdef CONFIG_LOCKPROF
+/*
+ * Lock contention profiling.  Every lock records how often it was
+ * taken, how often that meant waiting, and for how long.  The site
+ * is the return address of the init call.  The contended locks are
+ * dumped as the "lockprof" statistics, see stats_register().
+ */
+struct lockprof {
+	LIST_ENTRY(lockprof) lp_entries;
+	const char *lp_type;
+	void *lp_site;
+	uint64_t lp_acquires;
+	uint64_t lp_contended;
+	s_time_t lp_waittime;
+	s_time_t lp_maxwait;
+};
+static LIST_HEAD(, lockprof) lockprofs = LIST_HEAD_INITIALIZER(lockprofs);
+
+static void
+lockprof_init(struct lockprof *lp, const char *type, void *site)
+{
+
+	memset(lp, 0, sizeof(*lp));
+	lp->lp_type = type;
+	lp->lp_site = site;
+	LIST_INSERT_HEAD(&lockprofs, lp, lp_entries);
+}
+
+static void
+lockprof_waited(struct lockprof *lp, s_time_t start)
+{
+	s_time_t waited = NOW() - start;
+
+	lp->lp_contended++;
+	lp->lp_waittime += waited;
+	if (waited > lp->lp_maxwait)
+		lp->lp_maxwait = waited;
+}
+
+void
+rumpuser_lockprof_dump(void)
+{
+	struct lockprof *lp;
+
+	printk("lockprof: type  site  acquires  contended  wait(us)  maxwait(us)\n");
+	LIST_FOREACH(lp, &lockprofs, lp_entries) {
+		if (lp->lp_contended == 0)
+			continue;
+		printk("lockprof: %s %p %llu %llu %llu %llu\n",
+		    lp->lp_type, lp->lp_site,
+		    (unsigned long long)lp->lp_acquires,
+		    (unsigned long long)lp->lp_contended,
+		    (unsigned long long)NSEC_TO_USEC(lp->lp_waittime),
+		    (unsigned long long)NSEC_TO_USEC(lp->lp_maxwait));
+	}
+}
+
+#define LOCKPROF_DECL		struct lockprof lp;
+#define LOCKPROF_INIT(l, type)	\
+	lockprof_init(&(l)->lp, type, __builtin_return_address(0))
+#define LOCKPROF_FINI(l)	LIST_REMOVE(&(l)->lp, lp_entries)
+#define LOCKPROF_ACQUIRED(l)	((l)->lp.lp_acquires++)
+#define LOCKPROF_START(t)	((t) = NOW())
+#define LOCKPROF_WAITED(l, t)	lockprof_waited(&(l)->lp, t)
+#else
+#define LOCKPROF_DECL
+#define LOCKPROF_INIT(l, type)
+#define LOCKPROF_FINI(l)
+#define LOCKPROF_ACQUIRED(l)
+#define LOCKPROF_START(t)	((void)(t))
+#define LOCKPROF_WAITED(l, t)
+#endif
+
 struct rumpuser_mtx {
 	struct waithead waiters;
 	int v;
 	int flags;
 	struct lwp *o;
+	LOCKPROF_DECL
 };
 
 void
@@ -148,9 +243,32 @@ rumpuser_mutex_init(struct rumpuser_mtx **mtxp, int flags)
 	memset(mtx, 0, sizeof(*mtx));
 	mtx->flags = flags;
 	TAILQ_INIT(&mtx->waiters);
+	LOCKPROF_INIT(mtx, "mtx");
 	*mtxp = mtx;
 }
 
+/*
+ * Contended mutexes are handed off: rumpuser_mutex_exit() makes the
+ * first waiter the owner before waking it up, so waiters get the
+ * mutex in FIFO order and can't lose it again to a barging thread.
+ * Must be called unscheduled from the rump kernel.
+ */
+static void
+mutex_enter_blocking(struct rumpuser_mtx *mtx)
+{
+	s_time_t start, tstart;
+
+	if (rumpuser_mutex_tryenter(mtx) == 0)
+		return;
+	LOCKPROF_START(start);
+	tstart = trace_enabled ? NOW() : 0;
+	wait_handoff(&mtx->waiters);
+	assert(mtx->v > 0 && mtx->o == get_current()->lwp);
+	tracepoint(TRACE_LOCK_WAIT, 0, 0, mtx, NOW() - tstart);
+	LOCKPROF_ACQUIRED(mtx);
+	LOCKPROF_WAITED(mtx, start);
+}
+
 void
 rumpuser_mutex_enter(struct rumpuser_mtx *mtx)
 {
@@ -158,8 +276,7 @@ rumpuser_mutex_enter(struct rumpuser_mtx *mtx)
 
 	if (rumpuser_mutex_tryenter(mtx) != 0) {
 		rumpkern_unsched(&nlocks, NULL);
-		while (rumpuser_mutex_tryenter(mtx) != 0)
-			wait(&mtx->waiters, 0);
+		mutex_enter_blocking(mtx);
 		rumpkern_sched(nlocks, NULL);
 	}
 }
@@ -186,6 +303,7 @@ rumpuser_mutex_tryenter(struct rumpuser_mtx *mtx)
 
 	mtx->v++;
 	mtx->o = l;
+	LOCKPROF_ACQUIRED(mtx);
 
 	return 0;
 }
@@ -193,11 +311,19 @@ rumpuser_mutex_tryenter(struct rumpuser_mtx *mtx)
 void
 rumpuser_mutex_exit(struct rumpuser_mtx *mtx)
 {
+	struct waiter *w;
 
 	assert(mtx->v > 0);
 	if (--mtx->v == 0) {
-		mtx->o = NULL;
-		wakeup_one(&mtx->waiters);
+		if ((w = TAILQ_FIRST(&mtx->waiters)) != NULL) {
+			TAILQ_REMOVE(&mtx->waiters, w, entries);
+			w->onlist = 0;
+			mtx->v = 1;
+			mtx->o = w->who->lwp;
+			wake(w->who);
+		} else {
+			mtx->o = NULL;
+		}
 	}
 }
 
@@ -206,6 +332,7 @@ rumpuser_mutex_destroy(struct rumpuser_mtx *mtx)
 {
 
 	assert(TAILQ_EMPTY(&mtx->waiters) && mtx->o == NULL);
+	LOCKPROF_FINI(mtx);
 	free(mtx);
 }
 
@@ -216,11 +343,18 @@ rumpuser_mutex_owner(struct rumpuser_mtx *mtx, struct lwp **lp)
 	*lp = mtx->o;
 }
 
+/*
+ * Writer-preferring rwlocks: readers queue up behind a waiting writer.
+ * Like mutexes, the lock is handed off on release, either to the first
+ * waiting writer or to all waiting readers as a batch, so nobody is
+ * woken up just to find the lock taken again.
+ */
 struct rumpuser_rw {
 	struct waithead rwait;
 	struct waithead wwait;
 	int v;
 	struct lwp *o;
+	LOCKPROF_DECL
 };
 
 void
@@ -232,15 +366,41 @@ rumpuser_rw_init(struct rumpuser_rw **rwp)
 	memset(rw, 0, sizeof(*rw));
 	TAILQ_INIT(&rw->rwait);
 	TAILQ_INIT(&rw->wwait);
+	LOCKPROF_INIT(rw, "rw");
 
 	*rwp = rw;
 }
 
+/* Pass the free lock on to whoever is next in line. */
+static void
+rw_handoff(struct rumpuser_rw *rw)
+{
+	struct waiter *w;
+
+	assert(rw->o == NULL);
+	if (rw->v == 0 && (w = TAILQ_FIRST(&rw->wwait)) != NULL) {
+		TAILQ_REMOVE(&rw->wwait, w, entries);
+		w->onlist = 0;
+		rw->o = w->who->lwp;
+		wake(w->who);
+		return;
+	}
+	if (!TAILQ_EMPTY(&rw->wwait))
+		return;
+	while ((w = TAILQ_FIRST(&rw->rwait)) != NULL) {
+		TAILQ_REMOVE(&rw->rwait, w, entries);
+		w->onlist = 0;
+		rw->v++;
+		wake(w->who);
+	}
+}
+
 void
 rumpuser_rw_enter(int enum_rumprwlock, struct rumpuser_rw *rw)
 {
 	enum rumprwlock lk = enum_rumprwlock;
 	struct waithead *w;
+	s_time_t start;
 	int nlocks;
 
 	switch (lk) {
@@ -254,8 +414,11 @@ rumpuser_rw_enter(int enum_rumprwlock, struct rumpuser_rw *rw)
 
 	if (rumpuser_rw_tryenter(enum_rumprwlock, rw) != 0) {
 		rumpkern_unsched(&nlocks, NULL);
-		while (rumpuser_rw_tryenter(enum_rumprwlock, rw) != 0)
-			wait(w, 0);
+		LOCKPROF_START(start);
+		/* rw_handoff() gives us the lock before waking us up */
+		wait_handoff(w);
+		LOCKPROF_ACQUIRED(rw);
+		LOCKPROF_WAITED(rw, start);
 		rumpkern_sched(nlocks, NULL);
 	}
 }
@@ -268,7 +431,7 @@ rumpuser_rw_tryenter(int enum_rumprwlock, struct rumpuser_rw *rw)
 
 	switch (lk) {
 	case RUMPUSER_RW_WRITER:
-		if (rw->o == NULL) {
+		if (rw->o == NULL && rw->v == 0) {
 			rw->o = rumpuser_curlwp();
 			rv = 0;
 		} else {
@@ -284,6 +447,8 @@ rumpuser_rw_tryenter(int enum_rumprwlock, struct rumpuser_rw *rw)
 		}
 		break;
 	}
+	if (rv == 0)
+		LOCKPROF_ACQUIRED(rw);
 
 	return rv;
 }
@@ -295,22 +460,20 @@ rumpuser_rw_exit(struct rumpuser_rw *rw)
 	if (rw->o) {
 		rw->o = NULL;
 	} else {
-		rw->v--;
+		assert(rw->v > 0);
+		if (--rw->v > 0)
+			return;
 	}
 
-	/* standard procedure, don't let readers starve out writers */
-	if (!TAILQ_EMPTY(&rw->wwait)) {
-		if (rw->o == NULL)
-			wakeup_one(&rw->wwait);
-	} else if (!TAILQ_EMPTY(&rw->rwait) && rw->o == NULL) {
-		wakeup_all(&rw->rwait);
-	}
+	rw_handoff(rw);
 }
 
 void
 rumpuser_rw_destroy(struct rumpuser_rw *rw)
 {
 
+	assert(TAILQ_EMPTY(&rw->rwait) && TAILQ_EMPTY(&rw->wwait));
+	LOCKPROF_FINI(rw);
 	free(rw);
 }
 
@@ -333,16 +496,21 @@ void
 rumpuser_rw_downgrade(struct rumpuser_rw *rw)
 {
 
-	assert(rw->o == rumpuser_curlwp());
-	rw->v = -1;
+	assert(rw->o == rumpuser_curlwp() && rw->v == 0);
+	rw->o = NULL;
+	rw->v = 1;
+
+	/* let queued readers in with us, unless a writer is waiting */
+	rw_handoff(rw);
 }
 
 int
 rumpuser_rw_tryupgrade(struct rumpuser_rw *rw)
 {
 
-	if (rw->v == -1) {
-		rw->v = 1;
+	/* only possible if we are the sole reader */
+	if (rw->o == NULL && rw->v == 1) {
+		rw->v = 0;
 		rw->o = rumpuser_curlwp();
 		return 0;
 	}
@@ -353,6 +521,7 @@ rumpuser_rw_tryupgrade(struct rumpuser_rw *rw)
 struct rumpuser_cv {
 	struct waithead waiters;
 	int nwaiters;
+	LOCKPROF_DECL
 };
 
 void
@@ -363,6 +532,7 @@ rumpuser_cv_init(struct rumpuser_cv **cvp)
 	cv = malloc(sizeof(*cv));
 	memset(cv, 0, sizeof(*cv));
 	TAILQ_INIT(&cv->waiters);
+	LOCKPROF_INIT(cv, "cv");
 	*cvp = cv;
 }
 
@@ -371,6 +541,7 @@ rumpuser_cv_destroy(struct rumpuser_cv *cv)
 {
 
 	assert(cv->nwaiters == 0);
+	LOCKPROF_FINI(cv);
 	free(cv);
 }
 
@@ -392,7 +563,8 @@ cv_resched(struct rumpuser_mtx *mtx, int nlocks)
 		rumpkern_sched(nlocks, mtx);
 		rumpuser_mutex_enter_nowrap(mtx);
 	} else {
-		rumpuser_mutex_enter_nowrap(mtx);
+		/* the mutex may have been handed off to a waiter */
+		mutex_enter_blocking(mtx);
 		rumpkern_sched(nlocks, mtx);
 	}
 }
@@ -400,11 +572,15 @@ cv_resched(struct rumpuser_mtx *mtx, int nlocks)
 void
 rumpuser_cv_wait(struct rumpuser_cv *cv, struct rumpuser_mtx *mtx)
 {
+	s_time_t start;
 	int nlocks;
 
 	cv->nwaiters++;
 	cv_unsched(mtx, &nlocks);
+	LOCKPROF_START(start);
 	wait(&cv->waiters, 0);
+	LOCKPROF_ACQUIRED(cv);
+	LOCKPROF_WAITED(cv, start);
 	cv_resched(mtx, nlocks);
 	cv->nwaiters--;
 }
@@ -424,12 +600,16 @@ int
 rumpuser_cv_timedwait(struct rumpuser_cv *cv, struct rumpuser_mtx *mtx,
 	int64_t sec, int64_t nsec)
 {
+	s_time_t start;
 	int nlocks;
 	int rv;
 
 	cv->nwaiters++;
 	cv_unsched(mtx, &nlocks);
+	LOCKPROF_START(start);
 	rv = wait(&cv->waiters, sec * 1000*1000*1000ULL + nsec);
+	LOCKPROF_ACQUIRED(cv);
+	LOCKPROF_WAITED(cv, start);
 	cv_resched(mtx, nlocks);
 	cv->nwaiters--;
 
@@ -0,0 +1,259 @@
+/*
+ * xenif<n> over a vchan to another domain instead of a vif, so that
+ * two guests on one host talk without a backend and a bridge in
+ * between.  The toolstack puts the peer's domid in rump/vchanif/<n>,
+ * and ours in the peer's.  The lower domid serves the rings under its
+ * data/vchanif/<n>, the other end connects to them.
+ *
+ * Each frame goes as a vchanif_hdr followed by the frame.  Checksums
+ * may be left blank, the peer's stack fills them in or doesn't need
+ * them, but there's no segmentation offload: a frame is at most
+ * VCHANIF_FRAMEMAX bytes.  Once the peer closes, the interface is dead.
+ */
+
+#include <sys/uio.h>
+
+#include <mini-os/os.h>
+#include <mini-os/sched.h>
+#include <mini-os/wait.h>
+#include <mini-os/xenbus.h>
+#include <mini-os/vchan.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rumphyper.h"
+#include <rump/rumpuser.h>
+
+#include <rumpxenif/if_virt.h>
+#include <rumpxenif/if_virt_user.h>
+
+#define VCHANIF_RING		(64*1024)
+#define VCHANIF_FRAMEMAX	(14 + 4 + 1500)		/* with a vlan tag */
+#define VCHANIF_CONNWAIT	10000			/* ms */
+
+struct vchanif_hdr {
+	uint16_t vh_len;
+	uint16_t vh_flags;
+};
+#define VCHANIF_CSUM_BLANK	0x01
+
+struct vchanif {
+	struct vchan *vi_vc;
+	struct virtif_sc *vi_vifsc;
+	int vi_devnum;
+	uint64_t vi_txdrops;
+	unsigned char vi_rxbuf[VCHANIF_FRAMEMAX];
+};
+
+static int
+vchanif_readall(struct vchanif *vi, void *buf, size_t len)
+{
+	struct vchan *vc = vi->vi_vc;
+	char *p = buf;
+	int n;
+
+	while (len) {
+		wait_event(*vchan_waitq(vc),
+		    vchan_data_ready(vc) > 0 || vchan_is_open(vc) == 0);
+		if ((n = vchan_read(vc, p, len)) < 0)
+			return EPIPE;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void
+vchanif_rx(void *arg)
+{
+	struct vchanif *vi = arg;
+	struct vchanif_hdr hdr;
+	struct iovec iov;
+	int flags;
+
+	/* give us a rump kernel context */
+	rumpuser__hyp.hyp_schedule();
+	rumpuser__hyp.hyp_lwproc_newlwp(0);
+	rumpuser__hyp.hyp_unschedule();
+
+	for (;;) {
+		if (vchanif_readall(vi, &hdr, sizeof(hdr)) != 0)
+			break;
+		if (hdr.vh_len > sizeof(vi->vi_rxbuf)) {
+			printk("vchanif%d: %u byte frame, giving up\n",
+			    vi->vi_devnum, hdr.vh_len);
+			break;
+		}
+		if (vchanif_readall(vi, vi->vi_rxbuf, hdr.vh_len) != 0)
+			break;
+
+		flags = 0;
+		if (hdr.vh_flags & VCHANIF_CSUM_BLANK)
+			flags |= VIF_PKT_CSUM_BLANK;
+		iov.iov_base = vi->vi_rxbuf;
+		iov.iov_len = hdr.vh_len;
+		rumpuser__hyp.hyp_schedule();
+		rump_virtif_pktdeliver(vi->vi_vifsc, &iov, 1, flags);
+		rumpuser__hyp.hyp_unschedule();
+	}
+	printk("vchanif%d: peer gone\n", vi->vi_devnum);
+}
+
+/* the server side publishes ring-ref last, wait for that */
+static struct vchan *
+vchanif_connect(domid_t peer, const char *path)
+{
+	char key[64], *msg, *val;
+	int waited;
+
+	snprintf(key, sizeof(key), "%s/ring-ref", path);
+	for (waited = 0; waited < VCHANIF_CONNWAIT; waited += 100) {
+		if ((msg = xenbus_read(XBT_NIL, key, &val)) == NULL) {
+			free(val);
+			return vchan_client_init(peer, path);
+		}
+		free(msg);
+		msleep(100);
+	}
+	return NULL;
+}
+
+/*
+ * Set up xenif<devnum> if rump/vchanif/<devnum> says so, ENXIO if it
+ * doesn't.  Called outside the rump kernel.
+ */
+int
+vchanif_attach(int devnum, struct virtif_sc *vif_sc, uint8_t *enaddr,
+	struct vchanif **vip)
+{
+	struct vchanif *vi;
+	char path[64], *msg, *val;
+	domid_t self, peer;
+	int server;
+
+	snprintf(path, sizeof(path), "rump/vchanif/%d", devnum);
+	if ((msg = xenbus_read(XBT_NIL, path, &val)) != NULL) {
+		free(msg);
+		return ENXIO;
+	}
+	peer = strtoul(val, NULL, 10);
+	free(val);
+	self = xenbus_get_self_id();
+	if (peer == self)
+		return EINVAL;
+
+	if ((vi = malloc(sizeof(*vi))) == NULL)
+		return ENOMEM;
+	memset(vi, 0, sizeof(*vi));
+	vi->vi_vifsc = vif_sc;
+	vi->vi_devnum = devnum;
+
+	server = self < peer;
+	if (server) {
+		snprintf(path, sizeof(path), "data/vchanif/%d", devnum);
+		vi->vi_vc = vchan_server_init(peer, path,
+		    VCHANIF_RING, VCHANIF_RING);
+	} else {
+		snprintf(path, sizeof(path), "/local/domain/%u/data/vchanif/%d",
+		    peer, devnum);
+		vi->vi_vc = vchanif_connect(peer, path);
+	}
+	if (vi->vi_vc == NULL) {
+		printk("vchanif%d: no vchan to domain %u\n", devnum, peer);
+		free(vi);
+		return ENXIO;
+	}
+	printk("vchanif%d: %s %s for domain %u\n", devnum,
+	    server ? "serving" : "connected to", path, peer);
+
+	/* locally administered, different at both ends */
+	enaddr[0] = 0x02;
+	enaddr[1] = 0x00;
+	enaddr[2] = self >> 8;
+	enaddr[3] = self & 0xff;
+	enaddr[4] = 'v';
+	enaddr[5] = devnum;
+
+	if (create_thread_prio("vchanifr", NULL, THREAD_PRIO_DRIVER,
+	    vchanif_rx, vi, NULL) == NULL) {
+		printk("fatal thread creation failure\n"); /* XXX */
+		do_exit();
+	}
+
+	*vip = vi;
+	return 0;
+}
+
+static int
+vchanif_write(struct vchan *vc, const void *buf, size_t len)
+{
+
+	/* space was checked for the whole frame, this doesn't come short */
+	return vchan_write(vc, buf, len) == (int)len ? 0 : EPIPE;
+}
+
+/*
+ * Frames go whole or not at all.  Wait for ring space like netfront
+ * waits for slots, drop when the peer isn't there.
+ */
+void
+vchanif_send(struct vchanif *vi, struct vif_pkt *pkts, int npkts)
+{
+	struct vchan *vc = vi->vi_vc;
+	struct vchanif_hdr hdr;
+	struct vif_stats vs;
+	struct vif_pkt *vp;
+	size_t len, j;
+	int nlocks, i, need, drops = 0;
+
+	rumpkern_unsched(&nlocks, NULL);
+	for (i = 0; i < npkts; i++) {
+		vp = &pkts[i];
+		for (j = 0, len = 0; j < vp->vp_iovlen; j++)
+			len += vp->vp_iov[j].iov_len;
+		if (len > VCHANIF_FRAMEMAX || (vp->vp_flags & VIF_PKT_TSO4)) {
+			drops++;
+			continue;
+		}
+
+		need = sizeof(hdr) + len;
+		wait_event(*vchan_waitq(vc),
+		    vchan_buffer_space(vc) >= need || vchan_is_open(vc) != 1);
+		if (vchan_is_open(vc) != 1) {
+			drops++;
+			continue;
+		}
+
+		hdr.vh_len = len;
+		hdr.vh_flags = 0;
+		if (vp->vp_flags & VIF_PKT_CSUM_BLANK)
+			hdr.vh_flags |= VCHANIF_CSUM_BLANK;
+		if (vchanif_write(vc, &hdr, sizeof(hdr)) != 0) {
+			drops++;
+			continue;
+		}
+		for (j = 0; j < vp->vp_iovlen; j++)
+			vchanif_write(vc, vp->vp_iov[j].iov_base,
+			    vp->vp_iov[j].iov_len);
+	}
+	rumpkern_sched(nlocks, NULL);
+
+	if (drops) {
+		vi->vi_txdrops += drops;
+		memset(&vs, 0, sizeof(vs));
+		vs.vs_oerrors = drops;
+		rump_virtif_stats(vi->vi_vifsc, &vs);
+	}
+}
+
+void
+vchanif_dying(struct vchanif *vi)
+{
+
+	if (vi->vi_txdrops)
+		printk("vchanif%d: dropped %llu frames\n", vi->vi_devnum,
+		    (unsigned long long)vi->vi_txdrops);
+}
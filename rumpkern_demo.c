@@ -7,6 +7,7 @@
 #include <sys/types.h>
 
 #include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include <ufs/ufs/ufsmount.h>
 
@@ -187,6 +188,8 @@ processzombies(void)
 	}
 }
 
+int rumpuser_vif_ipconfig(int);
+
 static void
 setupnet(void)
 {
@@ -198,10 +201,14 @@ setupnet(void)
 	}
 
 	/*
-	 * Configure the interface using DHCP.  DHCP support is a bit
-	 * flimsy, so if this doesn't work properly, you can also use
-	 * the manual interface configuration options.
+	 * Use the address from the vif spec (ip=) if there is one, it
+	 * doesn't cost a round trip.  Otherwise configure the interface
+	 * using DHCP.  DHCP support is a bit flimsy, so if this doesn't
+	 * work properly, you can also use the manual interface
+	 * configuration options.
 	 */
+	if (rumpuser_vif_ipconfig(0) == 0)
+		return;
 	if ((rv = rump_pub_netconfig_dhcp_ipv4_oneshot("xenif0")) != 0) {
 		printf("getting IP for xenif0 via DHCP failed: %d\n", rv);
 		return;
@@ -287,17 +294,39 @@ donet(void)
 	}
 }
 
+/*
+ * bozohttpd serves from a fixed pool of workers.  Each is a process
+ * of its own, since bozo talks to the client on stdin/stdout, and
+ * inherits the listening socket, from which it accepts connections
+ * one after another.  No process or thread is set up per connection.
+ */
+#define HTTPD_NWORKERS 8
+
+/*
+ * Each worker has a response cache of its own.  The memory for them
+ * is shared out, so that the workers together stay within what one
+ * bozo would use by default.
+ */
+#define HTTPD_CACHEKB (4 * 1024)
+
+static int httpd_listenfd;
+
 int main(int, char **);
 void *
 wwwbozo(void *arg)
 {
-	char *argv[] = { "bozo", "-X", "/etc" };
+	char fdbuf[16], cachebuf[16];
+	char *argv[] = { "bozo", "-X", "-W", fdbuf, "-K", cachebuf, "/etc" };
 
 	rump_pub_lwproc_switch(arg);
+	snprintf(fdbuf, sizeof(fdbuf), "%d", httpd_listenfd);
+	snprintf(cachebuf, sizeof(cachebuf), "%d",
+	    HTTPD_CACHEKB / HTTPD_NWORKERS);
 
 	/*
 	 * Call program main.  Since we don't have a new vm space,
-	 * ensure that options will be re-parsed.
+	 * ensure that options will be re-parsed.  Workers start one
+	 * at a time, so getopt state isn't shared.
 	 */
 	optind = 1;
 	optreset = 1;
@@ -309,18 +338,19 @@ wwwbozo(void *arg)
 	return NULL;
 }
 
+/* /etc for httpd, the ramdisk module instead if there is one */
+static const char *etcdev = "blk1";
+
 static void
 dohttpd(void)
 {
 	struct ufs_args ua;
-	struct sockaddr_in sin;
-	socklen_t slen;
-	int rv, s, sa, count;
+	int rv, i;
 	struct lwp *l;
-	pthread_t pt;
+	pthread_t pt[HTTPD_NWORKERS];
 
 	if ((rv = rump_pub_etfs_register(BLKDEV(1),
-	    "blk1", RUMP_ETFS_BLK)) != 0)
+	    etcdev, RUMP_ETFS_BLK)) != 0)
 		errx(1, "etfs %s", strerror(rv));
 
 	mkdir("/etc", 0777);
@@ -329,51 +359,92 @@ dohttpd(void)
 		err(1, "mount");
 	setupnet();
 
-	/* create a decicated process which does the work */
+	/* create a decicated process which hands out the listening socket */
 	rump_pub_lwproc_rfork(RUMP_RFCFDG);
 	l = rump_pub_lwproc_curlwp();
 
-	/*
-	 * ok, now.  we run bozohttpd in inetd mode to gain control
-	 * of the worker model is uses.  This means that we have to:
-	 *  1: open the listening socket and accept connections
-	 *  2: rfork with descriptor inheritance
-	 *  3: dup2 the accepted fd's to {0,1,2}
-	 *  4: create a mini os thread to handle the request(s)
-	 */
-	s = sucketonport(80);
-	for (count = 0;; count++) {
-		/* 1: accept */
-		slen = sizeof(sin);
-		sa = accept(s, (struct sockaddr *)&sin, &slen);
-		if (sa == -1)
-			err(1, "accept round %d", count);
-
-		/* 2: rfork */
+	httpd_listenfd = sucketonport(80);
+	for (i = 0; i < HTTPD_NWORKERS; i++) {
+		/* the worker gets a copy of our descriptors */
 		rv = rump_pub_lwproc_rfork(RUMP_RFFDG);
 		if (rv != 0)
 			errx(1, "fork failed: %s", strerror(rv));
-
-		/* 3: setup fd's */
-		dup2(sa, 0);
-		dup2(sa, 1);
-		dup2(sa, 2);
-		fcntl(3, F_CLOSEM);
-
-		/* 4: create thread */
-		pthread_create(&pt, NULL, wwwbozo, rump_pub_lwproc_curlwp());
+		pthread_create(&pt[i], NULL, wwwbozo, rump_pub_lwproc_curlwp());
 
 		/*
-		 * back to handling proc.  yea, this a slightly gray
-		 * area of semantics, and we could do a lot better in
-		 * preventing a race.  that ssaid, we should be fine due
-		 * to cooperative scheduling.
-		 *
-		 * then, release the reference to the socket fd
+		 * back to handling proc.  the worker has switched to its
+		 * own lwp by the time we run again, cooperative scheduling
+		 * being what it is.
 		 */
 		rump_pub_lwproc_switch(l);
-		close(sa);
 	}
+	close(httpd_listenfd);
+
+	for (i = 0; i < HTTPD_NWORKERS; i++)
+		pthread_join(pt[i], NULL);
+}
+
+/*
+ * Blast UDP at the discard port of a peer, small packets for the
+ * packet rate and full sized ones for bandwidth.  Transmit only, the
+ * peer needn't run anything but may count what arrives.
+ */
+#define BENCH_NETTIME SECONDS(2)
+static void
+dobenchnet(const char *peer)
+{
+	static const size_t sizes[] = { 18, 1472 };
+	struct sockaddr_in sin;
+	char buf[1472];
+	uint64_t start, t, npkts, nerr;
+	int s, i;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_len = sizeof(sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(9);
+	if ((sin.sin_addr.s_addr = inet_addr(peer)) == INADDR_NONE) {
+		printf("bench: net skipped, bad peer %s\n", peer);
+		return;
+	}
+
+	setupnet();
+	if ((s = socket(PF_INET, SOCK_DGRAM, 0)) == -1
+	    || connect(s, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+		printf("bench: net skipped, %s\n", strerror(errno));
+		return;
+	}
+	memset(buf, 0, sizeof(buf));
+
+	for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+		npkts = nerr = 0;
+		start = NOW();
+		while ((t = NOW() - start) < BENCH_NETTIME) {
+			if (send(s, buf, sizes[i], 0) == -1)
+				nerr++;
+			else
+				npkts++;
+		}
+		printf("bench: net udp size=%zu pps=%"PRIu64" kbps=%"PRIu64
+		    " errors=%"PRIu64"\n", sizes[i],
+		    npkts * SECONDS(1) / t,
+		    npkts * sizes[i] * 8 * (SECONDS(1) / 1000) / t, nerr);
+	}
+	close(s);
+}
+
+void rumpuser_bench(void);
+void bench_pthread(void);
+
+/* with a peer address, e.g. "10 10.0.0.1", the network is measured too */
+static void
+dobench(const char *peer)
+{
+
+	rumpuser_bench();
+	bench_pthread();
+	if (*peer)
+		dobenchnet(peer);
 }
 
 void test_pthread(void);
@@ -381,18 +452,27 @@ void test_pthread(void);
 int
 app_main(start_info_t *si)
 {
-	long tests;
+	long tests = 0;
+	char *ep = "";
 
 	printf("running demos, command line: %s\n", si->cmd_line);
 
 	if (si->cmd_line[0]) {
-		tests = strtol((const char *)si->cmd_line, NULL, 16);
+		tests = strtol((const char *)si->cmd_line, &ep, 16);
+		while (*ep == ' ')
+			ep++;
+	}
+	if (si->mod_len) {
+		printf("ramdisk of %lu bytes, /etc from there\n", si->mod_len);
+		etcdev = "ram0";
 	}
 
 	if (tests & 0x1)
 		dofs();
 	if (tests & 0x8)
 		test_pthread();
+	if (tests & 0x10)
+		dobench(ep);
 	if (tests & 0x2)
 		donet();
 	if (tests & 0x4)
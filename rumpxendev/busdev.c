@@ -57,8 +57,11 @@
 #include <sys/cdefs.h>
 __KERNEL_RCSID(0, "$NetBSD: $");
 
+#include <sys/filio.h>
+
 #include "rumpxen_xendev.h"
 #include "rumphyper.h"
+#include "xenio.h"
 
 #define BUFFER_SIZE (XENSTORE_PAYLOAD_MAX+sizeof(struct xsd_sockmsg))
 
@@ -105,6 +108,7 @@ struct xenbus_dev_data {
 	struct xenbus_event_queue replies; /* Entirely unread by user. */
 
 	_Bool queued_enomem, want_restart;
+	_Bool coalesce_watches; /* protected by xenbus_req_lock */
 
 	/* Partially written request(s). */
 	unsigned int wbuf_used;
@@ -118,6 +122,12 @@ struct xenbus_dev_data {
 	int rmsg_done;
 	void (*rmsg_free)(void*);
 
+	/* Where watch events are built for reading, one at a time. */
+	union {
+		struct xsd_sockmsg msg;
+		unsigned char buffer[BUFFER_SIZE];
+	} ebuf;
+
 	struct selinfo selinfo;
 	/* The lock used for the purposes described in select(9)
 	 * is xenbus_req_lock, not d->lock. */
@@ -125,6 +135,12 @@ struct xenbus_dev_data {
 
 /*----- helpers -----*/
 
+static void
+nofree(void *p)
+{
+	/* d->ebuf */
+}
+
 static void
 free_watch(struct xenbus_dev_watch *watch)
 {
@@ -484,9 +500,16 @@ process_watch_event(struct xenbus_dev_data *d, struct xenbus_event *event,
 	DPRINTF(("/dev/xen/xenbus: watch event allocating %lu\n",
 		 (unsigned long)totalsz));
 
-	/* Allocate it and fill in the header */
+	/* Allocate it, unless it fits d->ebuf, and fill in the header */
 
-	struct xsd_sockmsg *reply = xbd_malloc(totalsz);
+	struct xsd_sockmsg *reply;
+	if (totalsz <= sizeof(d->ebuf)) {
+		reply = &d->ebuf.msg;
+		*mfree_r = nofree;
+	} else {
+		reply = xbd_malloc(totalsz);
+		*mfree_r = xbd_free;
+	}
 	if (!reply) {
 		printf("xenbus dev: out of memory for watch event"
 		       " wpath=`%s' epath=`%s'\n",
@@ -516,7 +539,6 @@ process_watch_event(struct xenbus_dev_data *d, struct xenbus_event *event,
 
 end:
 	xenbus_free(event);
-	*mfree_r = xbd_free;
 	return reply;
 }
 
@@ -654,6 +676,17 @@ fail:
 	return 0;
 }
 
+static _Bool
+events_pending(struct xenbus_dev_data *d)
+{
+	_Bool pending;
+
+	spin_lock(&xenbus_req_lock);
+	pending = !STAILQ_EMPTY(&d->replies.events);
+	spin_unlock(&xenbus_req_lock);
+	return pending;
+}
+
 static int
 xenbus_dev_read(struct file *fp, off_t *offset, struct uio *uio,
 		kauth_cred_t cred, int flags)
@@ -685,6 +718,9 @@ xenbus_dev_read(struct file *fp, off_t *offset, struct uio *uio,
 			break;
 
 		if (!d->rmsg) {
+			if (uio->uio_resid != org_resid && !events_pending(d))
+				/* Return what we have, don't wait for more. */
+				break;
 			d->rmsg = next_event_msg(d, fp, &err, &d->rmsg_free);
 			if (!d->rmsg) {
 				if (uio->uio_resid != org_resid)
@@ -734,6 +770,27 @@ end:
 #define RBITS (POLLIN  | POLLRDNORM)
 #define WBITS (POLLOUT | POLLWRNORM)
 
+/* Drop a new watch event if the same one is still queued. */
+static _Bool
+coalesce_watch_event(struct xenbus_dev_data *d)
+{
+	struct xenbus_event *last, *event;
+
+	last = STAILQ_LAST(&d->replies.events, xenbus_event, entry);
+	if (!last || !last->watch)
+		return 0;
+	STAILQ_FOREACH(event, &d->replies.events, entry) {
+		if (event == last)
+			return 0;
+		if (event->watch == last->watch &&
+		    !strcmp(event->path, last->path))
+			break;
+	}
+	STAILQ_REMOVE(&d->replies.events, last, xenbus_event, entry);
+	xenbus_free(last);
+	return 1;
+}
+
 static void
 xenbus_dev_xb_wakeup(struct xenbus_event_queue *queue)
 {
@@ -741,6 +798,8 @@ xenbus_dev_xb_wakeup(struct xenbus_event_queue *queue)
 	DPRINTF(("/dev/xen/xenbus: wakeup\n"));
 	struct xenbus_dev_data *d =
 		container_of(queue, struct xenbus_dev_data, replies);
+	if (d->coalesce_watches && coalesce_watch_event(d))
+		return; /* the reader already knows */
 	wake_up(&d->replies.waitq);
 	selnotify(&d->selinfo, RBITS, NOTE_SUBMIT);
 }
@@ -779,7 +838,8 @@ xenbus_dev_poll(struct file *fp, int events)
 	revents |= events & WBITS;
 
 	if (events & RBITS)
-		if (d->rmsg || d->queued_enomem || d->want_restart)
+		if (d->rmsg || d->queued_enomem || d->want_restart ||
+		    !STAILQ_EMPTY(&d->replies.events))
 			revents |= events & RBITS;
 
 	if (!revents) {
@@ -795,6 +855,27 @@ xenbus_dev_poll(struct file *fp, int events)
 	return revents;
 }
 
+static int
+xenbus_dev_ioctl(struct file *fp, u_long cmd, void *data)
+{
+	struct xenbus_dev_data *d = fp->f_data;
+
+	switch (cmd) {
+	case FIONBIO:
+		/* f_flag has it already, reads look there */
+		return 0;
+
+	case IOCTL_XENBUS_COALESCE_WATCHES:
+		spin_lock(&xenbus_req_lock);
+		d->coalesce_watches = *(int *)data != 0;
+		spin_unlock(&xenbus_req_lock);
+		return 0;
+
+	default:
+		return ENOTTY;
+	}
+}
+
 /*----- setup etc. -----*/
 
 static int
@@ -808,7 +889,8 @@ xenbus_dev_close(struct file *fp)
 	 * but next_event_msg will want to unlock and relock it */
 	mutex_enter(&d->lock);
 
-	xbd_free(d->rmsg);
+	if (d->rmsg)
+		d->rmsg_free(d->rmsg);
 	d->rmsg = 0;
 
 	for (;;) {
@@ -874,7 +956,7 @@ xenbus_dev_close(struct file *fp)
 const struct fileops xenbus_dev_fileops = {
         .fo_read = xenbus_dev_read,
         .fo_write = xenbus_dev_write,
-        .fo_ioctl = fbadop_ioctl,
+        .fo_ioctl = xenbus_dev_ioctl,
         .fo_fcntl = fnullop_fcntl,
         .fo_poll = xenbus_dev_poll,
         .fo_stat = fbadop_stat,
@@ -900,6 +982,7 @@ xenbus_dev_open(struct file *fp, void **fdata_r)
 	d->replies.wakeup = xenbus_dev_xb_wakeup;
 	d->queued_enomem = 0;
 	d->want_restart = 0;
+	d->coalesce_watches = 0;
 	d->wbuf_used = 0;
 	d->rmsg = 0;
 	d->rmsg_done = 0;
@@ -0,0 +1,474 @@
+/*
+ * evtdev.c
+ *
+ * /dev/xen/evtchn: event channels bound by user-space, for protocols
+ * the rump kernel has no driver for.  Each open file has its own set
+ * of ports and its own queue of ports which fired.
+ *
+ * The Mini-OS event handler runs with interrupts off and no rump
+ * kernel context, so it only masks the port, queues it and wakes
+ * readers.  selnotify() for pollers is left to a thread with a rump
+ * kernel context of its own, shared by all open files.
+ */
+
+#include <sys/cdefs.h>
+__KERNEL_RCSID(0, "$NetBSD: $");
+
+#include "rumpxen_xendev.h"
+#include "rumphyper.h"
+#include "xenio.h"
+
+#pragma GCC diagnostic ignored "-Wcast-qual"
+/* mini-os/os.h has some bad casts */
+#include <mini-os/os.h>
+#include <mini-os/events.h>
+#include <mini-os/kernel.h>
+#include <mini-os/sched.h>
+#include <mini-os/wait.h>
+#pragma GCC diagnostic error "-Wcast-qual"
+
+#define EVTCHN_RING 1024	/* fired ports queued per open file */
+
+/*----- data structures -----*/
+
+struct evtchn_dev_data;
+
+struct evtchn_dev_port {
+	LIST_ENTRY(evtchn_dev_port) entry;
+	struct evtchn_dev_data *d;
+	evtchn_port_t port;
+};
+
+struct evtchn_dev_data {
+	kmutex_t lock;
+	LIST_HEAD(, evtchn_dev_port) ports;
+
+	/* Filled in by the event handler, with interrupts off. */
+	evtchn_port_t ring[EVTCHN_RING];
+	unsigned int ring_prod, ring_cons;
+	_Bool ring_overflow;
+
+	struct wait_queue_head waitq;
+	_Bool want_restart;
+
+	/* Waiting for, or in, selnotify() by the notifier thread. */
+	TAILQ_ENTRY(evtchn_dev_data) notify_entry;
+	_Bool notify_queued, notify_busy;
+
+	struct selinfo selinfo;
+};
+
+static TAILQ_HEAD(, evtchn_dev_data) evtchn_notify_queue =
+	TAILQ_HEAD_INITIALIZER(evtchn_notify_queue);
+static struct thread *evtchn_notifier;
+
+#define RBITS (POLLIN  | POLLRDNORM)
+#define WBITS (POLLOUT | POLLWRNORM)
+
+/*----- event handling -----*/
+
+static void
+evtchn_dev_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
+{
+	struct evtchn_dev_port *p = data;
+	struct evtchn_dev_data *d = p->d;
+
+	/* until the user writes the port back */
+	mask_evtchn(port);
+
+	if (d->ring_prod - d->ring_cons < EVTCHN_RING)
+		d->ring[d->ring_prod++ % EVTCHN_RING] = port;
+	else
+		d->ring_overflow = 1;
+	wake_up(&d->waitq);
+
+	if (!d->notify_queued) {
+		d->notify_queued = 1;
+		TAILQ_INSERT_TAIL(&evtchn_notify_queue, d, notify_entry);
+		wake(evtchn_notifier);
+	}
+}
+
+static void
+evtchn_dev_notifier(void *arg)
+{
+	struct evtchn_dev_data *d;
+	struct thread *me = get_current();
+	unsigned long flags;
+	int nlocks;
+
+	/* give us a rump kernel context */
+	rumpuser__hyp.hyp_schedule();
+	rumpuser__hyp.hyp_lwproc_newlwp(0);
+	rumpuser__hyp.hyp_unschedule();
+
+	local_irq_save(flags);
+	for (;;) {
+		while (TAILQ_EMPTY(&evtchn_notify_queue)) {
+			block(me);
+			local_irq_restore(flags);
+			schedule();
+			local_irq_save(flags);
+		}
+		d = TAILQ_FIRST(&evtchn_notify_queue);
+		TAILQ_REMOVE(&evtchn_notify_queue, d, notify_entry);
+		d->notify_queued = 0;
+		d->notify_busy = 1;
+		local_irq_restore(flags);
+
+		rumpkern_sched(0, NULL);
+		selnotify(&d->selinfo, RBITS, 0);
+		rumpkern_unsched(&nlocks, NULL);
+
+		local_irq_save(flags);
+		d->notify_busy = 0;
+		/* close may be waiting for us to be done with d */
+		wake_up(&d->waitq);
+	}
+}
+
+/*----- helpers -----*/
+
+static struct evtchn_dev_port *
+find_port(struct evtchn_dev_data *d, evtchn_port_t port)
+{
+	struct evtchn_dev_port *p;
+
+	LIST_FOREACH(p, &d->ports, entry)
+		if (p->port == port)
+			return p;
+	/* not found */
+	return 0;
+}
+
+static void
+unbind_port(struct evtchn_dev_port *p)
+{
+
+	LIST_REMOVE(p, entry);
+	unbind_evtchn(p->port);
+	kernel_suspend_release();
+	xbd_free(p);
+}
+
+/* Must be called with d->lock held; may temporarily release it. */
+static int
+wait_for_ring(struct evtchn_dev_data *d, struct file *fp,
+	      unsigned long *flags)
+{
+	int nlocks;
+	DEFINE_WAIT(w);
+
+	while (d->ring_prod == d->ring_cons && !d->ring_overflow) {
+		if (d->want_restart)
+			return ERESTART;
+		if (fp->f_flag & FNONBLOCK)
+			return EAGAIN;
+
+		add_waiter(w, d->waitq);
+		local_irq_restore(*flags);
+		mutex_exit(&d->lock);
+		rumpkern_unsched(&nlocks, 0);
+
+		schedule();
+
+		rumpkern_sched(nlocks, 0);
+		mutex_enter(&d->lock);
+		local_irq_save(*flags);
+		remove_waiter(w, d->waitq);
+	}
+	return d->ring_overflow ? EFBIG : 0;
+}
+
+/*----- file operations -----*/
+
+static int
+evtchn_dev_read(struct file *fp, off_t *offset, struct uio *uio,
+		kauth_cred_t cred, int flags)
+{
+	struct evtchn_dev_data *d = fp->f_data;
+	uint32_t ports[64];
+	unsigned long iflags;
+	unsigned int n, i;
+	int err;
+
+	if (uio->uio_resid < sizeof(ports[0]))
+		return EINVAL;
+
+	mutex_enter(&d->lock);
+	local_irq_save(iflags);
+	err = wait_for_ring(d, fp, &iflags);
+	if (err) {
+		local_irq_restore(iflags);
+		goto end;
+	}
+	n = d->ring_prod - d->ring_cons;
+	if (n > __arraycount(ports))
+		n = __arraycount(ports);
+	if (n > uio->uio_resid / sizeof(ports[0]))
+		n = uio->uio_resid / sizeof(ports[0]);
+	for (i = 0; i < n; i++)
+		ports[i] = d->ring[d->ring_cons++ % EVTCHN_RING];
+	local_irq_restore(iflags);
+
+	err = uiomove(ports, n * sizeof(ports[0]), uio);
+end:
+	mutex_exit(&d->lock);
+	return err;
+}
+
+static int
+evtchn_dev_write(struct file *fp, off_t *offset, struct uio *uio,
+		 kauth_cred_t cred, int flags)
+{
+	struct evtchn_dev_data *d = fp->f_data;
+	uint32_t ports[64];
+	size_t n, i;
+	int err = 0;
+
+	mutex_enter(&d->lock);
+	while (uio->uio_resid >= sizeof(ports[0])) {
+		n = uio->uio_resid / sizeof(ports[0]);
+		if (n > __arraycount(ports))
+			n = __arraycount(ports);
+		err = uiomove(ports, n * sizeof(ports[0]), uio);
+		if (err)
+			break;
+		/* someone else's ports are left alone */
+		for (i = 0; i < n; i++)
+			if (find_port(d, ports[i]))
+				unmask_evtchn(ports[i]);
+	}
+	mutex_exit(&d->lock);
+	return err;
+}
+
+static int
+bind_port(struct evtchn_dev_data *d, u_long how, unsigned int dom,
+	  unsigned int arg, unsigned int *port_r)
+{
+	struct evtchn_dev_port *p;
+	evtchn_port_t port;
+	int rc;
+
+	p = xbd_malloc(sizeof(*p));
+	if (!p)
+		return ENOMEM;
+	p->d = d;
+
+	switch (how) {
+	case IOCTL_EVTCHN_BIND_VIRQ:
+		port = bind_virq(arg, evtchn_dev_handler, p);
+		rc = port == (evtchn_port_t)-1;
+		break;
+	case IOCTL_EVTCHN_BIND_INTERDOMAIN:
+		rc = evtchn_bind_interdomain(dom, arg, evtchn_dev_handler, p,
+					     &port);
+		break;
+	default:
+		rc = evtchn_alloc_unbound(dom, evtchn_dev_handler, p, &port);
+		break;
+	}
+	if (rc) {
+		xbd_free(p);
+		return EINVAL;
+	}
+
+	p->port = port;
+	/* the port would be gone after a restore */
+	kernel_suspend_hold();
+	LIST_INSERT_HEAD(&d->ports, p, entry);
+	unmask_evtchn(port);
+	*port_r = port;
+	return 0;
+}
+
+static int
+evtchn_dev_ioctl(struct file *fp, u_long cmd, void *data)
+{
+	struct evtchn_dev_data *d = fp->f_data;
+	struct ioctl_evtchn_bind_virq *bv;
+	struct ioctl_evtchn_bind_interdomain *bi;
+	struct ioctl_evtchn_bind_unbound_port *bu;
+	struct evtchn_dev_port *p;
+	unsigned long flags;
+	int err = 0;
+
+	mutex_enter(&d->lock);
+	switch (cmd) {
+	case IOCTL_EVTCHN_BIND_VIRQ:
+		bv = data;
+		err = bind_port(d, cmd, 0, bv->virq, &bv->port);
+		break;
+
+	case IOCTL_EVTCHN_BIND_INTERDOMAIN:
+		bi = data;
+		err = bind_port(d, cmd, bi->remote_domain, bi->remote_port,
+				&bi->port);
+		break;
+
+	case IOCTL_EVTCHN_BIND_UNBOUND_PORT:
+		bu = data;
+		err = bind_port(d, cmd, bu->remote_domain, 0, &bu->port);
+		break;
+
+	case IOCTL_EVTCHN_UNBIND:
+		p = find_port(d, ((struct ioctl_evtchn_unbind *)data)->port);
+		if (!p) {
+			err = EINVAL;
+			break;
+		}
+		unbind_port(p);
+		break;
+
+	case IOCTL_EVTCHN_NOTIFY:
+		p = find_port(d, ((struct ioctl_evtchn_notify *)data)->port);
+		if (!p) {
+			err = EINVAL;
+			break;
+		}
+		notify_remote_via_evtchn(p->port);
+		break;
+
+	case IOCTL_EVTCHN_RESET:
+		local_irq_save(flags);
+		d->ring_prod = d->ring_cons = 0;
+		d->ring_overflow = 0;
+		local_irq_restore(flags);
+		break;
+
+	default:
+		err = ENOTTY;
+		break;
+	}
+	mutex_exit(&d->lock);
+	return err;
+}
+
+static int
+evtchn_dev_poll(struct file *fp, int events)
+{
+	struct evtchn_dev_data *d = fp->f_data;
+	unsigned long flags;
+	int revents;
+
+	mutex_enter(&d->lock);
+
+	/* writing ports back never blocks */
+	revents = events & WBITS;
+
+	local_irq_save(flags);
+	if (events & RBITS)
+		if (d->ring_prod != d->ring_cons || d->ring_overflow
+		    || d->want_restart)
+			revents |= events & RBITS;
+	local_irq_restore(flags);
+
+	/* the notifier can't run before we get this far */
+	if (!revents && (events & RBITS))
+		selrecord(curlwp, &d->selinfo);
+
+	mutex_exit(&d->lock);
+	return revents;
+}
+
+static void
+evtchn_dev_restart(file_t *fp)
+{
+	struct evtchn_dev_data *d = fp->f_data;
+
+	mutex_enter(&d->lock);
+	d->want_restart |= 1;
+	wake_up(&d->waitq);
+	mutex_exit(&d->lock);
+}
+
+static int
+evtchn_dev_close(struct file *fp)
+{
+	struct evtchn_dev_data *d = fp->f_data;
+	struct evtchn_dev_port *p, *p_tmp;
+	unsigned long flags;
+	int nlocks;
+	DEFINE_WAIT(w);
+
+	mutex_enter(&d->lock);
+	LIST_FOREACH_SAFE(p, &d->ports, entry, p_tmp)
+		unbind_port(p);
+
+	/* nothing fires any more, get d out of the notifier's hands */
+	local_irq_save(flags);
+	if (d->notify_queued) {
+		TAILQ_REMOVE(&evtchn_notify_queue, d, notify_entry);
+		d->notify_queued = 0;
+	}
+	while (d->notify_busy) {
+		add_waiter(w, d->waitq);
+		local_irq_restore(flags);
+		mutex_exit(&d->lock);
+		rumpkern_unsched(&nlocks, 0);
+
+		schedule();
+
+		rumpkern_sched(nlocks, 0);
+		mutex_enter(&d->lock);
+		local_irq_save(flags);
+		remove_waiter(w, d->waitq);
+	}
+	local_irq_restore(flags);
+	mutex_exit(&d->lock);
+
+	seldestroy(&d->selinfo);
+	mutex_destroy(&d->lock);
+	xbd_free(d);
+	return 0;
+}
+
+const struct fileops evtchn_dev_fileops = {
+	.fo_read = evtchn_dev_read,
+	.fo_write = evtchn_dev_write,
+	.fo_ioctl = evtchn_dev_ioctl,
+	.fo_fcntl = fnullop_fcntl,
+	.fo_poll = evtchn_dev_poll,
+	.fo_stat = fbadop_stat,
+	.fo_close = evtchn_dev_close,
+	.fo_kqfilter = fnullop_kqfilter,
+	.fo_restart = evtchn_dev_restart,
+};
+
+int
+evtchn_dev_open(struct file *fp, void **fdata_r)
+{
+	struct evtchn_dev_data *d;
+
+	if (!evtchn_notifier) {
+		evtchn_notifier = create_thread("xenevtn", NULL,
+						evtchn_dev_notifier, NULL,
+						NULL);
+		if (!evtchn_notifier)
+			return ENOMEM;
+	}
+
+	d = xbd_malloc(sizeof(*d));
+	if (!d)
+		return ENOMEM;
+	memset(d, 0, sizeof(*d));
+
+	mutex_init(&d->lock, MUTEX_DEFAULT, IPL_HIGH);
+	LIST_INIT(&d->ports);
+	init_waitqueue_head(&d->waitq);
+	selinit(&d->selinfo);
+
+	*fdata_r = d;
+	return 0;
+}
+
+/*
+ * Local variables:
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
@@ -0,0 +1,148 @@
+/*
+ * gntdev.c
+ *
+ * /dev/xen/gntdev: grants from other domains mapped for user-space,
+ * which shares the address space with everything else here, so the
+ * pages are used where they are mapped.  Each open file has a gntmap
+ * of its own, and closing the file unmaps whatever is still mapped.
+ */
+
+#include <sys/cdefs.h>
+__KERNEL_RCSID(0, "$NetBSD: $");
+
+#include "rumpxen_xendev.h"
+#include "xenio.h"
+
+#pragma GCC diagnostic ignored "-Wcast-qual"
+/* mini-os/os.h has some bad casts */
+#include <mini-os/os.h>
+#include <mini-os/gntmap.h>
+#pragma GCC diagnostic error "-Wcast-qual"
+
+#define GNTDEV_MAX_MAP 1024	/* grants in one IOCTL_GNTDEV_MAP_GRANT_REF */
+
+struct gntdev_dev_data {
+	kmutex_t lock;
+	struct gntmap map;
+};
+
+static int
+map_grant_refs(struct gntdev_dev_data *d,
+	       struct ioctl_gntdev_map_grant_ref *m)
+{
+	struct ioctl_gntdev_grant_ref *grefs;
+	uint32_t *refs;
+	uint32_t i;
+	int err;
+
+	if (m->count == 0 || m->count > GNTDEV_MAX_MAP)
+		return EINVAL;
+
+	grefs = xbd_malloc(m->count * sizeof(*grefs));
+	refs = xbd_malloc(m->count * sizeof(*refs));
+	if (!grefs || !refs) {
+		err = ENOMEM;
+		goto end;
+	}
+	err = copyin(m->refs, grefs, m->count * sizeof(*grefs));
+	if (err)
+		goto end;
+	for (i = 0; i < m->count; i++)
+		refs[i] = grefs[i].ref;
+
+	/* domids straight from grefs, every other word */
+	m->va = gntmap_map_grant_refs(&d->map, m->count, &grefs[0].domid,
+				      sizeof(*grefs) / sizeof(uint32_t),
+				      refs, m->writable);
+	if (!m->va)
+		err = EINVAL;
+end:
+	xbd_free(grefs);
+	xbd_free(refs);
+	return err;
+}
+
+static int
+gntdev_dev_ioctl(struct file *fp, u_long cmd, void *data)
+{
+	struct gntdev_dev_data *d = fp->f_data;
+	struct ioctl_gntdev_unmap_grant_ref *u;
+	int err;
+
+	mutex_enter(&d->lock);
+	switch (cmd) {
+	case IOCTL_GNTDEV_MAP_GRANT_REF:
+		err = map_grant_refs(d, data);
+		break;
+
+	case IOCTL_GNTDEV_UNMAP_GRANT_REF:
+		u = data;
+		if (u->count == 0 || u->count > GNTDEV_MAX_MAP) {
+			err = EINVAL;
+			break;
+		}
+		err = gntmap_munmap(&d->map, (unsigned long)u->va, u->count)
+			? EINVAL : 0;
+		break;
+
+	case IOCTL_GNTDEV_SET_MAX_GRANTS:
+		err = -gntmap_set_max_grants(&d->map,
+			((struct ioctl_gntdev_set_max_grants *)data)->count);
+		break;
+
+	default:
+		err = ENOTTY;
+		break;
+	}
+	mutex_exit(&d->lock);
+	return err;
+}
+
+static int
+gntdev_dev_close(struct file *fp)
+{
+	struct gntdev_dev_data *d = fp->f_data;
+
+	gntmap_fini(&d->map);
+	mutex_destroy(&d->lock);
+	xbd_free(d);
+	return 0;
+}
+
+const struct fileops gntdev_dev_fileops = {
+	.fo_read = fbadop_read,
+	.fo_write = fbadop_write,
+	.fo_ioctl = gntdev_dev_ioctl,
+	.fo_fcntl = fnullop_fcntl,
+	.fo_poll = fnullop_poll,
+	.fo_stat = fbadop_stat,
+	.fo_close = gntdev_dev_close,
+	.fo_kqfilter = fnullop_kqfilter,
+	.fo_restart = fnullop_restart,
+};
+
+int
+gntdev_dev_open(struct file *fp, void **fdata_r)
+{
+	struct gntdev_dev_data *d;
+
+	d = xbd_malloc(sizeof(*d));
+	if (!d)
+		return ENOMEM;
+
+	mutex_init(&d->lock, MUTEX_DEFAULT, IPL_HIGH);
+	gntmap_init(&d->map);
+
+	*fdata_r = d;
+	return 0;
+}
+
+/*
+ * Local variables:
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
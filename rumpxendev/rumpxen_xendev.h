@@ -56,6 +56,12 @@
 extern int xenbus_dev_open(struct file *fp, void **fdata);
 extern const struct fileops xenbus_dev_fileops;
 
+extern int evtchn_dev_open(struct file *fp, void **fdata);
+extern const struct fileops evtchn_dev_fileops;
+
+extern int gntdev_dev_open(struct file *fp, void **fdata);
+extern const struct fileops gntdev_dev_fileops;
+
 
 static inline void*
 xbd_malloc(size_t sz)
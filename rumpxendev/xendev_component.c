@@ -55,6 +55,8 @@ static const struct xen_dev_info {
 #define XDEV(cmin, leaf)						\
 	[cmin] = { DEV_XEN "/" #leaf, leaf##_dev_open, &leaf##_dev_fileops }
 	XDEV(0, xenbus),
+	XDEV(1, evtchn),
+	XDEV(2, gntdev),
 #undef XDEV
 };
 
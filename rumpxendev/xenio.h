@@ -0,0 +1,106 @@
+/*
+ * xenio.h
+ *
+ * ioctls of the /dev/xen devices, for applications linked with the
+ * rump kernel.  The event channel ones are NetBSD's.
+ */
+
+#ifndef RUMP_DEV_XENIO_H
+#define RUMP_DEV_XENIO_H
+
+#include <sys/ioccom.h>
+#include <sys/stdint.h>
+
+/*
+ * /dev/xen/xenbus
+ *
+ * With coalescing on, a watch event is dropped if one for the same
+ * watch and path is still waiting to be read.  Off by default.
+ */
+#define IOCTL_XENBUS_COALESCE_WATCHES \
+	_IOW('X', 0, int)
+
+/*
+ * /dev/xen/evtchn
+ *
+ * A read returns the ports which fired since the last one, one
+ * uint32_t each, and fails with EFBIG if more fired than could be
+ * queued.  A port which fired stays masked until it is written back
+ * to the device, again as one uint32_t each.
+ */
+
+struct ioctl_evtchn_bind_virq {
+	unsigned int virq;
+	unsigned int port;		/* out */
+};
+#define IOCTL_EVTCHN_BIND_VIRQ \
+	_IOWR('E', 4, struct ioctl_evtchn_bind_virq)
+
+struct ioctl_evtchn_bind_interdomain {
+	unsigned int remote_domain;
+	unsigned int remote_port;
+	unsigned int port;		/* out */
+};
+#define IOCTL_EVTCHN_BIND_INTERDOMAIN \
+	_IOWR('E', 5, struct ioctl_evtchn_bind_interdomain)
+
+struct ioctl_evtchn_bind_unbound_port {
+	unsigned int remote_domain;
+	unsigned int port;		/* out */
+};
+#define IOCTL_EVTCHN_BIND_UNBOUND_PORT \
+	_IOWR('E', 6, struct ioctl_evtchn_bind_unbound_port)
+
+struct ioctl_evtchn_unbind {
+	unsigned int port;
+};
+#define IOCTL_EVTCHN_UNBIND \
+	_IOW('E', 7, struct ioctl_evtchn_unbind)
+
+struct ioctl_evtchn_notify {
+	unsigned int port;
+};
+#define IOCTL_EVTCHN_NOTIFY \
+	_IOW('E', 8, struct ioctl_evtchn_notify)
+
+/* forget the ports queued for reading */
+#define IOCTL_EVTCHN_RESET \
+	_IO('E', 9)
+
+/*
+ * /dev/xen/gntdev
+ *
+ * Everything shares one address space with the rump kernel, so there
+ * is no mmap: mapping returns the address the grants went to, and it
+ * stays valid until unmapped or the device is closed.
+ */
+
+struct ioctl_gntdev_grant_ref {
+	uint32_t domid;
+	uint32_t ref;
+};
+
+struct ioctl_gntdev_map_grant_ref {
+	uint32_t count;
+	uint32_t writable;
+	const struct ioctl_gntdev_grant_ref *refs;
+	void *va;			/* out */
+};
+#define IOCTL_GNTDEV_MAP_GRANT_REF \
+	_IOWR('G', 0, struct ioctl_gntdev_map_grant_ref)
+
+struct ioctl_gntdev_unmap_grant_ref {
+	void *va;
+	uint32_t count;
+};
+#define IOCTL_GNTDEV_UNMAP_GRANT_REF \
+	_IOW('G', 1, struct ioctl_gntdev_unmap_grant_ref)
+
+/* only before the first map, the default is 128 */
+struct ioctl_gntdev_set_max_grants {
+	uint32_t count;
+};
+#define IOCTL_GNTDEV_SET_MAX_GRANTS \
+	_IOW('G', 2, struct ioctl_gntdev_set_max_grants)
+
+#endif /*RUMP_DEV_XENIO_H*/
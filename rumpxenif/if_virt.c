@@ -67,9 +67,18 @@ static int	virtif_ioctl(struct ifnet *, u_long, void *);
 static void	virtif_start(struct ifnet *);
 static void	virtif_stop(struct ifnet *, int);
 
+/* longest mbuf chain sent as is, and packets per VIFHYPER_SEND() */
+#define LB_SH 32
+#define VIF_TXBATCH 16
+
 struct virtif_sc {
 	struct ethercom sc_ec;
 	struct virtif_user *sc_viu;
+
+	/* transmit batch, only touched by virtif_start() */
+	struct vif_pkt sc_txpkt[VIF_TXBATCH];
+	struct mbuf *sc_txm[VIF_TXBATCH];
+	struct iovec sc_txio[VIF_TXBATCH][LB_SH];
 };
 
 static int  virtif_clone(struct if_clone *, int);
@@ -86,7 +95,7 @@ virtif_clone(struct if_clone *ifc, int num)
 	struct ifnet *ifp;
 	uint8_t enaddr[ETHER_ADDR_LEN] = { 0xb2, 0x0a, 0x00, 0x0b, 0x0e, 0x01 };
 	char enaddrstr[3*ETHER_ADDR_LEN];
-	int error = 0;
+	int error = 0, offload;
 
 	if (num >= 0x100)
 		return E2BIG;
@@ -113,6 +122,19 @@ virtif_clone(struct if_clone *ifc, int num)
 	ifp->if_stop = virtif_stop;
 	IFQ_SET_READY(&ifp->if_snd);
 
+	/* offload whatever the other end is willing to do, enabled by default */
+	offload = VIFHYPER_OFFLOAD(viu);
+	if (offload & VIF_OFFLOAD_CSUM) {
+		ifp->if_capabilities |=
+		    IFCAP_CSUM_TCPv4_Tx | IFCAP_CSUM_UDPv4_Tx
+		    | IFCAP_CSUM_TCPv4_Rx | IFCAP_CSUM_UDPv4_Rx;
+		ifp->if_csum_flags_tx |= M_CSUM_TCPv4 | M_CSUM_UDPv4;
+		ifp->if_csum_flags_rx |= M_CSUM_TCPv4 | M_CSUM_UDPv4;
+	}
+	if (offload & VIF_OFFLOAD_TSO4)
+		ifp->if_capabilities |= IFCAP_TSOv4;
+	ifp->if_capenable = ifp->if_capabilities;
+
 	if_attach(ifp);
 	ether_ifattach(ifp, enaddr);
 
@@ -171,38 +193,63 @@ virtif_ioctl(struct ifnet *ifp, u_long cmd, void *data)
 /*
  * Output packets in-context until outgoing queue is empty.
  * Assume that VIFHYPER_SEND() is fast enough to not make it
- * necessary to drop kernel_lock.
+ * necessary to drop kernel_lock.  Packets are handed over up to
+ * VIF_TXBATCH at a time, so that the backend can notify the other
+ * end once per batch instead of once per packet.
  */
-#define LB_SH 32
 static void
 virtif_start(struct ifnet *ifp)
 {
 	struct virtif_sc *sc = ifp->if_softc;
 	struct mbuf *m, *m0;
-	struct iovec io[LB_SH];
-	int i;
+	struct vif_pkt *vp;
+	struct iovec *io;
+	int i, n, flags, segsz;
 
 	ifp->if_flags |= IFF_OACTIVE;
 
-	for (;;) {
+	for (n = 0;;) {
 		IF_DEQUEUE(&ifp->if_snd, m0);
-		if (!m0) {
-			break;
+		if (!m0 || n == VIF_TXBATCH) {
+			if (n > 0)
+				VIFHYPER_SEND(sc->sc_viu, sc->sc_txpkt, n);
+			while (n > 0)
+				m_freem(sc->sc_txm[--n]);
+			if (!m0)
+				break;
 		}
 
+		io = sc->sc_txio[n];
 		m = m0;
 		for (i = 0; i < LB_SH && m; i++) {
 			io[i].iov_base = mtod(m, void *);
 			io[i].iov_len = m->m_len;
 			m = m->m_next;
 		}
-		if (i == LB_SH)
-			panic("lazy bum");
+		if (m) {
+			/* a chain this long is not worth the trouble */
+			ifp->if_oerrors++;
+			m_freem(m0);
+			continue;
+		}
 		bpf_mtap(ifp, m0);
 
-		VIFHYPER_SEND(sc->sc_viu, io, i);
+		flags = segsz = 0;
+		if (m0->m_pkthdr.csum_flags & M_CSUM_TSOv4) {
+			flags |= VIF_PKT_TSO4 | VIF_PKT_CSUM_BLANK;
+			segsz = m0->m_pkthdr.segsz;
+		} else if (m0->m_pkthdr.csum_flags
+		    & (M_CSUM_TCPv4 | M_CSUM_UDPv4)) {
+			flags |= VIF_PKT_CSUM_BLANK;
+		}
 
-		m_freem(m0);
+		vp = &sc->sc_txpkt[n];
+		vp->vp_iov = io;
+		vp->vp_iovlen = i;
+		vp->vp_flags = flags;
+		vp->vp_segsz = segsz;
+		sc->sc_txm[n++] = m0;
+		ifp->if_opackets++;
 	}
 
 	ifp->if_flags &= ~IFF_OACTIVE;
@@ -215,20 +262,40 @@ virtif_stop(struct ifnet *ifp, int disable)
 	ifp->if_flags &= ~IFF_RUNNING;
 }
 
+/*
+ * A blank checksum comes from a sender on the same host, so there
+ * is nothing to verify.  Otherwise trust the other end only if rx
+ * checksum offload is enabled.
+ */
+static void
+virtif_rxcsum(struct ifnet *ifp, struct mbuf *m, int flags)
+{
+
+	if ((flags & VIF_PKT_CSUM_BLANK)
+	    || ((flags & VIF_PKT_CSUM_VALID)
+	      && (ifp->if_capenable & IFCAP_CSUM_TCPv4_Rx)))
+		m->m_pkthdr.csum_flags |= M_CSUM_TCPv4 | M_CSUM_UDPv4;
+}
+
 void
-rump_virtif_pktdeliver(struct virtif_sc *sc, struct iovec *iov, size_t iovlen)
+rump_virtif_pktdeliver(struct virtif_sc *sc, struct iovec *iov, size_t iovlen,
+	int flags)
 {
 	struct ifnet *ifp = &sc->sc_ec.ec_if;
 	struct mbuf *m;
 	size_t i;
 	int off, olen;
 
-	if ((ifp->if_flags & IFF_RUNNING) == 0)
+	if ((ifp->if_flags & IFF_RUNNING) == 0) {
+		ifp->if_iqdrops++;
 		return;
+	}
 
 	m = m_gethdr(M_NOWAIT, MT_DATA);
-	if (m == NULL)
+	if (m == NULL) {
+		ifp->if_iqdrops++;
 		return; /* drop packet */
+	}
 	m->m_len = m->m_pkthdr.len = 0;
 
 	for (i = 0, off = 0; i < iovlen; i++) {
@@ -237,10 +304,75 @@ rump_virtif_pktdeliver(struct virtif_sc *sc, struct iovec *iov, size_t iovlen)
 		off += iov[i].iov_len;
 		if (olen + off != m->m_pkthdr.len) {
 			aprint_verbose_ifnet(ifp, "m_copyback failed\n");
+			ifp->if_iqdrops++;
 			m_freem(m);
 			return;
 		}
 	}
+	virtif_rxcsum(ifp, m, flags);
+	ifp->if_ipackets++;
+
+	m->m_pkthdr.rcvif = ifp;
+	KERNEL_LOCK(1, NULL);
+	bpf_mtap(ifp, m);
+	ether_input(ifp, m);
+	KERNEL_UNLOCK_LAST(NULL);
+}
+
+/*
+ * The hypervisor side reports what was lost before a packet reached
+ * us or after it left, as increments since the previous call.
+ */
+void
+rump_virtif_stats(struct virtif_sc *sc, const struct vif_stats *vs)
+{
+	struct ifnet *ifp = &sc->sc_ec.ec_if;
+
+	ifp->if_ierrors += vs->vs_ierrors;
+	ifp->if_iqdrops += vs->vs_iqdrops;
+	ifp->if_oerrors += vs->vs_oerrors;
+}
+
+static void
+virtif_extfree(struct mbuf *m, void *buf, size_t size, void *arg)
+{
+	struct virtif_sc *sc = arg;
+
+	VIFHYPER_RXFREE(sc->sc_viu, buf);
+	if (m != NULL)
+		pool_cache_put(mb_cache, m);
+}
+
+/*
+ * Deliver a packet without copying it: the buffer is loaned to us
+ * and attached as external storage.  It is given back to the
+ * hypervisor with VIFHYPER_RXFREE() once the mbuf is freed.
+ */
+void
+rump_virtif_pktdeliver_ext(struct virtif_sc *sc, void *buf, size_t buflen,
+	size_t off, size_t len, int flags)
+{
+	struct ifnet *ifp = &sc->sc_ec.ec_if;
+	struct mbuf *m;
+
+	if ((ifp->if_flags & IFF_RUNNING) == 0) {
+		ifp->if_iqdrops++;
+		VIFHYPER_RXFREE(sc->sc_viu, buf);
+		return;
+	}
+
+	m = m_gethdr(M_NOWAIT, MT_DATA);
+	if (m == NULL) {
+		ifp->if_iqdrops++;
+		VIFHYPER_RXFREE(sc->sc_viu, buf);
+		return; /* drop packet */
+	}
+	MEXTADD(m, buf, buflen, M_DEVBUF, virtif_extfree, sc);
+	m->m_flags |= M_EXT_RW; /* we own the buffer */
+	m->m_data = (char *)buf + off;
+	m->m_len = m->m_pkthdr.len = len;
+	virtif_rxcsum(ifp, m, flags);
+	ifp->if_ipackets++;
 
 	m->m_pkthdr.rcvif = ifp;
 	KERNEL_LOCK(1, NULL);
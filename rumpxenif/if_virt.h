@@ -22,6 +22,35 @@
 #define VIFHYPER_DYING VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_dying)
 #define VIFHYPER_DESTROY VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_destroy)
 #define VIFHYPER_SEND VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_send)
+#define VIFHYPER_RXFREE VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_rxfree)
+#define VIFHYPER_OFFLOAD VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_offload)
+
+/* offload capabilities, returned by VIFHYPER_OFFLOAD() */
+#define VIF_OFFLOAD_CSUM	0x01	/* TCP/UDP over IPv4 checksums */
+#define VIF_OFFLOAD_TSO4	0x02	/* TCP segmentation over IPv4 */
+
+/* per-packet flags for VIFHYPER_SEND() and rump_virtif_pktdeliver() */
+#define VIF_PKT_CSUM_BLANK	0x01	/* TCP/UDP checksum not filled in */
+#define VIF_PKT_CSUM_VALID	0x02	/* rx: checksum already verified */
+#define VIF_PKT_TSO4		0x04	/* tx: segment into segsz packets */
+
+/* one packet of a VIFHYPER_SEND() batch */
+struct vif_pkt {
+	struct iovec	*vp_iov;
+	size_t		vp_iovlen;
+	int		vp_flags;
+	int		vp_segsz;
+};
+
+/* errors seen below the interface, see rump_virtif_stats() */
+struct vif_stats {
+	uint64_t	vs_ierrors;
+	uint64_t	vs_iqdrops;
+	uint64_t	vs_oerrors;
+};
 
 struct virtif_sc;
-void rump_virtif_pktdeliver(struct virtif_sc *, struct iovec *, size_t);
+void rump_virtif_stats(struct virtif_sc *, const struct vif_stats *);
+void rump_virtif_pktdeliver(struct virtif_sc *, struct iovec *, size_t, int);
+void rump_virtif_pktdeliver_ext(struct virtif_sc *, void *, size_t,
+				size_t, size_t, int);
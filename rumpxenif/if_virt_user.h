@@ -32,4 +32,7 @@ int 	VIFHYPER_CREATE(int, struct virtif_sc *, uint8_t *,
 void	VIFHYPER_DYING(struct virtif_user *);
 void	VIFHYPER_DESTROY(struct virtif_user *);
 
-void	VIFHYPER_SEND(struct virtif_user *, struct iovec *, size_t);
+int	VIFHYPER_OFFLOAD(struct virtif_user *);
+
+void	VIFHYPER_SEND(struct virtif_user *, struct vif_pkt *, int);
+void	VIFHYPER_RXFREE(struct virtif_user *, void *);
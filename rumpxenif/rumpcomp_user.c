@@ -47,6 +47,7 @@
 #include <rte_ethdev.h>
 #include <rte_mempool.h>
 #include <rte_mbuf.h>
+#include <rte_version.h>
 
 #include <rump/rumpuser_component.h>
 
@@ -65,8 +66,12 @@ static const char *ealargs[] = {
 	"-n 1",
 };
 
-/* change PORTID to the one your want to use */
-#define IF_PORTID 0
+/*
+ * Interface N drives DPDK port N.  Received frames are spread by RSS
+ * over up to MAXQUEUE rx queues, each served by a receiver thread
+ * of its own.
+ */
+#define MAXQUEUE 4
 
 /* change to the init method of your NIC driver */
 #ifndef PMD_INIT
@@ -76,15 +81,32 @@ static const char *ealargs[] = {
 /* Receive packets in bursts of 16 per read */
 #define MAX_PKT_BURST 16
 
+/* Transmit in bursts of up to 32 */
+#define MAX_TX_BURST 32
+
+/*
+ * Empty polls before the receiver goes to sleep.  It then waits for
+ * the rx interrupt where DPDK has them (2.1 and later), otherwise it
+ * sleeps, starting at RX_SLEEP_MIN and doubling up to RX_SLEEP_MAX
+ * microseconds while the queue stays empty.
+ */
+#define RX_SPIN_BUDGET 1024
+#define RX_SLEEP_MIN 10
+#define RX_SLEEP_MAX 10000
+
+#if RTE_VERSION >= RTE_VERSION_NUM(2,1,0,0)
+#define HAVE_RX_INTR
+#endif
+
 /*
  * No (immediate) need to edit below this line
  */
 
 #define MBSIZE	2048
 #define MBCACHE	32
-#define NMBUF	8192
+#define NMBUF	8192	/* per port, split between its rx queues */
+#define NTXMBUF	2048
 #define NDESC	256
-#define NQUEUE	1
 
 /* these thresholds don't matter at this stage of optimizing */
 static const struct rte_eth_rxconf rxconf = {
@@ -102,17 +124,40 @@ static const struct rte_eth_txconf txconf = {
 	},
 };
 
-static struct rte_mempool *mbpool;
+/*
+ * The mempool cache belongs to an lcore, and every thread which
+ * isn't an EAL thread counts as lcore 0.  So each rx queue has a
+ * cached pool of its own, used only by the queue's receiver.  The
+ * transmit side runs in whatever rump thread sends and has a pool
+ * without a cache.
+ */
+static struct rte_mempool *txpool;
+
+struct virtif_user;
+
+struct virtif_rxq {
+	struct virtif_user *rxq_viu;
+	int rxq_id;
+	pthread_t rxq_rcvpt;
+	struct rte_mempool *rxq_pool;
+
+	/* burst receive context */
+	struct rte_mbuf *rxq_m_pkts[MAX_PKT_BURST];
+	int rxq_nbufpkts;
+	int rxq_bufidx;
+
+	int rxq_rxintr;
+	int rxq_nloaned;
+	struct rte_mbuf *rxq_rxfree;	/* returned loans, linked by pkt.next */
+};
 
 struct virtif_user {
 	int viu_devnum;
+	int viu_port;
 	struct virtif_sc *viu_virtifsc;
-	pthread_t viu_rcvpt;
 
-	/* burst receive context */
-	struct rte_mbuf *viu_m_pkts[MAX_PKT_BURST];
-	int viu_nbufpkts;
-	int viu_bufidx;
+	int viu_nrxq;
+	struct virtif_rxq viu_rxq[MAXQUEUE];
 };
 
 static void
@@ -131,19 +176,23 @@ ifwarn(struct virtif_user *viu, const char *fmt, ...)
 static int
 globalinit(struct virtif_user *viu)
 {
+	static int inited;
 	int rv;
 
+	if (inited)
+		return 0;
+
 	if ((rv = rte_eal_init(sizeof(ealargs)/sizeof(ealargs[0]),
 	    /*UNCONST*/(void *)(uintptr_t)ealargs)) < 0)
 		OUT("eal init\n");
 
-	/* disable mempool cache due to DPDK bug, not thread safe */
-	if ((mbpool = rte_mempool_create("mbuf_pool", NMBUF, MBSIZE, 0/*MBCACHE*/,
+	/* no cache, used concurrently from any thread */
+	if ((txpool = rte_mempool_create("tx_pool", NTXMBUF, MBSIZE, 0,
 	    sizeof(struct rte_pktmbuf_pool_private),
 	    rte_pktmbuf_pool_init, NULL,
 	    rte_pktmbuf_init, NULL, 0, 0)) == NULL) {
 		rv = -EINVAL;
-		OUT("mbuf pool\n");
+		OUT("tx mbuf pool\n");
 	}
 
 	if ((rv = PMD_INIT()) < 0)
@@ -153,6 +202,7 @@ globalinit(struct virtif_user *viu)
 	if ((rv = rte_eth_dev_count()) == 0)
 		OUT("no ports\n");
 	rv = 0;
+	inited = 1;
 
  out:
  	return rv;
@@ -160,22 +210,35 @@ globalinit(struct virtif_user *viu)
 
 /*
  * Get mbuf off of interface, push it up into the TCP/IP stack.
- * TODO: share TCP/IP stack mbufs with DPDK mbufs to avoid
- * data copy (in rump_virtif_pktdeliver()).
+ * Single-segment frames are loaned to the stack as external storage
+ * and go back to the queue's pool in VIFHYPER_RXFREE().  Chains, and
+ * frames arriving while the stack already holds half the pool, are
+ * copied so that the NIC doesn't run out of rx buffers.
  */
 #define STACK_IOV 16
 static void
-deliverframe(struct virtif_user *viu)
+deliverframe(struct virtif_rxq *rxq)
 {
+	struct virtif_user *viu = rxq->rxq_viu;
 	struct rte_mbuf *m, *m0;
 	struct iovec iov[STACK_IOV];
 	struct iovec *iovp, *iovp0;
 
-	assert(viu->viu_nbufpkts > 0 && viu->viu_bufidx < MAX_PKT_BURST);
-	m0 = viu->viu_m_pkts[viu->viu_bufidx];
+	assert(rxq->rxq_nbufpkts > 0 && rxq->rxq_bufidx < MAX_PKT_BURST);
+	m0 = rxq->rxq_m_pkts[rxq->rxq_bufidx];
 	assert(m0 != NULL);
-	viu->viu_bufidx++;
-	viu->viu_nbufpkts--;
+	rxq->rxq_bufidx++;
+	rxq->rxq_nbufpkts--;
+
+	if (m0->pkt.nb_segs == 1
+	    && rxq->rxq_nloaned < NMBUF/viu->viu_nrxq/2) {
+		rxq->rxq_nloaned++;
+		rump_virtif_pktdeliver_ext(viu->viu_virtifsc,
+		    m0->buf_addr, m0->buf_len,
+		    rte_pktmbuf_mtod(m0, char *) - (char *)m0->buf_addr,
+		    rte_pktmbuf_data_len(m0), 0);
+		return;
+	}
 
 	if (m0->pkt.nb_segs > STACK_IOV) {
 		iovp = malloc(sizeof(*iovp) * m0->pkt.nb_segs);
@@ -190,46 +253,108 @@ deliverframe(struct virtif_user *viu)
 		iovp->iov_base = rte_pktmbuf_mtod(m, void *);
 		iovp->iov_len = rte_pktmbuf_data_len(m);
 	}
-	rump_virtif_pktdeliver(viu->viu_virtifsc, iovp0, iovp-iovp0);
+	rump_virtif_pktdeliver(viu->viu_virtifsc, iovp0, iovp-iovp0, 0);
 
 	rte_pktmbuf_free(m0);
 	if (iovp0 != iov)
 		free(iovp0);
 }
 
+/* Give loans returned by VIFHYPER_RXFREE() back to the pool.  Receiver only. */
+static void
+rxfree_drain(struct virtif_rxq *rxq)
+{
+	struct rte_mbuf *m, *next;
+
+	m = __sync_lock_test_and_set(&rxq->rxq_rxfree, NULL);
+	for (; m; m = next) {
+		next = m->pkt.next;
+		m->pkt.next = NULL;
+		rxq->rxq_nloaned--;
+		rte_pktmbuf_free(m);
+	}
+}
+
+static void
+rxburst(struct virtif_rxq *rxq)
+{
+
+	rxq->rxq_nbufpkts = rte_eth_rx_burst(rxq->rxq_viu->viu_port,
+	    rxq->rxq_id, rxq->rxq_m_pkts, MAX_PKT_BURST);
+	rxq->rxq_bufidx = 0;
+}
+
+/*
+ * Nothing on the queue for RX_SPIN_BUDGET polls, wait for more.
+ * The interrupt is armed before one last poll, so that a frame which
+ * arrived in between isn't left waiting for the next one.
+ */
+static void
+rxwait(struct virtif_rxq *rxq, int *sleepus)
+{
+#ifdef HAVE_RX_INTR
+	struct virtif_user *viu = rxq->rxq_viu;
+	struct rte_epoll_event ev;
+
+	if (rxq->rxq_rxintr) {
+		rte_eth_dev_rx_intr_enable(viu->viu_port, rxq->rxq_id);
+		rxburst(rxq);
+		if (rxq->rxq_nbufpkts == 0)
+			rte_epoll_wait(RTE_EPOLL_PER_THREAD, &ev, 1, -1);
+		rte_eth_dev_rx_intr_disable(viu->viu_port, rxq->rxq_id);
+		return;
+	}
+#endif
+	usleep(*sleepus);
+	if (*sleepus < RX_SLEEP_MAX)
+		*sleepus *= 2;
+}
+
 static void *
 receiver(void *arg)
 {
-	struct virtif_user *viu = arg;
+	struct virtif_rxq *rxq = arg;
+	int spins = 0, sleepus = RX_SLEEP_MIN;
 
 	/* step 1: this newly created host thread needs a rump kernel context */
 	rumpuser_component_kthread();
 
+#ifdef HAVE_RX_INTR
+	/* rx interrupts go to this thread's epoll instance */
+	rxq->rxq_rxintr = rte_eth_dev_rx_intr_ctl_q(rxq->rxq_viu->viu_port,
+	    rxq->rxq_id, RTE_EPOLL_PER_THREAD, RTE_INTR_EVENT_ADD, NULL) == 0;
+	if (!rxq->rxq_rxintr)
+		ifwarn(rxq->rxq_viu, "queue %d: no rx interrupts, polling",
+		    rxq->rxq_id);
+#endif
+
 	/* step 2: deliver packets until interface is decommissioned */
 	for (;;) {
 		/* we have cached frames. schedule + deliver */
-		if (viu->viu_nbufpkts > 0) {
+		if (rxq->rxq_nbufpkts > 0) {
 			rumpuser_component_schedule(NULL);
-			while (viu->viu_nbufpkts > 0) {
-				deliverframe(viu);
+			while (rxq->rxq_nbufpkts > 0) {
+				deliverframe(rxq);
 			}
 			rumpuser_component_unschedule();
 		}
 		
 		/* none cached.  ok, try to get some */
-		if (viu->viu_nbufpkts == 0) {
-			viu->viu_nbufpkts = rte_eth_rx_burst(IF_PORTID,
-			    0, viu->viu_m_pkts, MAX_PKT_BURST);
-			viu->viu_bufidx = 0;
+		if (rxq->rxq_nbufpkts == 0) {
+			rxfree_drain(rxq);
+			rxburst(rxq);
 		}
 			
-		if (viu->viu_nbufpkts == 0) {
-			/*
-			 * For now, don't ultrabusyloop.
-			 * I don't have an overabundance of
-			 * spare cores in my vm.
-			 */
-			usleep(10000);
+		/*
+		 * Busy-poll for a bounded while, so that a busy queue is
+		 * served at full speed, then stop burning the core.
+		 */
+		if (rxq->rxq_nbufpkts == 0) {
+			if (++spins >= RX_SPIN_BUDGET)
+				rxwait(rxq, &sleepus);
+		} else {
+			spins = 0;
+			sleepus = RX_SLEEP_MIN;
 		}
 	}
 
@@ -243,45 +368,92 @@ VIFHYPER_CREATE(int devnum, struct virtif_sc *vif_sc, uint8_t *enaddr,
 	struct virtif_user **viup)
 {
 	struct rte_eth_conf portconf;
+	struct rte_eth_dev_info info;
 	struct rte_eth_link link;
 	struct ether_addr ea;
 	struct virtif_user *viu;
+	struct virtif_rxq *rxq;
+	char name[32];
 	int rv = EINVAL; /* XXX: not very accurate ;) */
+	int i;
 
 	viu = malloc(sizeof(*viu));
 	memset(viu, 0, sizeof(*viu));
 	viu->viu_devnum = devnum;
+	viu->viu_port = devnum;
 	viu->viu_virtifsc = vif_sc;
 
-	/* this is here only for simplicity */
 	if ((rv = globalinit(viu)) != 0)
 		goto out;
+	if (viu->viu_port >= rte_eth_dev_count()) {
+		rv = -ENXIO;
+		OUT("no such port\n");
+	}
+
+	rte_eth_dev_info_get(viu->viu_port, &info);
+	viu->viu_nrxq = info.max_rx_queues < MAXQUEUE
+	    ? info.max_rx_queues : MAXQUEUE;
+	if (viu->viu_nrxq < 1)
+		viu->viu_nrxq = 1;
 
 	memset(&portconf, 0, sizeof(portconf));
-	if ((rv = rte_eth_dev_configure(IF_PORTID,
-	    NQUEUE, NQUEUE, &portconf)) < 0)
+	if (viu->viu_nrxq > 1) {
+		portconf.rxmode.mq_mode = ETH_MQ_RX_RSS;
+		portconf.rx_adv_conf.rss_conf.rss_key = NULL;
+		portconf.rx_adv_conf.rss_conf.rss_hf =
+		    ETH_RSS_IPV4 | ETH_RSS_IPV4_TCP | ETH_RSS_IPV4_UDP;
+	}
+#ifdef HAVE_RX_INTR
+	portconf.intr_conf.rxq = 1;
+#endif
+	/*
+	 * One tx queue: sends come in one at a time through
+	 * virtif_start() under the kernel lock.
+	 */
+	if ((rv = rte_eth_dev_configure(viu->viu_port,
+	    viu->viu_nrxq, 1, &portconf)) < 0)
 		OUT("configure device\n");
 
-	if ((rv = rte_eth_rx_queue_setup(IF_PORTID,
-	    0, NDESC, 0, &rxconf, mbpool)) <0)
-		OUT("rx queue setup\n");
+	for (i = 0; i < viu->viu_nrxq; i++) {
+		rxq = &viu->viu_rxq[i];
+		rxq->rxq_viu = viu;
+		rxq->rxq_id = i;
+		snprintf(name, sizeof(name), "mbuf_pool%d_%d", viu->viu_port, i);
+		if ((rxq->rxq_pool = rte_mempool_create(name,
+		    NMBUF/viu->viu_nrxq, MBSIZE, MBCACHE,
+		    sizeof(struct rte_pktmbuf_pool_private),
+		    rte_pktmbuf_pool_init, NULL,
+		    rte_pktmbuf_init, NULL, 0, 0)) == NULL) {
+			rv = -EINVAL;
+			OUT("mbuf pool\n");
+		}
+		if ((rv = rte_eth_rx_queue_setup(viu->viu_port,
+		    i, NDESC, 0, &rxconf, rxq->rxq_pool)) <0)
+			OUT("rx queue setup\n");
+	}
 
-	if ((rv = rte_eth_tx_queue_setup(IF_PORTID, 0, NDESC, 0, &txconf)) < 0)
+	if ((rv = rte_eth_tx_queue_setup(viu->viu_port,
+	    0, NDESC, 0, &txconf)) < 0)
 		OUT("tx queue setup\n");
 
-	if ((rv = rte_eth_dev_start(IF_PORTID)) < 0)
+	if ((rv = rte_eth_dev_start(viu->viu_port)) < 0)
 		OUT("device start\n");
 
-	rte_eth_link_get(IF_PORTID, &link);
+	rte_eth_link_get(viu->viu_port, &link);
 	if (!link.link_status) {
 		ifwarn(viu, "link down");
 	}
 
-	rte_eth_promiscuous_enable(IF_PORTID);
-	rte_eth_macaddr_get(IF_PORTID, &ea);
+	rte_eth_promiscuous_enable(viu->viu_port);
+	rte_eth_macaddr_get(viu->viu_port, &ea);
 	memcpy(enaddr, ea.addr_bytes, ETHER_ADDR_LEN);
 
-	rv = pthread_create(&viu->viu_rcvpt, NULL, receiver, viu);
+	for (i = 0; i < viu->viu_nrxq; i++) {
+		rxq = &viu->viu_rxq[i];
+		if ((rv = pthread_create(&rxq->rxq_rcvpt, NULL,
+		    receiver, rxq)) != 0)
+			break;
+	}
 
  out:
 	/* XXX: well this isn't much of an unrolling ... */
@@ -294,28 +466,81 @@ VIFHYPER_CREATE(int devnum, struct virtif_sc *vif_sc, uint8_t *enaddr,
 
 /*
  * To send, we copy the data from the TCP/IP stack memory into DPDK
- * memory.  TODO: share TCP/IP stack mbufs with DPDK mbufs to avoid
- * data copy.
+ * memory.  Sending without the copy would mean keeping the stack's
+ * mbuf until the NIC is done with it: virtif_start() frees it as
+ * soon as we return, and this DPDK can only attach rte_mbufs to
+ * other rte_mbufs, not to foreign memory.
  */
+/* no offloads (yet) */
+int
+VIFHYPER_OFFLOAD(struct virtif_user *viu)
+{
+
+	return 0;
+}
+
+/* Copy the batch into tx mbufs and send them in as few bursts as fit. */
 void
-VIFHYPER_SEND(struct virtif_user *viu,
-	struct iovec *iov, size_t iovlen)
+VIFHYPER_SEND(struct virtif_user *viu, struct vif_pkt *pkts, int npkts)
 {
-	struct rte_mbuf *m;
+	struct rte_mbuf *m, *m_pkts[MAX_TX_BURST];
+	struct vif_pkt *vp;
 	void *dptr;
 	unsigned i;
-
-	m = rte_pktmbuf_alloc(mbpool);
-	for (i = 0; i < iovlen; i++) {
-		dptr = rte_pktmbuf_append(m, iov[i].iov_len);
-		if (dptr == NULL) {
-			/* log error somehow? */
-			rte_pktmbuf_free(m);
-			break;
+	int n, nsent, p;
+
+	for (p = 0; p < npkts;) {
+		for (n = 0; n < MAX_TX_BURST && p < npkts; p++) {
+			vp = &pkts[p];
+			m = rte_pktmbuf_alloc(txpool);
+			if (m == NULL)
+				continue; /* drop */
+			for (i = 0; i < vp->vp_iovlen; i++) {
+				dptr = rte_pktmbuf_append(m,
+				    vp->vp_iov[i].iov_len);
+				if (dptr == NULL)
+					break;
+				memcpy(dptr, vp->vp_iov[i].iov_base,
+				    vp->vp_iov[i].iov_len);
+			}
+			if (i < vp->vp_iovlen) {
+				/* log error somehow? */
+				rte_pktmbuf_free(m);
+				continue;
+			}
+			m_pkts[n++] = m;
 		}
-		memcpy(dptr, iov[i].iov_base, iov[i].iov_len);
+		nsent = rte_eth_tx_burst(viu->viu_port, 0, m_pkts, n);
+		while (nsent < n)
+			rte_pktmbuf_free(m_pkts[nsent++]);
 	}
-	rte_eth_tx_burst(IF_PORTID, 0, &m, 1);
+}
+
+/*
+ * A buffer loaned out by deliverframe() is done with.  The rte_mbuf
+ * header directly precedes its data buffer, see rte_pktmbuf_init().
+ * This runs in whichever thread freed the stack's mbuf, which must
+ * not touch the pool's cache, so the mbuf is pushed on a lock-free
+ * list for the receiver of the queue owning the pool to free.
+ */
+void
+VIFHYPER_RXFREE(struct virtif_user *viu, void *buf)
+{
+	struct virtif_rxq *rxq;
+	struct rte_mbuf *m, *head;
+	int i;
+
+	m = (struct rte_mbuf *)((char *)buf - sizeof(struct rte_mbuf));
+	assert(m->buf_addr == buf);
+	for (i = 0; i < viu->viu_nrxq; i++)
+		if (viu->viu_rxq[i].rxq_pool == m->pool)
+			break;
+	assert(i < viu->viu_nrxq);
+	rxq = &viu->viu_rxq[i];
+	do {
+		head = rxq->rxq_rxfree;
+		m->pkt.next = head;
+	} while (!__sync_bool_compare_and_swap(&rxq->rxq_rxfree, head, m));
 }
 
 void
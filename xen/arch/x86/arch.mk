@@ -3,6 +3,10 @@
 # (including x86_32, x86_32y and x86_64).
 #
 
+# Event callbacks run with the FPU still holding some thread's state,
+# so the code they run is built without SSE or MMX, see fpu.c.
+NOFPU_CFLAGS := -mno-sse -mno-mmx
+
 ifeq ($(XEN_TARGET_ARCH),x86_32)
 ARCH_CFLAGS  := -m32 -march=i686
 ARCH_LDFLAGS := -m elf_i386
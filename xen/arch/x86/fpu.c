@@ -0,0 +1,195 @@
+/*
+ ****************************************************************************
+ *
+ *        File: fpu.c
+ *
+ * Environment: Xen Minimal OS
+ * Description: Lazy FPU/SSE state switching.  The registers belong to
+ *  one thread at a time.  Switching to any other thread sets CR0.TS,
+ *  so that its first FPU or SSE instruction traps with #NM, and only
+ *  then is the owner's state saved and the new thread's loaded.
+ *
+ ****************************************************************************
+ */
+#include <mini-os/os.h>
+#include <mini-os/hypervisor.h>
+#include <mini-os/lib.h>
+#include <mini-os/sched.h>
+#include <mini-os/xmalloc.h>
+
+#include <mini-os/machine/traps.h>
+
+#include <errno.h>
+#include <string.h>
+
+#define CPUID1_ECX_XSAVE	(1U << 26)
+#define CPUID1_ECX_OSXSAVE	(1U << 27)
+
+#define XSTATE_FP		(1ULL << 0)
+#define XSTATE_SSE		(1ULL << 1)
+#define XSTATE_YMM		(1ULL << 2)
+
+/* whose state is in the registers, NULL for nobody's */
+static struct thread *fpu_owner;
+/* CR0.TS as we last set it; Xen clears it when it delivers #NM */
+static int fpu_ts;
+/* a callback used the FPU, TS must be set again on the way out */
+static int fpu_cbused;
+
+static int fpu_xsave;
+static uint64_t fpu_xcr0;
+static unsigned int fpu_size = 512;
+
+/* xsave, xrstor and xsetbv by hand, old assemblers don't know them */
+static void fpu_save(void *area)
+{
+    if (fpu_xsave)
+        asm volatile(
+#ifdef __x86_64__
+                     ".byte 0x48,0x0f,0xae,0x27" /* xsave64 (%rdi) */
+#else
+                     ".byte 0x0f,0xae,0x27"      /* xsave (%edi) */
+#endif
+                     : : "D" (area), "a" ((uint32_t)fpu_xcr0),
+                       "d" ((uint32_t)(fpu_xcr0 >> 32)) : "memory");
+    else
+#ifdef __x86_64__
+        asm volatile("fxsaveq (%0)" : : "r" (area) : "memory");
+#else
+        asm volatile("fxsave (%0)" : : "r" (area) : "memory");
+#endif
+}
+
+static void fpu_restore(void *area)
+{
+    if (fpu_xsave)
+        asm volatile(
+#ifdef __x86_64__
+                     ".byte 0x48,0x0f,0xae,0x2f" /* xrstor64 (%rdi) */
+#else
+                     ".byte 0x0f,0xae,0x2f"      /* xrstor (%edi) */
+#endif
+                     : : "D" (area), "a" ((uint32_t)fpu_xcr0),
+                       "d" ((uint32_t)(fpu_xcr0 >> 32)) : "memory");
+    else
+#ifdef __x86_64__
+        asm volatile("fxrstorq (%0)" : : "r" (area) : "memory");
+#else
+        asm volatile("fxrstor (%0)" : : "r" (area) : "memory");
+#endif
+}
+
+static void fpu_set_ts(void)
+{
+
+    HYPERVISOR_fpu_taskswitch(1);
+    fpu_ts = 1;
+}
+
+void init_fpu(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    xen_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if ((ecx & (CPUID1_ECX_XSAVE|CPUID1_ECX_OSXSAVE))
+        == (CPUID1_ECX_XSAVE|CPUID1_ECX_OSXSAVE)) {
+        xen_cpuid(0xd, 0, &eax, &ebx, &ecx, &edx);
+        fpu_xcr0 = (((uint64_t)edx << 32) | eax)
+            & (XSTATE_FP|XSTATE_SSE|XSTATE_YMM);
+        asm volatile(".byte 0x0f,0x01,0xd1" /* xsetbv */
+                     : : "c" (0), "a" ((uint32_t)fpu_xcr0),
+                       "d" ((uint32_t)(fpu_xcr0 >> 32)));
+        /* ecx is the size for everything supported, always enough */
+        xen_cpuid(0xd, 0, &eax, &ebx, &ecx, &edx);
+        fpu_size = ecx;
+        fpu_xsave = 1;
+    }
+    printk("FPU: %s, %u byte save area\n",
+           fpu_xsave ? "xsave" : "fxsave", fpu_size);
+
+    /* the boot context isn't a thread, nothing to save for it */
+    fpu_owner = NULL;
+    fpu_set_ts();
+}
+
+/*
+ * Every thread gets its save area up front, #NM may come in the
+ * middle of the allocator.  A new thread starts from the state after
+ * fninit, with all exceptions masked in MXCSR.  An all-zero xsave
+ * header means the init state for everything but the legacy area.
+ */
+int fpu_thread_init(struct thread *thread)
+{
+    char *area;
+
+    if (fpu_owner == thread)
+        fpu_owner = NULL;
+    if (thread->thr_fpu == NULL
+        && (thread->thr_fpu = _xmalloc(fpu_size, 64)) == NULL)
+        return ENOMEM;
+    area = thread->thr_fpu;
+    memset(area, 0, fpu_size);
+    *(uint16_t *)(area + 0) = 0x37f;    /* FCW */
+    *(uint32_t *)(area + 24) = 0x1f80;  /* MXCSR */
+    return 0;
+}
+
+void fpu_thread_fini(struct thread *thread)
+{
+
+    if (fpu_owner == thread)
+        fpu_owner = NULL;
+    xfree(thread->thr_fpu);
+    thread->thr_fpu = NULL;
+}
+
+/* Called with the switch to next about to happen. */
+void fpu_switch(struct thread *next)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    if (!fpu_ts && fpu_owner != next)
+        fpu_set_ts();
+    local_irq_restore(flags);
+}
+
+/*
+ * Event callbacks run on top of whatever thread they interrupted,
+ * with the owner's state live in the registers.  Setting TS on every
+ * upcall would cost a hypercall, and the owner another #NM, so the
+ * callback paths are built with NOFPU_CFLAGS instead (arch.mk) and
+ * leave the registers alone.  If TS happens to be set already and a
+ * callback traps anyway, the owner's state is saved and TS is set
+ * again on the way out.
+ */
+void fpu_exit_callback(void)
+{
+
+    if (fpu_cbused) {
+        fpu_cbused = 0;
+        fpu_set_ts();
+    }
+}
+
+void do_device_not_available(struct pt_regs *regs, unsigned long error_code)
+{
+    struct thread *thread = current;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    fpu_ts = 0;
+    if (in_callback || thread == NULL) {
+        /* the registers are the callback's to scribble on */
+        if (fpu_owner != NULL)
+            fpu_save(fpu_owner->thr_fpu);
+        fpu_owner = NULL;
+        fpu_cbused = in_callback;
+    } else if (fpu_owner != thread) {
+        if (fpu_owner != NULL)
+            fpu_save(fpu_owner->thr_fpu);
+        fpu_restore(thread->thr_fpu);
+        fpu_owner = thread;
+    }
+    local_irq_restore(flags);
+}
@@ -70,6 +70,12 @@ void *ioremap_nocache(unsigned long phys_addr, unsigned long size)
     return __do_ioremap(phys_addr, size, IO_PROT_NOCACHE);
 }
 
+/* Write-combining, only for prefetchable memory */
+void *ioremap_wc(unsigned long phys_addr, unsigned long size)
+{
+    return __do_ioremap(phys_addr, size, IO_PROT_WC);
+}
+
 /* Un-map the io-remapped region. Currently no list of existing mappings is
  * maintained, so the caller has to supply the size */
 void iounmap(void *virt_addr, unsigned long size)
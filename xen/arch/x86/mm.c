@@ -39,6 +39,7 @@
 #include <mini-os/mm.h>
 #include <mini-os/types.h>
 #include <mini-os/lib.h>
+#include <mini-os/multicall.h>
 #include <xen/memory.h>
 
 #include <string.h>
@@ -66,7 +67,8 @@ static void new_pt_frame(unsigned long *pt_pfn, unsigned long prev_l_mfn,
     pgentry_t *tab = (pgentry_t *)start_info.pt_base;
     unsigned long pt_page = (unsigned long)pfn_to_virt(*pt_pfn); 
     pgentry_t prot_e, prot_t;
-    mmu_update_t mmu_updates[1];
+    mmu_update_t mmu_updates[2];
+    unsigned int done;
     int rc;
     
     prot_e = prot_t = 0;
@@ -100,7 +102,7 @@ static void new_pt_frame(unsigned long *pt_pfn, unsigned long prev_l_mfn,
         break;
     }
 
-    /* Make PFN a page table page */
+    /* Make PFN a page table page, then hook it into the hierarchy */
 #if defined(__x86_64__)
     tab = pte_to_virt(tab[l4_table_offset(pt_page)]);
 #endif
@@ -110,21 +112,15 @@ static void new_pt_frame(unsigned long *pt_pfn, unsigned long prev_l_mfn,
         sizeof(pgentry_t) * l1_table_offset(pt_page);
     mmu_updates[0].val = (pgentry_t)pfn_to_mfn(*pt_pfn) << PAGE_SHIFT | 
         (prot_e & ~_PAGE_RW);
-    
-    if ( (rc = HYPERVISOR_mmu_update(mmu_updates, 1, NULL, DOMID_SELF)) < 0 )
-    {
-        printk("ERROR: PTE for new page table page could not be updated\n");
-        printk("       mmu_update failed with rc=%d\n", rc);
-        do_exit();
-    }
-
-    /* Hook the new page table page into the hierarchy */
-    mmu_updates[0].ptr =
+    mmu_updates[1].ptr =
         ((pgentry_t)prev_l_mfn << PAGE_SHIFT) + sizeof(pgentry_t) * offset;
-    mmu_updates[0].val = (pgentry_t)pfn_to_mfn(*pt_pfn) << PAGE_SHIFT | prot_t;
+    mmu_updates[1].val = (pgentry_t)pfn_to_mfn(*pt_pfn) << PAGE_SHIFT | prot_t;
 
-    if ( (rc = HYPERVISOR_mmu_update(mmu_updates, 1, NULL, DOMID_SELF)) < 0 ) 
+    /* one hypercall, done in order */
+    if ( (rc = HYPERVISOR_mmu_update(mmu_updates, 2, &done, DOMID_SELF)) < 0 )
     {
+        if ( done == 0 )
+            printk("ERROR: PTE for new page table page could not be updated\n");
         printk("ERROR: mmu_update failed with rc=%d\n", rc);
         do_exit();
     }
@@ -219,7 +215,13 @@ static void build_pagetable(unsigned long *start_pfn, unsigned long *max_pfn)
     start_address = (unsigned long)pfn_to_virt(pfn_to_map);
     end_address = (unsigned long)pfn_to_virt(*max_pfn);
 
-    /* We worked out the virtual memory range to map, now mapping loop */
+    /*
+     * We worked out the virtual memory range to map, now mapping loop.
+     * Everything goes in with 4K PTEs.  A PV guest can't map 2MB
+     * superpages: page table frames later allocated out of the heap by
+     * need_pgt() have to be mapped read-only everywhere, which a large
+     * writable mapping over the heap would make impossible.
+     */
     printk("Mapping memory range 0x%lx - 0x%lx\n", start_address, end_address);
 
     while ( start_address < end_address )
@@ -531,7 +533,8 @@ unsigned long allocate_ondemand(unsigned long n, unsigned long alignment)
                 pgt = get_pgt(addr);
             if ( pgt )
             {
-                if ( *pgt & _PAGE_PRESENT )
+                /* stack guards are not present, but still taken */
+                if ( *pgt )
                     break;
                 pgt++;
             }
@@ -551,7 +554,7 @@ unsigned long allocate_ondemand(unsigned long n, unsigned long alignment)
  * Map an array of MFNs contiguously into virtual address space starting at
  * va. map f[i*stride]+i*increment for i in 0..n-1.
  */
-#define MAP_BATCH ((STACK_SIZE / 2) / sizeof(mmu_update_t))
+#define MAP_BATCH 64
 void do_map_frames(unsigned long va,
                    const unsigned long *mfns, unsigned long n, 
                    unsigned long stride, unsigned long incr, 
@@ -560,6 +563,7 @@ void do_map_frames(unsigned long va,
     pgentry_t *pgt = NULL;
     unsigned long done = 0;
     unsigned long i;
+    unsigned int mapped;
     int rc;
 
     if ( !mfns ) 
@@ -574,23 +578,19 @@ void do_map_frames(unsigned long va,
         memset(err, 0x00, n * sizeof(int));
     while ( done < n )
     {
-        unsigned long todo;
-
-        if ( err )
-            todo = 1;
-        else
-            todo = n - done;
+        unsigned long todo = n - done;
 
         if ( todo > MAP_BATCH )
             todo = MAP_BATCH;
 
         {
             mmu_update_t mmu_updates[todo];
+            unsigned long bva = va + done * PAGE_SIZE;
 
-            for ( i = 0; i < todo; i++, va += PAGE_SIZE, pgt++) 
+            for ( i = 0, pgt = NULL; i < todo; i++, bva += PAGE_SIZE, pgt++) 
             {
-                if ( !pgt || !(va & L1_MASK) )
-                    pgt = need_pgt(va);
+                if ( !pgt || !(bva & L1_MASK) )
+                    pgt = need_pgt(bva);
                 
                 mmu_updates[i].ptr = virt_to_mach(pgt) | MMU_NORMAL_PT_UPDATE;
                 mmu_updates[i].val = ((pgentry_t)(mfns[(done + i) * stride] +
@@ -598,14 +598,22 @@ void do_map_frames(unsigned long va,
                                       << PAGE_SHIFT) | prot;
             }
 
-            rc = HYPERVISOR_mmu_update(mmu_updates, todo, NULL, id);
+            /*
+             * The whole batch in one go, even with err: the success
+             * count says where a failure was, and the rest is tried
+             * again past it.
+             */
+            mapped = 0;
+            rc = HYPERVISOR_mmu_update(mmu_updates, todo, &mapped, id);
             if ( rc < 0 )
             {
-                if (err)
-                    err[done * stride] = rc;
-                else {
+                if (err) {
+                    err[(done + mapped) * stride] = rc;
+                    todo = mapped + 1;
+                } else {
                     printk("Map %ld (%lx, ...) at %p failed: %d.\n",
-                           todo, mfns[done * stride] + done * incr, va, rc);
+                           todo, mfns[done * stride] + done * incr,
+                           va + done * PAGE_SIZE, rc);
                     do_exit();
                 }
             }
@@ -634,55 +642,118 @@ void *map_frames_ex(const unsigned long *mfns, unsigned long n,
 }
 
 /*
- * Unmap nun_frames frames mapped at virtual address va.
+ * Unmap nun_frames frames mapped at virtual address va.  The PTEs are
+ * cleared with mmu_updates batched into multicalls, followed by
+ * invlpg for a few pages or a TLB flush for more.
  */
-#define UNMAP_BATCH ((STACK_SIZE / 2) / sizeof(multicall_entry_t))
+#define UNMAP_INVLPG_MAX 4
 int unmap_frames(unsigned long va, unsigned long num_frames)
 {
-    int n = UNMAP_BATCH;
-    multicall_entry_t call[n];
+    struct multicall mc;
+    pgentry_t *pgt = NULL;
+    unsigned long i;
     int ret;
-    int i;
 
     ASSERT(!((unsigned long)va & ~PAGE_MASK));
 
     DEBUG("va=%p, num=0x%lx\n", va, num_frames);
 
-    while ( num_frames ) {
-        if ( n > num_frames )
-            n = num_frames;
-
-        for ( i = 0; i < n; i++ )
+    multicall_init(&mc);
+    for ( i = 0; i < num_frames; i++, pgt++ )
+    {
+        if ( !pgt || !((va + i * PAGE_SIZE) & L1_MASK) )
+            pgt = get_pgt(va + i * PAGE_SIZE);
+        if ( !pgt )
         {
-            int arg = 0;
-            /* simply update the PTE for the VA and invalidate TLB */
-            call[i].op = __HYPERVISOR_update_va_mapping;
-            call[i].args[arg++] = va;
-            call[i].args[arg++] = 0;
-#ifdef __i386__
-            call[i].args[arg++] = 0;
-#endif  
-            call[i].args[arg++] = UVMF_INVLPG;
-
-            va += PAGE_SIZE;
+            printk("unmap_frames: no page table for %lx\n",
+                   va + i * PAGE_SIZE);
+            multicall_flush(&mc);
+            return EINVAL;
         }
+        multicall_mmu_update(&mc, virt_to_mach(pgt) | MMU_NORMAL_PT_UPDATE,
+                             0, DOMID_SELF);
+    }
+    if ( num_frames <= UNMAP_INVLPG_MAX )
+        for ( i = 0; i < num_frames; i++ )
+            multicall_mmuext(&mc, MMUEXT_INVLPG_LOCAL, va + i * PAGE_SIZE);
+    else
+        multicall_mmuext(&mc, MMUEXT_TLB_FLUSH_LOCAL, 0);
 
-        ret = HYPERVISOR_multicall(call, n);
-        if ( ret )
-        {
-            printk("update_va_mapping hypercall failed with rc=%d.\n", ret);
-            return -ret;
-        }
+    ret = multicall_flush(&mc);
+    if ( ret )
+    {
+        printk("unmap_frames: multicall failed with rc=%d.\n", ret);
+        return -ret;
+    }
+    return 0;
+}
 
-        for ( i = 0; i < n; i++ )
-        {
-            if ( call[i].result ) 
-            {
-                printk("update_va_mapping failed for with rc=%d.\n", ret);
-                return -(call[i].result);
-            }
-        }
-        num_frames -= n;
+/*
+ * Thread stacks are mapped from the demand map area with a guard page
+ * below, so that running off the end faults instead of scribbling
+ * over the neighbour.  The guard PTE is left non-zero, which keeps
+ * allocate_ondemand() from handing the slot out.  The backing pages
+ * come from the page allocator in one run, found again on unmap from
+ * the first PTE.
+ */
+#define STACK_GUARD_PTE 0x200ULL /* available bit, not present */
+void *map_stack(unsigned long npages)
+{
+    unsigned long mfns[MAP_BATCH];
+    unsigned long guard = 0;
+    unsigned long va, backing, i, j, n;
+
+    if ( (va = allocate_ondemand(npages + 1, 1)) == 0 )
+        return NULL;
+    if ( (backing = alloc_pages_exact(npages, PAGE_SIZE)) == 0 )
+        return NULL;
+
+    do_map_frames(va, &guard, 1, 0, 0, DOMID_SELF, NULL, STACK_GUARD_PTE);
+    va += PAGE_SIZE;
+    for ( i = 0; i < npages; i += n )
+    {
+        n = npages - i;
+        if ( n > MAP_BATCH )
+            n = MAP_BATCH;
+        for ( j = 0; j < n; j++ )
+            mfns[j] = virt_to_mfn(backing + (i + j) * PAGE_SIZE);
+        do_map_frames(va + i * PAGE_SIZE, mfns, n, 1, 0, DOMID_SELF, NULL,
+                      L1_PROT);
+    }
+    return (void *)va;
+}
+
+void unmap_stack(void *stack, unsigned long npages)
+{
+    unsigned long va = (unsigned long)stack;
+    void *backing = mfn_to_virt(virtual_to_mfn(va));
+
+    unmap_frames(va - PAGE_SIZE, npages + 1);
+    free_pages_exact(backing, npages);
+}
+
+/*
+ * Take pages of the 1:1 area out of the page tables, or put them back,
+ * for guard pages in memory from the page allocator.  Pages must be
+ * accessible again before they are freed.
+ */
+int protect_pages(unsigned long va, unsigned long npages, int noaccess)
+{
+    pgentry_t *pgt;
+    pgentry_t val;
+    unsigned long i;
+    int rc;
+
+    for ( i = 0; i < npages; i++, va += PAGE_SIZE )
+    {
+        pgt = need_pgt(va);
+        if ( !(*pgt & _PAGE_PRESENT) == !!noaccess )
+            continue;
+        val = noaccess ? 0 : (((pgentry_t)virt_to_mfn(va) << PAGE_SHIFT)
+                              | L1_PROT);
+        rc = HYPERVISOR_update_va_mapping(va, __pte(val), UVMF_INVLPG);
+        if ( rc )
+            return rc;
     }
     return 0;
 }
@@ -856,8 +927,6 @@ static void clear_bootstrap(void)
         printk("Unable to unmap NULL page. rc=%d\n", rc);
 }
 
-void arch_init_p2m(unsigned long max_pfn)
-{
 #ifdef __x86_64__
 #define L1_P2M_SHIFT    9
 #define L2_P2M_SHIFT    18    
@@ -873,35 +942,61 @@ void arch_init_p2m(unsigned long max_pfn)
 #define L1_P2M_MASK     (L1_P2M_ENTRIES - 1)    
 #define L2_P2M_MASK     (L2_P2M_ENTRIES - 1)    
 #define L3_P2M_MASK     (L3_P2M_ENTRIES - 1)    
-    
-    unsigned long *l1_list = NULL, *l2_list = NULL, *l3_list;
+
+/*
+ * The frame lists tell the toolstack where the p2m is, for a save.
+ * Their leaves are the pages of phys_to_machine_mapping itself, so
+ * that ballooning is seen without further ado and that a restore,
+ * which rewrites those pages with the new mfns, leaves a p2m we can
+ * use.  The lists hold mfns, so they are rebuilt after a restore.
+ */
+static unsigned long *p2m_l3_list;
+static unsigned long *p2m_l2_lists[L3_P2M_ENTRIES];
+static unsigned long p2m_max_pfn;
+
+static void arch_fill_p2m(void)
+{
+    unsigned long *l2_list = NULL;
     unsigned long pfn;
-    
-    l3_list = (unsigned long *)alloc_page(); 
-    for ( pfn=0; pfn<max_pfn; pfn++ )
+
+    for ( pfn = 0; pfn < p2m_max_pfn; pfn += L1_P2M_ENTRIES )
     {
         if ( !(pfn % (L1_P2M_ENTRIES * L2_P2M_ENTRIES)) )
         {
-            l2_list = (unsigned long*)alloc_page();
-            if ( (pfn >> L3_P2M_SHIFT) > 0 )
-            {
-                printk("Error: Too many pfns.\n");
-                do_exit();
-            }
-            l3_list[(pfn >> L2_P2M_SHIFT)] = virt_to_mfn(l2_list);  
-        }
-        if ( !(pfn % (L1_P2M_ENTRIES)) )
-        {
-            l1_list = (unsigned long*)alloc_page();
-            l2_list[(pfn >> L1_P2M_SHIFT) & L2_P2M_MASK] = 
-                virt_to_mfn(l1_list); 
+            l2_list = p2m_l2_lists[pfn >> L2_P2M_SHIFT];
+            p2m_l3_list[pfn >> L2_P2M_SHIFT] = virt_to_mfn(l2_list);
         }
-
-        l1_list[pfn & L1_P2M_MASK] = pfn_to_mfn(pfn); 
+        l2_list[(pfn >> L1_P2M_SHIFT) & L2_P2M_MASK] =
+            virt_to_mfn(phys_to_machine_mapping + pfn);
     }
     HYPERVISOR_shared_info->arch.pfn_to_mfn_frame_list_list = 
-        virt_to_mfn(l3_list);
-    HYPERVISOR_shared_info->arch.max_pfn = max_pfn;
+        virt_to_mfn(p2m_l3_list);
+    HYPERVISOR_shared_info->arch.max_pfn = p2m_max_pfn;
+}
+
+void arch_init_p2m(unsigned long max_pfn)
+{
+    unsigned long pfn;
+
+    if ( ((max_pfn - 1) >> L3_P2M_SHIFT) > 0 )
+    {
+        printk("Error: Too many pfns.\n");
+        do_exit();
+    }
+    ASSERT(!((unsigned long)phys_to_machine_mapping & ~PAGE_MASK));
+
+    p2m_l3_list = (unsigned long *)alloc_page(); 
+    for ( pfn = 0; pfn < max_pfn; pfn += L1_P2M_ENTRIES * L2_P2M_ENTRIES )
+        p2m_l2_lists[pfn >> L2_P2M_SHIFT] = (unsigned long *)alloc_page();
+    p2m_max_pfn = max_pfn;
+    arch_fill_p2m();
+}
+
+/* After a restore: same pages, new mfns, new shared info. */
+void arch_rebuild_p2m(void)
+{
+
+    arch_fill_p2m();
 }
 
 void arch_init_mm(unsigned long* start_pfn_p, unsigned long* max_pfn_p)
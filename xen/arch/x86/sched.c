@@ -47,7 +47,7 @@
 
 void dump_stack(struct thread *thread)
 {
-    unsigned long *bottom = (unsigned long *)(thread->stack + STACK_SIZE); 
+    unsigned long *bottom = (unsigned long *)(thread->stack + thread->stack_size);
     unsigned long *pointer = (unsigned long *)thread->thr_sp;
     int count;
     if(thread == current)
@@ -83,27 +83,46 @@ static void stack_push(struct thread *thread, unsigned long value)
 
 /* Architecture specific setup of thread creation */
 struct thread* arch_create_thread(const char *name, void (*function)(void *),
-                                  void *data, void *stack)
+                                  void *data, void *stack, size_t stack_size)
 {
     struct thread *thread;
     
-    thread = xmalloc(struct thread);
+    if (stack_size == 0)
+        stack_size = STACK_SIZE;
     /* We can't use lazy allocation here since the trap handler runs on the stack */
     if (!stack) {
-        thread->stack = (char *)alloc_pages(STACK_SIZE_PAGE_ORDER);
+        stack_size = (stack_size + PAGE_SIZE-1) & PAGE_MASK;
+        if ((thread = thread_cache_get(stack_size)) == NULL) {
+            thread = xmalloc(struct thread);
+            thread->thr_fpu = NULL;
+            thread->stack = map_stack(stack_size >> PAGE_SHIFT);
+            if (thread->stack == NULL) {
+                xfree(thread);
+                return NULL;
+            }
+        }
+        thread->flags = 0;
 #if 0
         printk("Thread \"%s\": pointer: 0x%lx, stack: 0x%lx\n", name, thread, 
                 thread->stack);
 #endif
     } else {
+	thread = xmalloc(struct thread);
+	thread->thr_fpu = NULL;
 	thread->stack = stack;
-	thread->flags |= THREAD_EXTSTACK;
+	thread->flags = THREAD_EXTSTACK;
+    }
+    if (fpu_thread_init(thread) != 0) {
+        if (!stack)
+            unmap_stack(thread->stack, stack_size >> PAGE_SHIFT);
+        xfree(thread);
+        return NULL;
     }
     thread->name = name;
+    thread->stack_size = stack_size;
     
-    thread->thr_sp = (unsigned long)thread->stack + STACK_SIZE;
-    /* Save pointer to the thread on the stack, used by current macro */
-    *((unsigned long *)thread->stack) = (unsigned long)thread;
+    /* external stacks may be any size, keep the ABI alignment */
+    thread->thr_sp = ((unsigned long)thread->stack + stack_size) & ~15UL;
     
     stack_push(thread, (unsigned long) function);
     stack_push(thread, (unsigned long) data);
@@ -113,6 +132,7 @@ struct thread* arch_create_thread(const char *name, void (*function)(void *),
 
 void run_idle_thread(void)
 {
+    current_thread = idle_thread;
     /* Switch stacks and run the thread */ 
 #if defined(__i386__)
     __asm__ __volatile__("mov %0,%%esp\n\t"
@@ -27,6 +27,7 @@
  */
 
 #include <mini-os/os.h>
+#include <mini-os/mm.h>
 
 #include <string.h>
 
@@ -42,6 +43,9 @@ shared_info_t *HYPERVISOR_shared_info;
  */
 union start_info_union start_info_union;
 
+/* the page Xen handed us, where a restore leaves the new start info */
+static start_info_t *start_info_ptr;
+
 /*
  * Just allocate the kernel stack here. SS:ESP is set up to point here
  * in head.S.
@@ -82,6 +86,8 @@ arch_init(start_info_t *si)
 	/* WARN: don't do printk before here, it uses information from
 	   shared_info. Use xprintk instead. */
 	memcpy(&start_info, si, sizeof(*si));
+	start_info_ptr = si;
+	init_string();
 
 	/* set up minimal memory infos */
 	phys_to_machine_mapping = (unsigned long *)start_info.mfn_list;
@@ -102,6 +108,54 @@ arch_init(start_info_t *si)
 
 }
 
+/*
+ * Suspend support.  The save record wants the xenstore and console
+ * frames as pfns, and no mapping of the shared info page, which isn't
+ * part of our memory.  Until it is mapped again, event masking goes
+ * to a stand-in page.
+ */
+static shared_info_t dummy_shared_info;
+
+void
+arch_pre_suspend(void)
+{
+
+	start_info_ptr->store_mfn = mfn_to_pfn(start_info.store_mfn);
+	start_info_ptr->console.domU.mfn =
+	    mfn_to_pfn(start_info.console.domU.mfn);
+
+	dummy_shared_info.vcpu_info[0].evtchn_upcall_mask = 1;
+	HYPERVISOR_shared_info = &dummy_shared_info;
+	HYPERVISOR_update_va_mapping((unsigned long)shared_info, __pte(0),
+	    UVMF_INVLPG);
+}
+
+/* Returns 0 when resumed in a new domain, non-zero if cancelled. */
+int
+arch_suspend(void)
+{
+
+	return HYPERVISOR_suspend(virt_to_mfn(start_info_ptr));
+}
+
+void
+arch_post_suspend(int cancelled)
+{
+
+	if (cancelled) {
+		start_info_ptr->store_mfn = start_info.store_mfn;
+		start_info_ptr->console.domU.mfn = start_info.console.domU.mfn;
+	} else {
+		memcpy(&start_info, start_info_ptr, sizeof(start_info));
+	}
+
+	HYPERVISOR_shared_info = map_shared_info(start_info.shared_info);
+	/* a new domain's page has events enabled, keep them off for now */
+	HYPERVISOR_shared_info->vcpu_info[0].evtchn_upcall_mask = 1;
+	if (!cancelled)
+		arch_rebuild_p2m();
+}
+
 void
 arch_fini(void)
 {
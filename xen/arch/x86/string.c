@@ -0,0 +1,79 @@
+/*
+ ****************************************************************************
+ *
+ *        File: string.c
+ *
+ * Environment: Xen Minimal OS
+ * Description: memcpy() and memset() for Mini-OS and the libc linked
+ *  with it, which finds these before its own.  Both are string
+ *  instructions: with fast strings (ERMS) rep movsb/stosb is as quick
+ *  as anything for all sizes, without it the bulk goes a word at a
+ *  time.  Vector loops would not win by enough to pay for pulling
+ *  every caller's FPU state in and out, see fpu.c.
+ *
+ ****************************************************************************
+ */
+#include <mini-os/os.h>
+#include <mini-os/lib.h>
+
+#include <string.h>
+
+#define CPUID7_EBX_ERMS		(1U << 9)
+
+#ifdef __x86_64__
+#define STR_WORD	8
+#define STR_MOVS	"rep movsq"
+#define STR_STOS	"rep stosq"
+#else
+#define STR_WORD	4
+#define STR_MOVS	"rep movsl"
+#define STR_STOS	"rep stosl"
+#endif
+
+/* word at a time until init_string() knows better */
+static int string_erms;
+
+void init_string(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    xen_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 7)
+        return;
+    xen_cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+    string_erms = !!(ebx & CPUID7_EBX_ERMS);
+}
+
+void *memcpy(void *dst, const void *src, size_t n)
+{
+    void *ret = dst;
+    size_t words;
+
+    if (!string_erms) {
+        words = n / STR_WORD;
+        n %= STR_WORD;
+        asm volatile(STR_MOVS
+                     : "+D" (dst), "+S" (src), "+c" (words) : : "memory");
+    }
+    asm volatile("rep movsb"
+                 : "+D" (dst), "+S" (src), "+c" (n) : : "memory");
+    return ret;
+}
+
+void *memset(void *dst, int c, size_t n)
+{
+    void *ret = dst;
+    unsigned long pattern;
+    size_t words;
+
+    if (!string_erms) {
+        pattern = (unsigned char)c * (~0UL / 0xff);
+        words = n / STR_WORD;
+        n %= STR_WORD;
+        asm volatile(STR_STOS
+                     : "+D" (dst), "+c" (words) : "a" (pattern) : "memory");
+    }
+    asm volatile("rep stosb"
+                 : "+D" (dst), "+c" (n) : "a" (c) : "memory");
+    return ret;
+}
@@ -38,6 +38,8 @@
 #include <mini-os/events.h>
 #include <mini-os/time.h>
 #include <mini-os/lib.h>
+#include <mini-os/multicall.h>
+#include <mini-os/stats.h>
 
 /************************************************************************
  * Time functions
@@ -55,7 +57,21 @@ struct shadow_time_info {
 static struct timespec shadow_ts;
 static uint32_t shadow_ts_version;
 
-static struct shadow_time_info shadow;
+/*
+ * Two copies, so that the timer interrupt can refresh one while
+ * monotonic_clock() is reading the other.
+ */
+static struct shadow_time_info shadow_buf[2];
+static struct shadow_time_info *volatile shadow = &shadow_buf[0];
+static int tsc_stable;
+
+/*
+ * Added to Xen's system time.  A restore starts that over from the
+ * new domain's creation, the offset carries on from where the saved
+ * domain stopped, so that NOW() never runs backwards.
+ */
+static s_time_t time_offset;
+static s_time_t suspend_now;
 
 
 #ifndef rmb
@@ -71,14 +87,6 @@ static struct shadow_time_info shadow;
         }                                  \
     } while ( 0 )
 
-static inline int time_values_up_to_date(void)
-{
-	struct vcpu_time_info *src = &HYPERVISOR_shared_info->vcpu_info[0].time; 
-
-	return (shadow.version == src->version);
-}
-
-
 /*
  * Scale a 64-bit delta by scaling and multiplying by a 32-bit fraction,
  * yielding a 64-bit result.
@@ -116,31 +124,43 @@ static inline uint64_t scale_delta(uint64_t delta, uint32_t mul_frac, int shift)
 }
 
 
-static unsigned long get_nsec_offset(void)
+
+static inline uint64_t get_nsec_offset(const struct shadow_time_info *t)
 {
-	uint64_t now, delta;
+	uint64_t now;
+
 	rdtscll(now);
-	delta = now - shadow.tsc_timestamp;
-	return scale_delta(delta, shadow.tsc_to_nsec_mul, shadow.tsc_shift);
+	return scale_delta(now - t->tsc_timestamp, t->tsc_to_nsec_mul,
+	    t->tsc_shift);
 }
 
 
+/*
+ * Only called with interrupts off or from the timer interrupt.  Fills
+ * the copy readers aren't looking at, then flips them over.
+ */
 static void get_time_values_from_xen(void)
 {
 	struct vcpu_time_info    *src = &HYPERVISOR_shared_info->vcpu_info[0].time;
+	struct shadow_time_info *t = &shadow_buf[shadow == &shadow_buf[0]];
 
  	do {
-		shadow.version = src->version;
+		t->version = src->version;
 		rmb();
-		shadow.tsc_timestamp     = src->tsc_timestamp;
-		shadow.system_timestamp  = src->system_time;
-		shadow.tsc_to_nsec_mul   = src->tsc_to_system_mul;
-		shadow.tsc_shift         = src->tsc_shift;
+		t->tsc_timestamp     = src->tsc_timestamp;
+		t->system_timestamp  = src->system_time;
+		t->tsc_to_nsec_mul   = src->tsc_to_system_mul;
+		t->tsc_shift         = src->tsc_shift;
+#ifdef XEN_PVCLOCK_TSC_STABLE_BIT
+		tsc_stable = (src->flags & XEN_PVCLOCK_TSC_STABLE_BIT) != 0;
+#endif
 		rmb();
 	}
-	while ((src->version & 1) | (shadow.version ^ src->version));
+	while ((src->version & 1) | (t->version ^ src->version));
 
-	shadow.tsc_to_usec_mul = shadow.tsc_to_nsec_mul / 1000;
+	t->tsc_to_usec_mul = t->tsc_to_nsec_mul / 1000;
+	wmb();
+	shadow = t;
 }
 
 
@@ -149,22 +169,38 @@ static void get_time_values_from_xen(void)
 /* monotonic_clock(): returns # of nanoseconds passed since time_init()
  *		Note: This function is required to return accurate
  *		time even in the absence of multiple timer ticks.
+ *
+ * The copy taken by the timer interrupt is only good while it matches
+ * the version in shared_info: Xen rewrites vcpu_time_info after a
+ * migration or a TSC rescale.  With a stable TSC nothing else can
+ * move under us, so that one check is all there is before the rdtsc
+ * and scale; otherwise the reads are ordered and retried.
  */
 uint64_t monotonic_clock(void)
 {
+	struct vcpu_time_info *src = &HYPERVISOR_shared_info->vcpu_info[0].time;
+	const struct shadow_time_info *t;
+	unsigned long flags;
 	uint64_t time;
-	uint32_t local_time_version;
 
-	do {
-		local_time_version = shadow.version;
+	if (likely(tsc_stable)) {
+		t = shadow;
+		if (likely(t->version == src->version))
+			return t->system_timestamp + get_nsec_offset(t)
+			    + time_offset;
+	}
+
+	for (;;) {
+		t = shadow;
 		rmb();
-		time = shadow.system_timestamp + get_nsec_offset();
-        if (!time_values_up_to_date())
-			get_time_values_from_xen();
+		time = t->system_timestamp + get_nsec_offset(t);
 		rmb();
-	} while (local_time_version != shadow.version);
-
-	return time;
+		if (likely(t->version == src->version))
+			return time + time_offset;
+		local_irq_save(flags);
+		get_time_values_from_xen();
+		local_irq_restore(flags);
+	}
 }
 
 static void update_wallclock(void)
@@ -181,16 +217,125 @@ static void update_wallclock(void)
 	while ((s->wc_version & 1) | (shadow_ts_version ^ s->wc_version));
 }
 
+/*
+ * Nanoseconds since the epoch.  Xen gives the wall time at system
+ * time zero, the rest is monotonic_clock().
+ */
+s_time_t wallclock(void)
+{
+	unsigned long flags;
+	s_time_t base;
 
-void block_domain(s_time_t until)
+	local_irq_save(flags);
+	base = SECONDS(shadow_ts.tv_sec) + shadow_ts.tv_nsec - time_offset;
+	local_irq_restore(flags);
+
+	return base + NOW();
+}
+
+
+/*
+ * Halt polling: before blocking, spin for a while on the upcall
+ * pending flag, which Xen sets even with events masked.  An event
+ * that shows up within the window costs no trip through the
+ * hypervisor's scheduler.  The window adapts the way KVM's does: it
+ * doubles when a block ended with an event sooner than poll_max, and
+ * halves when the domain stayed idle for longer, so that idle spells
+ * don't keep burning CPU.  poll_max 0, the default, turns it off.
+ */
+#define POLL_GROW_START MICROSECS(10)
+
+static s_time_t poll_max;
+static s_time_t poll_ns;
+static uint64_t poll_hits, poll_misses, poll_blocks;
+
+void block_domain_set_poll(s_time_t max)
+{
+
+    poll_max = max > 0 ? max : 0;
+    if (poll_ns > poll_max)
+        poll_ns = poll_max;
+}
+
+static void poll_adjust(s_time_t idle, int event)
+{
+
+    if (event && idle <= poll_max) {
+        poll_ns = poll_ns ? poll_ns * 2 : POLL_GROW_START;
+        if (poll_ns > poll_max)
+            poll_ns = poll_max;
+    } else if (idle > poll_max) {
+        poll_ns /= 2;
+        if (poll_ns < POLL_GROW_START)
+            poll_ns = 0;
+    }
+}
+
+static void poll_dump(void)
+{
+
+    printk("haltpoll: window %lu/%lu us, %lu hits, %lu misses, "
+        "%lu blocks\n", (unsigned long)NSEC_TO_USEC(poll_ns),
+        (unsigned long)NSEC_TO_USEC(poll_max), (unsigned long)poll_hits,
+        (unsigned long)poll_misses, (unsigned long)poll_blocks);
+}
+
+/*
+ * Block until an event arrives, at the latest somewhere in
+ * [earliest, latest].  A timer already programmed inside the window
+ * is reused instead of reprogramming the hypervisor.  Returns early,
+ * with the event still pending, if it came in while polling.
+ */
+static s_time_t timer_deadline;
+
+void block_domain_range(s_time_t earliest, s_time_t latest)
 {
+    vcpu_info_t *vcpu;
+    struct multicall mc;
+    s_time_t start, now, end;
+
     ASSERT(irqs_disabled());
-    if(monotonic_clock() < until)
-    {
-        HYPERVISOR_set_timer_op(until);
-        HYPERVISOR_sched_op(SCHEDOP_block, 0);
-        local_irq_disable();
+    vcpu = &HYPERVISOR_shared_info->vcpu_info[smp_processor_id()];
+    start = now = monotonic_clock();
+    if (now >= earliest)
+        return;
+
+    if (poll_ns) {
+        end = now + poll_ns < earliest ? now + poll_ns : earliest;
+        while (!vcpu->evtchn_upcall_pending
+          && (now = monotonic_clock()) < end)
+            cpu_relax();
+        if (vcpu->evtchn_upcall_pending) {
+            poll_hits++;
+            return;
+        }
+        poll_misses++;
+        if (now >= earliest)
+            return;
     }
+
+    /* timer and block in one trip to the hypervisor */
+    multicall_init(&mc);
+    if (timer_deadline <= now
+      || timer_deadline < earliest || timer_deadline > latest) {
+        multicall_set_timer(&mc, latest - time_offset);
+        timer_deadline = latest;
+    }
+    multicall_sched_op(&mc, SCHEDOP_block, NULL);
+    multicall_flush(&mc);
+    local_irq_disable();
+    poll_blocks++;
+
+    if (poll_max) {
+        now = monotonic_clock();
+        poll_adjust(now - start, now < earliest);
+    }
+}
+
+void block_domain(s_time_t until)
+{
+
+    block_domain_range(until, until);
 }
 
 
@@ -209,6 +354,30 @@ static evtchn_port_t port;
 void init_time(void)
 {
     printk("Initialising timer interface\n");
+    update_wallclock();
+    port = bind_virq(VIRQ_TIMER, &timer_handler, NULL);
+    unmask_evtchn(port);
+    stats_register("haltpoll", poll_dump);
+}
+
+/* Called with interrupts off around the suspend hypercall. */
+void suspend_time(void)
+{
+
+    suspend_now = NOW();
+}
+
+void resume_time(int cancelled)
+{
+
+    timer_deadline = 0;
+    get_time_values_from_xen();
+    update_wallclock();
+    if (cancelled)
+        return;
+
+    time_offset = 0;
+    time_offset = suspend_now - monotonic_clock();
     port = bind_virq(VIRQ_TIMER, &timer_handler, NULL);
     unmask_evtchn(port);
 }
@@ -88,7 +88,6 @@ DO_ERROR( 3, "int3", int3)
 DO_ERROR( 4, "overflow", overflow)
 DO_ERROR( 5, "bounds", bounds)
 DO_ERROR_INFO( 6, "invalid operand", invalid_op, ILL_ILLOPN, regs->eip)
-DO_ERROR( 7, "device not available", device_not_available)
 DO_ERROR( 9, "coprocessor segment overrun", coprocessor_segment_overrun)
 DO_ERROR(10, "invalid TSS", invalid_TSS)
 DO_ERROR(11, "segment not present", segment_not_present)
@@ -328,6 +327,7 @@ static trap_info_t trap_table[] = {
 void trap_init(void)
 {
     HYPERVISOR_set_trap_table(trap_table);    
+    init_fpu();
 }
 
 void trap_fini(void)
@@ -0,0 +1,216 @@
+/*
+ ****************************************************************************
+ *
+ *        File: balloon.c
+ *
+ * Environment: Xen Minimal OS
+ * Description: Balloon driver.  Follows memory/target in xenstore by
+ *  giving free pages back to Xen and populating them again later.
+ *  The domain never grows beyond the memory it was booted with.
+ *
+ ****************************************************************************
+ */
+#include <mini-os/os.h>
+#include <mini-os/mm.h>
+#include <mini-os/hypervisor.h>
+#include <mini-os/xenbus.h>
+#include <mini-os/sched.h>
+#include <mini-os/balloon.h>
+#include <xen/memory.h>
+
+#include <string.h>
+
+/* Don't balloon the page allocator below this many free pages. */
+#define BALLOON_RESERVE_PAGES 256
+#define BALLOON_BATCH 64
+
+/*
+ * PFNs handed back to Xen are remembered in a stack of pages, so
+ * that bookkeeping costs nothing while the balloon is empty.
+ */
+#define CHUNK_PFNS ((PAGE_SIZE - 2*sizeof(unsigned long)) / sizeof(xen_pfn_t))
+struct balloon_chunk {
+    struct balloon_chunk *next;
+    unsigned long n;
+    xen_pfn_t pfns[CHUNK_PFNS];
+};
+
+static struct balloon_chunk *chunks;
+static unsigned long nr_ballooned;
+static unsigned long nr_boot_pages;
+static unsigned long (*balloon_reserve)(void);
+
+unsigned long balloon_current_pages(void)
+{
+    return nr_boot_pages - nr_ballooned;
+}
+
+void balloon_set_reserve(unsigned long (*reserve)(void))
+{
+    balloon_reserve = reserve;
+}
+
+static int balloon_map(unsigned long va, unsigned long mfn)
+{
+    phys_to_machine_mapping[virt_to_pfn(va)] = mfn;
+    return HYPERVISOR_update_va_mapping(va,
+                                        __pte((mfn << PAGE_SHIFT) | L1_PROT),
+                                        UVMF_INVLPG);
+}
+
+static int balloon_unmap(unsigned long va)
+{
+    phys_to_machine_mapping[virt_to_pfn(va)] = INVALID_P2M_ENTRY;
+    return HYPERVISOR_update_va_mapping(va, __pte(0), UVMF_INVLPG);
+}
+
+/*
+ * Inflate the balloon: give up to n free pages back to Xen.  Returns
+ * how many went.
+ */
+static unsigned long balloon_inflate(unsigned long n)
+{
+    unsigned long pages[BALLOON_BATCH];
+    xen_pfn_t mfns[BALLOON_BATCH];
+    struct balloon_chunk *ch;
+    unsigned long done = 0;
+    int i, batch, got, rc;
+
+    while (done < n) {
+        if (chunks == NULL || chunks->n == CHUNK_PFNS) {
+            if ((ch = (void *)alloc_page()) == NULL)
+                break;
+            ch->next = chunks;
+            ch->n = 0;
+            chunks = ch;
+        }
+        batch = BALLOON_BATCH;
+        if (batch > n - done)
+            batch = n - done;
+        if (batch > CHUNK_PFNS - chunks->n)
+            batch = CHUNK_PFNS - chunks->n;
+
+        got = alloc_pages_bulk(pages, batch);
+        for (i = 0; i < got; i++) {
+            mfns[i] = virt_to_mfn(pages[i]);
+            balloon_unmap(pages[i]);
+        }
+        rc = free_physical_pages(mfns, got);
+        if (rc < 0)
+            rc = 0;
+        for (i = 0; i < rc; i++)
+            chunks->pfns[chunks->n++] = virt_to_pfn(pages[i]);
+        /* whatever Xen didn't take goes back to the allocator */
+        for (i = rc; i < got; i++) {
+            balloon_map(pages[i], mfns[i]);
+            free_page((void *)pages[i]);
+        }
+        nr_ballooned += rc;
+        done += rc;
+        if (rc < batch)
+            break;
+    }
+
+    if (chunks != NULL && chunks->n == 0) {
+        ch = chunks;
+        chunks = ch->next;
+        free_page(ch);
+    }
+    return done;
+}
+
+/*
+ * Deflate the balloon: take up to n ballooned pages back from Xen.
+ * Returns how many came.
+ */
+static unsigned long balloon_deflate(unsigned long n)
+{
+    struct xen_memory_reservation reservation;
+    xen_pfn_t frames[BALLOON_BATCH];
+    struct balloon_chunk *ch;
+    unsigned long done = 0, pfn;
+    int i, batch, rc;
+
+    while (done < n && (ch = chunks) != NULL) {
+        batch = BALLOON_BATCH;
+        if (batch > n - done)
+            batch = n - done;
+        if (batch > ch->n)
+            batch = ch->n;
+
+        /* from the top of the stack, so that leftovers stay put */
+        for (i = 0; i < batch; i++)
+            frames[i] = ch->pfns[ch->n - 1 - i];
+
+        set_xen_guest_handle(reservation.extent_start, frames);
+        reservation.nr_extents = batch;
+        reservation.extent_order = 0;
+        reservation.address_bits = 0;
+        reservation.domid = DOMID_SELF;
+        rc = HYPERVISOR_memory_op(XENMEM_populate_physmap, &reservation);
+        if (rc < 0)
+            rc = 0;
+
+        /* frames[] now holds the new MFNs */
+        for (i = 0; i < rc; i++) {
+            pfn = ch->pfns[--ch->n];
+            balloon_map((unsigned long)pfn_to_virt(pfn), frames[i]);
+            free_page(pfn_to_virt(pfn));
+        }
+        nr_ballooned -= rc;
+        done += rc;
+
+        if (ch->n == 0) {
+            chunks = ch->next;
+            free_page(ch);
+        }
+        if (rc < batch)
+            break;
+    }
+    return done;
+}
+
+void balloon_set_target(unsigned long target)
+{
+    unsigned long cur = balloon_current_pages(), n, keep;
+
+    if (target < cur) {
+        n = cur - target;
+        keep = BALLOON_RESERVE_PAGES;
+        if (balloon_reserve)
+            keep += balloon_reserve();
+        if (nr_free_pages < keep)
+            n = 0;
+        else if (n > nr_free_pages - keep)
+            n = nr_free_pages - keep;
+        balloon_inflate(n);
+    } else if (target > cur) {
+        balloon_deflate(target - cur);
+    }
+
+    printk("balloon: target %lu pages, now %lu\n",
+           target, balloon_current_pages());
+}
+
+static void balloon_thread(void *arg)
+{
+    struct xenbus_event_queue events;
+    const char *path = "memory/target";
+    int target;
+
+    xenbus_event_queue_init(&events);
+    xenbus_watch_path_token(XBT_NIL, path, path, &events);
+    for (;;) {
+        xenbus_wait_for_watch(&events);
+        /* in KiB */
+        if ((target = xenbus_read_integer(path)) < 0)
+            continue;
+        balloon_set_target((unsigned long)target >> (PAGE_SHIFT - 10));
+    }
+}
+
+void init_balloon(void)
+{
+    nr_boot_pages = start_info.nr_pages;
+    create_thread("balloon", NULL, balloon_thread, NULL, NULL);
+}
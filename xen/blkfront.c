@@ -8,6 +8,7 @@
 #include <mini-os/events.h>
 #include <mini-os/gnttab.h>
 #include <mini-os/blkfront.h>
+#include <mini-os/trace.h>
 
 #include <xen/io/blkif.h>
 #include <xen/io/protocols.h>
@@ -23,21 +24,36 @@
 
 /* Note: we really suppose non-preemptive threads.  */
 
-DECLARE_WAIT_QUEUE_HEAD(blkfront_queue);
-
-#define BLK_RING_SIZE __RING_SIZE((struct blkif_sring *)0, PAGE_SIZE)
 #define GRANT_INVALID_REF 0
+#define BLK_MAX_RING_PAGES (1 << BLKFRONT_MAX_RING_ORDER)
 
 struct blk_buffer {
     void* page;
     grant_ref_t gref;
+    struct blk_buffer *next;		/* free list */
+    struct blk_buffer *pool_next;	/* all buffers of the device */
 };
 
+/*
+ * Enough persistent grants to fill every direct segment of every ring
+ * slot, but no more than 1/BLK_PGRANT_SHARE of the domain's memory per
+ * device, and always at least what one aiocb needs.  Transfers beyond
+ * that wait for grants to come back.
+ */
+#define BLK_PGRANT_SHARE 8
+#define BLK_MAX_PGRANTS(dev) ((dev)->max_pgrants)
+
+/* One indirect page always describes a whole request */
+#define BLK_SEGS_PER_INDIRECT_FRAME \
+    (PAGE_SIZE / sizeof(struct blkif_request_segment))
+
 struct blkfront_dev {
     domid_t dom;
 
     struct blkif_front_ring ring;
-    grant_ref_t ring_ref;
+    int ring_order;
+    int ring_alloc_order;	/* ring_order may shrink after a restore */
+    grant_ref_t ring_ref[BLK_MAX_RING_PAGES];
     evtchn_port_t evtchn;
     blkif_vdev_t handle;
 
@@ -45,23 +61,217 @@ struct blkfront_dev {
     char *backend;
     struct blkfront_info info;
 
+    /* Persistent grants: granted once, reused for every request */
+    struct blk_buffer *pgrants;
+    struct blk_buffer *pfree;
+    int npgrants;
+    int npfree;
+    int max_pgrants;	/* set with the ring size */
+
+    /* Indirect descriptor pages, at most one per ring slot */
+    struct blk_buffer *ipages;
+    struct blk_buffer *ifree;
+
+    /* Woken by our event channel only */
+    struct wait_queue_head waitq;
+
+    /*
+     * While plugged, requests are queued but not pushed.  The last
+     * queued request may still be extended by an adjacent aiocb.
+     */
+    int plugged;
+    struct blkfront_aiocb *merge_tail;
+    RING_IDX merge_idx;
+    uint64_t merge_sector;
+
     struct xenbus_event_queue events;
 
+    /*
+     * aiocbs with requests on the ring, in the order they went out,
+     * to be issued again after a restore.  ring_gen counts restores,
+     * so that a submitter which slept can tell its requests are gone.
+     */
+    MINIOS_TAILQ_HEAD(, blkfront_aiocb) inflight;
+    unsigned ring_gen;
+    int suspended;	/* new submitters wait */
+    int offline;	/* no ring to put requests on */
+    int dead;		/* lost its backend, I/O fails with -EIO */
+
+    struct blkfront_dev *next;	/* blkfront_devs */
 };
 
+static struct blkfront_dev *blkfront_devs;
+
 void blkfront_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
 {
-    wake_up(&blkfront_queue);
+    struct blkfront_dev *dev = data;
+
+    wake_up(&dev->waitq);
+}
+
+struct wait_queue_head *blkfront_waitq(struct blkfront_dev *dev)
+{
+    return &dev->waitq;
+}
+
+static struct blk_buffer *blkfront_get_pbuf(struct blkfront_dev *dev)
+{
+    struct blk_buffer *buf;
+
+    if ((buf = dev->pfree) != NULL) {
+        dev->pfree = buf->next;
+        dev->npfree--;
+        return buf;
+    }
+
+    /* Grow the pool lazily, up to the bound */
+    if (dev->npgrants >= BLK_MAX_PGRANTS(dev))
+        return NULL;
+    if ((buf = malloc(sizeof(*buf))) == NULL)
+        return NULL;
+    if ((buf->page = (void *)alloc_page()) == NULL) {
+        free(buf);
+        return NULL;
+    }
+    buf->gref = gnttab_grant_access(dev->dom, virt_to_mfn(buf->page), 0);
+    buf->pool_next = dev->pgrants;
+    dev->pgrants = buf;
+    dev->npgrants++;
+
+    return buf;
+}
+
+static void blkfront_size_pgrants(struct blkfront_dev *dev)
+{
+    unsigned long n = RING_SIZE(&dev->ring) * BLKIF_MAX_SEGMENTS_PER_REQUEST;
+
+    if (n > start_info.nr_pages / BLK_PGRANT_SHARE)
+        n = start_info.nr_pages / BLK_PGRANT_SHARE;
+    if (n < BLKFRONT_MAX_SEGMENTS)
+        n = BLKFRONT_MAX_SEGMENTS;
+    dev->max_pgrants = n;
+}
+
+static void blkfront_put_pbuf(struct blkfront_dev *dev, struct blk_buffer *buf)
+{
+    buf->next = dev->pfree;
+    dev->pfree = buf;
+    dev->npfree++;
+}
+
+/*
+ * Take a persistently granted page for each of the n pages of aiocbp,
+ * all or none: aiocbs holding some while they wait for the rest could
+ * leave every one of them short.
+ */
+static int blkfront_get_pbufs(struct blkfront_dev *dev,
+        struct blkfront_aiocb *aiocbp, int n)
+{
+    int j;
+
+    if (dev->npfree + BLK_MAX_PGRANTS(dev) - dev->npgrants < n)
+        return -1;
+    for (j = 0; j < n; j++)
+        if ((aiocbp->pbuf[j] = blkfront_get_pbuf(dev)) == NULL) {
+            while (j-- > 0)
+                blkfront_put_pbuf(dev, aiocbp->pbuf[j]);
+            return -1;
+        }
+    return 0;
+}
+
+static void free_buffers(struct blk_buffer **pool, struct blk_buffer **freelist)
+{
+    struct blk_buffer *buf;
+
+    while ((buf = *pool) != NULL) {
+        *pool = buf->pool_next;
+        gnttab_end_access(buf->gref);
+        free_page(buf->page);
+        free(buf);
+    }
+    *freelist = NULL;
+}
+
+static void regrant_buffers(struct blk_buffer *pool, domid_t dom, int readonly)
+{
+    struct blk_buffer *buf;
+
+    for (buf = pool; buf; buf = buf->pool_next)
+        gnttab_regrant(buf->gref, dom, virt_to_mfn(buf->page), readonly);
+}
+
+#ifdef BLKIF_OP_INDIRECT
+/*
+ * Make sure there is an indirect page on dev->ifree.  They are only
+ * read by the backend, and allocated as indirect requests need them
+ * rather than one per ring slot up front: a deep ring then costs no
+ * memory until that many large transfers are in flight together.
+ * Fails if out of memory, the request then goes out direct.
+ */
+static int blkfront_want_ibuf(struct blkfront_dev *dev)
+{
+    struct blk_buffer *buf;
+
+    ASSERT(BLKFRONT_MAX_SEGMENTS <= BLK_SEGS_PER_INDIRECT_FRAME);
+
+    if (dev->ifree != NULL)
+        return 0;
+    if ((buf = malloc(sizeof(*buf))) == NULL)
+        return -1;
+    if ((buf->page = (void *)alloc_page()) == NULL) {
+        free(buf);
+        return -1;
+    }
+    buf->gref = gnttab_grant_access(dev->dom, virt_to_mfn(buf->page), 1);
+    buf->pool_next = dev->ipages;
+    dev->ipages = buf;
+    buf->next = NULL;
+    dev->ifree = buf;
+    return 0;
+}
+#endif
+
+/* Byte range of segment j within its page */
+static inline void blkfront_seg_range(struct blkfront_aiocb *aiocbp, int j,
+        unsigned *off, unsigned *len)
+{
+    uintptr_t buf = (uintptr_t)aiocbp->aio_buf;
+    unsigned first = 0, last = PAGE_SIZE - 1;
+
+    if (j == 0)
+        first = buf & ~PAGE_MASK;
+    if (j == aiocbp->n - 1)
+        last = (buf + aiocbp->aio_nbytes - 1) & ~PAGE_MASK;
+    *off = first;
+    *len = last - first + 1;
 }
 
 static void free_blkfront(struct blkfront_dev *dev)
 {
+    struct blkfront_dev **prev;
+    int i;
+
+    for (prev = &blkfront_devs; *prev; prev = &(*prev)->next)
+        if (*prev == dev) {
+            *prev = dev->next;
+            break;
+        }
+
     mask_evtchn(dev->evtchn);
 
     free(dev->backend);
 
-    gnttab_end_access(dev->ring_ref);
-    free_page(dev->ring.sring);
+    free_buffers(&dev->pgrants, &dev->pfree);
+    dev->npgrants = 0;
+    dev->npfree = 0;
+    free_buffers(&dev->ipages, &dev->ifree);
+
+    if (dev->ring.sring) {
+        for (i = 0; i < (1 << dev->ring_alloc_order); i++)
+            gnttab_end_access(dev->ring_ref[i]);
+        free_pages(dev->ring.sring, dev->ring_alloc_order);
+    }
 
     unbind_evtchn(dev->evtchn);
 
@@ -69,110 +279,112 @@ static void free_blkfront(struct blkfront_dev *dev)
     free(dev);
 }
 
-struct blkfront_dev *init_blkfront(char *_nodename, struct blkfront_info *info)
+/*
+ * Find the backend and get an event channel to it, and the largest
+ * ring it takes.  Done again after a restore, the backend may well
+ * be a different one by then.
+ */
+static char *blkfront_bind_backend(struct blkfront_dev *dev, int *max_order)
 {
-    xenbus_transaction_t xbt;
-    char* err;
-    char* message=NULL;
-    struct blkif_sring *s;
-    int retry=0;
-    char* msg = NULL;
-    char* c;
-    char* nodename = _nodename ? _nodename : "device/vbd/768";
-
-    struct blkfront_dev *dev;
-
-    char path[strlen(nodename) + 1 + 10 + 1];
-
-    dev = malloc(sizeof(*dev));
-    memset(dev, 0, sizeof(*dev));
-    dev->nodename = strdup(nodename);
+    char path[strlen(dev->nodename) + 1 + 10 + 1];
+    char *msg;
 
-    snprintf(path, sizeof(path), "%s/backend-id", nodename);
+    snprintf(path, sizeof(path), "%s/backend-id", dev->nodename);
     dev->dom = xenbus_read_integer(path); 
     evtchn_alloc_unbound(dev->dom, blkfront_handler, dev, &dev->evtchn);
 
-    s = (struct blkif_sring*) alloc_page();
-    memset(s,0,PAGE_SIZE);
-
+    free(dev->backend);
+    dev->backend = NULL;
+    snprintf(path, sizeof(path), "%s/backend", dev->nodename);
+    msg = xenbus_read(XBT_NIL, path, &dev->backend);
+    if (msg) {
+        printk("Error %s when reading the backend path %s\n", msg, path);
+        return msg;
+    }
 
-    SHARED_RING_INIT(s);
-    FRONT_RING_INIT(&dev->ring, s, PAGE_SIZE);
+    /* a bigger ring if the backend can take one, else the classic page */
+    {
+        char path[strlen(dev->backend) + 1 + 19 + 1];
 
-    dev->ring_ref = gnttab_grant_access(dev->dom,virt_to_mfn(s),0);
+        snprintf(path, sizeof(path), "%s/max-ring-page-order", dev->backend);
+        *max_order = xenbus_read_integer(path);
+        if (*max_order < 0)
+            *max_order = 0;
+        if (*max_order > BLKFRONT_MAX_RING_ORDER)
+            *max_order = BLKFRONT_MAX_RING_ORDER;
+    }
+    return NULL;
+}
 
-    xenbus_event_queue_init(&dev->events);
+/*
+ * Publish the ring and event channel, wait for the backend to connect
+ * and read what it offers into dev->info.
+ */
+static int blkfront_connect(struct blkfront_dev *dev)
+{
+    struct xenbus_batch batch;
+    char* err = NULL;
+    char* msg = NULL;
+    char* c;
+    char key[16];
+    int retry=0, i;
 
 again:
-    err = xenbus_transaction_start(&xbt);
+    err = xenbus_batch_start(&batch, 1);
     if (err) {
         printk("starting transaction\n");
         free(err);
     }
 
-    err = xenbus_printf(xbt, nodename, "ring-ref","%u",
-                dev->ring_ref);
-    if (err) {
-        message = "writing ring-ref";
-        goto abort_transaction;
+    if (dev->ring_order == 0) {
+        xenbus_batch_printf(&batch, dev->nodename, "ring-ref", "%u",
+                    dev->ring_ref[0]);
+    } else {
+        xenbus_batch_printf(&batch, dev->nodename,
+                    "ring-page-order", "%u", dev->ring_order);
+        for (i = 0; i < (1 << dev->ring_order); i++) {
+            snprintf(key, sizeof(key), "ring-ref%d", i);
+            xenbus_batch_printf(&batch, dev->nodename, key, "%u",
+                        dev->ring_ref[i]);
+        }
     }
-    err = xenbus_printf(xbt, nodename,
+    xenbus_batch_printf(&batch, dev->nodename,
                 "event-channel", "%u", dev->evtchn);
-    if (err) {
-        message = "writing event-channel";
-        goto abort_transaction;
-    }
-    err = xenbus_printf(xbt, nodename,
+    xenbus_batch_printf(&batch, dev->nodename,
                 "protocol", "%s", XEN_IO_PROTO_ABI_NATIVE);
-    if (err) {
-        message = "writing protocol";
-        goto abort_transaction;
-    }
-
-    snprintf(path, sizeof(path), "%s/state", nodename);
-    err = xenbus_switch_state(xbt, path, XenbusStateConnected);
-    if (err) {
-        message = "switching state";
-        goto abort_transaction;
-    }
+    xenbus_batch_printf(&batch, dev->nodename, "feature-persistent", "%u", 1);
+    xenbus_batch_printf(&batch, dev->nodename, "state", "%u",
+                XenbusStateConnected);
 
-
-    err = xenbus_transaction_end(xbt, 0, &retry);
-    if (err) free(err);
+    err = xenbus_batch_end(&batch, 0, &retry);
     if (retry) {
-            goto again;
-        printk("completing transaction\n");
+        free(err);
+        goto again;
     }
-
-    goto done;
-
-abort_transaction:
-    free(err);
-    err = xenbus_transaction_end(xbt, 1, &retry);
-    printk("Abort transaction %s\n", message);
-    goto error;
-
-done:
-
-    snprintf(path, sizeof(path), "%s/backend", nodename);
-    msg = xenbus_read(XBT_NIL, path, &dev->backend);
-    if (msg) {
-        printk("Error %s when reading the backend path %s\n", msg, path);
-        goto error;
+    if (err) {
+        printk("Abort transaction writing the ring details\n");
+        free(err);
+        return -1;
     }
 
-    printk("blkfront: node=%s backend=%s\n", nodename, dev->backend);
-
-    dev->handle = strtoul(strrchr(nodename, '/')+1, NULL, 10);
+    printk("blkfront: node=%s backend=%s\n", dev->nodename, dev->backend);
 
     {
         XenbusState state;
-        char path[strlen(dev->backend) + 1 + 19 + 1];
+        int info_, sectors, sector_size, barrier, flush, persistent;
+#ifdef BLKIF_OP_DISCARD
+        int discard, gran;
+#endif
+#ifdef BLKIF_OP_INDIRECT
+        int max_indirect;
+#endif
+        char path[strlen(dev->backend) + 1 + 29 + 1];
         snprintf(path, sizeof(path), "%s/mode", dev->backend);
         msg = xenbus_read(XBT_NIL, path, &c);
         if (msg) {
             printk("Error %s when reading the mode\n", msg);
-            goto error;
+            free(msg);
+            return -1;
         }
         if (*c == 'w')
             dev->info.mode = O_RDWR;
@@ -191,36 +403,127 @@ done:
         if (msg != NULL || state != XenbusStateConnected) {
             printk("backend not available, state=%d\n", state);
             xenbus_unwatch_path_token(XBT_NIL, path, path);
-            goto error;
+            free(msg);
+            return -1;
         }
 
+        /* the backend's details, all in one round trip */
+        xenbus_batch_start(&batch, 0);
         snprintf(path, sizeof(path), "%s/info", dev->backend);
-        dev->info.info = xenbus_read_integer(path);
+        xenbus_batch_read_integer(&batch, path, &info_);
 
         snprintf(path, sizeof(path), "%s/sectors", dev->backend);
         // FIXME: read_integer returns an int, so disk size limited to 1TB for now
-        dev->info.sectors = xenbus_read_integer(path);
+        xenbus_batch_read_integer(&batch, path, &sectors);
 
         snprintf(path, sizeof(path), "%s/sector-size", dev->backend);
-        dev->info.sector_size = xenbus_read_integer(path);
+        xenbus_batch_read_integer(&batch, path, &sector_size);
 
         snprintf(path, sizeof(path), "%s/feature-barrier", dev->backend);
-        dev->info.barrier = xenbus_read_integer(path);
+        xenbus_batch_read_integer(&batch, path, &barrier);
 
         snprintf(path, sizeof(path), "%s/feature-flush-cache", dev->backend);
-        dev->info.flush = xenbus_read_integer(path);
+        xenbus_batch_read_integer(&batch, path, &flush);
+
+        snprintf(path, sizeof(path), "%s/feature-persistent", dev->backend);
+        xenbus_batch_read_integer(&batch, path, &persistent);
+
+#ifdef BLKIF_OP_DISCARD
+        snprintf(path, sizeof(path), "%s/feature-discard", dev->backend);
+        xenbus_batch_read_integer(&batch, path, &discard);
+        snprintf(path, sizeof(path), "%s/discard-granularity", dev->backend);
+        xenbus_batch_read_integer(&batch, path, &gran);
+#endif
+
+#ifdef BLKIF_OP_INDIRECT
+        snprintf(path, sizeof(path), "%s/feature-max-indirect-segments",
+            dev->backend);
+        xenbus_batch_read_integer(&batch, path, &max_indirect);
+#endif
+        free(xenbus_batch_end(&batch, 0, &retry));
+
+        dev->info.info = info_;
+        dev->info.sectors = sectors;
+        dev->info.sector_size = sector_size;
+        dev->info.barrier = barrier;
+        dev->info.flush = flush;
+        dev->info.persistent = persistent == 1;
+        dev->info.ring_size = RING_SIZE(&dev->ring);
+#ifdef BLKIF_OP_DISCARD
+        dev->info.discard = discard == 1;
+        if (dev->info.discard)
+            dev->info.discard_granularity = gran > 0 ? gran : 0;
+#endif
+
+#ifdef BLKIF_OP_INDIRECT
+        dev->info.max_indirect = max_indirect;
+        if (dev->info.max_indirect > BLKFRONT_MAX_SEGMENTS)
+            dev->info.max_indirect = BLKFRONT_MAX_SEGMENTS;
+        if (dev->info.max_indirect <= BLKIF_MAX_SEGMENTS_PER_REQUEST)
+            dev->info.max_indirect = 0;
+#endif
+    }
+    return 0;
+}
+
+struct blkfront_dev *init_blkfront(char *_nodename, struct blkfront_info *info)
+{
+    struct blkif_sring *s;
+    int i, max_order;
+    char* msg = NULL;
+    char* nodename = _nodename ? _nodename : "device/vbd/768";
+
+    struct blkfront_dev *dev;
+
+    dev = malloc(sizeof(*dev));
+    memset(dev, 0, sizeof(*dev));
+    dev->nodename = strdup(nodename);
+    dev->handle = strtoul(strrchr(nodename, '/')+1, NULL, 10);
+    init_waitqueue_head(&dev->waitq);
+    MINIOS_TAILQ_INIT(&dev->inflight);
+    xenbus_event_queue_init(&dev->events);
+
+    if ((msg = blkfront_bind_backend(dev, &max_order)) != NULL)
+        goto error;
 
-        *info = dev->info;
+    for (dev->ring_order = max_order; ; dev->ring_order--) {
+        if ((s = (struct blkif_sring *)alloc_pages(dev->ring_order)) != NULL)
+            break;
+        if (dev->ring_order == 0) {
+            printk("blkfront: no memory for the ring\n");
+            goto error;
+        }
     }
+    dev->ring_alloc_order = dev->ring_order;
+    memset(s, 0, PAGE_SIZE << dev->ring_order);
+
+
+    SHARED_RING_INIT(s);
+    FRONT_RING_INIT(&dev->ring, s, PAGE_SIZE << dev->ring_order);
+    blkfront_size_pgrants(dev);
+
+    for (i = 0; i < (1 << dev->ring_order); i++)
+        dev->ring_ref[i] = gnttab_grant_access(dev->dom,
+            virt_to_mfn((char *)s + i * PAGE_SIZE), 0);
+
+    if (blkfront_connect(dev) != 0)
+        goto error;
+
+    *info = dev->info;
     unmask_evtchn(dev->evtchn);
 
-    printk("blkfront: %u sectors\n", dev->info.sectors);
+    printk("blkfront: %u sectors%s%s, %d indirect segments, %d ring slots\n",
+        dev->info.sectors,
+        dev->info.persistent ? ", persistent grants" : "",
+        dev->info.discard ? ", discard" : "",
+        dev->info.max_indirect, dev->info.ring_size);
 
+    dev->next = blkfront_devs;
+    blkfront_devs = dev;
     return dev;
 
 error:
     free(msg);
-    free(err);
     free_blkfront(dev);
     return NULL;
 }
@@ -275,47 +578,317 @@ close:
     if (err) free(err);
     xenbus_unwatch_path_token(XBT_NIL, path, path);
 
-    snprintf(path, sizeof(path), "%s/ring-ref", nodename);
-    xenbus_rm(XBT_NIL, path);
-    snprintf(path, sizeof(path), "%s/event-channel", nodename);
+    if (dev->ring_order == 0) {
+        snprintf(path, sizeof(path), "%s/ring-ref", dev->nodename);
+        xenbus_rm(XBT_NIL, path);
+    } else {
+        char path[strlen(dev->nodename) + 1 + 15 + 1];
+        int i;
+
+        snprintf(path, sizeof(path), "%s/ring-page-order", dev->nodename);
+        xenbus_rm(XBT_NIL, path);
+        for (i = 0; i < (1 << dev->ring_order); i++) {
+            snprintf(path, sizeof(path), "%s/ring-ref%d", dev->nodename, i);
+            xenbus_rm(XBT_NIL, path);
+        }
+    }
+    snprintf(path, sizeof(path), "%s/event-channel", dev->nodename);
     xenbus_rm(XBT_NIL, path);
 
     if (!err)
         free_blkfront(dev);
 }
 
-static void blkfront_wait_slot(struct blkfront_dev *dev)
+static void blkfront_push(struct blkfront_dev *dev)
+{
+    int notify;
+
+    /* once the backend can see a request it must not change */
+    dev->merge_tail = NULL;
+
+    wmb();
+    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&dev->ring, notify);
+    if (notify) notify_remote_via_evtchn(dev->evtchn);
+}
+
+/* Wait for a slot, and for a ring to begin with */
+static int blkfront_wait_slot(struct blkfront_dev *dev)
 {
-    /* Wait for a slot */
-    if (RING_FULL(&dev->ring)) {
+    if (RING_FULL(&dev->ring) || dev->offline) {
 	unsigned long flags;
 	DEFINE_WAIT(w);
+
+	/* The backend can't free slots it hasn't been told about */
+	blkfront_push(dev);
 	local_irq_save(flags);
 	while (1) {
 	    blkfront_aio_poll(dev);
-	    if (!RING_FULL(&dev->ring))
+	    if (!RING_FULL(&dev->ring) && !dev->offline)
+		break;
+	    if (dev->dead)
 		break;
 	    /* Really no slot, go to sleep. */
-	    add_waiter(w, blkfront_queue);
+	    add_waiter(w, dev->waitq);
 	    local_irq_restore(flags);
 	    schedule();
 	    local_irq_save(flags);
 	}
-	remove_waiter(w, blkfront_queue);
+	remove_waiter(w, dev->waitq);
 	local_irq_restore(flags);
     }
+    return dev->dead ? -1 : 0;
+}
+
+/*
+ * Get the persistent grants for aiocbp, reaping finished requests until
+ * enough are free.  A backend using persistent grants keeps every gref
+ * it sees mapped, so there is no falling back to a one-shot grant.
+ * Fails only when out of memory with none of them in flight.
+ */
+static int blkfront_wait_pbufs(struct blkfront_dev *dev,
+        struct blkfront_aiocb *aiocbp, int n)
+{
+    unsigned long flags;
+    int err = 0;
+    DEFINE_WAIT(w);
+
+    ASSERT(n <= BLK_MAX_PGRANTS(dev));
+    if (blkfront_get_pbufs(dev, aiocbp, n) == 0)
+        return 0;
+
+    blkfront_push(dev);
+    local_irq_save(flags);
+    while (1) {
+        blkfront_aio_poll(dev);
+        if (blkfront_get_pbufs(dev, aiocbp, n) == 0)
+            break;
+        if (dev->npfree == dev->npgrants) {
+            err = -1;
+            break;
+        }
+        add_waiter(w, dev->waitq);
+        local_irq_restore(flags);
+        schedule();
+        local_irq_save(flags);
+    }
+    remove_waiter(w, dev->waitq);
+    local_irq_restore(flags);
+    return err;
 }
 
+/* Describe pages [first, first+cnt) of aiocbp, returns sectors covered */
+static uint64_t blkfront_fill_segs(struct blkfront_aiocb *aiocbp,
+        int first, int cnt, struct blkif_request_segment *seg)
+{
+    uint64_t nsect = 0;
+    int j;
+
+    for (j = 0; j < cnt; j++) {
+        unsigned off, len;
+
+        blkfront_seg_range(aiocbp, first + j, &off, &len);
+        seg[j].gref = aiocbp->gref[first + j];
+        seg[j].first_sect = off / 512;
+        seg[j].last_sect = (off + len) / 512 - 1;
+        nsect += len / 512;
+    }
+
+    return nsect;
+}
+
+/* Queue segments [first, first+cnt) of aiocbp as one ring request */
+static uint64_t blkfront_queue_request(struct blkfront_dev *dev,
+        struct blkfront_aiocb *aiocbp, int first, int cnt, uint64_t sector)
+{
+    struct blkif_request *req;
+    struct blkif_request_segment *seg;
+    uint8_t op = aiocbp->is_write ? BLKIF_OP_WRITE : BLKIF_OP_READ;
+    uint64_t nsect;
+
+    req = RING_GET_REQUEST(&dev->ring, dev->ring.req_prod_pvt);
+
+#ifdef BLKIF_OP_INDIRECT
+    if (cnt > BLKIF_MAX_SEGMENTS_PER_REQUEST) {
+        struct blkif_request_indirect *ireq = (void *)req;
+        struct blk_buffer *ibuf = dev->ifree;
+
+        /* blkfront_want_ibuf() made sure of one */
+        BUG_ON(ibuf == NULL);
+        dev->ifree = ibuf->next;
+        aiocbp->ibuf[aiocbp->nibuf++] = ibuf;
+
+        ireq->operation = BLKIF_OP_INDIRECT;
+        ireq->indirect_op = op;
+        ireq->nr_segments = cnt;
+        ireq->handle = dev->handle;
+        ireq->id = (uintptr_t) aiocbp;
+        ireq->sector_number = sector;
+        ireq->indirect_grefs[0] = ibuf->gref;
+        seg = ibuf->page;
+    } else
+#endif
+    {
+        req->operation = op;
+        req->nr_segments = cnt;
+        req->handle = dev->handle;
+        req->id = (uintptr_t) aiocbp;
+        req->sector_number = sector;
+        seg = req->seg;
+    }
+
+    nsect = blkfront_fill_segs(aiocbp, first, cnt, seg);
+
+    dev->ring.req_prod_pvt++;
+    aiocbp->nreq++;
+
+    return nsect;
+}
+
+static void blkfront_put_ibufs(struct blkfront_dev *dev,
+        struct blkfront_aiocb *aiocbp)
+{
+    int j;
+
+    for (j = 0; j < aiocbp->nibuf; j++) {
+        aiocbp->ibuf[j]->next = dev->ifree;
+        dev->ifree = aiocbp->ibuf[j];
+    }
+    aiocbp->nibuf = 0;
+}
+
+/* Point the directly granted pages of aiocbp at their new frames */
+static void blkfront_aio_regrant(struct blkfront_dev *dev,
+        struct blkfront_aiocb *aiocbp)
+{
+    uintptr_t start = (uintptr_t)aiocbp->aio_buf & PAGE_MASK;
+    int j;
+
+    for (j = 0; j < aiocbp->n; j++)
+        if (!aiocbp->pbuf[j])
+            gnttab_regrant(aiocbp->gref[j], dev->dom,
+                virtual_to_mfn(start + j * PAGE_SIZE), aiocbp->is_write);
+}
+
+/* Release the grants of a finished aiocb, copying read data back */
+static void blkfront_aio_release(struct blkfront_dev *dev,
+        struct blkfront_aiocb *aiocbp)
+{
+    grant_ref_t refs[BLKFRONT_MAX_SEGMENTS];
+    int j, nrefs = 0;
+
+    for (j = 0; j < aiocbp->n; j++) {
+        struct blk_buffer *buf = aiocbp->pbuf[j];
+
+        if (!buf) {
+            refs[nrefs++] = aiocbp->gref[j];
+            continue;
+        }
+        if (!aiocbp->is_write) {
+            unsigned off, len;
+
+            blkfront_seg_range(aiocbp, j, &off, &len);
+            memcpy((char *)((uintptr_t)aiocbp->aio_buf & PAGE_MASK)
+                + j * PAGE_SIZE + off, (char *)buf->page + off, len);
+        }
+        blkfront_put_pbuf(dev, buf);
+    }
+    gnttab_end_access_batch(refs, nrefs);
+
+    blkfront_put_ibufs(dev, aiocbp);
+}
+
+/*
+ * Append aiocbp to the last queued request if the two are contiguous
+ * on disk and the segments fit.  Only possible while plugged.
+ */
+static int blkfront_try_merge(struct blkfront_dev *dev,
+        struct blkfront_aiocb *aiocbp, uint64_t sector)
+{
+    struct blkif_request *req;
+    uint8_t op = aiocbp->is_write ? BLKIF_OP_WRITE : BLKIF_OP_READ;
+
+    if (!dev->plugged || dev->merge_tail == NULL
+      || dev->merge_sector != sector)
+        return 0;
+
+    req = RING_GET_REQUEST(&dev->ring, dev->merge_idx);
+    if (req->operation != op
+      || req->nr_segments + aiocbp->n > BLKIF_MAX_SEGMENTS_PER_REQUEST)
+        return 0;
+
+    dev->merge_sector += blkfront_fill_segs(aiocbp, 0, aiocbp->n,
+        &req->seg[req->nr_segments]);
+    req->nr_segments += aiocbp->n;
+
+    dev->merge_tail->merge_next = aiocbp;
+    dev->merge_tail = aiocbp;
+    aiocbp->nreq = 1;
+
+    return 1;
+}
+
+/* One ring request for aiocbp is done, finish it if it was the last */
+static void blkfront_aio_done(struct blkfront_dev *dev,
+        struct blkfront_aiocb *aiocbp, int status)
+{
+    if (status != BLKIF_RSP_OKAY)
+        aiocbp->aio_ret = -EIO;
+    /* Wait until every chunk of a split transfer is back */
+    if (--aiocbp->nreq > 0)
+        return;
+
+    MINIOS_TAILQ_REMOVE(&dev->inflight, aiocbp, inflight);
+    blkfront_aio_release(dev, aiocbp);
+    tracepoint(TRACE_BLK_DONE, aiocbp->aio_ret != 0, 0, aiocbp, 0);
+    /* Nota: callback frees aiocbp itself */
+    if (aiocbp->aio_cb)
+        aiocbp->aio_cb(aiocbp, aiocbp->aio_ret);
+}
+
+/*
+ * Submitters wait here while suspended: anything they granted would
+ * have to be granted again, and the ring may be replaced under them.
+ * Fails if the device did not get its backend back.
+ */
+static int blkfront_wait_resumed(struct blkfront_dev *dev)
+{
+    if (dev->suspended)
+        wait_event(dev->waitq, !dev->suspended);
+    return dev->dead ? -1 : 0;
+}
+
+/* Finish aiocbp with -EIO, it will never reach a backend */
+static void blkfront_aio_fail(struct blkfront_dev *dev,
+        struct blkfront_aiocb *aiocbp)
+{
+    blkfront_aio_release(dev, aiocbp);
+    /* Nota: callback frees aiocbp itself */
+    if (aiocbp->aio_cb)
+        aiocbp->aio_cb(aiocbp, -EIO);
+}
+
+static void blkfront_aio_submit(struct blkfront_dev *dev,
+        struct blkfront_aiocb *aiocbp, unsigned gen);
+
 /* Issue an aio */
 void blkfront_aio(struct blkfront_aiocb *aiocbp, int write)
 {
     struct blkfront_dev *dev = aiocbp->aio_dev;
-    struct blkif_request *req;
-    RING_IDX i;
-    int notify;
-    int n, j;
+    unsigned long frames[BLKFRONT_MAX_SEGMENTS];
+    grant_ref_t refs[BLKFRONT_MAX_SEGMENTS];
+    short idx[BLKFRONT_MAX_SEGMENTS];
+    unsigned gen;
+    int n, j, ndirect;
     uintptr_t start, end;
 
+    /* grants made now must be for the backend we will talk to */
+    if (blkfront_wait_resumed(dev)) {
+        if (aiocbp->aio_cb)
+            aiocbp->aio_cb(aiocbp, -EIO);
+        return;
+    }
+    gen = dev->ring_gen;
+
     // Can't io at non-sector-aligned location
     ASSERT(!(aiocbp->aio_offset & (dev->info.sector_size-1)));
     // Can't io non-sector-sized amounts
@@ -327,43 +900,137 @@ void blkfront_aio(struct blkfront_aiocb *aiocbp, int write)
     end = ((uintptr_t)aiocbp->aio_buf + aiocbp->aio_nbytes + PAGE_SIZE - 1) & PAGE_MASK;
     aiocbp->n = n = (end - start) / PAGE_SIZE;
 
-    /* qemu's IDE max multsect is 16 (8KB) and SCSI max DMA was set to 32KB,
-     * so max 44KB can't happen */
-    ASSERT(n <= BLKIF_MAX_SEGMENTS_PER_REQUEST);
+    ASSERT(n <= BLKFRONT_MAX_SEGMENTS);
+
+    aiocbp->is_write = write;
+    aiocbp->op = write ? BLKIF_OP_WRITE : BLKIF_OP_READ;
+    aiocbp->aio_ret = 0;
+    tracepoint(TRACE_BLK_SUBMIT, write, aiocbp->aio_nbytes, aiocbp,
+               aiocbp->aio_offset / 512);
+    aiocbp->nibuf = 0;
+    aiocbp->merge_next = NULL;
+
+    /* Bounce through persistently granted pages if the backend keeps them */
+    if (!dev->info.persistent)
+        memset(aiocbp->pbuf, 0, n * sizeof(aiocbp->pbuf[0]));
+    else if (blkfront_wait_pbufs(dev, aiocbp, n)) {
+        if (aiocbp->aio_cb)
+            aiocbp->aio_cb(aiocbp, -ENOMEM);
+        return;
+    }
+
+    for (j = 0, ndirect = 0; j < n; j++) {
+	uintptr_t data = start + j * PAGE_SIZE;
+        struct blk_buffer *buf = aiocbp->pbuf[j];
+        unsigned off, len;
 
-    blkfront_wait_slot(dev);
-    i = dev->ring.req_prod_pvt;
-    req = RING_GET_REQUEST(&dev->ring, i);
+        blkfront_seg_range(aiocbp, j, &off, &len);
 
-    req->operation = write ? BLKIF_OP_WRITE : BLKIF_OP_READ;
-    req->nr_segments = n;
-    req->handle = dev->handle;
-    req->id = (uintptr_t) aiocbp;
-    req->sector_number = aiocbp->aio_offset / 512;
+        if (buf) {
+            if (write)
+                memcpy((char *)buf->page + off, (char *)data + off, len);
+            aiocbp->gref[j] = buf->gref;
+            continue;
+        }
 
-    for (j = 0; j < n; j++) {
-        req->seg[j].first_sect = 0;
-        req->seg[j].last_sect = PAGE_SIZE / 512 - 1;
-    }
-    req->seg[0].first_sect = ((uintptr_t)aiocbp->aio_buf & ~PAGE_MASK) / 512;
-    req->seg[n-1].last_sect = (((uintptr_t)aiocbp->aio_buf + aiocbp->aio_nbytes - 1) & ~PAGE_MASK) / 512;
-    for (j = 0; j < n; j++) {
-	uintptr_t data = start + j * PAGE_SIZE;
         if (!write) {
             /* Trigger CoW if needed */
-            *(char*)(data + (req->seg[j].first_sect << 9)) = 0;
+            *(char*)(data + off) = 0;
             barrier();
         }
-	aiocbp->gref[j] = req->seg[j].gref =
-            gnttab_grant_access(dev->dom, virtual_to_mfn(data), write);
+        idx[ndirect] = j;
+        frames[ndirect++] = virtual_to_mfn(data);
     }
+    /* grant all pages we could not bounce in one go */
+    gnttab_grant_access_batch(dev->dom, frames, ndirect, write, refs);
+    for (j = 0; j < ndirect; j++)
+        aiocbp->gref[idx[j]] = refs[j];
 
-    dev->ring.req_prod_pvt = i + 1;
+    blkfront_aio_submit(dev, aiocbp, gen);
+}
 
-    wmb();
-    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&dev->ring, notify);
+/*
+ * Put a granted aiocb on the ring.  gen is the ring_gen its grants
+ * were made for: if the domain was restored while we waited for a
+ * slot, they are made again and the transfer starts over.
+ */
+static void blkfront_aio_submit(struct blkfront_dev *dev,
+        struct blkfront_aiocb *aiocbp, unsigned gen)
+{
+    uint64_t sector;
+    int n = aiocbp->n, j, cnt, maxsegs;
+
+restart:
+    if (dev->ring_gen != gen) {
+        blkfront_put_ibufs(dev, aiocbp);
+        blkfront_aio_regrant(dev, aiocbp);
+        aiocbp->aio_ret = 0;
+        gen = dev->ring_gen;
+    }
+
+    maxsegs = BLKIF_MAX_SEGMENTS_PER_REQUEST;
+    if (dev->info.max_indirect > maxsegs)
+        maxsegs = dev->info.max_indirect;
+
+    sector = aiocbp->aio_offset / 512;
+    if (blkfront_try_merge(dev, aiocbp, sector)) {
+        MINIOS_TAILQ_INSERT_TAIL(&dev->inflight, aiocbp, inflight);
+        return;
+    }
+
+    /*
+     * The extra reference keeps completions of the first chunks, which
+     * blkfront_wait_slot() may reap, from finishing the aiocb early.
+     */
+    aiocbp->nreq = 1;
+    for (j = 0; j < n; j += cnt) {
+        cnt = n - j;
+        if (cnt > maxsegs)
+            cnt = maxsegs;
+        if (blkfront_wait_slot(dev)) {
+            /* chunks already queued went with the ring */
+            blkfront_aio_fail(dev, aiocbp);
+            return;
+        }
+        if (dev->ring_gen != gen)
+            goto restart;
+#ifdef BLKIF_OP_INDIRECT
+        if (cnt > BLKIF_MAX_SEGMENTS_PER_REQUEST && blkfront_want_ibuf(dev))
+            cnt = BLKIF_MAX_SEGMENTS_PER_REQUEST;
+#endif
+        sector += blkfront_queue_request(dev, aiocbp, j, cnt, sector);
+    }
+    MINIOS_TAILQ_INSERT_TAIL(&dev->inflight, aiocbp, inflight);
+
+    if (dev->plugged) {
+        /* a single direct request can take on followers */
+        if (n <= BLKIF_MAX_SEGMENTS_PER_REQUEST) {
+            dev->merge_tail = aiocbp;
+            dev->merge_idx = dev->ring.req_prod_pvt - 1;
+            dev->merge_sector = sector;
+        }
+    } else {
+        blkfront_push(dev);
+    }
+
+    blkfront_aio_done(dev, aiocbp, BLKIF_RSP_OKAY);
+}
 
-    if(notify) notify_remote_via_evtchn(dev->evtchn);
+/*
+ * Hold back ring pushes until blkfront_unplug() so that a burst of
+ * requests costs one notification and adjacent ones can be merged.
+ */
+void blkfront_plug(struct blkfront_dev *dev)
+{
+    dev->plugged = 1;
+}
+
+void blkfront_unplug(struct blkfront_dev *dev)
+{
+    if (!dev->plugged)
+        return;
+    dev->plugged = 0;
+    blkfront_push(dev);
 }
 
 static void blkfront_aio_cb(struct blkfront_aiocb *aiocbp, int ret)
@@ -379,6 +1046,7 @@ void blkfront_io(struct blkfront_aiocb *aiocbp, int write)
     ASSERT(!aiocbp->aio_cb);
     aiocbp->aio_cb = blkfront_aio_cb;
     blkfront_aio(aiocbp, write);
+    blkfront_unplug(aiocbp->aio_dev);
     aiocbp->data = NULL;
 
     local_irq_save(flags);
@@ -387,22 +1055,22 @@ void blkfront_io(struct blkfront_aiocb *aiocbp, int write)
 	if (aiocbp->data)
 	    break;
 
-	add_waiter(w, blkfront_queue);
+	add_waiter(w, aiocbp->aio_dev->waitq);
 	local_irq_restore(flags);
 	schedule();
 	local_irq_save(flags);
     }
-    remove_waiter(w, blkfront_queue);
+    remove_waiter(w, aiocbp->aio_dev->waitq);
     local_irq_restore(flags);
 }
 
-static void blkfront_push_operation(struct blkfront_dev *dev, uint8_t op, uint64_t id)
+static int blkfront_push_operation(struct blkfront_dev *dev, uint8_t op, uint64_t id)
 {
     int i;
     struct blkif_request *req;
-    int notify;
 
-    blkfront_wait_slot(dev);
+    if (blkfront_wait_slot(dev))
+        return -1;
     i = dev->ring.req_prod_pvt;
     req = RING_GET_REQUEST(&dev->ring, i);
     req->operation = op;
@@ -412,15 +1080,68 @@ static void blkfront_push_operation(struct blkfront_dev *dev, uint8_t op, uint64
     /* Not needed anyway, but the backend will check it */
     req->sector_number = 0;
     dev->ring.req_prod_pvt = i + 1;
-    wmb();
-    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&dev->ring, notify);
-    if (notify) notify_remote_via_evtchn(dev->evtchn);
+    blkfront_push(dev);
+    return 0;
+}
+
+/* An operation without data for aiocbp, completing through aio_cb */
+static void blkfront_queue_operation(struct blkfront_dev *dev,
+        struct blkfront_aiocb *aiocbp, uint8_t op)
+{
+    aiocbp->op = op;
+    if (blkfront_push_operation(dev, op, (uintptr_t) aiocbp)) {
+        blkfront_aio_fail(dev, aiocbp);
+        return;
+    }
+    MINIOS_TAILQ_INSERT_TAIL(&dev->inflight, aiocbp, inflight);
 }
 
 void blkfront_aio_push_operation(struct blkfront_aiocb *aiocbp, uint8_t op)
 {
     struct blkfront_dev *dev = aiocbp->aio_dev;
-    blkfront_push_operation(dev, op, (uintptr_t) aiocbp);
+
+    aiocbp->n = 0;
+    aiocbp->nibuf = 0;
+    if (blkfront_wait_resumed(dev)) {
+        blkfront_aio_fail(dev, aiocbp);
+        return;
+    }
+    blkfront_queue_operation(dev, aiocbp, op);
+}
+
+/*
+ * Flush the backend's write cache, which covers every write completed
+ * so far.  Completes through aio_cb like any other aio, so that nobody
+ * has to wait for the ring to drain.  With no cache to flush there is
+ * nothing to wait for and aio_cb is called right away.
+ */
+void blkfront_aio_flush(struct blkfront_aiocb *aiocbp)
+{
+    struct blkfront_dev *dev = aiocbp->aio_dev;
+    uint8_t op;
+
+    if (blkfront_wait_resumed(dev)) {
+        if (aiocbp->aio_cb)
+            aiocbp->aio_cb(aiocbp, -EIO);
+        return;
+    }
+    aiocbp->is_write = 1;
+    aiocbp->aio_ret = 0;
+    aiocbp->n = 0;
+    aiocbp->nibuf = 0;
+    aiocbp->merge_next = NULL;
+    aiocbp->nreq = 1;
+
+    if (dev->info.flush == 1)
+        op = BLKIF_OP_FLUSH_DISKCACHE;
+    else if (dev->info.barrier == 1)
+        op = BLKIF_OP_WRITE_BARRIER;
+    else {
+        if (aiocbp->aio_cb)
+            aiocbp->aio_cb(aiocbp, 0);
+        return;
+    }
+    blkfront_queue_operation(dev, aiocbp, op);
 }
 
 void blkfront_sync(struct blkfront_dev *dev)
@@ -428,6 +1149,10 @@ void blkfront_sync(struct blkfront_dev *dev)
     unsigned long flags;
     DEFINE_WAIT(w);
 
+    if (blkfront_wait_resumed(dev))
+        return;
+    blkfront_unplug(dev);
+
     if (dev->info.mode == O_RDWR) {
         if (dev->info.barrier == 1)
             blkfront_push_operation(dev, BLKIF_OP_WRITE_BARRIER, 0);
@@ -442,13 +1167,15 @@ void blkfront_sync(struct blkfront_dev *dev)
 	blkfront_aio_poll(dev);
 	if (RING_FREE_REQUESTS(&dev->ring) == RING_SIZE(&dev->ring))
 	    break;
+	if (dev->dead)
+	    break;
 
-	add_waiter(w, blkfront_queue);
+	add_waiter(w, dev->waitq);
 	local_irq_restore(flags);
 	schedule();
 	local_irq_save(flags);
     }
-    remove_waiter(w, blkfront_queue);
+    remove_waiter(w, dev->waitq);
     local_irq_restore(flags);
 }
 
@@ -480,30 +1207,46 @@ moretodo:
         if (status != BLKIF_RSP_OKAY)
             printk("block error %d for op %d\n", status, rsp->operation);
 
+        dev->ring.rsp_cons = ++cons;
+
         switch (rsp->operation) {
         case BLKIF_OP_READ:
         case BLKIF_OP_WRITE:
-        {
-            int j;
-
-            for (j = 0; j < aiocbp->n; j++)
-                gnttab_end_access(aiocbp->gref[j]);
-
+#ifdef BLKIF_OP_INDIRECT
+        case BLKIF_OP_INDIRECT:
+#endif
+            /* One response covers every aiocb merged into the request */
+            while (aiocbp) {
+                struct blkfront_aiocb *next = aiocbp->merge_next;
+
+                blkfront_aio_done(dev, aiocbp, status);
+                aiocbp = next;
+            }
             break;
-        }
 
         case BLKIF_OP_WRITE_BARRIER:
         case BLKIF_OP_FLUSH_DISKCACHE:
+            /* those of blkfront_sync() have no aiocb */
+            if (aiocbp == NULL)
+                break;
+            MINIOS_TAILQ_REMOVE(&dev->inflight, aiocbp, inflight);
+            /* Nota: callback frees aiocbp itself */
+            if (aiocbp->aio_cb)
+                aiocbp->aio_cb(aiocbp, status ? -EIO : 0);
             break;
 
         default:
-            printk("unrecognized block operation %d response\n", rsp->operation);
+            /* blkfront_aio_push_operation() of anything else */
+            if (aiocbp == NULL || aiocbp->op != rsp->operation) {
+                printk("unrecognized block operation %d response\n",
+                    rsp->operation);
+                break;
+            }
+            MINIOS_TAILQ_REMOVE(&dev->inflight, aiocbp, inflight);
+            if (aiocbp->aio_cb)
+                aiocbp->aio_cb(aiocbp, status ? -EIO : 0);
         }
 
-        dev->ring.rsp_cons = ++cons;
-        /* Nota: callback frees aiocbp itself */
-        if (aiocbp && aiocbp->aio_cb)
-            aiocbp->aio_cb(aiocbp, status ? -EIO : 0);
         if (dev->ring.rsp_cons != cons)
             /* We reentered, we must not continue here */
             break;
@@ -514,3 +1257,120 @@ moretodo:
 
     return nr_consumed;
 }
+
+/* Put an aiocb whose requests were lost with the old ring out again */
+static void blkfront_aio_resubmit(struct blkfront_dev *dev,
+        struct blkfront_aiocb *aiocbp)
+{
+    blkfront_put_ibufs(dev, aiocbp);
+    aiocbp->merge_next = NULL;
+    aiocbp->aio_ret = 0;
+
+    switch (aiocbp->op) {
+    case BLKIF_OP_READ:
+    case BLKIF_OP_WRITE:
+        blkfront_aio_submit(dev, aiocbp, dev->ring_gen);
+        break;
+    default:
+        blkfront_queue_operation(dev, aiocbp, aiocbp->op);
+    }
+}
+
+/*
+ * Reconnect after a restore.  The old backend is gone along with our
+ * event channel and grants, and its ring is useless.  Everything that
+ * was on it is issued again, in the same order, which is all right
+ * for block devices: at worst a write or read is done twice.
+ */
+static int blkfront_resume(struct blkfront_dev *dev)
+{
+    MINIOS_TAILQ_HEAD(, blkfront_aiocb) redo;
+    struct blkfront_aiocb *aiocbp;
+    struct blkif_sring *s = dev->ring.sring;
+    char *msg;
+    int i, n, max_order;
+
+    /* reap what the old backend completed before we went */
+    blkfront_aio_poll(dev);
+    MINIOS_TAILQ_INIT(&redo);
+    MINIOS_TAILQ_CONCAT(&redo, &dev->inflight, inflight);
+
+    {
+        char path[strlen(dev->backend) + 1 + 5 + 1];
+
+        snprintf(path, sizeof(path), "%s/state", dev->backend);
+        free(xenbus_unwatch_path_token(XBT_NIL, path, path));
+    }
+    if ((msg = blkfront_bind_backend(dev, &max_order)) != NULL) {
+        free(msg);
+        goto fail;
+    }
+
+    /* the ring pages stay, perhaps fewer of them */
+    if (dev->ring_order > max_order)
+        dev->ring_order = max_order;
+    memset(s, 0, PAGE_SIZE << dev->ring_order);
+    SHARED_RING_INIT(s);
+    FRONT_RING_INIT(&dev->ring, s, PAGE_SIZE << dev->ring_order);
+    blkfront_size_pgrants(dev);
+    dev->merge_tail = NULL;
+    dev->ring_gen++;
+    for (i = 0; i < (1 << dev->ring_order); i++)
+        gnttab_regrant(dev->ring_ref[i], dev->dom,
+            virt_to_mfn((char *)s + i * PAGE_SIZE), 0);
+
+    regrant_buffers(dev->pgrants, dev->dom, 0);
+    regrant_buffers(dev->ipages, dev->dom, 1);
+    MINIOS_TAILQ_FOREACH(aiocbp, &redo, inflight)
+        blkfront_aio_regrant(dev, aiocbp);
+
+    if (blkfront_connect(dev) != 0)
+        goto fail;
+    dev->offline = 0;
+    unmask_evtchn(dev->evtchn);
+
+    for (n = 0; (aiocbp = MINIOS_TAILQ_FIRST(&redo)) != NULL; n++) {
+        MINIOS_TAILQ_REMOVE(&redo, aiocbp, inflight);
+        blkfront_aio_resubmit(dev, aiocbp);
+    }
+    blkfront_push(dev);
+    printk("blkfront: %s reconnected, %d aiocbs issued again\n",
+        dev->nodename, n);
+    return 0;
+
+fail:
+    printk("blkfront: %s lost its backend\n", dev->nodename);
+    while ((aiocbp = MINIOS_TAILQ_FIRST(&redo)) != NULL) {
+        MINIOS_TAILQ_REMOVE(&redo, aiocbp, inflight);
+        blkfront_aio_fail(dev, aiocbp);
+    }
+    return -1;
+}
+
+void suspend_blkfront(void)
+{
+    struct blkfront_dev *dev;
+
+    for (dev = blkfront_devs; dev; dev = dev->next) {
+        dev->suspended = 1;
+        dev->offline = 1;
+        mask_evtchn(dev->evtchn);
+    }
+}
+
+void resume_blkfront(int cancelled)
+{
+    struct blkfront_dev *dev;
+
+    for (dev = blkfront_devs; dev; dev = dev->next) {
+        if (cancelled) {
+            unmask_evtchn(dev->evtchn);
+            dev->offline = 0;
+        } else if (blkfront_resume(dev) != 0) {
+            /* stays offline, whoever waits for it gets -EIO */
+            dev->dead = 1;
+        }
+        dev->suspended = 0;
+        wake_up(&dev->waitq);
+    }
+}
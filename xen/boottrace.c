@@ -0,0 +1,91 @@
+/*
+ ****************************************************************************
+ *
+ *        File: boottrace.c
+ *
+ * Environment: Xen Minimal OS
+ * Description: Records when boot phases are reached, so that startup
+ *  regressions show up as numbers.
+ *
+ ****************************************************************************
+ */
+#include <mini-os/os.h>
+#include <mini-os/lib.h>
+#include <mini-os/time.h>
+#include <mini-os/xenbus.h>
+#include <mini-os/stats.h>
+#include <mini-os/boottrace.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct {
+    s_time_t when;
+    char name[BOOT_TRACE_NAMESZ];
+} marks[BOOT_TRACE_MAX];
+static int nmarks;
+
+void boot_mark(const char *fmt, ...)
+{
+    unsigned long flags;
+    va_list args;
+    int i;
+
+    /* marks come from threads and boot alike */
+    local_irq_save(flags);
+    if (nmarks == BOOT_TRACE_MAX) {
+        local_irq_restore(flags);
+        return;
+    }
+    i = nmarks++;
+    marks[i].when = NOW();
+    local_irq_restore(flags);
+
+    va_start(args, fmt);
+    vsnprintf(marks[i].name, sizeof(marks[i].name), fmt, args);
+    va_end(args);
+}
+
+/* microseconds since the first mark */
+static unsigned long mark_us(int i)
+{
+
+    return (unsigned long)((marks[i].when - marks[0].when) / 1000);
+}
+
+static void boot_trace_dump(void)
+{
+    int i;
+
+    for (i = 0; i < nmarks; i++)
+        printk("boot: %9lu us  +%8lu us  %s\n", mark_us(i),
+               i ? mark_us(i) - mark_us(i-1) : 0UL, marks[i].name);
+}
+
+void boot_trace_done(void)
+{
+    struct xenbus_batch batch;
+    char key[16];
+    int i, n, retry;
+
+    boot_mark("boot done");
+    boot_trace_dump();
+
+    /* data/boot-trace/<n> is "<us> <name>", all in one round trip */
+    n = nmarks;
+    xenbus_batch_start(&batch, 0);
+    for (i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "%d", i);
+        xenbus_batch_printf(&batch, "data/boot-trace", key, "%lu %s",
+                            mark_us(i), marks[i].name);
+    }
+    free(xenbus_batch_end(&batch, 0, &retry));
+}
+
+void init_boot_trace(void)
+{
+
+    stats_register("boot", boot_trace_dump);
+}
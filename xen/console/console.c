@@ -77,68 +77,61 @@ void xencons_tx(void)
 }
 
 
+/*
+ * Translate \n to \r\n through a small buffer, so that the ring gets
+ * a few bulk copies and the daemon a single notification per call.
+ */
+#define CONSOLE_CHUNK 256
+
 void console_print(struct consfront_dev *dev, char *data, int length)
 {
-    char *curr_char, saved_char;
-    char copied_str[length+1];
-    char *copied_ptr;
-    int part_len;
+    char chunk[CONSOLE_CHUNK];
     int (*ring_send_fn)(struct consfront_dev *dev, const char *data, unsigned length);
-    int sent;
+    int i, n, sent = 0, total = 0;
 
     if(!console_initialised)
         ring_send_fn = xencons_ring_send_no_notify;
     else
-        ring_send_fn = xencons_ring_send;
-
-    copied_ptr = copied_str;
-    memcpy(copied_ptr, data, length);
-    for(curr_char = copied_ptr; curr_char < copied_ptr+length-1; curr_char++)
-    {
-        if(*curr_char == '\n')
-        {
-            *curr_char = '\r';
-            saved_char = *(curr_char+1);
-            *(curr_char+1) = '\n';
-            part_len = curr_char - copied_ptr + 2;
-            ring_send_fn(dev, copied_ptr, part_len);
-            *(curr_char+1) = saved_char;
-            copied_ptr = curr_char+1;
-            length -= part_len - 1;
+        ring_send_fn = xencons_ring_write;
+
+    for (i = 0, n = 0; i < length; i++) {
+        if (data[i] == '\n')
+            chunk[n++] = '\r';
+        chunk[n++] = data[i];
+        if (n >= CONSOLE_CHUNK - 1 || i == length - 1) {
+            sent += ring_send_fn(dev, chunk, n);
+            total += n;
+            n = 0;
         }
     }
-
-    if (copied_ptr[length-1] == '\n') {
-        copied_ptr[length-1] = '\r';
-        copied_ptr[length] = '\n';
-        length++;
-    }
-    
-    /*
-     * we assume that the lower layer loops until it manages to
-     * send everything.  XXX is this the best place to do "buffering"?
-     */
-    sent = ring_send_fn(dev, copied_ptr, length);
-    ASSERT(ring_send_fn == xencons_ring_send_no_notify || sent == length);
+    if (console_initialised && total)
+        xencons_notify(dev);
+    ASSERT(!console_initialised || sent == total);
 }
 
 void print(int direct, const char *fmt, va_list args)
 {
-    static char   buf[1024];
+    /* per call, so that threads and interrupts don't share it */
+    char buf[1024];
+    int len;
     
-    (void)vsnprintf(buf, sizeof(buf), fmt, args);
+    len = vsnprintf(buf, sizeof(buf), fmt, args);
+    if (len < 0)
+        return;
+    if (len >= sizeof(buf))
+        len = sizeof(buf) - 1;
  
     if(direct)
     {
-        (void)HYPERVISOR_console_io(CONSOLEIO_write, strlen(buf), buf);
+        (void)HYPERVISOR_console_io(CONSOLEIO_write, len, buf);
         return;
     } else {
 #ifndef USE_XEN_CONSOLE
     if(!console_initialised)
 #endif    
-            (void)HYPERVISOR_console_io(CONSOLEIO_write, strlen(buf), buf);
+            (void)HYPERVISOR_console_io(CONSOLEIO_write, len, buf);
         
-        console_print(NULL, buf, strlen(buf));
+        console_print(NULL, buf, len);
     }
 }
 
@@ -56,15 +56,30 @@ int xencons_ring_send_no_notify(struct consfront_dev *dev, const char *data, uns
 	mb();
 	BUG_ON((prod - cons) > sizeof(intf->out));
 
-	while ((sent < len) && ((prod - cons) < sizeof(intf->out)))
-		intf->out[MASK_XENCONS_IDX(prod++, intf->out)] = data[sent++];
+	/* what fits, in at most two copies around the end of the ring */
+	while (sent < len && (prod - cons) < sizeof(intf->out)) {
+		XENCONS_RING_IDX off = MASK_XENCONS_IDX(prod, intf->out);
+		unsigned part = sizeof(intf->out) - off;
+
+		if (part > sizeof(intf->out) - (prod - cons))
+			part = sizeof(intf->out) - (prod - cons);
+		if (part > len - sent)
+			part = len - sent;
+		memcpy(intf->out + off, data + sent, part);
+		prod += part;
+		sent += part;
+	}
 	wmb();
 	intf->out_prod = prod;
     
 	return sent;
 }
 
-int xencons_ring_send(struct consfront_dev *dev, const char *data, unsigned len)
+/*
+ * Put all of data on the ring, without telling the daemon unless a
+ * full ring has to be drained first.  xencons_notify() when done.
+ */
+int xencons_ring_write(struct consfront_dev *dev, const char *data, unsigned len)
 {
 	int sent = 0;
 	int part;
@@ -72,13 +87,29 @@ int xencons_ring_send(struct consfront_dev *dev, const char *data, unsigned len)
 	for (sent = 0; sent < len; sent += part) {
 		part = xencons_ring_send_no_notify(dev,
 		    data + sent, len - sent);
-		notify_daemon(dev);
+		if (part == 0)
+			notify_daemon(dev);
 	}
 
 	ASSERT(sent == len);
 	return sent;
 }
 
+void xencons_notify(struct consfront_dev *dev)
+{
+
+	notify_daemon(dev);
+}
+
+int xencons_ring_send(struct consfront_dev *dev, const char *data, unsigned len)
+{
+	int sent;
+
+	sent = xencons_ring_write(dev, data, len);
+	notify_daemon(dev);
+	return sent;
+}
+
 void console_handle_input(evtchn_port_t port, struct pt_regs *regs, void *data)
 {
 	struct consfront_dev *dev = (struct consfront_dev *) data;
@@ -21,6 +21,8 @@
 #include <mini-os/hypervisor.h>
 #include <mini-os/events.h>
 #include <mini-os/lib.h>
+#include <mini-os/time.h>
+#include <mini-os/stats.h>
 
 #define NR_EVS 1024
 
@@ -29,6 +31,8 @@ typedef struct _ev_action_t {
 	evtchn_handler_t handler;
 	void *data;
     uint32_t count;
+    s_time_t time;      /* total time spent in the handler */
+    s_time_t maxtime;
 } ev_action_t;
 
 static ev_action_t ev_actions[NR_EVS];
@@ -72,6 +76,7 @@ void unbind_all_ports(void)
 int do_event(evtchn_port_t port, struct pt_regs *regs)
 {
     ev_action_t  *action;
+    s_time_t start;
 
     clear_evtchn(port);
 
@@ -85,7 +90,12 @@ int do_event(evtchn_port_t port, struct pt_regs *regs)
     action->count++;
 
     /* call the handler */
+    start = NOW();
 	action->handler(port, regs, action->data);
+    start = NOW() - start;
+    action->time += start;
+    if (start > action->maxtime)
+        action->maxtime = start;
 
     return 1;
 
@@ -99,6 +109,8 @@ evtchn_port_t bind_evtchn(evtchn_port_t port, evtchn_handler_t handler,
                port);
 
 	ev_actions[port].data = data;
+	ev_actions[port].count = 0;
+	ev_actions[port].time = ev_actions[port].maxtime = 0;
 	wmb();
 	ev_actions[port].handler = handler;
 	set_bit(port, bound_ports);
@@ -196,6 +208,24 @@ void init_events(void)
     }
 }
 
+/*
+ * After a restore no port is bound any more.  Forget them all; their
+ * owners bind anew from their resume functions.
+ */
+void resume_events(void)
+{
+    int i;
+
+    for ( i = 0; i < NR_EVS; i++ )
+    {
+        ev_actions[i].handler = default_handler;
+        ev_actions[i].data = NULL;
+        clear_bit(i, bound_ports);
+        mask_evtchn(i);
+        clear_evtchn(i);
+    }
+}
+
 void fini_events(void)
 {
     /* Dealloc all events */
@@ -205,6 +235,30 @@ void fini_events(void)
 #endif
 }
 
+static void evtchn_dump_stats(void)
+{
+    ev_action_t *action;
+    int i;
+
+    printk("evtchn: port  events  time(us)  maxtime(us)  handler\n");
+    for ( i = 0; i < NR_EVS; i++ )
+    {
+        action = &ev_actions[i];
+        if ( action->count == 0 )
+            continue;
+        printk("evtchn: %d %u %llu %llu %p\n", i, action->count,
+               (unsigned long long)NSEC_TO_USEC(action->time),
+               (unsigned long long)NSEC_TO_USEC(action->maxtime),
+               action->handler);
+    }
+}
+
+void init_evtchn_stats(void)
+{
+
+    stats_register("evtchn", evtchn_dump_stats);
+}
+
 void default_handler(evtchn_port_t port, struct pt_regs *regs, void *ignore)
 {
     printk("[Port %d] - event received\n", port);
@@ -7,9 +7,6 @@
  * (host address, grant handle) pairs. Grant handles come from a hypervisor map
  * operation and are needed for the corresponding unmap.
  *
- * This is a rather naive implementation in terms of performance. If we start
- * using it frequently, there's definitely some low-hanging fruit here.
- *
  *
  * Permission is hereby granted, free of charge, to any person obtaining a copy
  * of this software and associated documentation files (the "Software"), to
@@ -42,25 +39,40 @@
 
 #define DEFAULT_MAX_GRANTS 128
 
+/*
+ * Unused entries are kept on a free list, used ones are hashed by
+ * host address, both linked through the next index.  That keeps
+ * finding a free entry and looking one up by address O(1).
+ */
 struct gntmap_entry {
     unsigned long host_addr;
     grant_handle_t handle;
+    int next;
 };
 
+#define GNTMAP_NONE (-1)
+
 static inline int
 gntmap_entry_used(struct gntmap_entry *entry)
 {
     return entry->host_addr != 0;
 }
 
+static inline int
+gntmap_hash(struct gntmap *map, unsigned long addr)
+{
+    return (addr >> PAGE_SHIFT) & (map->nbuckets - 1);
+}
+
 static struct gntmap_entry*
 gntmap_find_free_entry(struct gntmap *map)
 {
-    int i;
+    struct gntmap_entry *ent;
 
-    for (i = 0; i < map->nentries; i++) {
-        if (!gntmap_entry_used(&map->entries[i]))
-            return &map->entries[i];
+    if (map->freelist != GNTMAP_NONE) {
+        ent = &map->entries[map->freelist];
+        map->freelist = ent->next;
+        return ent;
     }
 
 #ifdef GNTMAP_DEBUG
@@ -70,14 +82,41 @@ gntmap_find_free_entry(struct gntmap *map)
     return NULL;
 }
 
+static void
+gntmap_put_free_entry(struct gntmap *map, struct gntmap_entry *ent)
+{
+    ent->host_addr = 0;
+    ent->next = map->freelist;
+    map->freelist = ent - map->entries;
+}
+
+static void
+gntmap_hash_insert(struct gntmap *map, struct gntmap_entry *ent)
+{
+    int b = gntmap_hash(map, ent->host_addr);
+
+    ent->next = map->buckets[b];
+    map->buckets[b] = ent - map->entries;
+}
+
+/* Look up the entry for addr and unhash it. */
 static struct gntmap_entry*
 gntmap_find_entry(struct gntmap *map, unsigned long addr)
 {
-    int i;
+    struct gntmap_entry *ent;
+    int *prevp;
 
-    for (i = 0; i < map->nentries; i++) {
-        if (map->entries[i].host_addr == addr)
-            return &map->entries[i];
+    if (map->nentries == 0)
+        return NULL;
+
+    for (prevp = &map->buckets[gntmap_hash(map, addr)];
+         *prevp != GNTMAP_NONE;
+         prevp = &ent->next) {
+        ent = &map->entries[*prevp];
+        if (ent->host_addr == addr) {
+            *prevp = ent->next;
+            return ent;
+        }
     }
     return NULL;
 }
@@ -85,6 +124,8 @@ gntmap_find_entry(struct gntmap *map, unsigned long addr)
 int
 gntmap_set_max_grants(struct gntmap *map, int count)
 {
+    int i, nbuckets;
+
 #ifdef GNTMAP_DEBUG
     printk("gntmap_set_max_grants(map=%p, count=%d)\n", map, count);
 #endif
@@ -92,93 +133,106 @@ gntmap_set_max_grants(struct gntmap *map, int count)
     if (map->nentries != 0)
         return -EBUSY;
 
+    for (nbuckets = 1; nbuckets < count; nbuckets <<= 1)
+        continue;
+
     map->entries = xmalloc_array(struct gntmap_entry, count);
     if (map->entries == NULL)
         return -ENOMEM;
+    map->buckets = xmalloc_array(int, nbuckets);
+    if (map->buckets == NULL) {
+        xfree(map->entries);
+        map->entries = NULL;
+        return -ENOMEM;
+    }
 
     memset(map->entries, 0, sizeof(struct gntmap_entry) * count);
+    map->freelist = GNTMAP_NONE;
+    for (i = count - 1; i >= 0; i--)
+        gntmap_put_free_entry(map, &map->entries[i]);
+    for (i = 0; i < nbuckets; i++)
+        map->buckets[i] = GNTMAP_NONE;
+    map->nbuckets = nbuckets;
     map->nentries = count;
     return 0;
 }
 
+/*
+ * Unmap n entries with one hypercall.  The entries must already be
+ * unhashed, they end up on the free list.
+ */
 static int
-_gntmap_map_grant_ref(struct gntmap_entry *entry, 
-                      unsigned long host_addr,
-                      uint32_t domid,
-                      uint32_t ref,
-                      int writable)
+_gntmap_unmap_grant_refs(struct gntmap *map, struct gntmap_entry **ents, int n)
 {
-    struct gnttab_map_grant_ref op;
-    int rc;
-
-    op.ref = (grant_ref_t) ref;
-    op.dom = (domid_t) domid;
-    op.host_addr = (uint64_t) host_addr;
-    op.flags = GNTMAP_host_map;
-    if (!writable)
-        op.flags |= GNTMAP_readonly;
-
-    rc = HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, &op, 1);
-    if (rc != 0 || op.status != GNTST_okay) {
-        printk("GNTTABOP_map_grant_ref failed: "
-               "returned %d, status %" PRId16 "\n",
-               rc, op.status);
-        return rc != 0 ? rc : op.status;
-    }
+    struct gnttab_unmap_grant_ref *ops;
+    int i, rc, ret = 0;
 
-    entry->host_addr = host_addr;
-    entry->handle = op.handle;
-    return 0;
-}
+    if (n == 0)
+        return 0;
+    ops = xmalloc_array(struct gnttab_unmap_grant_ref, n);
+    if (ops == NULL)
+        return -ENOMEM;
 
-static int
-_gntmap_unmap_grant_ref(struct gntmap_entry *entry)
-{
-    struct gnttab_unmap_grant_ref op;
-    int rc;
-
-    op.host_addr    = (uint64_t) entry->host_addr;
-    op.dev_bus_addr = 0;
-    op.handle       = entry->handle;
-
-    rc = HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, &op, 1);
-    if (rc != 0 || op.status != GNTST_okay) {
-        printk("GNTTABOP_unmap_grant_ref failed: "
-               "returned %d, status %" PRId16 "\n",
-               rc, op.status);
-        return rc != 0 ? rc : op.status;
+    for (i = 0; i < n; i++) {
+        ops[i].host_addr    = (uint64_t) ents[i]->host_addr;
+        ops[i].dev_bus_addr = 0;
+        ops[i].handle       = ents[i]->handle;
     }
 
-    entry->host_addr = 0;
-    return 0;
+    rc = HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, ops, n);
+    for (i = 0; i < n; i++) {
+        if (rc != 0 || ops[i].status != GNTST_okay) {
+            printk("GNTTABOP_unmap_grant_ref failed: "
+                   "returned %d, status %" PRId16 "\n",
+                   rc, ops[i].status);
+            if (ret == 0)
+                ret = rc != 0 ? rc : ops[i].status;
+            /* still mapped, keep it findable */
+            gntmap_hash_insert(map, ents[i]);
+            continue;
+        }
+        gntmap_put_free_entry(map, ents[i]);
+    }
+
+    xfree(ops);
+    return ret;
 }
 
 int
 gntmap_munmap(struct gntmap *map, unsigned long start_address, int count)
 {
+    struct gntmap_entry **ents;
     int i, rc;
-    struct gntmap_entry *ent;
 
 #ifdef GNTMAP_DEBUG
     printk("gntmap_munmap(map=%p, start_address=%lx, count=%d)\n",
            map, start_address, count);
 #endif
 
+    ents = xmalloc_array(struct gntmap_entry *, count);
+    if (ents == NULL)
+        return -ENOMEM;
+
     for (i = 0; i < count; i++) {
-        ent = gntmap_find_entry(map, start_address + PAGE_SIZE * i);
-        if (ent == NULL) {
+        ents[i] = gntmap_find_entry(map, start_address + PAGE_SIZE * i);
+        if (ents[i] == NULL) {
             printk("gntmap: tried to munmap unknown page\n");
+            /* unmap what we did find */
+            _gntmap_unmap_grant_refs(map, ents, i);
+            xfree(ents);
             return -EINVAL;
         }
-
-        rc = _gntmap_unmap_grant_ref(ent);
-        if (rc != 0)
-            return rc;
     }
 
-    return 0;
+    rc = _gntmap_unmap_grant_refs(map, ents, count);
+    xfree(ents);
+    return rc;
 }
 
+/*
+ * Map count grants to a contiguous range of addresses with a single
+ * GNTTABOP_map_grant_ref hypercall.
+ */
 void*
 gntmap_map_grant_refs(struct gntmap *map, 
                       uint32_t count,
@@ -187,9 +241,10 @@ gntmap_map_grant_refs(struct gntmap *map,
                       uint32_t *refs,
                       int writable)
 {
+    struct gnttab_map_grant_ref *ops;
+    struct gntmap_entry **ents;
     unsigned long addr;
-    struct gntmap_entry *ent;
-    int i;
+    int i, rc, nmapped;
 
 #ifdef GNTMAP_DEBUG
     printk("gntmap_map_grant_refs(map=%p, count=%" PRIu32 ", "
@@ -206,21 +261,56 @@ gntmap_map_grant_refs(struct gntmap *map,
     if (addr == 0)
         return NULL;
 
+    ops = xmalloc_array(struct gnttab_map_grant_ref, count);
+    ents = xmalloc_array(struct gntmap_entry *, count);
+    if (ops == NULL || ents == NULL)
+        goto fail_alloc;
+
     for (i = 0; i < count; i++) {
-        ent = gntmap_find_free_entry(map);
-        if (ent == NULL ||
-            _gntmap_map_grant_ref(ent,
-                                  addr + PAGE_SIZE * i,
-                                  domids[i * domids_stride],
-                                  refs[i],
-                                  writable) != 0) {
-
-            (void) gntmap_munmap(map, addr, i);
-            return NULL;
+        if ((ents[i] = gntmap_find_free_entry(map)) == NULL) {
+            while (--i >= 0)
+                gntmap_put_free_entry(map, ents[i]);
+            goto fail_alloc;
         }
+        ops[i].ref = (grant_ref_t) refs[i];
+        ops[i].dom = (domid_t) domids[i * domids_stride];
+        ops[i].host_addr = (uint64_t) (addr + PAGE_SIZE * i);
+        ops[i].flags = GNTMAP_host_map;
+        if (!writable)
+            ops[i].flags |= GNTMAP_readonly;
     }
 
+    rc = HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, ops, count);
+
+    for (i = 0, nmapped = 0; i < count; i++) {
+        if (rc == 0 && ops[i].status == GNTST_okay) {
+            ents[i]->host_addr = addr + PAGE_SIZE * i;
+            ents[i]->handle = ops[i].handle;
+            ents[nmapped++] = ents[i];
+        } else {
+            printk("GNTTABOP_map_grant_ref failed: "
+                   "returned %d, status %" PRId16 "\n",
+                   rc, ops[i].status);
+            gntmap_put_free_entry(map, ents[i]);
+        }
+    }
+    if (nmapped != count) {
+        /* all or nothing */
+        (void) _gntmap_unmap_grant_refs(map, ents, nmapped);
+        addr = 0;
+    } else {
+        for (i = 0; i < count; i++)
+            gntmap_hash_insert(map, ents[i]);
+    }
+
+    xfree(ents);
+    xfree(ops);
     return (void*) addr;
+
+ fail_alloc:
+    xfree(ents);
+    xfree(ops);
+    return NULL;
 }
 
 void
@@ -231,6 +321,9 @@ gntmap_init(struct gntmap *map)
 #endif
     map->nentries = 0;
     map->entries = NULL;
+    map->buckets = NULL;
+    map->nbuckets = 0;
+    map->freelist = GNTMAP_NONE;
 }
 
 void
@@ -245,11 +338,16 @@ gntmap_fini(struct gntmap *map)
 
     for (i = 0; i < map->nentries; i++) {
         ent = &map->entries[i];
-        if (gntmap_entry_used(ent))
-            (void) _gntmap_unmap_grant_ref(ent);
+        if (gntmap_entry_used(ent)) {
+            map->buckets[gntmap_hash(map, ent->host_addr)] = GNTMAP_NONE;
+            (void) _gntmap_unmap_grant_refs(map, &ent, 1);
+        }
     }
 
     xfree(map->entries);
+    xfree(map->buckets);
     map->entries = NULL;
+    map->buckets = NULL;
     map->nentries = 0;
+    map->nbuckets = 0;
 }
@@ -17,28 +17,42 @@
  */
 #include <mini-os/os.h>
 #include <mini-os/mm.h>
+#include <mini-os/hypervisor.h>
 #include <mini-os/gnttab.h>
 #include <mini-os/semaphore.h>
+#include <mini-os/trace.h>
 
 #include <string.h>
 
 #define NR_RESERVED_ENTRIES 8
 
-/* NR_GRANT_FRAMES must be less than or equal to that configured in Xen */
+/*
+ * We start out with NR_GRANT_FRAMES and add frames on demand, up to
+ * what GNTTABOP_query_size says Xen allows, but never more than
+ * GNTTAB_MAX_FRAMES.  NR_GRANT_FRAMES must be less than or equal to
+ * that configured in Xen.
+ */
 #ifdef __ia64__
 #define NR_GRANT_FRAMES 1
 #else
 #define NR_GRANT_FRAMES 4
 #endif
-#define NR_GRANT_ENTRIES (NR_GRANT_FRAMES * PAGE_SIZE / sizeof(grant_entry_t))
+#define GNTTAB_MAX_FRAMES 32
+#define ENTRIES_PER_FRAME (PAGE_SIZE / sizeof(grant_entry_t))
+#define NR_GRANT_ENTRIES (nr_grant_frames * ENTRIES_PER_FRAME)
+#define MAX_GRANT_ENTRIES (GNTTAB_MAX_FRAMES * ENTRIES_PER_FRAME)
 
 static grant_entry_t *gnttab_table;
-static grant_ref_t gnttab_list[NR_GRANT_ENTRIES];
+static unsigned int nr_grant_frames, max_grant_frames;
+static unsigned long gnttab_exhausted;
+static grant_ref_t gnttab_list[MAX_GRANT_ENTRIES];
 #ifdef GNT_DEBUG
-static char inuse[NR_GRANT_ENTRIES];
+static char inuse[MAX_GRANT_ENTRIES];
 #endif
 static __DECLARE_SEMAPHORE_GENERIC(gnttab_sem, 0);
 
+static int gnttab_grow(unsigned int nentries);
+
 static void
 put_free_entry(grant_ref_t ref)
 {
@@ -54,24 +68,76 @@ put_free_entry(grant_ref_t ref)
     up(&gnttab_sem);
 }
 
-static grant_ref_t
-get_free_entry(void)
+
+/*
+ * Claim n entries in one go, waiting until all of them are free so
+ * that concurrent batches cannot starve each other half way.  If
+ * the table is full, grow it first.  Mapping the new frames may
+ * allocate page tables, so that is only done from thread context
+ * with interrupts enabled.
+ */
+static void
+get_free_entries(grant_ref_t *refs, int n)
 {
     unsigned int ref;
     unsigned long flags;
-    down(&gnttab_sem);
-    local_irq_save(flags);
-    ref = gnttab_list[0];
-    BUG_ON(ref < NR_RESERVED_ENTRIES || ref >= NR_GRANT_ENTRIES);
-    gnttab_list[0] = gnttab_list[ref];
+    int i;
+
+    BUG_ON(n > MAX_GRANT_ENTRIES - NR_RESERVED_ENTRIES);
+    while (1) {
+        local_irq_save(flags);
+        if (gnttab_sem.count >= n)
+            break;
+        local_irq_restore(flags);
+
+        if (!in_callback && !irqs_disabled() && gnttab_grow(n))
+            continue;
+        gnttab_exhausted++;
+        wait_event(gnttab_sem.wait, gnttab_sem.count >= n);
+    }
+    gnttab_sem.count -= n;
+    tracepoint(TRACE_GNT_ALLOC, 0, n, gnttab_list[0], 0);
+    for (i = 0; i < n; i++) {
+        ref = gnttab_list[0];
+        BUG_ON(ref < NR_RESERVED_ENTRIES || ref >= NR_GRANT_ENTRIES);
+        gnttab_list[0] = gnttab_list[ref];
 #ifdef GNT_DEBUG
-    BUG_ON(inuse[ref]);
-    inuse[ref] = 1;
+        BUG_ON(inuse[ref]);
+        inuse[ref] = 1;
 #endif
+        refs[i] = ref;
+    }
     local_irq_restore(flags);
+}
+
+static grant_ref_t
+get_free_entry(void)
+{
+    grant_ref_t ref;
+
+    get_free_entries(&ref, 1);
     return ref;
 }
 
+/* Clear the flags of an entry, returns 0 if the remote end still uses it. */
+static int
+end_access_entry(grant_ref_t ref)
+{
+    uint16_t flags, nflags;
+
+    BUG_ON(ref >= NR_GRANT_ENTRIES || ref < NR_RESERVED_ENTRIES);
+
+    nflags = gnttab_table[ref].flags;
+    do {
+        if ((flags = nflags) & (GTF_reading|GTF_writing)) {
+            printk("WARNING: g.e. still in use! (%x)\n", flags);
+            return 0;
+        }
+    } while ((nflags = synch_cmpxchg(&gnttab_table[ref].flags, flags, 0)) !=
+            flags);
+    return 1;
+}
+
 grant_ref_t
 gnttab_grant_access(domid_t domid, unsigned long frame, int readonly)
 {
@@ -101,26 +167,92 @@ gnttab_grant_transfer(domid_t domid, unsigned long pfn)
     return ref;
 }
 
-int
-gnttab_end_access(grant_ref_t ref)
+/*
+ * Grant access to n frames, claiming all the references under a
+ * single critical section.
+ */
+void
+gnttab_grant_access_batch(domid_t domid, const unsigned long *frames, int n,
+			  int readonly, grant_ref_t *refs)
+{
+    int i;
+
+    if (n == 0)
+        return;
+
+    get_free_entries(refs, n);
+    for (i = 0; i < n; i++) {
+        gnttab_table[refs[i]].frame = frames[i];
+        gnttab_table[refs[i]].domid = domid;
+    }
+    wmb();
+    readonly *= GTF_readonly;
+    for (i = 0; i < n; i++)
+        gnttab_table[refs[i]].flags = GTF_permit_access | readonly;
+}
+
+/*
+ * Point an entry we hold at frame again.  After a restore the table
+ * comes back empty and every frame has moved, but the references are
+ * still allocated to whoever had them: frontends redo their grants in
+ * place, and references written into rings stay valid.
+ */
+void
+gnttab_regrant(grant_ref_t ref, domid_t domid, unsigned long frame,
+	       int readonly)
 {
-    uint16_t flags, nflags;
 
     BUG_ON(ref >= NR_GRANT_ENTRIES || ref < NR_RESERVED_ENTRIES);
+    gnttab_table[ref].frame = frame;
+    gnttab_table[ref].domid = domid;
+    wmb();
+    readonly *= GTF_readonly;
+    gnttab_table[ref].flags = GTF_permit_access | readonly;
+}
 
-    nflags = gnttab_table[ref].flags;
-    do {
-        if ((flags = nflags) & (GTF_reading|GTF_writing)) {
-            printk("WARNING: g.e. still in use! (%x)\n", flags);
-            return 0;
-        }
-    } while ((nflags = synch_cmpxchg(&gnttab_table[ref].flags, flags, 0)) !=
-            flags);
+int
+gnttab_end_access(grant_ref_t ref)
+{
+
+    if (!end_access_entry(ref))
+        return 0;
 
     put_free_entry(ref);
     return 1;
 }
 
+/*
+ * End access to n grants and put them back on the free list in one
+ * go.  Entries still in use are left alone, like gnttab_end_access()
+ * does.  Returns the number of grants ended.
+ */
+int
+gnttab_end_access_batch(const grant_ref_t *refs, int n)
+{
+    unsigned long flags;
+    int i, nended = 0;
+
+    local_irq_save(flags);
+    for (i = 0; i < n; i++) {
+        if (!end_access_entry(refs[i]))
+            continue;
+#ifdef GNT_DEBUG
+        BUG_ON(!inuse[refs[i]]);
+        inuse[refs[i]] = 0;
+#endif
+        gnttab_list[refs[i]] = gnttab_list[0];
+        gnttab_list[0] = refs[i];
+        nended++;
+    }
+    if (nended) {
+        gnttab_sem.count += nended;
+        wake_up(&gnttab_sem.wait);
+    }
+    local_irq_restore(flags);
+
+    return nended;
+}
+
 unsigned long
 gnttab_end_transfer(grant_ref_t ref)
 {
@@ -175,26 +307,119 @@ gnttabop_error(int16_t status)
         return gnttabop_error_msgs[status];
 }
 
+/*
+ * Set up the table with nframes frames, mapping the ones we do not
+ * have yet and putting their entries on the free list.  With remap,
+ * all of them are mapped again and the free list is left alone.
+ */
+static int
+gnttab_setup_frames(unsigned int nframes, int remap)
+{
+    struct gnttab_setup_table setup;
+    unsigned long frames[GNTTAB_MAX_FRAMES];
+    unsigned int i, old;
+    int rc;
+
+    setup.dom = DOMID_SELF;
+    setup.nr_frames = nframes;
+    set_xen_guest_handle(setup.frame_list, frames);
+
+    rc = HYPERVISOR_grant_table_op(GNTTABOP_setup_table, &setup, 1);
+    if (rc || setup.status != GNTST_okay) {
+        printk("gnttab: cannot set up %u frames: %d/%s\n", nframes,
+            rc, gnttabop_error(setup.status));
+        return 0;
+    }
+
+    old = remap ? 0 : nr_grant_frames;
+    do_map_frames((unsigned long)gnttab_table + old * PAGE_SIZE,
+        frames + old, nframes - old, 1, 0, DOMID_SELF, NULL, L1_PROT);
+    if (remap)
+        return 1;
+
+    nr_grant_frames = nframes;
+    for (i = old * ENTRIES_PER_FRAME; i < NR_GRANT_ENTRIES; i++)
+        if (i >= NR_RESERVED_ENTRIES)
+            put_free_entry(i);
+    return 1;
+}
+
+/* Add enough frames for at least nentries more entries. */
+static int
+gnttab_grow(unsigned int nentries)
+{
+    unsigned int nframes;
+
+    if (nr_grant_frames >= max_grant_frames)
+        return 0;
+
+    /* double, or more if a big batch asks for it */
+    nframes = nr_grant_frames
+        + (nentries + ENTRIES_PER_FRAME - 1) / ENTRIES_PER_FRAME;
+    if (nframes < 2 * nr_grant_frames)
+        nframes = 2 * nr_grant_frames;
+    if (nframes > max_grant_frames)
+        nframes = max_grant_frames;
+
+    if (!gnttab_setup_frames(nframes, 0))
+        return 0;
+    printk("gnttab: grown to %u frames\n", nr_grant_frames);
+    return 1;
+}
+
+void
+gnttab_stats(unsigned int *nframes, unsigned int *maxframes,
+	     unsigned long *exhausted)
+{
+
+    *nframes = nr_grant_frames;
+    *maxframes = max_grant_frames;
+    *exhausted = gnttab_exhausted;
+}
+
 void
 init_gnttab(void)
 {
-    struct gnttab_setup_table setup;
-    unsigned long frames[NR_GRANT_FRAMES];
-    int i;
+    struct gnttab_query_size query;
 
 #ifdef GNT_DEBUG
     memset(inuse, 1, sizeof(inuse));
 #endif
-    for (i = NR_RESERVED_ENTRIES; i < NR_GRANT_ENTRIES; i++)
-        put_free_entry(i);
 
-    setup.dom = DOMID_SELF;
-    setup.nr_frames = NR_GRANT_FRAMES;
-    set_xen_guest_handle(setup.frame_list, frames);
+    query.dom = DOMID_SELF;
+    if (HYPERVISOR_grant_table_op(GNTTABOP_query_size, &query, 1) == 0
+      && query.status == GNTST_okay)
+        max_grant_frames = query.max_nr_frames;
+    if (max_grant_frames > GNTTAB_MAX_FRAMES)
+        max_grant_frames = GNTTAB_MAX_FRAMES;
+    if (max_grant_frames < NR_GRANT_FRAMES)
+        max_grant_frames = NR_GRANT_FRAMES;
+
+    /* reserve room to grow into, so the table stays contiguous */
+    gnttab_table = (grant_entry_t *)allocate_ondemand(max_grant_frames, 1);
+    gnttab_setup_frames(NR_GRANT_FRAMES, 0);
+    printk("gnttab_table mapped at %p, %u of max %u frames.\n",
+        gnttab_table, nr_grant_frames, max_grant_frames);
+}
 
-    HYPERVISOR_grant_table_op(GNTTABOP_setup_table, &setup, 1);
-    gnttab_table = map_frames(frames, NR_GRANT_FRAMES);
-    printk("gnttab_table mapped at %p.\n", gnttab_table);
+/*
+ * The table frames belong to Xen and must not be mapped when the
+ * domain is saved.  A restored domain gets a table of its own, and
+ * whatever was granted before is gone.
+ */
+void
+suspend_gnttab(void)
+{
+
+    unmap_frames((unsigned long)gnttab_table, nr_grant_frames);
+}
+
+void
+resume_gnttab(void)
+{
+
+    if (!gnttab_setup_frames(nr_grant_frames, 1))
+        do_exit();
 }
 
 void
@@ -0,0 +1,127 @@
+/*
+ ****************************************************************************
+ *
+ *        File: hypercall_stats.c
+ *
+ * Environment: Xen Minimal OS
+ * Description: Per-hypercall counts and cycle totals, dumped on request
+ *  through control/stats and optionally every few seconds.
+ *
+ ****************************************************************************
+ */
+#include <mini-os/os.h>
+#include <mini-os/lib.h>
+#include <mini-os/sched.h>
+#include <mini-os/stats.h>
+#include <mini-os/hypercall_stats.h>
+
+#include <stdio.h>
+
+struct hypercall_stat hypercall_stats[HYPERCALL_STATS_MAX];
+
+static const char *const hypercall_names[HYPERCALL_STATS_MAX] = {
+    [__HYPERVISOR_set_trap_table] = "set_trap_table",
+    [__HYPERVISOR_mmu_update] = "mmu_update",
+    [__HYPERVISOR_set_gdt] = "set_gdt",
+    [__HYPERVISOR_stack_switch] = "stack_switch",
+    [__HYPERVISOR_set_callbacks] = "set_callbacks",
+    [__HYPERVISOR_fpu_taskswitch] = "fpu_taskswitch",
+    [__HYPERVISOR_memory_op] = "memory_op",
+    [__HYPERVISOR_multicall] = "multicall",
+    [__HYPERVISOR_update_va_mapping] = "update_va_mapping",
+    [__HYPERVISOR_set_timer_op] = "set_timer_op",
+    [__HYPERVISOR_xen_version] = "xen_version",
+    [__HYPERVISOR_console_io] = "console_io",
+    [__HYPERVISOR_grant_table_op] = "grant_table_op",
+    [__HYPERVISOR_vm_assist] = "vm_assist",
+    [__HYPERVISOR_vcpu_op] = "vcpu_op",
+    [__HYPERVISOR_mmuext_op] = "mmuext_op",
+    [__HYPERVISOR_sched_op] = "sched_op",
+    [__HYPERVISOR_callback_op] = "callback_op",
+    [__HYPERVISOR_event_channel_op] = "event_channel_op",
+    [__HYPERVISOR_physdev_op] = "physdev_op",
+};
+
+/* as of the last dump, for the rates */
+static struct hypercall_stat hypercall_last[HYPERCALL_STATS_MAX];
+static s_time_t hypercall_last_time;
+static int hypercall_period;
+static int hypercall_thread_running;
+
+static void hypercall_stats_print(int rates)
+{
+    struct hypercall_stat now, *last;
+    s_time_t t, ms;
+    char unknown[8];
+    const char *name;
+    int i;
+
+    t = NOW();
+    ms = NSEC_TO_MSEC(t - hypercall_last_time);
+    if (ms == 0)
+        ms = 1;
+    printk("hypercall: %-18s %10s %8s %10s %10s\n", "op", "calls",
+        rates ? "calls/s" : "", "cycles/op", "batched");
+    for (i = 0; i < HYPERCALL_STATS_MAX; i++) {
+        now = hypercall_stats[i];
+        last = &hypercall_last[i];
+        if (now.calls == 0 && now.batched == 0)
+            continue;
+        if ((name = hypercall_names[i]) == NULL) {
+            snprintf(unknown, sizeof(unknown), "op%d", i);
+            name = unknown;
+        }
+        if (rates)
+            printk("hypercall: %-18s %10llu %8llu %10llu %10llu\n", name,
+                (unsigned long long)now.calls,
+                (unsigned long long)((now.calls - last->calls) * 1000 / ms),
+                (unsigned long long)(now.calls == last->calls ? 0
+                    : (now.cycles - last->cycles)
+                    / (now.calls - last->calls)),
+                (unsigned long long)now.batched);
+        else
+            printk("hypercall: %-18s %10llu %8s %10llu %10llu\n", name,
+                (unsigned long long)now.calls, "",
+                (unsigned long long)(now.calls ? now.cycles / now.calls : 0),
+                (unsigned long long)now.batched);
+        if (rates)
+            *last = now;
+    }
+    if (rates)
+        hypercall_last_time = t;
+}
+
+static void hypercall_stats_dump(void)
+{
+
+    hypercall_stats_print(0);
+}
+
+static void hypercall_stats_thread(void *arg)
+{
+
+    hypercall_last_time = NOW();
+    while (hypercall_period > 0) {
+        msleep(hypercall_period * 1000);
+        hypercall_stats_print(1);
+    }
+    hypercall_thread_running = 0;
+    exit_thread();
+}
+
+/* Print the rates every secs seconds, 0 to stop. */
+void hypercall_stats_set_period(int secs)
+{
+
+    hypercall_period = secs > 0 ? secs : 0;
+    if (hypercall_period && !hypercall_thread_running) {
+        hypercall_thread_running = 1;
+        create_thread("hcstats", NULL, hypercall_stats_thread, NULL, NULL);
+    }
+}
+
+void init_hypercall_stats(void)
+{
+
+    stats_register("hypercall", hypercall_stats_dump);
+}
@@ -68,6 +68,7 @@ void do_hypervisor_callback(struct pt_regs *regs)
         }
     }
 
+    fpu_exit_callback();
     in_callback = 0;
 }
 
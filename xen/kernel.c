@@ -42,8 +42,18 @@
 #include <mini-os/fbfront.h>
 #include <mini-os/pcifront.h>
 #include <mini-os/xmalloc.h>
+#include <mini-os/balloon.h>
+#include <mini-os/stats.h>
+#include <mini-os/softirq.h>
+#include <mini-os/boottrace.h>
+#include <mini-os/trace.h>
+#include <mini-os/console.h>
+#include <mini-os/kernel.h>
 #include <xen/features.h>
 #include <xen/version.h>
+#include <xen/vcpu.h>
+
+#include <errno.h>
 
 #include "netbsd_init.h"
 
@@ -65,17 +75,37 @@ void setup_xen_features(void)
     }
 }
 
+/*
+ * Only VCPU 0 is ever brought up: the scheduler and the rumpuser
+ * synchronisation hypercalls rely on cooperative scheduling on a
+ * single CPU.  Tell the user if the domain was given more.
+ */
+static void
+check_vcpus(void)
+{
+    int n;
+
+    for (n = 1; HYPERVISOR_vcpu_op(VCPUOP_is_up, n, NULL) >= 0; n++)
+        continue;
+    if (n > 1)
+        printk("%d VCPUs configured, only VCPU 0 will be used\n", n);
+}
+
 static void
 _app_main(void *arg)
 {
     start_info_t *si = arg;
 
+    boot_mark("main thread");
 #ifdef CONFIG_PCI
     init_pcifront(NULL);
+    boot_mark("pcifront");
 #endif
 
     _netbsd_init();
+    boot_mark("netbsd init");
 
+    boot_trace_done();
     app_main(si);
     _netbsd_fini(); /* stubbornly execute this anyway */
 }
@@ -87,6 +117,8 @@ void start_kernel(start_info_t *si)
 {
 
     arch_init(si);
+    /* from here on NOW() works */
+    boot_mark("arch_init");
     trap_init();
 
     /* print out some useful information  */
@@ -104,6 +136,7 @@ void start_kernel(start_info_t *si)
 
     /* Set up events. */
     init_events();
+    boot_mark("events");
     
     /* ENABLE EVENT DELIVERY. This is disabled at start of day. */
     __sti();
@@ -112,23 +145,47 @@ void start_kernel(start_info_t *si)
 
     setup_xen_features();
 
+    check_vcpus();
+
     /* Init memory management. */
     init_mm();
+    boot_mark("mm");
 
     /* Init time and timers. */
     init_time();
+    boot_mark("time");
 
     /* Init the console driver. */
     init_console();
+    boot_mark("console");
 
     /* Init grant tables */
     init_gnttab();
+    boot_mark("gnttab");
     
     /* Init scheduler. */
     init_sched();
+    boot_mark("sched");
+
+    /* Deferred work for event handlers */
+    init_softirq();
  
     /* Init XenBus */
     init_xenbus();
+    boot_mark("xenbus");
+
+    /* Follow memory/target */
+    init_balloon();
+
+    /* Statistics dumps through control/stats */
+    init_stats();
+    init_evtchn_stats();
+    stats_register("heap", memprof_dump);
+#ifdef CONFIG_HYPERCALL_STATS
+    init_hypercall_stats();
+#endif
+    init_boot_trace();
+    init_trace();
 
     /* Call (possibly overridden) app_main() */
     create_thread("main", NULL, _app_main, &start_info, NULL);
@@ -165,6 +222,83 @@ void stop_kernel(void)
     arch_fini();
 }
 
+/*
+ * Event channels that nothing binds again after a restore: PCI
+ * interrupts, vchans and ports bound through /dev/xen/evtchn.  Their
+ * users hold a count while bound, and no suspend starts meanwhile.
+ */
+static int suspend_holds;
+
+void kernel_suspend_hold(void)
+{
+    suspend_holds++;
+}
+
+void kernel_suspend_release(void)
+{
+    BUG_ON(suspend_holds == 0);
+    suspend_holds--;
+}
+
+int kernel_suspend_held(void)
+{
+    return suspend_holds;
+}
+
+/*
+ * Suspend the domain for the toolstack to save it.  Returns 0 once
+ * resumed, in a new domain, or non-zero if the suspend was cancelled
+ * and we are back in the old one with everything as it was.
+ *
+ * This covers the kernel's own ties to Xen: shared info, p2m, event
+ * channels, timer, grant table, console and xenbus, and the block,
+ * network and PCI frontends, which reconnect to their new backends
+ * on the way back.  Nothing else may hold grants, event channels or
+ * foreign mappings; while kernel_suspend_hold() is in effect this
+ * fails with -EBUSY.  Called from a thread, which must not yield on
+ * the way down.
+ */
+int kernel_suspend(void)
+{
+    unsigned long flags;
+    int rc;
+
+    if (suspend_holds) {
+        printk("kernel: %d event channels can't be restored, "
+               "not suspending\n", suspend_holds);
+        return -EBUSY;
+    }
+
+    printk("kernel: suspending\n");
+    suspend_blkfront();
+    suspend_netfront();
+    suspend_pcifront();
+    suspend_xenbus();
+
+    local_irq_save(flags);
+    suspend_time();
+    suspend_gnttab();
+    arch_pre_suspend();
+
+    rc = arch_suspend();
+
+    arch_post_suspend(rc);
+    if (!rc)
+        resume_events();
+    resume_time(rc);
+    resume_gnttab();
+    if (!rc)
+        xencons_resume();
+    local_irq_restore(flags);
+
+    resume_xenbus(rc);
+    resume_pcifront(rc);
+    resume_netfront(rc);
+    resume_blkfront(rc);
+    printk("kernel: %s\n", rc ? "suspend cancelled" : "resumed");
+    return rc;
+}
+
 /*
  * do_exit: This is called whenever an IRET fails in entry.S.
  * This will generally be because an application has got itself into
@@ -59,6 +59,9 @@
 static unsigned long *alloc_bitmap;
 #define PAGES_PER_MAPWORD (sizeof(unsigned long) * 8)
 
+/* Number of pages clear in the bitmap, i.e. free. */
+unsigned long nr_free_pages;
+
 #define allocated_in_map(_pn) \
 (alloc_bitmap[(_pn)/PAGES_PER_MAPWORD] & (1UL<<((_pn)&(PAGES_PER_MAPWORD-1))))
 
@@ -80,6 +83,8 @@ static void map_alloc(unsigned long first_page, unsigned long nr_pages)
     end_idx   = (first_page + nr_pages) / PAGES_PER_MAPWORD;
     end_off   = (first_page + nr_pages) & (PAGES_PER_MAPWORD-1);
 
+    nr_free_pages -= nr_pages;
+
     if ( curr_idx == end_idx )
     {
         alloc_bitmap[curr_idx] |= ((1UL<<end_off)-1) & -(1UL<<start_off);
@@ -102,6 +107,8 @@ static void map_free(unsigned long first_page, unsigned long nr_pages)
     end_idx   = (first_page + nr_pages) / PAGES_PER_MAPWORD;
     end_off   = (first_page + nr_pages) & (PAGES_PER_MAPWORD-1);
 
+    nr_free_pages += nr_pages;
+
     if ( curr_idx == end_idx )
     {
         alloc_bitmap[curr_idx] &= -(1UL<<end_off) | ((1UL<<start_off)-1);
@@ -139,6 +146,28 @@ static chunk_head_t *free_head[FREELIST_SIZE];
 static chunk_head_t  free_tail[FREELIST_SIZE];
 #define FREELIST_EMPTY(_l) ((_l)->next == NULL)
 
+/* Bit i set <=> free_head[i] is not empty. */
+static unsigned long free_orders;
+
+static void freelist_insert(chunk_head_t *ch, chunk_tail_t *ct, int order)
+{
+    ch->level       = order;
+    ch->next        = free_head[order];
+    ch->pprev       = &free_head[order];
+    ct->level       = order;
+    ch->next->pprev = &ch->next;
+    free_head[order] = ch;
+    free_orders |= 1UL << order;
+}
+
+static void freelist_remove(chunk_head_t *ch)
+{
+    *(ch->pprev) = ch->next;
+    ch->next->pprev = ch->pprev;
+    if (FREELIST_EMPTY(free_head[ch->level]))
+        free_orders &= ~(1UL << ch->level);
+}
+
 #define round_pgdown(_p)  ((_p)&PAGE_MASK)
 #define round_pgup(_p)    (((_p)+(PAGE_SIZE-1))&PAGE_MASK)
 
@@ -246,12 +275,7 @@ static void init_page_allocator(unsigned long min, unsigned long max)
         range -= (1UL<<i);
         ct = (chunk_tail_t *)min-1;
         i -= PAGE_SHIFT;
-        ch->level       = i;
-        ch->next        = free_head[i];
-        ch->pprev       = &free_head[i];
-        ch->next->pprev = &ch->next;
-        free_head[i]    = ch;
-        ct->level       = i;
+        freelist_insert(ch, ct, i);
     }
 }
 
@@ -260,22 +284,19 @@ static void init_page_allocator(unsigned long min, unsigned long max)
 unsigned long alloc_pages(int order)
 {
     int i;
+    unsigned long avail;
     chunk_head_t *alloc_ch, *spare_ch;
     chunk_tail_t            *spare_ct;
 
 
     /* Find smallest order which can satisfy the request. */
-    for ( i = order; i < FREELIST_SIZE; i++ ) {
-	if ( !FREELIST_EMPTY(free_head[i]) ) 
-	    break;
-    }
-
-    if ( i == FREELIST_SIZE ) goto no_memory;
+    avail = free_orders & ~((1UL << order) - 1);
+    if ( avail == 0 ) goto no_memory;
+    i = __ffs(avail);
  
     /* Unlink a chunk. */
     alloc_ch = free_head[i];
-    free_head[i] = alloc_ch->next;
-    alloc_ch->next->pprev = alloc_ch->pprev;
+    freelist_remove(alloc_ch);
 
     /* We may have to break the chunk a number of times. */
     while ( i != order )
@@ -284,16 +305,7 @@ unsigned long alloc_pages(int order)
         i--;
         spare_ch = (chunk_head_t *)((char *)alloc_ch + (1UL<<(i+PAGE_SHIFT)));
         spare_ct = (chunk_tail_t *)((char *)spare_ch + (1UL<<(i+PAGE_SHIFT)))-1;
-
-        /* Create new header for spare chunk. */
-        spare_ch->level = i;
-        spare_ch->next  = free_head[i];
-        spare_ch->pprev = &free_head[i];
-        spare_ct->level = i;
-
-        /* Link in the spare chunk. */
-        spare_ch->next->pprev = &spare_ch->next;
-        free_head[i] = spare_ch;
+        freelist_insert(spare_ch, spare_ct, i);
     }
     
     map_alloc(PHYS_PFN(to_phys(alloc_ch)), 1UL<<order);
@@ -346,21 +358,109 @@ void free_pages(void *pointer, int order)
         }
         
         /* We are commited to merging, unlink the chunk */
-        *(to_merge_ch->pprev) = to_merge_ch->next;
-        to_merge_ch->next->pprev = to_merge_ch->pprev;
+        freelist_remove(to_merge_ch);
         
         order++;
     }
 
     /* Link the new chunk */
-    freed_ch->level = order;
-    freed_ch->next  = free_head[order];
-    freed_ch->pprev = &free_head[order];
-    freed_ct->level = order;
-    
-    freed_ch->next->pprev = &freed_ch->next;
-    free_head[order] = freed_ch;   
-   
+    freelist_insert(freed_ch, freed_ct, order);
+}
+
+/*
+ * Allocate n single pages into pages[], carving them out of as few
+ * free chunks as possible: the bitmap is updated once per chunk and
+ * chunks are not split into halves one level at a time.  Returns the
+ * number of pages allocated, which is less than n only if memory ran out.
+ */
+int alloc_pages_bulk(unsigned long *pages, int n)
+{
+    chunk_head_t *ch;
+    unsigned long avail, base, off, size, take;
+    int got = 0, want, i, k;
+
+    while (got < n) {
+        if (free_orders == 0)
+            break;
+        /* smallest chunk that covers the rest, else the biggest there is */
+        for (want = 0; (1 << want) < n - got; want++)
+            continue;
+        avail = free_orders & ~((1UL << want) - 1);
+        if (avail)
+            i = __ffs(avail);
+        else
+            for (i = FREELIST_SIZE-1; !(free_orders & (1UL << i)); i--)
+                continue;
+
+        ch = free_head[i];
+        freelist_remove(ch);
+        base = (unsigned long)ch;
+        size = 1UL << i;
+        take = size < (unsigned long)(n - got) ? size : (unsigned long)(n - got);
+        map_alloc(virt_to_pfn(base), take);
+        for (off = 0; off < take; off++)
+            pages[got++] = base + (off << PAGE_SHIFT);
+
+        /* return the rest in aligned chunks, whose buddies we hold */
+        for (off = take; off < size; off += 1UL << k) {
+            k = __ffs(off);
+            freelist_insert((chunk_head_t *)(base + (off << PAGE_SHIFT)),
+                            (chunk_tail_t *)(base + ((off + (1UL << k))
+                                                     << PAGE_SHIFT)) - 1, k);
+        }
+    }
+
+    return got;
+}
+
+void free_pages_bulk(unsigned long *pages, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        free_pages((void *)pages[i], 0);
+}
+
+/*
+ * Allocate npages contiguous pages aligned to at least align bytes.
+ * The request is rounded up to a power of two for the buddy allocator
+ * and the unused tail is freed straight away, so the caller must give
+ * the same npages to free_pages_exact().
+ */
+unsigned long alloc_pages_exact(unsigned long npages, unsigned long align)
+{
+    unsigned long v;
+    int order;
+
+    for (order = 0;
+         (1UL<<order) < npages || (PAGE_SIZE<<order) < align; order++)
+        continue;
+    if ((v = alloc_pages(order)) == 0)
+        return 0;
+    if (npages < (1UL<<order))
+        free_pages_exact((char *)v + (npages<<PAGE_SHIFT),
+                         (1UL<<order) - npages);
+    return v;
+}
+
+/*
+ * Free a run of pages in naturally aligned power-of-two chunks.  The
+ * run must start on a boundary of its largest chunk, as runs from
+ * alloc_pages_exact() and their tails do.
+ */
+void free_pages_exact(void *pointer, unsigned long npages)
+{
+    unsigned long pfn = virt_to_pfn(pointer);
+    int order;
+
+    while (npages) {
+        for (order = 0; (pfn & (1UL<<order)) == 0
+               && (2UL<<order) <= npages; order++)
+            continue;
+        free_pages(pfn_to_virt(pfn), order);
+        pfn += 1UL<<order;
+        npages -= 1UL<<order;
+    }
 }
 
 #ifndef __ia64__
@@ -0,0 +1,143 @@
+/*
+ ****************************************************************************
+ *
+ *        File: multicall.c
+ *
+ * Environment: Xen Minimal OS
+ * Description: Batching of hypercalls into HYPERVISOR_multicall, so
+ *  that a sequence of them costs one trip into the hypervisor.
+ *
+ ****************************************************************************
+ */
+#include <mini-os/os.h>
+#include <mini-os/hypervisor.h>
+#include <mini-os/lib.h>
+#include <mini-os/multicall.h>
+
+void multicall_init(struct multicall *mc)
+{
+    mc->mc_ncalls = 0;
+    mc->mc_nmmu = 0;
+    mc->mc_mmucall = -1;
+    mc->mc_err = 0;
+}
+
+static void multicall_issue(struct multicall *mc)
+{
+    int i, rc;
+
+    if (mc->mc_ncalls == 0)
+        return;
+#ifdef CONFIG_HYPERCALL_STATS
+    for (i = 0; i < mc->mc_ncalls; i++)
+        HYPERCALL_STATS_BATCHED(mc->mc_calls[i].op);
+#endif
+    rc = HYPERVISOR_multicall(mc->mc_calls, mc->mc_ncalls);
+    if (rc && !mc->mc_err)
+        mc->mc_err = rc;
+    for (i = 0; i < mc->mc_ncalls && !mc->mc_err; i++)
+        if ((long)mc->mc_calls[i].result < 0)
+            mc->mc_err = mc->mc_calls[i].result;
+    mc->mc_ncalls = 0;
+    mc->mc_nmmu = 0;
+    mc->mc_mmucall = -1;
+}
+
+int multicall_flush(struct multicall *mc)
+{
+    int err;
+
+    multicall_issue(mc);
+    err = mc->mc_err;
+    mc->mc_err = 0;
+    return err;
+}
+
+multicall_entry_t *multicall_next(struct multicall *mc, unsigned long op)
+{
+    multicall_entry_t *call;
+
+    if (mc->mc_ncalls == MULTICALL_MAX)
+        multicall_issue(mc);
+    call = &mc->mc_calls[mc->mc_ncalls++];
+    call->op = op;
+    call->result = 0;
+    /* whatever comes next can't be merged into */
+    mc->mc_mmucall = -1;
+    return call;
+}
+
+void multicall_mmu_update(struct multicall *mc, uint64_t ptr, uint64_t val,
+                          domid_t dom)
+{
+    multicall_entry_t *call;
+    mmu_update_t *u;
+
+    if (mc->mc_nmmu == MULTICALL_MMU_MAX)
+        multicall_issue(mc);
+    if (mc->mc_mmucall >= 0
+        && mc->mc_calls[mc->mc_mmucall].args[3] == dom) {
+        call = &mc->mc_calls[mc->mc_mmucall];
+        call->args[1]++;
+    } else {
+        call = multicall_next(mc, __HYPERVISOR_mmu_update);
+        call->args[0] = (unsigned long)&mc->mc_mmu[mc->mc_nmmu];
+        call->args[1] = 1;
+        call->args[2] = 0;      /* no success count */
+        call->args[3] = dom;
+        mc->mc_mmucall = call - mc->mc_calls;
+    }
+    u = &mc->mc_mmu[mc->mc_nmmu++];
+    u->ptr = ptr;
+    u->val = val;
+}
+
+void multicall_mmuext(struct multicall *mc, unsigned int cmd,
+                      unsigned long arg)
+{
+    multicall_entry_t *call;
+    struct mmuext_op *op;
+
+    call = multicall_next(mc, __HYPERVISOR_mmuext_op);
+    op = &mc->mc_args[call - mc->mc_calls].ext;
+    op->cmd = cmd;
+    op->arg1.linear_addr = arg;
+    call->args[0] = (unsigned long)op;
+    call->args[1] = 1;
+    call->args[2] = 0;
+    call->args[3] = DOMID_SELF;
+}
+
+void multicall_set_timer(struct multicall *mc, s_time_t deadline)
+{
+    multicall_entry_t *call;
+
+    call = multicall_next(mc, __HYPERVISOR_set_timer_op);
+#ifdef __i386__
+    call->args[0] = (unsigned long)deadline;
+    call->args[1] = (unsigned long)(deadline >> 32);
+#else
+    call->args[0] = deadline;
+#endif
+}
+
+void multicall_sched_op(struct multicall *mc, int cmd, void *arg)
+{
+    multicall_entry_t *call;
+
+    call = multicall_next(mc, __HYPERVISOR_sched_op);
+    call->args[0] = cmd;
+    call->args[1] = (unsigned long)arg;
+}
+
+void multicall_evtchn_send(struct multicall *mc, evtchn_port_t port)
+{
+    multicall_entry_t *call;
+    evtchn_send_t *send;
+
+    call = multicall_next(mc, __HYPERVISOR_event_channel_op);
+    send = &mc->mc_args[call - mc->mc_calls].send;
+    send->port = port;
+    call->args[0] = EVTCHNOP_send;
+    call->args[1] = (unsigned long)send;
+}
@@ -1,13 +1,37 @@
-/* Minimal network driver for Mini-OS. 
+/* Minimal network driver for Mini-OS.
  * Copyright (c) 2006-2007 Jacob Gorm Hansen, University of Copenhagen.
  * Based on netfront.c from Xen Linux.
  *
- * Does not handle fragments or extras.
+ * Does not handle rx fragments or extras.
+ *
+ * Received pages are handed to the netif_rx callback, which owns them
+ * until it gives them back with netfront_rxpage_put().  The ring is
+ * refilled from a small cache of returned pages.  The page allocator
+ * is not interrupt safe, so new pages are only allocated from thread
+ * context, and never more than the rx page budget.
+ *
+ * Frames up to rx_copybreak bytes are passed up with
+ * NETFRONT_RXF_COPY instead: the callback copies them out and the
+ * page goes straight back on the ring, still granted.  Small-packet
+ * traffic then cycles through a set of cache-hot pages without any
+ * grant table work.
+ *
+ * The callback may refuse a frame when it cannot queue any more.  The
+ * response is then left on the ring and no more slots are refilled,
+ * so the backend sees a full ring instead of us dropping packets.
+ * netfront_rx_resume() picks up where we left off.
+ *
+ * Across a save and restore, suspend_netfront() and resume_netfront()
+ * set the rings up again with the new backend.  Received frames still
+ * on the ring are lost, but every packet sent without a response yet
+ * goes out again from the tx pages it is still in.  If the backend
+ * does not come back, transmits fail with EIO from then on.
  */
 
 #include <mini-os/os.h>
 #include <mini-os/xenbus.h>
 #include <mini-os/events.h>
+#include <mini-os/softirq.h>
 #include <errno.h>
 #include <xen/io/netif.h>
 #include <mini-os/gnttab.h>
@@ -16,6 +40,9 @@
 #include <mini-os/netfront.h>
 #include <mini-os/lib.h>
 #include <mini-os/semaphore.h>
+#include <mini-os/trace.h>
+
+#include <sys/uio.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,25 +54,62 @@ DECLARE_WAIT_QUEUE_HEAD(netfront_queue);
 #define NET_RX_RING_SIZE __CONST_RING_SIZE(netif_rx, PAGE_SIZE)
 #define GRANT_INVALID_REF 0
 
+/* slots per packet every backend supporting feature-sg must accept */
+#ifndef XEN_NETIF_NR_SLOTS_MIN
+#define XEN_NETIF_NR_SLOTS_MIN 18
+#endif
+
 struct net_buffer {
     void* page;
     grant_ref_t gref;
 };
 
-struct netfront_dev {
-    domid_t dom;
+/*
+ * A copy of what went out on a tx id, to be sent again after a
+ * restore.  The slots of a packet are linked from the first one,
+ * which also keeps the extra info, if any.
+ */
+struct net_txshadow {
+    netif_tx_request_t req;
+    struct netif_extra_info extra;
+    RING_IDX idx;		/* where it went on the ring */
+    short next;			/* next slot of the packet, or -1 */
+    char first;
+    char pending;		/* no response yet */
+};
+
+/*
+ * One tx/rx ring pair with its own event channel.  With
+ * feature-multi-queue the backend services every pair from a
+ * separate thread, otherwise there is exactly one of these.
+ */
+struct netfront_queue {
+    struct netfront_dev *dev;
+    int id;
 
     unsigned short tx_freelist[NET_TX_RING_SIZE + 1];
     struct semaphore tx_sem;
 
     struct net_buffer rx_buffers[NET_RX_RING_SIZE];
     struct net_buffer tx_buffers[NET_TX_RING_SIZE];
+    struct net_txshadow tx_shadow[NET_TX_RING_SIZE];
 
     struct netif_tx_front_ring tx;
     struct netif_rx_front_ring rx;
     grant_ref_t tx_ring_ref;
     grant_ref_t rx_ring_ref;
     evtchn_port_t evtchn;
+    struct softirq_work work;
+    int rx_refused;		/* masked until netfront_rx_resume() */
+};
+
+struct netfront_dev {
+    domid_t dom;
+
+    int nqueues;
+    struct netfront_queue *queues;
+    int tx_max_slots;
+    int features;
 
     char *nodename;
     char *backend;
@@ -53,12 +117,30 @@ struct netfront_dev {
 
     struct xenbus_event_queue events;
 
+    /* pages returned by the rx callback, linked through the first word */
+    void *rxpage_cache;
+    int rxpage_ncached;
+    int rxpage_maxcached;
+    int rxpage_total;
+    int rxpage_budget;
+    int rx_starved;
+    int rx_copybreak;
+    int rx_poll_budget;
+    s_time_t rx_poll_delay;
 
-    void (*netif_rx)(struct netfront_dev *, unsigned char* data, int len);
+    struct netfront_stats stats;
+
+    int (*netif_rx)(struct netfront_dev *, void *page, unsigned char* data, int len, int flags);
     void *netfront_priv;
+
+    struct netfront_dev *next;	/* netfront_devs */
+    int dead;			/* lost its backend, tx fails */
 };
 
-void init_rx_buffers(struct netfront_dev *dev);
+static struct netfront_dev *netfront_devs;
+
+void init_rx_buffers(struct netfront_queue *queue);
+static void network_rx_refill(struct netfront_queue *queue, int canalloc);
 
 static inline void add_id_to_freelist(unsigned int id,unsigned short* freelist)
 {
@@ -78,81 +160,224 @@ static inline int xennet_rxidx(RING_IDX idx)
     return idx & (NET_RX_RING_SIZE - 1);
 }
 
-void network_rx(struct netfront_dev *dev)
+/* Call with interrupts disabled. */
+static void *netfront_rxpage_get(struct netfront_dev *dev, int canalloc)
 {
-    RING_IDX rp,cons,req_prod;
+    void *page;
+
+    if ((page = dev->rxpage_cache) != NULL) {
+        dev->rxpage_cache = *(void **)page;
+        dev->rxpage_ncached--;
+        return page;
+    }
+    if (!canalloc || dev->rxpage_total >= dev->rxpage_budget)
+        return NULL;
+    if ((page = (void *)alloc_page()) != NULL)
+        dev->rxpage_total++;
+    return page;
+}
+
+/*
+ * Top up the page cache so that n pages can be taken from it,
+ * within the budget, with a single call into the page allocator.
+ * Call with interrupts disabled.
+ */
+static void netfront_rxpage_fill(struct netfront_dev *dev, int n)
+{
+    unsigned long pages[NET_RX_RING_SIZE];
+    int i, got;
+
+    n -= dev->rxpage_ncached;
+    if (n > dev->rxpage_budget - dev->rxpage_total)
+        n = dev->rxpage_budget - dev->rxpage_total;
+    if (n <= 0)
+        return;
+
+    got = alloc_pages_bulk(pages, n);
+    for (i = 0; i < got; i++) {
+        *(void **)pages[i] = dev->rxpage_cache;
+        dev->rxpage_cache = (void *)pages[i];
+    }
+    dev->rxpage_ncached += got;
+    dev->rxpage_total += got;
+}
+
+/*
+ * Give back a page passed up by netif_rx.  Does not block, so it
+ * may be called from any context.  If a ring ran dry for lack of
+ * pages, this is the kick that refills it.
+ */
+void netfront_rxpage_put(struct netfront_dev *dev, void *page)
+{
+    unsigned long flags;
+    int i;
+
+    local_irq_save(flags);
+    if (dev->rxpage_ncached < dev->rxpage_maxcached) {
+        *(void **)page = dev->rxpage_cache;
+        dev->rxpage_cache = page;
+        dev->rxpage_ncached++;
+    } else {
+        free_page(page);
+        dev->rxpage_total--;
+    }
+    if (dev->rx_starved) {
+        dev->rx_starved = 0;
+        for (i = 0; i < dev->nqueues; i++)
+            network_rx_refill(&dev->queues[i], 0);
+    }
+    local_irq_restore(flags);
+}
+
+/*
+ * Post a request for every free rx slot, giving each one a page of
+ * its own.  Slots whose page never left us are still granted, the
+ * rest are granted in one batch.  Call with interrupts disabled.
+ */
+static void network_rx_refill(struct netfront_queue *queue, int canalloc)
+{
+    struct netfront_dev *dev = queue->dev;
+    unsigned long frames[NET_RX_RING_SIZE];
+    grant_ref_t grefs[NET_RX_RING_SIZE];
+    unsigned short ids[NET_RX_RING_SIZE];
+    RING_IDX req_prod;
+    int notify, n, i, ngrant;
+
+    req_prod = queue->rx.req_prod_pvt;
+    if (canalloc)
+        netfront_rxpage_fill(dev,
+            NET_RX_RING_SIZE - (req_prod - queue->rx.rsp_cons));
+    for (n = 0, ngrant = 0;
+      req_prod + n - queue->rx.rsp_cons < NET_RX_RING_SIZE; n++)
+    {
+        int id = xennet_rxidx(req_prod + n);
+        struct net_buffer* buf = &queue->rx_buffers[id];
+
+        if (buf->gref != GRANT_INVALID_REF)
+            continue;
+        if (buf->page == NULL &&
+          (buf->page = netfront_rxpage_get(dev, canalloc)) == NULL) {
+            dev->rx_starved = 1;
+            break;
+        }
+        ids[ngrant] = id;
+        frames[ngrant++] = virt_to_mfn(buf->page);
+    }
+
+    if (n == 0)
+        return;
+
+    gnttab_grant_access_batch(dev->dom, frames, ngrant, 0, grefs);
+    for (i = 0; i < ngrant; i++)
+        queue->rx_buffers[ids[i]].gref = grefs[i];
+
+    for (i = 0; i < n; i++, req_prod++)
+    {
+        int id = xennet_rxidx(req_prod);
+        netif_rx_request_t *req = RING_GET_REQUEST(&queue->rx, req_prod);
+
+        req->gref = queue->rx_buffers[id].gref;
+        req->id = id;
+    }
+
+    wmb();
+
+    queue->rx.req_prod_pvt = req_prod;
+
+    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&queue->rx, notify);
+    if (notify)
+        notify_remote_via_evtchn(queue->evtchn);
+}
+
+/*
+ * Consume up to budget rx responses.  Returns how many were consumed,
+ * or -1 if the netif_rx callback refused a frame.
+ */
+static int network_rx(struct netfront_queue *queue, int budget)
+{
+    struct netfront_dev *dev = queue->dev;
+    RING_IDX rp,cons;
     struct netif_rx_response *rx;
-    int nr_consumed, some, more, i, notify;
+    int more, n = 0;
 
 
 moretodo:
-    rp = dev->rx.sring->rsp_prod;
+    rp = queue->rx.sring->rsp_prod;
     rmb(); /* Ensure we see queued responses up to 'rp'. */
-    cons = dev->rx.rsp_cons;
+    cons = queue->rx.rsp_cons;
 
-    for (nr_consumed = 0, some = 0;
-         (cons != rp) && !some;
-         nr_consumed++, cons++)
+    for (; cons != rp; cons++, n++)
     {
         struct net_buffer* buf;
         unsigned char* page;
         int id;
 
-        rx = RING_GET_RESPONSE(&dev->rx, cons);
+        if (n == budget) {
+            /* leave notifications off, the poller comes back */
+            queue->rx.rsp_cons=cons;
+            network_rx_refill(queue, 0);
+            return n;
+        }
+
+        rx = RING_GET_RESPONSE(&queue->rx, cons);
 
         if (rx->flags & NETRXF_extra_info)
         {
-            printk("+++++++++++++++++++++ we have extras!\n");
+            /* never asked for, skip it */
+            dev->stats.rx_errors++;
             continue;
         }
 
 
         if (rx->status == NETIF_RSP_NULL) continue;
+        if (rx->status < 0)
+            dev->stats.rx_errors++;
 
         id = rx->id;
-        BUG_ON(id >= NET_TX_RING_SIZE);
+        BUG_ON(id >= NET_RX_RING_SIZE);
 
-        buf = &dev->rx_buffers[id];
+        buf = &queue->rx_buffers[id];
         page = (unsigned char*)buf->page;
-        gnttab_end_access(buf->gref);
 
         if(rx->status>0)
         {
-		dev->netif_rx(dev, page+rx->offset,rx->status);
+            int flags = 0;
+
+            if (rx->flags & NETRXF_csum_blank)
+                flags |= NETFRONT_RXF_CSUM_BLANK;
+            if (rx->flags & NETRXF_data_validated)
+                flags |= NETFRONT_RXF_CSUM_VALID;
+            if (rx->status <= dev->rx_copybreak)
+                flags |= NETFRONT_RXF_COPY;
+            tracepoint(TRACE_NET_RX, queue->id, rx->status, 0, 0);
+
+            if (dev->netif_rx(dev, page, page+rx->offset,rx->status,
+              flags) != 0) {
+                /* refused, keep the response for netfront_rx_resume() */
+                queue->rx.rsp_cons=cons;
+                queue->rx_refused = 1;
+                return -1;
+            }
+            dev->stats.rx_packets++;
+            dev->stats.rx_bytes += rx->status;
+            if (!(flags & NETFRONT_RXF_COPY)) {
+                /* the page now belongs to the callback */
+                gnttab_end_access(buf->gref);
+                buf->gref = GRANT_INVALID_REF;
+                buf->page = NULL;
+            }
         }
     }
-    dev->rx.rsp_cons=cons;
-
-    RING_FINAL_CHECK_FOR_RESPONSES(&dev->rx,more);
-    if(more && !some) goto moretodo;
-
-    req_prod = dev->rx.req_prod_pvt;
-
-    for(i=0; i<nr_consumed; i++)
-    {
-        int id = xennet_rxidx(req_prod + i);
-        netif_rx_request_t *req = RING_GET_REQUEST(&dev->rx, req_prod + i);
-        struct net_buffer* buf = &dev->rx_buffers[id];
-        void* page = buf->page;
-
-        /* We are sure to have free gnttab entries since they got released above */
-        buf->gref = req->gref = 
-            gnttab_grant_access(dev->dom,virt_to_mfn(page),0);
-
-        req->id = id;
-    }
+    queue->rx.rsp_cons=cons;
 
-    wmb();
-
-    dev->rx.req_prod_pvt = req_prod + i;
-    
-    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&dev->rx, notify);
-    if (notify)
-        notify_remote_via_evtchn(dev->evtchn);
+    RING_FINAL_CHECK_FOR_RESPONSES(&queue->rx,more);
+    if(more) goto moretodo;
 
+    network_rx_refill(queue, 0);
+    return n;
 }
 
-void network_tx_buf_gc(struct netfront_dev *dev)
+void network_tx_buf_gc(struct netfront_queue *queue)
 {
 
 
@@ -160,32 +385,33 @@ void network_tx_buf_gc(struct netfront_dev *dev)
     unsigned short id;
 
     do {
-        prod = dev->tx.sring->rsp_prod;
+        prod = queue->tx.sring->rsp_prod;
         rmb(); /* Ensure we see responses up to 'rp'. */
 
-        for (cons = dev->tx.rsp_cons; cons != prod; cons++) 
+        for (cons = queue->tx.rsp_cons; cons != prod; cons++)
         {
             struct netif_tx_response *txrsp;
-            struct net_buffer *buf;
 
-            txrsp = RING_GET_RESPONSE(&dev->tx, cons);
-            if (txrsp->status == NETIF_RSP_NULL)
+            txrsp = RING_GET_RESPONSE(&queue->tx, cons);
+            if (txrsp->status == NETIF_RSP_NULL) {
+                /* the slot of an extra info, it has no buffer */
+                up(&queue->tx_sem);
                 continue;
+            }
 
             if (txrsp->status == NETIF_RSP_ERROR)
-                printk("packet error\n");
+                queue->dev->stats.tx_errors++;
+            else if (txrsp->status == NETIF_RSP_DROPPED)
+                queue->dev->stats.tx_dropped++;
 
             id  = txrsp->id;
             BUG_ON(id >= NET_TX_RING_SIZE);
-            buf = &dev->tx_buffers[id];
-            gnttab_end_access(buf->gref);
-            buf->gref=GRANT_INVALID_REF;
-
-	    add_id_to_freelist(id,dev->tx_freelist);
-	    up(&dev->tx_sem);
+            queue->tx_shadow[id].pending = 0;
+	    add_id_to_freelist(id,queue->tx_freelist);
+	    up(&queue->tx_sem);
         }
 
-        dev->tx.rsp_cons = prod;
+        queue->tx.rsp_cons = prod;
 
         /*
          * Set a new event, then check for race with update of tx_cons.
@@ -195,105 +421,153 @@ void network_tx_buf_gc(struct netfront_dev *dev)
          * data is outstanding: in such cases notification from Xen is
          * likely to be the only kick that we'll get.
          */
-        dev->tx.sring->rsp_event =
-            prod + ((dev->tx.sring->req_prod - prod) >> 1) + 1;
+        queue->tx.sring->rsp_event =
+            prod + ((queue->tx.sring->req_prod - prod) >> 1) + 1;
         mb();
-    } while ((cons == prod) && (prod != dev->tx.sring->rsp_prod));
+    } while ((cons == prod) && (prod != queue->tx.sring->rsp_prod));
 
 
 }
 
-void netfront_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
+/*
+ * NAPI-style polling.  The handler masks the event channel and
+ * defers to the softirq thread, which polls the ring in rounds of
+ * rx_poll_budget responses until it runs dry.  With rx_poll_delay
+ * set, a round that found work is followed by another one that much
+ * later, still masked, so that under load packets are picked up in
+ * batches instead of one upcall each.  Notifications are enabled
+ * again after a round which found nothing.  While the netif_rx
+ * callback refuses frames the channel stays masked until
+ * netfront_rx_resume().
+ */
+static void netfront_softirq(void *data)
 {
-    int flags;
-    struct netfront_dev *dev = data;
+    int flags, n;
+    struct netfront_queue *queue = data;
+    struct netfront_dev *dev = queue->dev;
 
     local_irq_save(flags);
 
-    network_tx_buf_gc(dev);
-    network_rx(dev);
+    network_tx_buf_gc(queue);
+    n = network_rx(queue, dev->rx_poll_budget);
 
     local_irq_restore(flags);
+
+    if (n < 0)
+        return;
+    if (n == dev->rx_poll_budget)
+        softirq_schedule(&queue->work);
+    else if (n > 0 && dev->rx_poll_delay)
+        softirq_schedule_delayed(&queue->work, dev->rx_poll_delay);
+    else
+        unmask_evtchn(queue->evtchn);
 }
 
+void netfront_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
+{
+    struct netfront_queue *queue = data;
 
-static void free_netfront(struct netfront_dev *dev)
+    mask_evtchn(port);
+    softirq_schedule(&queue->work);
+}
+
+
+static void free_netfront_queue(struct netfront_queue *queue)
 {
     int i;
 
-    for(i=0;i<NET_TX_RING_SIZE;i++)
-	down(&dev->tx_sem);
+    if (queue->tx.sring == NULL)
+	return;
 
-    mask_evtchn(dev->evtchn);
+    for(i=0;i<NET_TX_RING_SIZE;i++)
+	down(&queue->tx_sem);
 
-    free(dev->mac);
-    free(dev->backend);
+    mask_evtchn(queue->evtchn);
+    softirq_cancel(&queue->work);
 
-    gnttab_end_access(dev->rx_ring_ref);
-    gnttab_end_access(dev->tx_ring_ref);
+    gnttab_end_access(queue->rx_ring_ref);
+    gnttab_end_access(queue->tx_ring_ref);
 
-    free_page(dev->rx.sring);
-    free_page(dev->tx.sring);
+    free_page(queue->rx.sring);
+    free_page(queue->tx.sring);
 
-    unbind_evtchn(dev->evtchn);
+    unbind_evtchn(queue->evtchn);
 
     for(i=0;i<NET_RX_RING_SIZE;i++) {
-	gnttab_end_access(dev->rx_buffers[i].gref);
-	free_page(dev->rx_buffers[i].page);
+	if (!queue->rx_buffers[i].page)
+	    continue;
+	if (queue->rx_buffers[i].gref != GRANT_INVALID_REF)
+	    gnttab_end_access(queue->rx_buffers[i].gref);
+	free_page(queue->rx_buffers[i].page);
     }
 
-    for(i=0;i<NET_TX_RING_SIZE;i++)
-	if (dev->tx_buffers[i].page)
-	    free_page(dev->tx_buffers[i].page);
+    for(i=0;i<NET_TX_RING_SIZE;i++) {
+	gnttab_end_access(queue->tx_buffers[i].gref);
+	free_page(queue->tx_buffers[i].page);
+    }
+}
+
+/*
+ * Pages still loaned out through netif_rx must have been returned
+ * before the device is freed.
+ */
+static void free_netfront(struct netfront_dev *dev)
+{
+    struct netfront_dev **prev;
+    void *page;
+    int i;
+
+    for (prev = &netfront_devs; *prev; prev = &(*prev)->next)
+        if (*prev == dev) {
+            *prev = dev->next;
+            break;
+        }
+
+    for (i = 0; i < dev->nqueues; i++)
+	free_netfront_queue(&dev->queues[i]);
+    free(dev->queues);
+
+    while ((page = dev->rxpage_cache) != NULL) {
+	dev->rxpage_cache = *(void **)page;
+	free_page(page);
+    }
+
+    free(dev->mac);
+    free(dev->backend);
 
     free(dev->nodename);
     free(dev);
 }
 
-struct netfront_dev *init_netfront(char *_nodename, void (*thenetif_rx)(struct netfront_dev *, unsigned char* data, int len), unsigned char rawmac[6], char **ip, void *priv)
+/*
+ * The tx pages are granted to the backend once, read-only, and stay
+ * granted for the life of the queue, so that sending a packet costs
+ * no grant table updates.
+ */
+static void setup_netfront_queue(struct netfront_dev *dev,
+	struct netfront_queue *queue)
 {
-    xenbus_transaction_t xbt;
-    char* err;
-    char* message=NULL;
     struct netif_tx_sring *txs;
     struct netif_rx_sring *rxs;
-    int retry=0;
+    unsigned long frames[NET_TX_RING_SIZE];
+    grant_ref_t grefs[NET_TX_RING_SIZE];
     int i;
-    char* msg = NULL;
-    char nodename[256];
-    char path[256];
-    struct netfront_dev *dev;
-    static int netfrontends = 0;
 
-    if (!_nodename)
-        snprintf(nodename, sizeof(nodename), "device/vif/%d", netfrontends);
-    else
-        strncpy(nodename, _nodename, strlen(nodename));
-    netfrontends++;
-
-    dev = malloc(sizeof(*dev));
-    memset(dev, 0, sizeof(*dev));
-    dev->nodename = strdup(nodename);
-    dev->netfront_priv = priv;
+    queue->dev = dev;
 
-    printk("net TX ring size %d\n", NET_TX_RING_SIZE);
-    printk("net RX ring size %d\n", NET_RX_RING_SIZE);
-    init_SEMAPHORE(&dev->tx_sem, NET_TX_RING_SIZE);
+    init_SEMAPHORE(&queue->tx_sem, NET_TX_RING_SIZE);
     for(i=0;i<NET_TX_RING_SIZE;i++)
     {
-	add_id_to_freelist(i,dev->tx_freelist);
-        dev->tx_buffers[i].page = NULL;
-    }
-
-    for(i=0;i<NET_RX_RING_SIZE;i++)
-    {
-	/* TODO: that's a lot of memory */
-        dev->rx_buffers[i].page = (char*)alloc_page();
+	add_id_to_freelist(i,queue->tx_freelist);
+        queue->tx_buffers[i].page = (char*) alloc_page();
+        frames[i] = virt_to_mfn(queue->tx_buffers[i].page);
     }
+    gnttab_grant_access_batch(dev->dom, frames, NET_TX_RING_SIZE, 1, grefs);
+    for(i=0;i<NET_TX_RING_SIZE;i++)
+        queue->tx_buffers[i].gref = grefs[i];
 
-    snprintf(path, sizeof(path), "%s/backend-id", nodename);
-    dev->dom = xenbus_read_integer(path);
-        evtchn_alloc_unbound(dev->dom, netfront_handler, dev, &dev->evtchn);
+    softirq_init_work(&queue->work, netfront_softirq, queue);
+    evtchn_alloc_unbound(dev->dom, netfront_handler, queue, &queue->evtchn);
 
     txs = (struct netif_tx_sring *) alloc_page();
     rxs = (struct netif_rx_sring *) alloc_page();
@@ -303,82 +577,198 @@ struct netfront_dev *init_netfront(char *_nodename, void (*thenetif_rx)(struct n
 
     SHARED_RING_INIT(txs);
     SHARED_RING_INIT(rxs);
-    FRONT_RING_INIT(&dev->tx, txs, PAGE_SIZE);
-    FRONT_RING_INIT(&dev->rx, rxs, PAGE_SIZE);
+    FRONT_RING_INIT(&queue->tx, txs, PAGE_SIZE);
+    FRONT_RING_INIT(&queue->rx, rxs, PAGE_SIZE);
 
-    dev->tx_ring_ref = gnttab_grant_access(dev->dom,virt_to_mfn(txs),0);
-    dev->rx_ring_ref = gnttab_grant_access(dev->dom,virt_to_mfn(rxs),0);
+    queue->tx_ring_ref = gnttab_grant_access(dev->dom,virt_to_mfn(txs),0);
+    queue->rx_ring_ref = gnttab_grant_access(dev->dom,virt_to_mfn(rxs),0);
 
-    init_rx_buffers(dev);
+    init_rx_buffers(queue);
+}
 
-    dev->netif_rx = thenetif_rx;
+/*
+ * Write the ring references and event channel of a queue.  A single
+ * queue uses the legacy keys directly under the vif node, multiple
+ * queues each get a queue-N subdirectory.
+ */
+static void write_netfront_queue(struct xenbus_batch *batch,
+	struct netfront_dev *dev, struct netfront_queue *queue)
+{
+    char qnode[256];
 
-    xenbus_event_queue_init(&dev->events);
+    if (dev->nqueues == 1)
+        snprintf(qnode, sizeof(qnode), "%s", dev->nodename);
+    else
+        snprintf(qnode, sizeof(qnode), "%s/queue-%d",
+            dev->nodename, queue->id);
+
+    xenbus_batch_printf(batch, qnode, "tx-ring-ref","%u",
+                queue->tx_ring_ref);
+    xenbus_batch_printf(batch, qnode, "rx-ring-ref","%u",
+                queue->rx_ring_ref);
+    xenbus_batch_printf(batch, qnode,
+                "event-channel", "%u", queue->evtchn);
+}
+
+/* Publish the queues and what we want, and mark us connected. */
+static char *write_netfront(struct netfront_dev *dev)
+{
+    struct xenbus_batch batch;
+    char* err;
+    int retry=0;
+    int i;
 
 again:
-    err = xenbus_transaction_start(&xbt);
+    err = xenbus_batch_start(&batch, 1);
     if (err) {
         printk("starting transaction\n");
         free(err);
     }
 
-    err = xenbus_printf(xbt, nodename, "tx-ring-ref","%u",
-                dev->tx_ring_ref);
-    if (err) {
-        message = "writing tx ring-ref";
-        goto abort_transaction;
-    }
-    err = xenbus_printf(xbt, nodename, "rx-ring-ref","%u",
-                dev->rx_ring_ref);
-    if (err) {
-        message = "writing rx ring-ref";
-        goto abort_transaction;
-    }
-    err = xenbus_printf(xbt, nodename,
-                "event-channel", "%u", dev->evtchn);
-    if (err) {
-        message = "writing event-channel";
-        goto abort_transaction;
-    }
-    err = xenbus_printf(xbt, nodename, "feature-no-csum-offload", "%u", 1);
-    if (err) {
-        message = "writing feature-no-csum-offload";
-        goto abort_transaction;
+    if (dev->nqueues > 1)
+        xenbus_batch_printf(&batch, dev->nodename, "multi-queue-num-queues",
+                    "%u", dev->nqueues);
+    for (i = 0; i < dev->nqueues; i++)
+        write_netfront_queue(&batch, dev, &dev->queues[i]);
+    /*
+     * We take partially checksummed packets from the backend, but
+     * do not advertise rx GSO since that would need multi-slot
+     * receive.
+     */
+    xenbus_batch_printf(&batch, dev->nodename, "feature-no-csum-offload",
+                "%u", 0);
+    xenbus_batch_printf(&batch, dev->nodename, "request-rx-copy", "%u", 1);
+    xenbus_batch_printf(&batch, dev->nodename, "state", "%u",
+                XenbusStateConnected);
+
+    err = xenbus_batch_end(&batch, 0, &retry);
+    if (retry) {
+        free(err);
+        goto again;
     }
+    if (err)
+        printk("Abort transaction writing the ring details\n");
+    return err;
+}
+
+/* Watch the backend's state, and wait for it to connect. */
+static int wait_netfront_connected(struct netfront_dev *dev)
+{
+    XenbusState state;
+    char *err = NULL;
+    char path[strlen(dev->backend) + 1 + 5 + 1];
 
-    err = xenbus_printf(xbt, nodename, "request-rx-copy", "%u", 1);
+    snprintf(path, sizeof(path), "%s/state", dev->backend);
 
-    if (err) {
-        message = "writing request-rx-copy";
-        goto abort_transaction;
-    }
+    xenbus_watch_path_token(XBT_NIL, path, path, &dev->events);
 
-    snprintf(path, sizeof(path), "%s/state", nodename);
-    err = xenbus_switch_state(xbt, path, XenbusStateConnected);
-    if (err) {
-        message = "switching state";
-        goto abort_transaction;
+    state = xenbus_read_integer(path);
+    while (err == NULL && state < XenbusStateConnected)
+        err = xenbus_wait_for_state_change(path, &state, &dev->events);
+    free(err);
+    if (state != XenbusStateConnected) {
+        printk("backend not avalable, state=%d\n", state);
+        xenbus_unwatch_path_token(XBT_NIL, path, path);
+        return -1;
     }
+    return 0;
+}
 
-    err = xenbus_transaction_end(xbt, 0, &retry);
-    if (err) free(err);
-    if (retry) {
-            goto again;
-        printk("completing transaction\n");
-    }
+struct netfront_dev *init_netfront(char *_nodename, int (*thenetif_rx)(struct netfront_dev *, void *page, unsigned char* data, int len, int flags), unsigned char rawmac[6], char **ip, void *priv)
+{
+    struct xenbus_batch batch;
+    char* err = NULL;
+    int retry=0;
+    int i;
+    char* msg = NULL;
+    char nodename[256];
+    char path[256];
+    struct netfront_dev *dev;
+    static int netfrontends = 0;
+    int maxqueues, sg, gso;
 
-    goto done;
+    if (!_nodename)
+        snprintf(nodename, sizeof(nodename), "device/vif/%d", netfrontends);
+    else
+        snprintf(nodename, sizeof(nodename), "%s", _nodename);
+    netfrontends++;
 
-abort_transaction:
-    free(err);
-    err = xenbus_transaction_end(xbt, 1, &retry);
-    printk("Abort transaction %s\n", message);
-    goto error;
+    dev = malloc(sizeof(*dev));
+    memset(dev, 0, sizeof(*dev));
+    dev->nodename = strdup(nodename);
+    dev->netfront_priv = priv;
 
-done:
+    printk("net TX ring size %d\n", NET_TX_RING_SIZE);
+    printk("net RX ring size %d\n", NET_RX_RING_SIZE);
 
+    snprintf(path, sizeof(path), "%s/backend-id", nodename);
+    dev->dom = xenbus_read_integer(path);
+
+    /*
+     * The backend advertises multi-queue-max-queues before it
+     * enters InitWait, so it is known by the time we get here.
+     * Every queue costs a full rx ring worth of pages, so stay
+     * well below what the backend would allow.
+     */
     snprintf(path, sizeof(path), "%s/backend", nodename);
     msg = xenbus_read(XBT_NIL, path, &dev->backend);
+    if (msg) {
+        printk("%s: backend failed\n", __func__);
+        goto error;
+    }
+    xenbus_batch_start(&batch, 0);
+    snprintf(path, sizeof(path), "%s/multi-queue-max-queues", dev->backend);
+    xenbus_batch_read_integer(&batch, path, &maxqueues);
+    snprintf(path, sizeof(path), "%s/feature-sg", dev->backend);
+    xenbus_batch_read_integer(&batch, path, &sg);
+    snprintf(path, sizeof(path), "%s/feature-gso-tcpv4", dev->backend);
+    xenbus_batch_read_integer(&batch, path, &gso);
+    free(xenbus_batch_end(&batch, 0, &retry));
+
+    if (maxqueues > NETFRONT_MAX_QUEUES)
+        maxqueues = NETFRONT_MAX_QUEUES;
+    if (maxqueues < 1)
+        maxqueues = 1;
+
+    if (sg == 1)
+        dev->tx_max_slots = XEN_NETIF_NR_SLOTS_MIN;
+    else
+        dev->tx_max_slots = 1;
+
+    /*
+     * netback always accepts NETTXF_csum_blank.  GSO packets are
+     * larger than a page, so they also need feature-sg.
+     */
+    dev->features = NETFRONT_F_CSUM;
+    if (gso == 1 && dev->tx_max_slots > 1)
+        dev->features |= NETFRONT_F_GSO_TCPV4;
+
+    dev->queues = malloc(maxqueues * sizeof(*dev->queues));
+    if (dev->queues == NULL) {
+        printk("%s: cannot allocate %d queues\n", __func__, maxqueues);
+        goto error;
+    }
+    memset(dev->queues, 0, maxqueues * sizeof(*dev->queues));
+    dev->nqueues = maxqueues;
+    dev->rxpage_budget = dev->nqueues * NET_RX_RING_SIZE;
+    dev->rxpage_maxcached = NET_RX_RING_SIZE;
+    dev->rx_poll_budget = NETFRONT_POLL_BUDGET;
+
+    for (i = 0; i < dev->nqueues; i++) {
+        dev->queues[i].id = i;
+        setup_netfront_queue(dev, &dev->queues[i]);
+    }
+    printk("netfront: %d queue%s, %d tx slots per packet%s\n", dev->nqueues,
+        dev->nqueues > 1 ? "s" : "", dev->tx_max_slots,
+        dev->features & NETFRONT_F_GSO_TCPV4 ? ", tso" : "");
+
+    dev->netif_rx = thenetif_rx;
+
+    xenbus_event_queue_init(&dev->events);
+
+    if ((err = write_netfront(dev)) != NULL)
+        goto error;
+
     snprintf(path, sizeof(path), "%s/mac", nodename);
     msg = xenbus_read(XBT_NIL, path, &dev->mac);
 
@@ -390,30 +780,17 @@ done:
     printk("netfront: node=%s backend=%s\n", nodename, dev->backend);
     printk("netfront: MAC %s\n", dev->mac);
 
-    {
-        XenbusState state;
-        char path[strlen(dev->backend) + 1 + 5 + 1];
-        snprintf(path, sizeof(path), "%s/state", dev->backend);
-
-        xenbus_watch_path_token(XBT_NIL, path, path, &dev->events);
-
-        err = NULL;
-        state = xenbus_read_integer(path);
-        while (err == NULL && state < XenbusStateConnected)
-            err = xenbus_wait_for_state_change(path, &state, &dev->events);
-        if (state != XenbusStateConnected) {
-            printk("backend not avalable, state=%d\n", state);
-            xenbus_unwatch_path_token(XBT_NIL, path, path);
-            goto error;
-        }
-
-        if (ip) {
-            snprintf(path, sizeof(path), "%s/ip", dev->backend);
-            xenbus_read(XBT_NIL, path, ip);
-        }
+    if (wait_netfront_connected(dev) != 0)
+        goto error;
+    if (ip) {
+        snprintf(path, sizeof(path), "%s/ip", dev->backend);
+        if ((msg = xenbus_read(XBT_NIL, path, ip)) != NULL)
+            free(msg);
+        msg = NULL;
     }
 
-    unmask_evtchn(dev->evtchn);
+    for (i = 0; i < dev->nqueues; i++)
+        unmask_evtchn(dev->queues[i].evtchn);
 
     if (rawmac) {
 	char *p;
@@ -432,6 +809,8 @@ done:
 	}
     }
 
+    dev->next = netfront_devs;
+    netfront_devs = dev;
     return dev;
 error:
     free(msg);
@@ -445,9 +824,11 @@ void shutdown_netfront(struct netfront_dev *dev)
 {
     char* err = NULL;
     XenbusState state;
+    int i;
 
     char path[strlen(dev->backend) + 1 + 5 + 1];
     char nodename[strlen(dev->nodename) + 1 + 5 + 1];
+    char qpath[strlen(dev->nodename) + 64];
 
     printk("close network: backend at %s\n",dev->backend);
 
@@ -489,103 +870,513 @@ close:
     if (err) free(err);
     xenbus_unwatch_path_token(XBT_NIL, path, path);
 
-    snprintf(path, sizeof(path), "%s/tx-ring-ref", nodename);
-    xenbus_rm(XBT_NIL, path);
-    snprintf(path, sizeof(path), "%s/rx-ring-ref", nodename);
-    xenbus_rm(XBT_NIL, path);
-    snprintf(path, sizeof(path), "%s/event-channel", nodename);
-    xenbus_rm(XBT_NIL, path);
-    snprintf(path, sizeof(path), "%s/request-rx-copy", nodename);
-    xenbus_rm(XBT_NIL, path);
+    if (dev->nqueues == 1) {
+        snprintf(qpath, sizeof(qpath), "%s/tx-ring-ref", dev->nodename);
+        xenbus_rm(XBT_NIL, qpath);
+        snprintf(qpath, sizeof(qpath), "%s/rx-ring-ref", dev->nodename);
+        xenbus_rm(XBT_NIL, qpath);
+        snprintf(qpath, sizeof(qpath), "%s/event-channel", dev->nodename);
+        xenbus_rm(XBT_NIL, qpath);
+    } else {
+        for (i = 0; i < dev->nqueues; i++) {
+            snprintf(qpath, sizeof(qpath), "%s/queue-%d", dev->nodename, i);
+            xenbus_rm(XBT_NIL, qpath);
+        }
+        snprintf(qpath, sizeof(qpath), "%s/multi-queue-num-queues",
+            dev->nodename);
+        xenbus_rm(XBT_NIL, qpath);
+    }
+    snprintf(qpath, sizeof(qpath), "%s/request-rx-copy", dev->nodename);
+    xenbus_rm(XBT_NIL, qpath);
 
     if (!err)
         free_netfront(dev);
 }
 
 
-void init_rx_buffers(struct netfront_dev *dev)
+void init_rx_buffers(struct netfront_queue *queue)
 {
-    int i, requeue_idx;
-    netif_rx_request_t *req;
-    int notify;
+    unsigned long flags;
 
-    /* Rebuild the RX buffer freelist and the RX ring itself. */
-    for (requeue_idx = 0, i = 0; i < NET_RX_RING_SIZE; i++) 
-    {
-        struct net_buffer* buf = &dev->rx_buffers[requeue_idx];
-        req = RING_GET_REQUEST(&dev->rx, requeue_idx);
+    local_irq_save(flags);
+    network_rx_refill(queue, 1);
+    local_irq_restore(flags);
 
-        buf->gref = req->gref = 
-            gnttab_grant_access(dev->dom,virt_to_mfn(buf->page),0);
+    queue->rx.sring->rsp_event = queue->rx.rsp_cons + 1;
+}
 
-        req->id = requeue_idx;
 
-        requeue_idx++;
+/*
+ * Tx completions are reaped lazily: from the event handler, and on
+ * the transmit path only once fewer than NET_TX_GC_WATERMARK slots
+ * are left, or when a packet doesn't fit.
+ */
+#define NET_TX_GC_WATERMARK (NET_TX_RING_SIZE / 4)
+
+/*
+ * Like down(), but takes n tx slots at once so that packets cannot deadlock.
+ * Fails if the device lost its backend, slots will never come back then.
+ */
+static int netfront_tx_reserve(struct netfront_queue *queue, int n)
+{
+    struct netfront_dev *dev = queue->dev;
+    unsigned long flags;
+    while (1) {
+        local_irq_save(flags);
+        if (dev->dead) {
+            local_irq_restore(flags);
+            return -1;
+        }
+        if (queue->tx_sem.count < n)
+            network_tx_buf_gc(queue);
+        if (queue->tx_sem.count >= n)
+            break;
+        dev->stats.tx_stalls++;
+        local_irq_restore(flags);
+        wait_event(queue->tx_sem.wait,
+                   queue->tx_sem.count >= n || dev->dead);
     }
+    queue->tx_sem.count -= n;
+    local_irq_restore(flags);
+    return 0;
+}
 
-    dev->rx.req_prod_pvt = requeue_idx;
+/* Hand the requests queued so far to the backend. */
+static void netfront_tx_push(struct netfront_queue *queue)
+{
+    unsigned long flags;
+    int notify;
 
-    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&dev->rx, notify);
+    wmb();
 
-    if (notify) 
-        notify_remote_via_evtchn(dev->evtchn);
+    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&queue->tx, notify);
 
-    dev->rx.sring->rsp_event = dev->rx.rsp_cons + 1;
-}
+    if(notify) notify_remote_via_evtchn(queue->evtchn);
 
+    if (queue->tx_sem.count < NET_TX_GC_WATERMARK) {
+        local_irq_save(flags);
+        network_tx_buf_gc(queue);
+        local_irq_restore(flags);
+    }
+}
 
-void netfront_xmit(struct netfront_dev *dev, unsigned char* data,int len)
+/*
+ * Send one packet gathered from an iovec.  The data is copied once,
+ * straight into the tx pages, and the packet goes out as a chain
+ * of NETTXF_more_data slots if the backend supports feature-sg.
+ * The first slot carries the size of the whole packet.
+ *
+ * NETFRONT_TXF_CSUM_BLANK leaves the TCP/UDP checksum to the backend.
+ * NETFRONT_TXF_GSO_TCPV4 additionally has the backend cut the packet
+ * into gso_size segments, described by an extra info slot following
+ * the first one.
+ *
+ * NETFRONT_TXF_MORE queues the packet without pushing it to the
+ * backend, more are coming.  The last packet of a batch goes without
+ * it, or netfront_xmit_flush() pushes the lot.
+ */
+int netfront_xmit_iov(struct netfront_dev *dev, int qidx,
+	const struct iovec *iov, int iovcnt, int txflags, int gso_size)
 {
+    struct netfront_queue *queue;
     int flags;
     struct netif_tx_request *tx;
     RING_IDX i;
-    int notify;
-    unsigned short id;
+    unsigned short ids[XEN_NETIF_NR_SLOTS_MIN];
     struct net_buffer* buf;
-    void* page;
+    struct net_txshadow *sh;
+    size_t len, slotlen, off, ioff, n;
+    int nslots, nextra, slot, v;
+
+    BUG_ON(qidx < 0 || qidx >= dev->nqueues);
+    queue = &dev->queues[qidx];
+
+    for (len = 0, v = 0; v < iovcnt; v++)
+        len += iov[v].iov_len;
+    if (len == 0)
+        return 0;
+    nslots = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (nslots > dev->tx_max_slots) {
+        printk("netfront: dropping %lu byte packet\n", (unsigned long)len);
+        dev->stats.tx_dropped++;
+        return EMSGSIZE;
+    }
+    if ((txflags & NETFRONT_TXF_GSO_TCPV4)
+      && !(dev->features & NETFRONT_F_GSO_TCPV4)) {
+        dev->stats.tx_dropped++;
+        return EOPNOTSUPP;
+    }
+    nextra = (txflags & NETFRONT_TXF_GSO_TCPV4) ? 1 : 0;
+    tracepoint(TRACE_NET_TX, qidx, len, nslots, 0);
+
+    /*
+     * An extra info takes a ring slot, but no buffer id.  Slots held
+     * by a batch not pushed yet never come back by themselves.
+     */
+    if (queue->tx_sem.count < nslots + nextra)
+        netfront_tx_push(queue);
+    if (netfront_tx_reserve(queue, nslots + nextra)) {
+        dev->stats.tx_dropped++;
+        return EIO;
+    }
+
+    local_irq_save(flags);
+    for (slot = 0; slot < nslots; slot++)
+        ids[slot] = get_id_from_freelist(queue->tx_freelist);
+    local_irq_restore(flags);
+
+    i = queue->tx.req_prod_pvt;
+    v = 0;
+    ioff = 0;
+    for (slot = 0; slot < nslots; slot++) {
+        buf = &queue->tx_buffers[ids[slot]];
+
+        slotlen = len - slot * PAGE_SIZE;
+        if (slotlen > PAGE_SIZE)
+            slotlen = PAGE_SIZE;
+        for (off = 0; off < slotlen; off += n) {
+            while (ioff == iov[v].iov_len) {
+                v++;
+                ioff = 0;
+            }
+            n = iov[v].iov_len - ioff;
+            if (n > slotlen - off)
+                n = slotlen - off;
+            memcpy((char *)buf->page + off,
+                (const char *)iov[v].iov_base + ioff, n);
+            ioff += n;
+        }
+
+        tx = RING_GET_REQUEST(&queue->tx, i);
+        tx->gref = buf->gref;
+
+        tx->offset=0;
+        tx->size = slot == 0 ? len : slotlen;
+        tx->flags = slot < nslots-1 ? NETTXF_more_data : 0;
+        tx->id = ids[slot];
+        sh = &queue->tx_shadow[ids[slot]];
+        sh->idx = i;
+        sh->next = slot < nslots-1 ? ids[slot+1] : -1;
+        sh->first = slot == 0;
+        sh->pending = 1;
+        i++;
+
+        if (slot == 0) {
+            if (txflags & (NETFRONT_TXF_CSUM_BLANK|NETFRONT_TXF_GSO_TCPV4))
+                tx->flags |= NETTXF_csum_blank | NETTXF_data_validated;
+            if (nextra) {
+                struct netif_extra_info *gso;
+
+                tx->flags |= NETTXF_extra_info;
+                gso = (struct netif_extra_info *)
+                    RING_GET_REQUEST(&queue->tx, i);
+                gso->type = XEN_NETIF_EXTRA_TYPE_GSO;
+                gso->flags = 0;
+                gso->u.gso.size = gso_size;
+                gso->u.gso.type = XEN_NETIF_GSO_TYPE_TCPV4;
+                gso->u.gso.pad = 0;
+                gso->u.gso.features = 0;
+                sh->extra = *gso;
+                i++;
+            }
+        }
+        sh->req = *tx;
+    }
+    queue->tx.req_prod_pvt = i;
+    dev->stats.tx_packets++;
+    dev->stats.tx_bytes += len;
+
+    if (!(txflags & NETFRONT_TXF_MORE))
+        netfront_tx_push(queue);
+
+    return 0;
+}
+
+void netfront_xmit_flush(struct netfront_dev *dev, int qidx)
+{
+
+    BUG_ON(qidx < 0 || qidx >= dev->nqueues);
+    netfront_tx_push(&dev->queues[qidx]);
+}
+
+void netfront_xmit_queue(struct netfront_dev *dev, int qidx,
+	unsigned char* data,int len)
+{
+    struct iovec iov;
 
     BUG_ON(len > PAGE_SIZE);
 
-    down(&dev->tx_sem);
+    iov.iov_base = data;
+    iov.iov_len = len;
+    netfront_xmit_iov(dev, qidx, &iov, 1, 0, 0);
+}
 
-    local_irq_save(flags);
-    id = get_id_from_freelist(dev->tx_freelist);
-    local_irq_restore(flags);
+void netfront_xmit(struct netfront_dev *dev, unsigned char* data,int len)
+{
 
-    buf = &dev->tx_buffers[id];
-    page = buf->page;
-    if (!page)
-	page = buf->page = (char*) alloc_page();
+    netfront_xmit_queue(dev, 0, data, len);
+}
 
-    i = dev->tx.req_prod_pvt;
-    tx = RING_GET_REQUEST(&dev->tx, i);
+/*
+ * Allow npages rx pages on top of those it takes to fill the rings.
+ * The budget counts pages on the rings, in the cache and loaned out
+ * through netif_rx alike.
+ */
+void netfront_set_rx_budget(struct netfront_dev *dev, int npages)
+{
 
-    memcpy(page,data,len);
+    dev->rxpage_budget = dev->nqueues * NET_RX_RING_SIZE + npages;
+}
 
-    buf->gref = 
-        tx->gref = gnttab_grant_access(dev->dom,virt_to_mfn(page),1);
+/*
+ * Keep up to npages returned rx pages for refills, beyond that they
+ * go back to the page allocator.
+ */
+void netfront_set_rx_cache(struct netfront_dev *dev, int npages)
+{
 
-    tx->offset=0;
-    tx->size = len;
-    tx->flags=0;
-    tx->id = id;
-    dev->tx.req_prod_pvt = i + 1;
+    dev->rxpage_maxcached = npages;
+}
 
-    wmb();
+/*
+ * Copy frames of up to nbytes instead of loaning out their page.
+ */
+void netfront_set_rx_copybreak(struct netfront_dev *dev, int nbytes)
+{
 
-    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&dev->tx, notify);
+    dev->rx_copybreak = nbytes;
+}
 
-    if(notify) notify_remote_via_evtchn(dev->evtchn);
+/*
+ * Process responses the netif_rx callback refused earlier, and top the
+ * rings that ran out of pages up with newly allocated ones if the
+ * budget allows.  Queues that are neither are left to their polling,
+ * so this is cheap to call after every batch.  Must be called from
+ * thread context.
+ */
+void netfront_rx_resume(struct netfront_dev *dev)
+{
+    struct netfront_queue *queue;
+    unsigned long flags;
+    int i, starved;
 
     local_irq_save(flags);
-    network_tx_buf_gc(dev);
+    starved = dev->rx_starved;
+    dev->rx_starved = 0;
+    for (i = 0; i < dev->nqueues; i++) {
+        queue = &dev->queues[i];
+        if (!starved && !queue->rx_refused)
+            continue;
+        network_rx_refill(queue, 1);
+        if (queue->rx_refused) {
+            queue->rx_refused = 0;
+            /* polling takes over again, and unmasks when done */
+            softirq_schedule(&queue->work);
+        }
+    }
     local_irq_restore(flags);
 }
 
+/*
+ * Poll at most budget rx responses per round, and with delay_us set,
+ * wait that long before polling again while packets keep coming.
+ */
+void netfront_set_rx_poll(struct netfront_dev *dev, int budget, int delay_us)
+{
+
+    if (budget > 0)
+        dev->rx_poll_budget = budget;
+    dev->rx_poll_delay = delay_us > 0 ? MICROSECS(delay_us) : 0;
+}
+
+/*
+ * Set a queue up again after a restore, ahead of the backend.  Tx
+ * packets still without a response go on the new ring first, oldest
+ * first, to the pages they are in.  Returns how many there were.
+ */
+static int netfront_resume_queue(struct netfront_dev *dev,
+	struct netfront_queue *queue)
+{
+    struct netif_tx_sring *txs = queue->tx.sring;
+    struct netif_rx_sring *rxs = queue->rx.sring;
+    unsigned short order[NET_TX_RING_SIZE];
+    char sent[NET_TX_RING_SIZE];
+    struct net_txshadow *sh;
+    unsigned long flags;
+    RING_IDX i, prod;
+    int n, j, k, id;
+
+    local_irq_save(flags);
+
+    /* whatever the old backend answered before we went */
+    network_tx_buf_gc(queue);
+    prod = queue->tx.req_prod_pvt;
+    for (n = 0, id = 0; id < NET_TX_RING_SIZE; id++) {
+        sh = &queue->tx_shadow[id];
+        if (!sh->pending || !sh->first)
+            continue;
+        for (j = n; j > 0
+          && prod - queue->tx_shadow[order[j-1]].idx < prod - sh->idx; j--)
+            order[j] = order[j-1];
+        order[j] = id;
+        n++;
+    }
+
+    memset(txs, 0, PAGE_SIZE);
+    memset(rxs, 0, PAGE_SIZE);
+    SHARED_RING_INIT(txs);
+    SHARED_RING_INIT(rxs);
+    FRONT_RING_INIT(&queue->tx, txs, PAGE_SIZE);
+    FRONT_RING_INIT(&queue->rx, rxs, PAGE_SIZE);
+    gnttab_regrant(queue->tx_ring_ref, dev->dom, virt_to_mfn(txs), 0);
+    gnttab_regrant(queue->rx_ring_ref, dev->dom, virt_to_mfn(rxs), 0);
+
+    for (id = 0; id < NET_TX_RING_SIZE; id++)
+        gnttab_regrant(queue->tx_buffers[id].gref, dev->dom,
+            virt_to_mfn(queue->tx_buffers[id].page), 1);
+    for (id = 0; id < NET_RX_RING_SIZE; id++)
+        if (queue->rx_buffers[id].gref != GRANT_INVALID_REF)
+            gnttab_regrant(queue->rx_buffers[id].gref, dev->dom,
+                virt_to_mfn(queue->rx_buffers[id].page), 0);
+
+    memset(sent, 0, sizeof(sent));
+    i = queue->tx.req_prod_pvt;
+    for (k = 0; k < n; k++) {
+        for (id = order[k]; id >= 0; id = sh->next) {
+            sh = &queue->tx_shadow[id];
+            *RING_GET_REQUEST(&queue->tx, i) = sh->req;
+            sh->idx = i++;
+            sent[id] = 1;
+            if (sh->first && (sh->req.flags & NETTXF_extra_info))
+                *(struct netif_extra_info *)RING_GET_REQUEST(&queue->tx, i++) =
+                    sh->extra;
+        }
+    }
+    queue->tx.req_prod_pvt = i;
+
+    /* slots of packets which were answered only in part */
+    for (id = 0; id < NET_TX_RING_SIZE; id++) {
+        if (!queue->tx_shadow[id].pending || sent[id])
+            continue;
+        queue->tx_shadow[id].pending = 0;
+        add_id_to_freelist(id, queue->tx_freelist);
+        up(&queue->tx_sem);
+    }
+
+    local_irq_restore(flags);
+
+    evtchn_alloc_unbound(dev->dom, netfront_handler, queue, &queue->evtchn);
+    init_rx_buffers(queue);
+
+    return n;
+}
+
+/*
+ * Reconnect after a restore.  The new backend is taken to offer what
+ * the old one did, the features negotiated at init stay.
+ */
+static int netfront_resume(struct netfront_dev *dev)
+{
+    char path[strlen(dev->nodename) + 1 + 10 + 1];
+    char *msg;
+    int i, n;
+
+    {
+        char path[strlen(dev->backend) + 1 + 5 + 1];
+
+        snprintf(path, sizeof(path), "%s/state", dev->backend);
+        free(xenbus_unwatch_path_token(XBT_NIL, path, path));
+    }
+
+    snprintf(path, sizeof(path), "%s/backend-id", dev->nodename);
+    dev->dom = xenbus_read_integer(path);
+    free(dev->backend);
+    dev->backend = NULL;
+    snprintf(path, sizeof(path), "%s/backend", dev->nodename);
+    if ((msg = xenbus_read(XBT_NIL, path, &dev->backend)) != NULL) {
+        free(msg);
+        goto fail;
+    }
+
+    for (i = 0, n = 0; i < dev->nqueues; i++)
+        n += netfront_resume_queue(dev, &dev->queues[i]);
+
+    if ((msg = write_netfront(dev)) != NULL) {
+        free(msg);
+        goto fail;
+    }
+    if (wait_netfront_connected(dev) != 0)
+        goto fail;
+
+    for (i = 0; i < dev->nqueues; i++)
+        netfront_tx_push(&dev->queues[i]);
+    printk("netfront: %s reconnected, %d packets sent again\n",
+        dev->nodename, n);
+    return 0;
+
+fail:
+    printk("netfront: %s lost its backend\n", dev->nodename);
+    return -1;
+}
+
+void suspend_netfront(void)
+{
+    struct netfront_dev *dev;
+    int i;
+
+    for (dev = netfront_devs; dev; dev = dev->next)
+        for (i = 0; i < dev->nqueues; i++) {
+            mask_evtchn(dev->queues[i].evtchn);
+            softirq_cancel(&dev->queues[i].work);
+        }
+}
+
+void resume_netfront(int cancelled)
+{
+    struct netfront_dev *dev;
+    int i;
+
+    for (dev = netfront_devs; dev; dev = dev->next) {
+        if (!cancelled && netfront_resume(dev) != 0) {
+            /* stays masked, and senders waiting for slots give up */
+            dev->dead = 1;
+            for (i = 0; i < dev->nqueues; i++)
+                wake_up(&dev->queues[i].tx_sem.wait);
+            continue;
+        }
+        /* polling takes over again, and unmasks when done */
+        for (i = 0; i < dev->nqueues; i++)
+            softirq_schedule(&dev->queues[i].work);
+    }
+}
+
+int
+netfront_num_queues(struct netfront_dev *dev)
+{
+
+	return dev->nqueues;
+}
+
+int
+netfront_features(struct netfront_dev *dev)
+{
+
+	return dev->features;
+}
+
+void
+netfront_get_stats(struct netfront_dev *dev, struct netfront_stats *st)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	*st = dev->stats;
+	local_irq_restore(flags);
+}
+
 void *
 netfront_get_private(struct netfront_dev *dev)
 {
 
 	return dev->netfront_priv;
 }
-
@@ -32,8 +32,12 @@ struct pcifront_dev {
     char *backend;
 
     struct xenbus_event_queue events;
+
+    struct pcifront_dev *next;	/* pcifront_devs */
 };
 
+static struct pcifront_dev *pcifront_devs;
+
 void pcifront_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
 {
     wake_up(&pcifront_queue);
@@ -41,9 +45,17 @@ void pcifront_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
 
 static void free_pcifront(struct pcifront_dev *dev)
 {
+    struct pcifront_dev **prev;
+
     if (!dev)
         dev = pcidev;
 
+    for (prev = &pcifront_devs; *prev; prev = &(*prev)->next)
+        if (*prev == dev) {
+            *prev = dev->next;
+            break;
+        }
+
     mask_evtchn(dev->evtchn);
 
     gnttab_end_access(dev->info_ref);
@@ -139,43 +151,17 @@ void pcifront_watches(void *opaque)
     xenbus_unwatch_path_token(XBT_NIL, path, path);
 }
 
-struct pcifront_dev *init_pcifront(char *_nodename)
+/*
+ * Publish the shared page and event channel.  The backend connects,
+ * and then so do we.
+ */
+static int write_pcifront(struct pcifront_dev *dev)
 {
     xenbus_transaction_t xbt;
     char* err;
     char* message=NULL;
     int retry=0;
-    char* msg;
-    char* nodename = _nodename ? _nodename : "device/pci/0";
-    int dom;
-
-    struct pcifront_dev *dev;
-
-    char path[strlen(nodename) + 1 + 10 + 1];
-
-    if (!_nodename && pcidev)
-        return pcidev;
-
-    snprintf(path, sizeof(path), "%s/backend-id", nodename);
-    dom = xenbus_read_integer(path); 
-    if (dom == -1) {
-        printk("no backend\n");
-        return NULL;
-    }
-
-    dev = malloc(sizeof(*dev));
-    memset(dev, 0, sizeof(*dev));
-    dev->nodename = strdup(nodename);
-    dev->dom = dom;
-
-    evtchn_alloc_unbound(dev->dom, pcifront_handler, dev, &dev->evtchn);
-
-    dev->info = (struct xen_pci_sharedinfo*) alloc_page();
-    memset(dev->info,0,PAGE_SIZE);
-
-    dev->info_ref = gnttab_grant_access(dev->dom,virt_to_mfn(dev->info),0);
-
-    xenbus_event_queue_init(&dev->events);
+    char path[strlen(dev->nodename) + 1 + 5 + 1];
 
 again:
     err = xenbus_transaction_start(&xbt);
@@ -184,26 +170,26 @@ again:
         free(err);
     }
 
-    err = xenbus_printf(xbt, nodename, "pci-op-ref","%u",
+    err = xenbus_printf(xbt, dev->nodename, "pci-op-ref","%u",
                 dev->info_ref);
     if (err) {
         message = "writing pci-op-ref";
         goto abort_transaction;
     }
-    err = xenbus_printf(xbt, nodename,
+    err = xenbus_printf(xbt, dev->nodename,
                 "event-channel", "%u", dev->evtchn);
     if (err) {
         message = "writing event-channel";
         goto abort_transaction;
     }
-    err = xenbus_printf(xbt, nodename,
+    err = xenbus_printf(xbt, dev->nodename,
                 "magic", XEN_PCI_MAGIC);
     if (err) {
         message = "writing magic";
         goto abort_transaction;
     }
 
-    snprintf(path, sizeof(path), "%s/state", nodename);
+    snprintf(path, sizeof(path), "%s/state", dev->nodename);
     err = xenbus_switch_state(xbt, path, XenbusStateInitialised);
     if (err) {
         message = "switching state";
@@ -217,15 +203,85 @@ again:
         printk("completing transaction\n");
     }
 
-    goto done;
+    return 0;
 
 abort_transaction:
     free(err);
     err = xenbus_transaction_end(xbt, 1, &retry);
+    free(err);
     printk("Abort transaction %s\n", message);
-    goto error;
+    return -1;
+}
+
+/* Wait for the backend to connect, then connect ourselves. */
+static int wait_pcifront_connected(struct pcifront_dev *dev)
+{
+    char path[strlen(dev->backend) + 1 + 5 + 1];
+    char frontpath[strlen(dev->nodename) + 1 + 5 + 1];
+    XenbusState state;
+    char *err = NULL;
+
+    snprintf(path, sizeof(path), "%s/state", dev->backend);
+
+    xenbus_watch_path_token(XBT_NIL, path, path, &dev->events);
+
+    state = xenbus_read_integer(path);
+    while (err == NULL && state < XenbusStateConnected)
+        err = xenbus_wait_for_state_change(path, &state, &dev->events);
+    free(err);
+    if (state != XenbusStateConnected) {
+        printk("backend not avalable, state=%d\n", state);
+        xenbus_unwatch_path_token(XBT_NIL, path, path);
+        return -1;
+    }
+
+    snprintf(frontpath, sizeof(frontpath), "%s/state", dev->nodename);
+    if ((err = xenbus_switch_state(XBT_NIL, frontpath, XenbusStateConnected))
+        != NULL) {
+        printk("error switching state %s\n", err);
+        free(err);
+        xenbus_unwatch_path_token(XBT_NIL, path, path);
+        return -1;
+    }
+    return 0;
+}
 
-done:
+struct pcifront_dev *init_pcifront(char *_nodename)
+{
+    char* msg = NULL;
+    char* nodename = _nodename ? _nodename : "device/pci/0";
+    int dom;
+
+    struct pcifront_dev *dev;
+
+    char path[strlen(nodename) + 1 + 10 + 1];
+
+    if (!_nodename && pcidev)
+        return pcidev;
+
+    snprintf(path, sizeof(path), "%s/backend-id", nodename);
+    dom = xenbus_read_integer(path); 
+    if (dom == -1) {
+        printk("no backend\n");
+        return NULL;
+    }
+
+    dev = malloc(sizeof(*dev));
+    memset(dev, 0, sizeof(*dev));
+    dev->nodename = strdup(nodename);
+    dev->dom = dom;
+
+    evtchn_alloc_unbound(dev->dom, pcifront_handler, dev, &dev->evtchn);
+
+    dev->info = (struct xen_pci_sharedinfo*) alloc_page();
+    memset(dev->info,0,PAGE_SIZE);
+
+    dev->info_ref = gnttab_grant_access(dev->dom,virt_to_mfn(dev->info),0);
+
+    xenbus_event_queue_init(&dev->events);
+
+    if (write_pcifront(dev) != 0)
+        goto error;
 
     snprintf(path, sizeof(path), "%s/backend", nodename);
     msg = xenbus_read(XBT_NIL, path, &dev->backend);
@@ -236,41 +292,19 @@ done:
 
     printk("pcifront: node=%s backend=%s\n", nodename, dev->backend);
 
-    {
-        char path[strlen(dev->backend) + 1 + 5 + 1];
-        char frontpath[strlen(nodename) + 1 + 5 + 1];
-        XenbusState state;
-        snprintf(path, sizeof(path), "%s/state", dev->backend);
-
-        xenbus_watch_path_token(XBT_NIL, path, path, &dev->events);
-
-        err = NULL;
-        state = xenbus_read_integer(path);
-        while (err == NULL && state < XenbusStateConnected)
-            err = xenbus_wait_for_state_change(path, &state, &dev->events);
-        if (state != XenbusStateConnected) {
-            printk("backend not avalable, state=%d\n", state);
-            xenbus_unwatch_path_token(XBT_NIL, path, path);
-            goto error;
-        }
-
-        snprintf(frontpath, sizeof(frontpath), "%s/state", nodename);
-        if ((err = xenbus_switch_state(XBT_NIL, frontpath, XenbusStateConnected))
-            != NULL) {
-            printk("error switching state %s\n", err);
-            xenbus_unwatch_path_token(XBT_NIL, path, path);
-            goto error;
-        }
-    }
+    if (wait_pcifront_connected(dev) != 0)
+        goto error;
     unmask_evtchn(dev->evtchn);
 
     if (!_nodename)
         pcidev = dev;
 
+    dev->next = pcifront_devs;
+    pcifront_devs = dev;
     return dev;
 
 error:
-    free(err);
+    free(msg);
     free_pcifront(dev);
     return NULL;
 }
@@ -639,3 +673,68 @@ int pcifront_disable_msix(struct pcifront_dev *dev,
     
     return op.err;
 }
+
+/*
+ * Reconnect after a restore, with a new event channel and the shared
+ * page granted to whichever backend we have now.  An op which was in
+ * flight is still in the page, flagged active, so the backend is
+ * told about it again.
+ */
+static void pcifront_resume(struct pcifront_dev *dev)
+{
+    char path[strlen(dev->nodename) + 1 + 10 + 1];
+    char *msg;
+
+    {
+        char path[strlen(dev->backend) + 1 + 5 + 1];
+
+        snprintf(path, sizeof(path), "%s/state", dev->backend);
+        free(xenbus_unwatch_path_token(XBT_NIL, path, path));
+    }
+
+    snprintf(path, sizeof(path), "%s/backend-id", dev->nodename);
+    dev->dom = xenbus_read_integer(path);
+    free(dev->backend);
+    dev->backend = NULL;
+    snprintf(path, sizeof(path), "%s/backend", dev->nodename);
+    if ((msg = xenbus_read(XBT_NIL, path, &dev->backend)) != NULL) {
+        free(msg);
+        goto fail;
+    }
+
+    evtchn_alloc_unbound(dev->dom, pcifront_handler, dev, &dev->evtchn);
+    gnttab_regrant(dev->info_ref, dev->dom, virt_to_mfn(dev->info), 0);
+    if (write_pcifront(dev) != 0 || wait_pcifront_connected(dev) != 0)
+        goto fail;
+    unmask_evtchn(dev->evtchn);
+
+    if (test_bit(_XEN_PCIF_active, (void*) &dev->info->flags))
+        notify_remote_via_evtchn(dev->evtchn);
+    printk("pcifront: %s reconnected\n", dev->nodename);
+    return;
+
+fail:
+    printk("pcifront: %s lost its backend\n", dev->nodename);
+}
+
+void suspend_pcifront(void)
+{
+    struct pcifront_dev *dev;
+
+    for (dev = pcifront_devs; dev; dev = dev->next)
+        mask_evtchn(dev->evtchn);
+}
+
+void resume_pcifront(int cancelled)
+{
+    struct pcifront_dev *dev;
+
+    for (dev = pcifront_devs; dev; dev = dev->next) {
+        if (!cancelled)
+            pcifront_resume(dev);
+        else
+            unmask_evtchn(dev->evtchn);
+        /* in case the op finished while we were away */
+        wake_up(&pcifront_queue);
+    }
+}
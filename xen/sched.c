@@ -13,7 +13,9 @@
  * Description: simple scheduler for Mini-Os
  *
  * The scheduler is non-preemptive (cooperative), and schedules according 
- * to Round Robin algorithm.
+ * to Round Robin algorithm within each priority class.  Runnable
+ * threads are kept on a run queue per class, sleeping threads with a
+ * timeout on a min-heap ordered by wakeup time.
  *
  ****************************************************************************
  * Permission is hereby granted, free of charge, to any person obtaining a copy
@@ -44,16 +46,51 @@
 #include <mini-os/xmalloc.h>
 #include <mini-os/sched.h>
 #include <mini-os/semaphore.h>
+#include <mini-os/trace.h>
 
 #include <sys/queue.h>
 
 TAILQ_HEAD(thread_list, thread);
 
 struct thread *idle_thread = NULL;
+struct thread *current_thread = NULL;
 static struct thread_list exited_threads = TAILQ_HEAD_INITIALIZER(exited_threads);
 static struct thread_list thread_list = TAILQ_HEAD_INITIALIZER(thread_list);
 static int threads_started;
 
+/*
+ * Per-CPU run queues, one per priority class.  wake() puts a thread
+ * at the tail, schedule() takes the head of the highest non-empty
+ * class.  clear_runnable() does not unlink, so threads which went to
+ * sleep while still on a queue are sorted out when they reach the head.
+ *
+ * Only VCPU 0 runs for now.  Keeping the queues per CPU, with a count
+ * of queued threads, is what a stealing idle CPU will need.
+ */
+struct runqueue {
+    struct thread_list rq_prio[THREAD_NPRIO];
+    int rq_nqueued;
+};
+#define SCHED_NCPU 1
+static struct runqueue runqueues[SCHED_NCPU];
+#define this_runq() (&runqueues[smp_processor_id()])
+
+/*
+ * Sleep queue: binary min-heap of threads blocked with a wakeup_time.
+ * It has room for every thread, so inserting never allocates.
+ */
+static struct thread **sleepq;
+static int sleepq_len, sleepq_size, nthreads;
+
+/*
+ * Timeouts may fire up to timer_slack late, so that sleepers with
+ * nearby deadlines share one hypervisor timer and one wakeup.  A
+ * thread can ask for a slack of its own, zero for exact timeouts.
+ */
+static s_time_t timer_slack;
+
+#define thread_slack(t) ((t)->slack < 0 ? timer_slack : (t)->slack)
+
 struct thread *main_thread;
 
 void inline print_runqueue(void)
@@ -68,18 +105,198 @@ void inline print_runqueue(void)
 
 static void (*scheduler_hook)(void *, void *);
 
+static void
+runq_insert(struct thread *thread)
+{
+
+    if (thread->flags & THREAD_ONRUNQ)
+        return;
+    thread->flags |= THREAD_ONRUNQ;
+    thread->cpu = smp_processor_id();
+    TAILQ_INSERT_TAIL(&runqueues[thread->cpu].rq_prio[thread->prio],
+                      thread, runq);
+    runqueues[thread->cpu].rq_nqueued++;
+}
+
+static void
+runq_remove(struct thread *thread)
+{
+
+    if ((thread->flags & THREAD_ONRUNQ) == 0)
+        return;
+    thread->flags &= ~THREAD_ONRUNQ;
+    TAILQ_REMOVE(&runqueues[thread->cpu].rq_prio[thread->prio],
+                 thread, runq);
+    runqueues[thread->cpu].rq_nqueued--;
+}
+
+static void
+sleepq_set(int idx, struct thread *thread)
+{
+
+    sleepq[idx] = thread;
+    thread->sleepq_idx = idx;
+}
+
+static void
+sleepq_up(int idx)
+{
+    struct thread *thread = sleepq[idx];
+    int parent;
+
+    while (idx > 0) {
+        parent = (idx - 1) / 2;
+        if (sleepq[parent]->wakeup_time <= thread->wakeup_time)
+            break;
+        sleepq_set(idx, sleepq[parent]);
+        idx = parent;
+    }
+    sleepq_set(idx, thread);
+}
+
+static void
+sleepq_down(int idx)
+{
+    struct thread *thread = sleepq[idx];
+    int child;
+
+    while ((child = 2*idx + 1) < sleepq_len) {
+        if (child + 1 < sleepq_len
+          && sleepq[child+1]->wakeup_time < sleepq[child]->wakeup_time)
+            child++;
+        if (thread->wakeup_time <= sleepq[child]->wakeup_time)
+            break;
+        sleepq_set(idx, sleepq[child]);
+        idx = child;
+    }
+    sleepq_set(idx, thread);
+}
+
+static void
+sleepq_insert(struct thread *thread)
+{
+
+    ASSERT(thread->sleepq_idx == -1 && sleepq_len < sleepq_size);
+    sleepq_set(sleepq_len++, thread);
+    sleepq_up(thread->sleepq_idx);
+}
+
+static void
+sleepq_remove(struct thread *thread)
+{
+    struct thread *moved;
+    int idx = thread->sleepq_idx;
+
+    if (idx == -1)
+        return;
+    thread->sleepq_idx = -1;
+    if (--sleepq_len == idx)
+        return;
+    moved = sleepq[sleepq_len];
+    sleepq_set(idx, moved);
+    sleepq_up(idx);
+    sleepq_down(moved->sleepq_idx);
+}
+
+/*
+ * The latest time the domain may sleep until without making anyone
+ * more than their slack late.  Below a sleeper woken at or after the
+ * bound found so far, nobody can lower it, so the walk stays short.
+ */
+static s_time_t
+sleepq_latest(int idx, s_time_t latest)
+{
+    struct thread *thread;
+    s_time_t t;
+
+    if (idx >= sleepq_len || (thread = sleepq[idx])->wakeup_time >= latest)
+        return latest;
+    t = thread->wakeup_time + thread_slack(thread);
+    if (t < latest)
+        latest = t;
+    latest = sleepq_latest(2*idx + 1, latest);
+    return sleepq_latest(2*idx + 2, latest);
+}
+
+/* Make sure the sleep queue has a slot for every thread. */
+static void
+sleepq_reserve(void)
+{
+    struct thread **newq;
+    unsigned long flags;
+    int newsize;
+
+    if (nthreads < sleepq_size)
+        return;
+    newsize = sleepq_size ? 2*sleepq_size : 64;
+    newq = xmalloc_array(struct thread *, newsize);
+    BUG_ON(newq == NULL);
+
+    local_irq_save(flags);
+    if (sleepq_len)
+        memcpy(newq, sleepq, sleepq_len * sizeof(*newq));
+    xfree(sleepq);
+    sleepq = newq;
+    sleepq_size = newsize;
+    local_irq_restore(flags);
+}
+
 void switch_threads(struct thread *prev, struct thread *next)
 {
 
     if (scheduler_hook)
 	scheduler_hook(prev->cookie, next->cookie);
+    tracepoint(TRACE_SCHED_SWITCH, 0, 0, prev, next);
+    current_thread = next;
     arch_switch_threads(prev, next);
 }
 
+/*
+ * Exited threads are kept with their stacks for reuse, so that under
+ * thread churn creating a thread is a list walk instead of an xmalloc()
+ * and a stack mapping.  A cached stack is only reused at the same
+ * size.  Threads on external stacks aren't cached.
+ * Only touched from thread context, so needs no locking.
+ */
+static struct thread_list thread_cache = TAILQ_HEAD_INITIALIZER(thread_cache);
+static int thread_cache_len;
+
+struct thread *thread_cache_get(size_t stack_size)
+{
+    struct thread *thread;
+
+    TAILQ_FOREACH(thread, &thread_cache, thread_list)
+        if (thread->stack_size == stack_size)
+            break;
+    if (thread != NULL) {
+        TAILQ_REMOVE(&thread_cache, thread, thread_list);
+        thread_cache_len--;
+    }
+    return thread;
+}
+
+static void thread_cache_put(struct thread *thread)
+{
+
+    if ((thread->flags & THREAD_EXTSTACK) == 0
+        && thread_cache_len < THREAD_CACHE_MAX) {
+        TAILQ_INSERT_HEAD(&thread_cache, thread, thread_list);
+        thread_cache_len++;
+        return;
+    }
+    if ((thread->flags & THREAD_EXTSTACK) == 0)
+        unmap_stack(thread->stack, thread->stack_size >> PAGE_SHIFT);
+    fpu_thread_fini(thread);
+    xfree(thread);
+}
+
 void schedule(void)
 {
     struct thread *prev, *next, *thread, *tmp;
+    struct runqueue *rq = this_runq();
     unsigned long flags;
+    s_time_t now, min_wakeup_time, max_wakeup_time;
+    int prio;
 
     prev = current;
     local_irq_save(flags); 
@@ -93,36 +310,48 @@ void schedule(void)
         BUG();
     }
 
+    /* Round robin: a still runnable prev goes to the back of the line. */
+    if (is_runnable(prev))
+        runq_insert(prev);
+    else if (prev->wakeup_time != 0LL
+      && (prev->flags & THREAD_ONRUNQ) == 0 && prev->sleepq_idx == -1)
+        sleepq_insert(prev);
+
     do {
-        /* Examine all threads.
-           Find a runnable thread, but also wake up expired ones and find the
-           time when the next timeout expires, else use 10 seconds. */
-        s_time_t now = NOW();
-        s_time_t min_wakeup_time = now + SECONDS(10);
+        /* Wake up expired sleepers, then take the first runnable thread.
+           If there is none, block until the next timeout expires, else
+           for 10 seconds. */
+        now = NOW();
+        while (sleepq_len && sleepq[0]->wakeup_time <= now) {
+            thread = sleepq[0];
+            thread->flags |= THREAD_TIMEDOUT;
+            wake(thread);
+        }
         next = NULL;
-        TAILQ_FOREACH_SAFE(thread, &thread_list, thread_list, tmp)
-        {
-            if (!is_runnable(thread) && thread->wakeup_time != 0LL)
-            {
-                if (thread->wakeup_time <= now) {
-		    thread->flags |= THREAD_TIMEDOUT;
-                    wake(thread);
-                } else if (thread->wakeup_time < min_wakeup_time)
-                    min_wakeup_time = thread->wakeup_time;
-            }
-            if(is_runnable(thread)) 
-            {
-                next = thread;
-                /* Put this thread on the end of the list */
-                TAILQ_REMOVE(&thread_list, thread, thread_list);
-                TAILQ_INSERT_TAIL(&thread_list, thread, thread_list);
-                break;
+        for (prio = 0; prio < THREAD_NPRIO && next == NULL; prio++) {
+            while ((thread = TAILQ_FIRST(&rq->rq_prio[prio])) != NULL) {
+                runq_remove(thread);
+                if (is_runnable(thread)) {
+                    next = thread;
+                    break;
+                }
+                /* went to sleep after it was queued */
+                if (thread->wakeup_time != 0LL && thread->sleepq_idx == -1)
+                    sleepq_insert(thread);
             }
         }
         if (next)
             break;
+        /* the loop above may have queued new sleepers */
+        if (sleepq_len && sleepq[0]->wakeup_time <= now)
+            continue;
+        min_wakeup_time = max_wakeup_time = now + SECONDS(10);
+        if (sleepq_len && sleepq[0]->wakeup_time < min_wakeup_time) {
+            min_wakeup_time = sleepq[0]->wakeup_time;
+            max_wakeup_time = sleepq_latest(0, Time_Max);
+        }
         /* block until the next timeout expires, or for 10 secs, whichever comes first */
-        block_domain(min_wakeup_time);
+        block_domain_range(min_wakeup_time, max_wakeup_time);
         /* handle pending events if any */
         force_evtchn_callback();
     } while(1);
@@ -136,33 +365,58 @@ void schedule(void)
         if(thread != prev)
         {
             TAILQ_REMOVE(&exited_threads, thread, thread_list);
-	    if ((thread->flags & THREAD_EXTSTACK) == 0)
-                free_pages(thread->stack, STACK_SIZE_PAGE_ORDER);
-            xfree(thread);
+            thread_cache_put(thread);
         }
     }
 }
 
 struct thread *
-create_thread(const char *name, void *cookie,
-	void (*function)(void *), void *data, void *stack)
+create_thread_stack(const char *name, void *cookie, int prio,
+	void (*function)(void *), void *data, void *stack, size_t stack_size)
 {
     struct thread *thread;
     unsigned long flags;
+
+    ASSERT(prio >= 0 && prio < THREAD_NPRIO);
     /* Call architecture specific setup. */
-    thread = arch_create_thread(name, function, data, stack);
+    thread = arch_create_thread(name, function, data, stack, stack_size);
+    if (thread == NULL)
+        return NULL;
     /* Not runable, not exited, not sleeping */
-    thread->flags = 0;
+    thread->flags &= THREAD_EXTSTACK;
     thread->wakeup_time = 0LL;
+    thread->slack = -1;
     thread->lwp = NULL;
     thread->cookie = cookie;
+    thread->sleepq_idx = -1;
+    thread->prio = prio;
     set_runnable(thread);
+    sleepq_reserve();
     local_irq_save(flags);
+    nthreads++;
     TAILQ_INSERT_TAIL(&thread_list, thread, thread_list);
+    runq_insert(thread);
     local_irq_restore(flags);
     return thread;
 }
 
+struct thread *
+create_thread_prio(const char *name, void *cookie, int prio,
+	void (*function)(void *), void *data, void *stack)
+{
+
+    return create_thread_stack(name, cookie, prio, function, data, stack, 0);
+}
+
+struct thread *
+create_thread(const char *name, void *cookie,
+	void (*function)(void *), void *data, void *stack)
+{
+
+    return create_thread_prio(name, cookie, THREAD_PRIO_NORMAL,
+                              function, data, stack);
+}
+
 struct join_waiter {
     struct thread *jw_thread;
     struct thread *jw_wanted;
@@ -198,7 +452,8 @@ void exit_thread(void)
 
     /* Remove from the thread list */
     TAILQ_REMOVE(&thread_list, thread, thread_list);
-    clear_runnable(thread);
+    nthreads--;
+    block(thread);
     /* Put onto exited list */
     TAILQ_INSERT_HEAD(&exited_threads, thread, thread_list);
     local_irq_restore(flags);
@@ -244,8 +499,14 @@ void join_thread(struct thread *joinable)
 
 void block(struct thread *thread)
 {
+    unsigned long flags;
+
+    local_irq_save(flags);
     thread->wakeup_time = 0LL;
     clear_runnable(thread);
+    runq_remove(thread);
+    sleepq_remove(thread);
+    local_irq_restore(flags);
 }
 
 static int
@@ -276,10 +537,29 @@ int absmsleep(uint32_t millisecs)
     return dosleep(MILLISECS(millisecs));
 }
 
+int nsleep(s_time_t nsecs)
+{
+
+    return dosleep(NOW() + nsecs);
+}
+
+int absnsleep(s_time_t deadline)
+{
+
+    /* wakeup_time 0 means not sleeping */
+    return dosleep(deadline > 0 ? deadline : 1);
+}
+
 void wake(struct thread *thread)
 {
+    unsigned long flags;
+
+    local_irq_save(flags);
+    sleepq_remove(thread);
     thread->wakeup_time = 0LL;
     set_runnable(thread);
+    runq_insert(thread);
+    local_irq_restore(flags);
 }
 
 void idle_thread_fn(void *unused)
@@ -293,9 +573,29 @@ void idle_thread_fn(void *unused)
 
 void init_sched(void)
 {
+    int cpu, prio;
+
     printk("Initialising scheduler\n");
 
-    idle_thread = create_thread("Idle", NULL, idle_thread_fn, NULL, NULL);
+    for (cpu = 0; cpu < SCHED_NCPU; cpu++)
+        for (prio = 0; prio < THREAD_NPRIO; prio++)
+            TAILQ_INIT(&runqueues[cpu].rq_prio[prio]);
+
+    idle_thread = create_thread_prio("Idle", NULL, THREAD_PRIO_IDLE,
+                                     idle_thread_fn, NULL, NULL);
+}
+
+void sched_set_timer_slack(s_time_t slack)
+{
+
+    timer_slack = slack > 0 ? slack : 0;
+}
+
+/* Negative goes back to the default set above. */
+void sched_set_thread_slack(struct thread *thread, s_time_t slack)
+{
+
+    thread->slack = slack < 0 ? -1 : slack;
 }
 
 void set_sched_hook(void (*f)(void *, void *))
@@ -0,0 +1,130 @@
+/*
+ ****************************************************************************
+ *
+ *        File: softirq.c
+ *
+ * Environment: Xen Minimal OS
+ * Description: Runs work deferred from event handlers in a thread of
+ *  its own, scheduled ahead of all other threads.  Delayed work sits on
+ *  a list sorted by deadline, the thread sleeps until the first one.
+ *
+ ****************************************************************************
+ */
+#include <mini-os/os.h>
+#include <mini-os/lib.h>
+#include <mini-os/sched.h>
+#include <mini-os/time.h>
+#include <mini-os/softirq.h>
+
+/* softirq_work.pending */
+#define WORK_IDLE    0
+#define WORK_PENDING 1
+#define WORK_DELAYED 2
+
+TAILQ_HEAD(softirq_list, softirq_work);
+static struct softirq_list softirq_pending
+    = TAILQ_HEAD_INITIALIZER(softirq_pending);
+/* sorted by deadline */
+static struct softirq_list softirq_delayed
+    = TAILQ_HEAD_INITIALIZER(softirq_delayed);
+static struct thread *softirq_thread;
+
+static void softirq_unlink(struct softirq_work *w)
+{
+
+    if (w->pending == WORK_PENDING)
+        TAILQ_REMOVE(&softirq_pending, w, entries);
+    else if (w->pending == WORK_DELAYED)
+        TAILQ_REMOVE(&softirq_delayed, w, entries);
+    w->pending = WORK_IDLE;
+}
+
+/* Callable from any context. */
+void softirq_schedule(struct softirq_work *w)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    if (w->pending != WORK_PENDING) {
+        softirq_unlink(w);
+        w->pending = WORK_PENDING;
+        TAILQ_INSERT_TAIL(&softirq_pending, w, entries);
+        if (softirq_thread)
+            wake(softirq_thread);
+    }
+    local_irq_restore(flags);
+}
+
+/* Run w no sooner than delay from now, unless it is queued meanwhile. */
+void softirq_schedule_delayed(struct softirq_work *w, s_time_t delay)
+{
+    struct softirq_work *iter;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    if (w->pending == WORK_IDLE) {
+        w->pending = WORK_DELAYED;
+        w->deadline = NOW() + delay;
+        TAILQ_FOREACH(iter, &softirq_delayed, entries)
+            if (iter->deadline > w->deadline)
+                break;
+        if (iter)
+            TAILQ_INSERT_BEFORE(iter, w, entries);
+        else
+            TAILQ_INSERT_TAIL(&softirq_delayed, w, entries);
+        /* may have to sleep less */
+        if (softirq_thread && w == TAILQ_FIRST(&softirq_delayed))
+            wake(softirq_thread);
+    }
+    local_irq_restore(flags);
+}
+
+void softirq_cancel(struct softirq_work *w)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    softirq_unlink(w);
+    local_irq_restore(flags);
+}
+
+static void softirq_run(void *arg)
+{
+    struct softirq_work *w;
+    unsigned long flags;
+    s_time_t now;
+
+    local_irq_save(flags);
+    for (;;) {
+        now = NOW();
+        while ((w = TAILQ_FIRST(&softirq_delayed)) != NULL
+               && w->deadline <= now) {
+            TAILQ_REMOVE(&softirq_delayed, w, entries);
+            w->pending = WORK_PENDING;
+            TAILQ_INSERT_TAIL(&softirq_pending, w, entries);
+        }
+        if ((w = TAILQ_FIRST(&softirq_pending)) == NULL) {
+            block(softirq_thread);
+            if ((w = TAILQ_FIRST(&softirq_delayed)) != NULL)
+                softirq_thread->wakeup_time = w->deadline;
+            local_irq_restore(flags);
+            schedule();
+            local_irq_save(flags);
+            continue;
+        }
+        TAILQ_REMOVE(&softirq_pending, w, entries);
+        w->pending = WORK_IDLE;
+        local_irq_restore(flags);
+
+        w->func(w->arg);
+
+        local_irq_save(flags);
+    }
+}
+
+void init_softirq(void)
+{
+
+    softirq_thread = create_thread_prio("softirq", NULL, THREAD_PRIO_SOFTIRQ,
+                                        softirq_run, NULL, NULL);
+}
@@ -0,0 +1,73 @@
+/*
+ ****************************************************************************
+ *
+ *        File: stats.c
+ *
+ * Environment: Xen Minimal OS
+ * Description: Dumps registered runtime statistics on request through
+ *  control/stats in xenstore.
+ *
+ ****************************************************************************
+ */
+#include <mini-os/os.h>
+#include <mini-os/lib.h>
+#include <mini-os/xenbus.h>
+#include <mini-os/sched.h>
+#include <mini-os/stats.h>
+
+#include <errno.h>
+#include <string.h>
+
+static struct {
+    const char *name;
+    void (*dump)(void);
+} stats[STATS_MAX];
+static int nstats;
+
+int stats_register(const char *name, void (*dump)(void))
+{
+
+    if (nstats == STATS_MAX)
+        return ENOSPC;
+    stats[nstats].name = name;
+    stats[nstats].dump = dump;
+    nstats++;
+    return 0;
+}
+
+void stats_dump(const char *name)
+{
+    int i;
+
+    for (i = 0; i < nstats; i++)
+        if (strcmp(name, "all") == 0 || strcmp(name, stats[i].name) == 0)
+            stats[i].dump();
+}
+
+static void stats_thread(void *arg)
+{
+    struct xenbus_event_queue events;
+    const char *path = "control/stats";
+    char *err, *val;
+
+    xenbus_event_queue_init(&events);
+    xenbus_watch_path_token(XBT_NIL, path, path, &events);
+    for (;;) {
+        xenbus_wait_for_watch(&events);
+        if ((err = xenbus_read(XBT_NIL, path, &val)) != NULL) {
+            free(err);
+            continue;
+        }
+        if (strcmp(val, "done") != 0 && *val != '\0') {
+            stats_dump(val);
+            free(xenbus_write(XBT_NIL, path, "done"));
+        }
+        free(val);
+    }
+}
+
+void init_stats(void)
+{
+
+    create_thread("stats", NULL, stats_thread, NULL, NULL);
+}
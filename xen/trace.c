@@ -0,0 +1,139 @@
+/*
+ ****************************************************************************
+ *
+ *        File: trace.c
+ *
+ * Environment: Xen Minimal OS
+ * Description: Ring of binary trace events, shared with dom0 and
+ *  switched on and off through control/trace.
+ *
+ ****************************************************************************
+ */
+#include <mini-os/os.h>
+#include <mini-os/lib.h>
+#include <mini-os/mm.h>
+#include <mini-os/time.h>
+#include <mini-os/gnttab.h>
+#include <mini-os/xenbus.h>
+#include <mini-os/sched.h>
+#include <mini-os/stats.h>
+#include <mini-os/trace.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int trace_enabled;
+
+static struct trace_ring_hdr *ring;
+static struct trace_event *trace_events;
+
+void __trace(uint16_t type, uint16_t arg, uint32_t a, uint64_t b, uint64_t c)
+{
+    struct trace_event *ev;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    ev = &trace_events[ring->prod % ring->nr_events];
+    ev->ts = NOW();
+    ev->type = type;
+    ev->arg = arg;
+    ev->a = a;
+    ev->b = b;
+    ev->c = c;
+    wmb();
+    ring->prod++;
+    local_irq_restore(flags);
+}
+
+/* Allocate the ring and publish it, once. */
+static int trace_setup(void)
+{
+    struct xenbus_batch batch;
+    char key[24];
+    int i, retry;
+    char *err;
+
+    if (ring)
+        return 0;
+    if ((ring = (void *)alloc_pages(TRACE_RING_ORDER)) == NULL) {
+        printk("trace: no memory for the ring\n");
+        return -1;
+    }
+    memset(ring, 0, TRACE_RING_PAGES * PAGE_SIZE);
+    ring->magic = TRACE_MAGIC;
+    ring->event_size = sizeof(struct trace_event);
+    ring->nr_events = (TRACE_RING_PAGES - 1) * PAGE_SIZE
+                      / sizeof(struct trace_event);
+    trace_events = (void *)((char *)ring + PAGE_SIZE);
+
+    xenbus_batch_start(&batch, 0);
+    xenbus_batch_printf(&batch, "data/trace", "nr-pages", "%d",
+                        TRACE_RING_PAGES);
+    for (i = 0; i < TRACE_RING_PAGES; i++) {
+        snprintf(key, sizeof(key), "ring-ref-%d", i);
+        xenbus_batch_printf(&batch, "data/trace", key, "%u",
+            gnttab_grant_access(0, virt_to_mfn((char *)ring + i*PAGE_SIZE),
+                                1));
+    }
+    if ((err = xenbus_batch_end(&batch, 0, &retry)) != NULL) {
+        printk("trace: publishing the ring failed: %s\n", err);
+        free(err);
+    }
+    return 0;
+}
+
+static void trace_dump(void)
+{
+    struct trace_event *ev;
+    uint64_t i, prod;
+
+    if (!ring) {
+        printk("trace: never switched on\n");
+        return;
+    }
+    prod = ring->prod;
+    printk("trace: %llu events, %s\n", (unsigned long long)prod,
+           trace_enabled ? "on" : "off");
+    /* the last few, oldest first */
+    for (i = prod > 16 ? prod - 16 : 0; i < prod; i++) {
+        ev = &trace_events[i % ring->nr_events];
+        printk("trace: %llu type %u arg %u a %u b %#llx c %#llx\n",
+               (unsigned long long)ev->ts, ev->type, ev->arg, ev->a,
+               (unsigned long long)ev->b, (unsigned long long)ev->c);
+    }
+}
+
+static void trace_thread(void *arg)
+{
+    struct xenbus_event_queue events;
+    const char *path = "control/trace";
+    char *err, *val;
+
+    xenbus_event_queue_init(&events);
+    xenbus_watch_path_token(XBT_NIL, path, path, &events);
+    for (;;) {
+        xenbus_wait_for_watch(&events);
+        if ((err = xenbus_read(XBT_NIL, path, &val)) != NULL) {
+            free(err);
+            continue;
+        }
+        if (strcmp(val, "on") == 0 && !trace_enabled) {
+            if (trace_setup() == 0) {
+                trace_enabled = 1;
+                printk("trace: on\n");
+            }
+        } else if (strcmp(val, "off") == 0 && trace_enabled) {
+            trace_enabled = 0;
+            printk("trace: off\n");
+        }
+        free(val);
+    }
+}
+
+void init_trace(void)
+{
+
+    stats_register("trace", trace_dump);
+    create_thread("trace", NULL, trace_thread, NULL, NULL);
+}
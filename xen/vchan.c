@@ -0,0 +1,481 @@
+/*
+ ****************************************************************************
+ *
+ *        File: vchan.c
+ *
+ * Environment: Xen Minimal OS
+ * Description: Inter-domain byte streams over a pair of granted rings,
+ *  wire compatible with libxenvchan.  The server allocates and grants
+ *  an interface page holding both ring indexes, plus the rings
+ *  themselves when they don't fit in that page, and publishes the
+ *  grant and an unbound event channel in xenstore.  The client maps
+ *  the lot.  The server reads the left ring and writes the right one.
+ *
+ ****************************************************************************
+ */
+#include <mini-os/os.h>
+#include <mini-os/lib.h>
+#include <mini-os/mm.h>
+#include <mini-os/events.h>
+#include <mini-os/gnttab.h>
+#include <mini-os/gntmap.h>
+#include <mini-os/xenbus.h>
+#include <mini-os/wait.h>
+#include <mini-os/xmalloc.h>
+#include <mini-os/vchan.h>
+#include <mini-os/kernel.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the libxenvchan shared page */
+struct vchan_ring_shared {
+    uint32_t cons, prod;
+};
+
+#define VCHAN_NOTIFY_WRITE  0x1
+#define VCHAN_NOTIFY_READ   0x2
+
+struct vchan_interface {
+    struct vchan_ring_shared left, right;
+    uint16_t left_order, right_order;
+    uint8_t cli_live, srv_live;
+    uint8_t cli_notify, srv_notify;
+    uint32_t grants[0];
+};
+
+/* orders 10 and 11 live in the interface page, bigger rings are granted */
+#define VCHAN_ORDER_MIN     10
+#define VCHAN_ORDER_MAX     20
+#define VCHAN_NPAGES(o)     ((o) >= PAGE_SHIFT ? 1 << ((o) - PAGE_SHIFT) : 0)
+
+struct vchan_ring {
+    volatile struct vchan_ring_shared *shr;
+    char *buf;
+    int order;
+};
+
+struct vchan {
+    struct vchan_interface *vc_ifc;
+    struct vchan_ring vc_rd, vc_wr;
+    int vc_server;
+    domid_t vc_peer;
+    evtchn_port_t vc_port;
+    struct wait_queue_head vc_wq;
+
+    /* server: the grants, left ring's first, and where they're published */
+    grant_ref_t vc_ifcref;
+    grant_ref_t *vc_grefs;
+    int vc_ngrefs;
+    char *vc_path;
+
+    /* client: everything mapped from the server */
+    struct gntmap vc_map;
+};
+
+static void vchan_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
+{
+    struct vchan *vc = data;
+
+    wake_up(&vc->vc_wq);
+}
+
+/*
+ * As in libxenvchan, each side asks for a kick in the other side's
+ * field and checks its own field before kicking.
+ */
+static volatile uint8_t *vchan_own_notify(struct vchan *vc)
+{
+    return vc->vc_server ? &vc->vc_ifc->srv_notify : &vc->vc_ifc->cli_notify;
+}
+
+static volatile uint8_t *vchan_peer_notify(struct vchan *vc)
+{
+    return vc->vc_server ? &vc->vc_ifc->cli_notify : &vc->vc_ifc->srv_notify;
+}
+
+/* ask the peer to kick us when it does bit */
+static void vchan_request_notify(struct vchan *vc, uint8_t bit)
+{
+    __sync_or_and_fetch(vchan_peer_notify(vc), bit);
+    mb();
+}
+
+/* kick the peer if it asked to hear about bit */
+static void vchan_send_notify(struct vchan *vc, uint8_t bit)
+{
+    uint8_t prev;
+
+    prev = __sync_fetch_and_and(vchan_own_notify(vc), ~bit);
+    if (prev & bit)
+        notify_remote_via_evtchn(vc->vc_port);
+}
+
+static void vchan_ring_setup(struct vchan *vc, struct vchan_ring *r,
+                             int left, int order, char *pages)
+{
+    struct vchan_interface *ifc = vc->vc_ifc;
+
+    r->shr = left ? &ifc->left : &ifc->right;
+    r->order = order;
+    if (order < PAGE_SHIFT)
+        r->buf = (char *)ifc + (1 << order);
+    else
+        r->buf = pages;
+}
+
+static int vchan_order(size_t min, int taken)
+{
+    int order;
+
+    if (min <= 1024 && taken != 10)
+        return 10;
+    if (min <= 2048 && taken != 11)
+        return 11;
+    for (order = PAGE_SHIFT; order < VCHAN_ORDER_MAX; order++)
+        if ((1UL << order) >= min)
+            break;
+    return order;
+}
+
+static void vchan_server_free(struct vchan *vc)
+{
+    struct vchan_interface *ifc = vc->vc_ifc;
+    int ok;
+
+    if (vc->vc_port)
+        unbind_evtchn(vc->vc_port);
+    ok = gnttab_end_access_batch(vc->vc_grefs, vc->vc_ngrefs)
+        == vc->vc_ngrefs;
+    if (vc->vc_ifcref)
+        ok &= gnttab_end_access(vc->vc_ifcref);
+    /* pages the peer still has mapped can't go back to the allocator */
+    if (!ok) {
+        printk("vchan: domain %u still maps the rings, leaking them\n",
+               vc->vc_peer);
+    } else if (ifc) {
+        if (VCHAN_NPAGES(ifc->left_order) && vc->vc_rd.buf)
+            free_pages(vc->vc_rd.buf, ifc->left_order - PAGE_SHIFT);
+        if (VCHAN_NPAGES(ifc->right_order) && vc->vc_wr.buf)
+            free_pages(vc->vc_wr.buf, ifc->right_order - PAGE_SHIFT);
+        free_page(ifc);
+    }
+    xfree(vc->vc_grefs);
+    xfree(vc);
+}
+
+/*
+ * ring-ref and event-channel under path, readable by the peer only.
+ * event-channel goes first, a client takes ring-ref as the sign that
+ * the server is there.
+ */
+static int vchan_publish(struct vchan *vc, const char *path)
+{
+    static const char *names[] = { "event-channel", "ring-ref" };
+    unsigned vals[2] = { vc->vc_port, vc->vc_ifcref };
+    char key[256], val[16], perms[32];
+    struct write_req req[2];
+    struct xsd_sockmsg *rep;
+    char *err;
+    int i, plen, bad;
+
+    plen = snprintf(perms, sizeof(perms), "n%u", xenbus_get_self_id()) + 1;
+    plen += snprintf(perms + plen, sizeof(perms) - plen, "r%u",
+                     vc->vc_peer) + 1;
+
+    for (i = 0; i < 2; i++) {
+        snprintf(key, sizeof(key), "%s/%s", path, names[i]);
+        snprintf(val, sizeof(val), "%u", vals[i]);
+        if ((err = xenbus_write(XBT_NIL, key, val)) != NULL) {
+            printk("vchan: writing %s: %s\n", key, err);
+            free(err);
+            return EIO;
+        }
+        /* xenbus_set_perms() does one entry, we need two */
+        req[0].data = key;
+        req[0].len = strlen(key) + 1;
+        req[1].data = perms;
+        req[1].len = plen;
+        rep = xenbus_msg_reply(XS_SET_PERMS, XBT_NIL, req, 2);
+        bad = rep->type == XS_ERROR;
+        xenbus_free(rep);
+        if (bad) {
+            printk("vchan: can't set permissions on %s\n", key);
+            return EACCES;
+        }
+    }
+    return 0;
+}
+
+static void vchan_unpublish(const char *path)
+{
+    char key[256], *err;
+
+    snprintf(key, sizeof(key), "%s/ring-ref", path);
+    if ((err = xenbus_rm(XBT_NIL, key)) != NULL)
+        free(err);
+    snprintf(key, sizeof(key), "%s/event-channel", path);
+    if ((err = xenbus_rm(XBT_NIL, key)) != NULL)
+        free(err);
+}
+
+struct vchan *vchan_server_init(domid_t peer, const char *path,
+                                size_t read_min, size_t write_min)
+{
+    struct vchan *vc;
+    struct vchan_interface *ifc;
+    unsigned long *frames;
+    char *rpages = NULL, *wpages = NULL;
+    int rorder, worder, nr, nw, i;
+
+    rorder = vchan_order(read_min, 0);
+    worder = vchan_order(write_min, rorder);
+    if ((1UL << rorder) < read_min || (1UL << worder) < write_min) {
+        printk("vchan: rings of %lu and %lu bytes are too big\n",
+               (unsigned long)read_min, (unsigned long)write_min);
+        return NULL;
+    }
+    nr = VCHAN_NPAGES(rorder);
+    nw = VCHAN_NPAGES(worder);
+
+    if ((vc = xmalloc(struct vchan)) == NULL)
+        return NULL;
+    memset(vc, 0, sizeof(*vc));
+    vc->vc_server = 1;
+    vc->vc_peer = peer;
+    init_waitqueue_head(&vc->vc_wq);
+
+    if ((ifc = (void *)alloc_page()) == NULL)
+        goto fail;
+    memset(ifc, 0, PAGE_SIZE);
+    vc->vc_ifc = ifc;
+    ifc->left_order = rorder;
+    ifc->right_order = worder;
+    if (nr && (rpages = (void *)alloc_pages(rorder - PAGE_SHIFT)) == NULL)
+        goto fail;
+    vchan_ring_setup(vc, &vc->vc_rd, 1, rorder, rpages);
+    if (nw && (wpages = (void *)alloc_pages(worder - PAGE_SHIFT)) == NULL)
+        goto fail;
+    vchan_ring_setup(vc, &vc->vc_wr, 0, worder, wpages);
+
+    if (nr + nw) {
+        vc->vc_grefs = xmalloc_array(grant_ref_t, nr + nw);
+        frames = xmalloc_array(unsigned long, nr + nw);
+        if (vc->vc_grefs == NULL || frames == NULL) {
+            xfree(frames);
+            goto fail;
+        }
+        for (i = 0; i < nr; i++)
+            frames[i] = virt_to_mfn(rpages + i * PAGE_SIZE);
+        for (i = 0; i < nw; i++)
+            frames[nr + i] = virt_to_mfn(wpages + i * PAGE_SIZE);
+        gnttab_grant_access_batch(peer, frames, nr + nw, 0, vc->vc_grefs);
+        vc->vc_ngrefs = nr + nw;
+        for (i = 0; i < nr + nw; i++)
+            ifc->grants[i] = vc->vc_grefs[i];
+        xfree(frames);
+    }
+
+    ifc->srv_live = 1;
+    ifc->cli_live = 2;
+    ifc->srv_notify = VCHAN_NOTIFY_WRITE;
+    ifc->cli_notify = VCHAN_NOTIFY_WRITE;
+    wmb();
+    vc->vc_ifcref = gnttab_grant_access(peer, virt_to_mfn(ifc), 0);
+
+    if (evtchn_alloc_unbound(peer, vchan_handler, vc, &vc->vc_port)) {
+        vc->vc_port = 0;
+        goto fail;
+    }
+    unmask_evtchn(vc->vc_port);
+
+    if (vchan_publish(vc, path) != 0) {
+        vchan_unpublish(path);
+        goto fail;
+    }
+    if ((vc->vc_path = strdup(path)) == NULL) {
+        vchan_unpublish(path);
+        goto fail;
+    }
+    kernel_suspend_hold();
+    return vc;
+
+ fail:
+    /* nothing was mapped by a peer yet, so this frees everything */
+    vchan_server_free(vc);
+    return NULL;
+}
+
+struct vchan *vchan_client_init(domid_t peer, const char *path)
+{
+    struct vchan *vc;
+    struct vchan_interface *ifc;
+    char key[256];
+    uint32_t domid = peer, ref;
+    char *lpages = NULL, *rpages = NULL;
+    int val, rport, lo, ro, nl, nr;
+
+    snprintf(key, sizeof(key), "%s/ring-ref", path);
+    if ((val = xenbus_read_integer(key)) < 0)
+        return NULL;
+    ref = val;
+    snprintf(key, sizeof(key), "%s/event-channel", path);
+    if ((rport = xenbus_read_integer(key)) < 0)
+        return NULL;
+
+    if ((vc = xmalloc(struct vchan)) == NULL)
+        return NULL;
+    memset(vc, 0, sizeof(*vc));
+    vc->vc_peer = peer;
+    init_waitqueue_head(&vc->vc_wq);
+    gntmap_init(&vc->vc_map);
+    if (gntmap_set_max_grants(&vc->vc_map,
+                              1 + 2 * VCHAN_NPAGES(VCHAN_ORDER_MAX)) != 0)
+        goto fail;
+
+    ifc = gntmap_map_grant_refs(&vc->vc_map, 1, &domid, 0, &ref, 1);
+    if (ifc == NULL) {
+        printk("vchan: can't map ring-ref %u of domain %u\n", ref, peer);
+        goto fail;
+    }
+    vc->vc_ifc = ifc;
+    lo = ifc->left_order;
+    ro = ifc->right_order;
+    if (lo < VCHAN_ORDER_MIN || lo > VCHAN_ORDER_MAX
+        || ro < VCHAN_ORDER_MIN || ro > VCHAN_ORDER_MAX
+        || (lo == ro && lo < PAGE_SHIFT)) {
+        printk("vchan: domain %u offers bad ring orders %d/%d\n",
+               peer, lo, ro);
+        goto fail;
+    }
+    nl = VCHAN_NPAGES(lo);
+    nr = VCHAN_NPAGES(ro);
+    if (nl && (lpages = gntmap_map_grant_refs(&vc->vc_map, nl, &domid, 0,
+                                              ifc->grants, 1)) == NULL)
+        goto fail;
+    if (nr && (rpages = gntmap_map_grant_refs(&vc->vc_map, nr, &domid, 0,
+                                              ifc->grants + nl, 1)) == NULL)
+        goto fail;
+    /* the client writes the left ring */
+    vchan_ring_setup(vc, &vc->vc_wr, 1, lo, lpages);
+    vchan_ring_setup(vc, &vc->vc_rd, 0, ro, rpages);
+
+    if (evtchn_bind_interdomain(peer, rport, vchan_handler, vc,
+                                &vc->vc_port)) {
+        vc->vc_port = 0;
+        goto fail;
+    }
+    unmask_evtchn(vc->vc_port);
+
+    ifc->cli_live = 1;
+    ifc->srv_notify = VCHAN_NOTIFY_WRITE;
+    wmb();
+    notify_remote_via_evtchn(vc->vc_port);
+    kernel_suspend_hold();
+    return vc;
+
+ fail:
+    gntmap_fini(&vc->vc_map);
+    xfree(vc);
+    return NULL;
+}
+
+void vchan_close(struct vchan *vc)
+{
+    struct vchan_interface *ifc = vc->vc_ifc;
+
+    kernel_suspend_release();
+    if (vc->vc_server) {
+        ifc->srv_live = 0;
+        wmb();
+        notify_remote_via_evtchn(vc->vc_port);
+        vchan_unpublish(vc->vc_path);
+        free(vc->vc_path);
+        vchan_server_free(vc);
+    } else {
+        ifc->cli_live = 0;
+        wmb();
+        notify_remote_via_evtchn(vc->vc_port);
+        unbind_evtchn(vc->vc_port);
+        gntmap_fini(&vc->vc_map);
+        xfree(vc);
+    }
+}
+
+int vchan_is_open(struct vchan *vc)
+{
+    struct vchan_interface *ifc = vc->vc_ifc;
+
+    return vc->vc_server ? ((volatile struct vchan_interface *)ifc)->cli_live
+                         : ((volatile struct vchan_interface *)ifc)->srv_live;
+}
+
+struct wait_queue_head *vchan_waitq(struct vchan *vc)
+{
+    return &vc->vc_wq;
+}
+
+static uint32_t vchan_avail(struct vchan_ring *r)
+{
+    uint32_t n = r->shr->prod - r->shr->cons;
+
+    rmb();
+    return n;
+}
+
+int vchan_data_ready(struct vchan *vc)
+{
+    vchan_request_notify(vc, VCHAN_NOTIFY_WRITE);
+    return vchan_avail(&vc->vc_rd);
+}
+
+int vchan_buffer_space(struct vchan *vc)
+{
+    vchan_request_notify(vc, VCHAN_NOTIFY_READ);
+    return (1 << vc->vc_wr.order) - vchan_avail(&vc->vc_wr);
+}
+
+int vchan_read(struct vchan *vc, void *buf, size_t len)
+{
+    struct vchan_ring *r = &vc->vc_rd;
+    uint32_t size = 1 << r->order, off, first, n;
+
+    n = vchan_avail(r);
+    if (n == 0)
+        return vchan_is_open(vc) == 0 ? -1 : 0;
+    if (n > len)
+        n = len;
+    off = r->shr->cons & (size - 1);
+    first = n < size - off ? n : size - off;
+    memcpy(buf, r->buf + off, first);
+    memcpy((char *)buf + first, r->buf, n - first);
+    /* done with the data before the space is given back */
+    mb();
+    r->shr->cons += n;
+    vchan_send_notify(vc, VCHAN_NOTIFY_READ);
+    return n;
+}
+
+int vchan_write(struct vchan *vc, const void *buf, size_t len)
+{
+    struct vchan_ring *r = &vc->vc_wr;
+    uint32_t size = 1 << r->order, off, first, n;
+
+    if (vchan_is_open(vc) != 1)
+        return vchan_is_open(vc) == 0 ? -1 : 0;
+    n = size - vchan_avail(r);
+    if (n > len)
+        n = len;
+    if (n == 0)
+        return 0;
+    off = r->shr->prod & (size - 1);
+    first = n < size - off ? n : size - off;
+    memcpy(r->buf + off, buf, first);
+    memcpy(r->buf, (const char *)buf + first, n - first);
+    wmb();
+    r->shr->prod += n;
+    vchan_send_notify(vc, VCHAN_NOTIFY_WRITE);
+    return n;
+}
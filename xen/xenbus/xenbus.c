@@ -48,7 +48,59 @@ static DECLARE_WAIT_QUEUE_HEAD(xb_waitq);
 static spinlock_t xb_lock = SPIN_LOCK_UNLOCKED; /* protects xenbus req ring */
 
 struct xenbus_event_queue xenbus_default_watch_queue;
-static MINIOS_LIST_HEAD(, xenbus_watch) watches;
+
+/* Watches, hashed by token, so that an event costs one short chain. */
+#define WATCH_HASH_SIZE 64
+static MINIOS_LIST_HEAD(, xenbus_watch) watches[WATCH_HASH_SIZE];
+
+static unsigned watch_hash(const char *token)
+{
+    unsigned h = 2166136261u;
+
+    while (*token)
+        h = (h ^ (unsigned char)*token++) * 16777619u;
+    return h % WATCH_HASH_SIZE;
+}
+
+/*
+ * Replies and watch events are nearly always small, so they come
+ * from a pool of fixed buffers, and only big ones from malloc.
+ * xenbus_free() tells them apart by address.
+ */
+#define MSG_POOL_NR 64
+#define MSG_POOL_BUFSZ 512
+static union msg_buf {
+    union msg_buf *next;
+    char data[MSG_POOL_BUFSZ];
+} __attribute__((aligned(16))) msg_pool[MSG_POOL_NR];
+static union msg_buf *msg_pool_free;
+static spinlock_t msg_pool_lock = SPIN_LOCK_UNLOCKED;
+
+static void *msg_alloc(size_t size)
+{
+    union msg_buf *b = NULL;
+
+    if (size <= MSG_POOL_BUFSZ) {
+        spin_lock(&msg_pool_lock);
+        if ((b = msg_pool_free) != NULL)
+            msg_pool_free = b->next;
+        spin_unlock(&msg_pool_lock);
+    }
+    return b ? (void *)b : malloc(size);
+}
+
+void xenbus_free(void *p)
+{
+    union msg_buf *b = p;
+
+    if (b >= msg_pool && b < msg_pool + MSG_POOL_NR) {
+        spin_lock(&msg_pool_lock);
+        b->next = msg_pool_free;
+        msg_pool_free = b;
+        spin_unlock(&msg_pool_lock);
+    } else
+        free(p);
+}
 struct xenbus_req_info 
 {
     struct xenbus_event_queue *reply_queue; /* non-0 iff in use */
@@ -151,7 +203,7 @@ void xenbus_wait_for_watch(struct xenbus_event_queue *queue)
         queue = &xenbus_default_watch_queue;
     ret = xenbus_wait_for_watch_return(queue);
     if (ret)
-        free(ret);
+        xenbus_free(ret);
     else
         printk("unexpected path returned by watch\n");
 }
@@ -277,7 +329,7 @@ static void xenbus_thread_func(void *ign)
 
             if(msg.type == XS_WATCH_EVENT)
             {
-		struct xenbus_event *event = malloc(sizeof(*event) + msg.len);
+		struct xenbus_event *event = msg_alloc(sizeof(*event) + msg.len);
                 struct xenbus_event_queue *events = NULL;
 		char *data = (char*)event + sizeof(*event);
                 struct xenbus_watch *watch;
@@ -294,7 +346,8 @@ static void xenbus_thread_func(void *ign)
 
                 spin_lock(&xenbus_req_lock);
 
-                MINIOS_LIST_FOREACH(watch, &watches, entry)
+                MINIOS_LIST_FOREACH(watch,
+                                    &watches[watch_hash(event->token)], entry)
                     if (!strcmp(watch->token, event->token)) {
                         event->watch = watch;
                         events = watch->events;
@@ -305,7 +358,7 @@ static void xenbus_thread_func(void *ign)
                     queue_event(events, event);
                 } else {
                     printk("unexpected watch token %s\n", event->token);
-                    free(event);
+                    xenbus_free(event);
                 }
 
                 spin_unlock(&xenbus_req_lock);
@@ -314,7 +367,7 @@ static void xenbus_thread_func(void *ign)
             else
             {
                 req_info[msg.req_id].for_queue->reply =
-                    malloc(sizeof(msg) + msg.len);
+                    msg_alloc(sizeof(msg) + msg.len);
                 memcpy_from_ring(xenstore_buf->rsp,
                     req_info[msg.req_id].for_queue->reply,
                     MASK_XENSTORE_IDX(xenstore_buf->rsp_cons),
@@ -345,7 +398,7 @@ void xenbus_id_release(int id)
     spin_lock(&xenbus_req_lock);
     req_info[id].reply_queue = 0;
     nr_live_reqs--;
-    if (nr_live_reqs == NR_REQS - 1)
+    if (nr_live_reqs == NR_REQS - 1 || nr_live_reqs == 0)
         wake_up(&req_wq);
     spin_unlock(&xenbus_req_lock);
 }
@@ -392,10 +445,11 @@ void xenbus_watch_prepare(struct xenbus_watch *watch)
     BUG_ON(!watch->events);
     size_t size = sizeof(void*)*2 + 5;
     watch->token = malloc(size);
+    watch->path = NULL;
     int r = snprintf(watch->token,size,"*%p",(void*)watch);
     BUG_ON(!(r > 0 && r < size));
     spin_lock(&xenbus_req_lock);
-    MINIOS_LIST_INSERT_HEAD(&watches, watch, entry);
+    MINIOS_LIST_INSERT_HEAD(&watches[watch_hash(watch->token)], watch, entry);
     spin_unlock(&xenbus_req_lock);
 }
 
@@ -413,11 +467,14 @@ void xenbus_watch_release(struct xenbus_watch *watch)
 /* Initialise xenbus. */
 void init_xenbus(void)
 {
-    int err;
+    int err, i;
     DEBUG("init_xenbus called.\n");
+    for (i = 0; i < MSG_POOL_NR; i++)
+        xenbus_free(&msg_pool[i]);
     xenbus_event_queue_init(&xenbus_default_watch_queue);
     xenstore_buf = mfn_to_virt(start_info.store_mfn);
-    create_thread("xenstore", NULL, xenbus_thread_func, NULL, NULL);
+    create_thread_prio("xenstore", NULL, THREAD_PRIO_DRIVER,
+                       xenbus_thread_func, NULL, NULL);
     DEBUG("buf at %p.\n", xenstore_buf);
     err = bind_evtchn(start_info.store_evtchn,
 		      xenbus_evtchn_handler,
@@ -511,8 +568,8 @@ void xenbus_xb_write(int type, int req_id, xenbus_transaction_t trans_id,
 }
 
 /* Send a mesasge to xenbus, in the same fashion as xb_write, and
-   block waiting for a reply.  The reply is malloced and should be
-   freed by the caller. */
+   block waiting for a reply.  The reply should be freed by the
+   caller, with xenbus_free(). */
 struct xsd_sockmsg *
 xenbus_msg_reply(int type,
 		 xenbus_transaction_t trans,
@@ -539,7 +596,6 @@ xenbus_msg_reply(int type,
     return rep;
 }
 
-void xenbus_free(void *p) { free(p); }
 
 static char *errmsg(struct xsd_sockmsg *rep)
 {
@@ -554,7 +610,7 @@ static char *errmsg(struct xsd_sockmsg *rep)
     res = malloc(rep->len + 1);
     memcpy(res, rep + 1, rep->len);
     res[rep->len] = 0;
-    free(rep);
+    xenbus_free(rep);
     return res;
 }	
 
@@ -600,7 +656,7 @@ char *xenbus_ls(xenbus_transaction_t xbt, const char *pre, char ***contents)
         x += l + 1;
     }
     res[i] = NULL;
-    free(repmsg);
+    xenbus_free(repmsg);
     *contents = res;
     return NULL;
 }
@@ -619,7 +675,7 @@ char *xenbus_read(xenbus_transaction_t xbt, const char *path, char **value)
     res = malloc(rep->len + 1);
     memcpy(res, rep + 1, rep->len);
     res[rep->len] = 0;
-    free(rep);
+    xenbus_free(rep);
     *value = res;
     return NULL;
 }
@@ -635,7 +691,7 @@ char *xenbus_write(xenbus_transaction_t xbt, const char *path, const char *value
     rep = xenbus_msg_reply(XS_WRITE, xbt, req, ARRAY_SIZE(req));
     msg = errmsg(rep);
     if (msg) return msg;
-    free(rep);
+    xenbus_free(rep);
     return NULL;
 }
 
@@ -656,17 +712,18 @@ char* xenbus_watch_path_token( xenbus_transaction_t xbt, const char *path, const
         events = &xenbus_default_watch_queue;
 
     watch->token = strdup(token);
+    watch->path = strdup(path);
     watch->events = events;
 
     spin_lock(&xenbus_req_lock);
-    MINIOS_LIST_INSERT_HEAD(&watches, watch, entry);
+    MINIOS_LIST_INSERT_HEAD(&watches[watch_hash(token)], watch, entry);
     spin_unlock(&xenbus_req_lock);
 
     rep = xenbus_msg_reply(XS_WATCH, xbt, req, ARRAY_SIZE(req));
 
     msg = errmsg(rep);
     if (msg) return msg;
-    free(rep);
+    xenbus_free(rep);
 
     return NULL;
 }
@@ -688,12 +745,13 @@ char* xenbus_unwatch_path_token( xenbus_transaction_t xbt, const char *path, con
 
     msg = errmsg(rep);
     if (msg) return msg;
-    free(rep);
+    xenbus_free(rep);
 
     spin_lock(&xenbus_req_lock);
-    MINIOS_LIST_FOREACH(watch, &watches, entry)
+    MINIOS_LIST_FOREACH(watch, &watches[watch_hash(token)], entry)
         if (!strcmp(watch->token, token)) {
             free(watch->token);
+            free(watch->path);
             MINIOS_LIST_REMOVE(watch, entry);
             free(watch);
             break;
@@ -703,6 +761,75 @@ char* xenbus_unwatch_path_token( xenbus_transaction_t xbt, const char *path, con
     return NULL;
 }
 
+/*
+ * A reply to a request made before a save would never come, so wait
+ * until there are none.  The caller must suspend without yielding.
+ */
+void suspend_xenbus(void)
+{
+
+    wait_event(req_wq, nr_live_reqs == 0);
+    mask_evtchn(start_info.store_evtchn);
+}
+
+/*
+ * A restored domain has a new ring and event channel, and xenstored
+ * knows none of its watches.  Those set up with a path are registered
+ * again, which fires each of them once.  Watches whose owners sent
+ * XS_WATCH themselves, see xenbus_watch_prepare(), are left to them.
+ */
+void resume_xenbus(int cancelled)
+{
+    struct xenbus_watch *watch;
+    struct xsd_sockmsg *rep;
+    char **tab, *msg;
+    int i, n;
+
+    if (cancelled) {
+        unmask_evtchn(start_info.store_evtchn);
+        return;
+    }
+
+    xenstore_buf = mfn_to_virt(start_info.store_mfn);
+    bind_evtchn(start_info.store_evtchn, xenbus_evtchn_handler, NULL);
+    unmask_evtchn(start_info.store_evtchn);
+    wake_up(&xb_waitq);
+
+    /* copy them out, the list may change while we wait for replies */
+    n = 0;
+    for (i = 0; i < WATCH_HASH_SIZE; i++)
+        MINIOS_LIST_FOREACH(watch, &watches[i], entry)
+            if (watch->path)
+                n++;
+    if (n == 0 || (tab = malloc(2 * n * sizeof(*tab))) == NULL)
+        return;
+    n = 0;
+    for (i = 0; i < WATCH_HASH_SIZE; i++)
+        MINIOS_LIST_FOREACH(watch, &watches[i], entry)
+            if (watch->path) {
+                tab[n++] = strdup(watch->path);
+                tab[n++] = strdup(watch->token);
+            }
+
+    for (i = 0; i < n; i += 2) {
+        struct write_req req[] = {
+            {tab[i], strlen(tab[i]) + 1},
+            {tab[i+1], strlen(tab[i+1]) + 1},
+        };
+
+        rep = xenbus_msg_reply(XS_WATCH, XBT_NIL, req, ARRAY_SIZE(req));
+        if ((msg = errmsg(rep)) != NULL) {
+            printk("xenbus: cannot watch %s again: %s\n", tab[i], msg);
+            free(msg);
+        } else {
+            xenbus_free(rep);
+        }
+        free(tab[i]);
+        free(tab[i+1]);
+    }
+    free(tab);
+}
+
 char *xenbus_rm(xenbus_transaction_t xbt, const char *path)
 {
     struct write_req req[] = { {path, strlen(path) + 1} };
@@ -712,7 +839,7 @@ char *xenbus_rm(xenbus_transaction_t xbt, const char *path)
     msg = errmsg(rep);
     if (msg)
 	return msg;
-    free(rep);
+    xenbus_free(rep);
     return NULL;
 }
 
@@ -730,7 +857,7 @@ char *xenbus_get_perms(xenbus_transaction_t xbt, const char *path, char **value)
     res = malloc(rep->len + 1);
     memcpy(res, rep + 1, rep->len);
     res[rep->len] = 0;
-    free(rep);
+    xenbus_free(rep);
     *value = res;
     return NULL;
 }
@@ -751,7 +878,7 @@ char *xenbus_set_perms(xenbus_transaction_t xbt, const char *path, domid_t dom,
     msg = errmsg(rep);
     if (msg)
 	return msg;
-    free(rep);
+    xenbus_free(rep);
     return NULL;
 }
 
@@ -771,7 +898,7 @@ char *xenbus_transaction_start(xenbus_transaction_t *xbt)
     /* hint: typeof(*xbt) == unsigned long */
     *xbt = strtoul((char *)(rep+1), NULL, 10);
 
-    free(rep);
+    xenbus_free(rep);
     return NULL;
 }
 
@@ -797,7 +924,7 @@ xenbus_transaction_end(xenbus_transaction_t t, int abort, int *retry)
 	    return err;
 	}
     }
-    free(rep);
+    xenbus_free(rep);
     return NULL;
 }
 
@@ -834,6 +961,166 @@ char* xenbus_printf(xenbus_transaction_t xbt,
     return xenbus_write(xbt,fullpath,val);
 }
 
+/*
+ * Batches.  Each op in flight holds one of the batch's slots and a
+ * req_info id; when the slots run out the oldest reply is reaped to
+ * free one, so a batch never ties up more than XENBUS_BATCH_DEPTH of
+ * the NR_REQS ids other threads need too.
+ */
+static void batch_reap(struct xenbus_batch *b)
+{
+    struct xenbus_event *event = await_event(&b->replies);
+    struct xenbus_batch_op *op = (struct xenbus_batch_op *)event;
+    struct xsd_sockmsg *rep = event->reply;
+    char *err, *value = NULL;
+
+    BUG_ON(rep->req_id != op->id);
+    xenbus_id_release(op->id);
+    op->id = -1;
+    b->nr_inflight--;
+
+    /* errmsg() frees rep when it is an error */
+    err = errmsg(rep);
+    if (!err) {
+        if (op->done) {
+            value = malloc(rep->len + 1);
+            memcpy(value, rep + 1, rep->len);
+            value[rep->len] = 0;
+        }
+        xenbus_free(rep);
+    }
+    if (op->done)
+        op->done(op->arg, err, value);
+    else if (err && !b->err)
+        b->err = err;
+    else
+        free(err);
+}
+
+char *xenbus_batch_start(struct xenbus_batch *b, int transaction)
+{
+    int i;
+
+    b->xbt = XBT_NIL;
+    b->in_trans = 0;
+    b->nr_inflight = 0;
+    b->err = NULL;
+    xenbus_event_queue_init(&b->replies);
+    for (i = 0; i < XENBUS_BATCH_DEPTH; i++)
+        b->ops[i].id = -1;
+    if (transaction) {
+        char *err = xenbus_transaction_start(&b->xbt);
+
+        /* on failure, the batch goes ahead outside a transaction */
+        b->in_trans = err == NULL;
+        return err;
+    }
+    return NULL;
+}
+
+void xenbus_batch_submit(struct xenbus_batch *b, int type,
+                         const struct write_req *io, int nr_reqs,
+                         xenbus_batch_fn *done, void *arg)
+{
+    struct xenbus_batch_op *op;
+    int i;
+
+    if (b->nr_inflight == XENBUS_BATCH_DEPTH)
+        batch_reap(b);
+    for (i = 0; b->ops[i].id != -1; i++)
+        ;
+    op = &b->ops[i];
+    op->event.watch = NULL;
+    op->done = done;
+    op->arg = arg;
+    op->id = xenbus_id_allocate(&b->replies, &op->event);
+    b->nr_inflight++;
+
+    /* this copies io onto the ring, so the caller's buffers are free
+       again once we return */
+    xenbus_xb_write(type, op->id, b->xbt, io, nr_reqs);
+}
+
+void xenbus_batch_read(struct xenbus_batch *b, const char *path,
+                       xenbus_batch_fn *done, void *arg)
+{
+    struct write_req req[] = { {path, strlen(path) + 1} };
+
+    xenbus_batch_submit(b, XS_READ, req, ARRAY_SIZE(req), done, arg);
+}
+
+static void batch_integer_done(void *arg, char *err, char *value)
+{
+    int *out = arg;
+
+    if (err) {
+        free(err);
+        *out = -1;
+        return;
+    }
+    *out = strtoul(value, NULL, 10);
+    free(value);
+}
+
+void xenbus_batch_read_integer(struct xenbus_batch *b, const char *path,
+                               int *out)
+{
+    xenbus_batch_read(b, path, batch_integer_done, out);
+}
+
+void xenbus_batch_write(struct xenbus_batch *b, const char *path,
+                        const char *value)
+{
+    struct write_req req[] = {
+	{path, strlen(path) + 1},
+	{value, strlen(value)},
+    };
+
+    xenbus_batch_submit(b, XS_WRITE, req, ARRAY_SIZE(req), NULL, NULL);
+}
+
+void xenbus_batch_printf(struct xenbus_batch *b, const char *node,
+                         const char *path, const char *fmt, ...)
+{
+    char fullpath[BUFFER_SIZE];
+    char val[BUFFER_SIZE];
+    va_list args;
+
+    BUG_ON(strlen(node) + strlen(path) + 1 >= BUFFER_SIZE);
+    sprintf(fullpath,"%s/%s", node, path);
+    va_start(args, fmt);
+    vsnprintf(val, sizeof(val), fmt, args);
+    va_end(args);
+    xenbus_batch_write(b, fullpath, val);
+}
+
+char *xenbus_batch_end(struct xenbus_batch *b, int abort, int *retry)
+{
+    char *err;
+
+    *retry = 0;
+    while (b->nr_inflight)
+        batch_reap(b);
+    err = b->err;
+    b->err = NULL;
+    if (b->in_trans) {
+        char *end = xenbus_transaction_end(b->xbt, abort || err, retry);
+
+        if (err)
+            free(end);
+        else
+            err = end;
+        /* a retry starts over, error or not */
+        if (*retry) {
+            free(err);
+            err = NULL;
+        }
+        b->in_trans = 0;
+        b->xbt = XBT_NIL;
+    }
+    return err;
+}
+
 domid_t xenbus_get_self_id(void)
 {
     char *dom_id;